@@ -4,19 +4,37 @@ ixprocfs = Extension(
     name='ixprocfs',
     sources=[
         'src/ixprocfs_module/ixprocfs.c',
+        'src/ixprocfs_module/cgroup.c',
+        'src/ixprocfs_module/cgroup_parsers.c',
         'src/ixprocfs_module/diskstats.c',
         'src/ixprocfs_module/diskstats_entry.c',
+        'src/ixprocfs_module/diskstats_filter.c',
+        'src/ixprocfs_module/diskstats_history.c',
+        'src/ixprocfs_module/diskstats_names.c',
+        'src/ixprocfs_module/diskstats_rate.c',
+        'src/ixprocfs_module/diskstats_snapshot.c',
+        'src/ixprocfs_module/diskstats_sysfs.c',
+        'src/ixprocfs_module/diskstats_topology.c',
         'src/ixprocfs_module/proc_fd.c',
-        'src/ixprocfs_module/proc_fd_iter.c',
         'src/ixprocfs_module/proc_pid.c',
         'src/ixprocfs_module/proc_pid_entry.c',
+        'src/ixprocfs_module/proc_pid_filter.c',
+        'src/ixprocfs_module/proc_pid_group.c',
         'src/ixprocfs_module/proc_pid_parsers.c',
+        'src/ixprocfs_module/proc_pid_handle.c',
         'src/ixprocfs_module/proc_pid_iter.c',
+        'src/ixprocfs_module/proc_pid_sampler.c',
+        'src/ixprocfs_module/proc_pid_snapshot.c',
+        'src/ixprocfs_module/proc_tree.c',
+	'src/utils/fdbuf.c',
+	'src/utils/hashtab.c',
 	'src/utils/iter.c',
-	'src/utils/parser_strings.c'
+	'src/utils/parser_strings.c',
+	'src/utils/workpool.c'
     ],
     libraries=[
         'bsd',
+        'pthread',
     ],
 )
 
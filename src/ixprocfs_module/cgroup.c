@@ -0,0 +1,693 @@
+/*
+ * Python language bindings for procfs-diskstats
+ *
+ * Copyright (C) Andrew Walker, 2022
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Python.h>
+#include <dirent.h>
+#include <unistd.h>
+#include "cgroup.h"
+#include "../utils/scan.h"
+
+/*
+ * Reader for the cgroup v2 hierarchy. The root directory is opened once
+ * and kept open; every read walks it depth first holding one directory
+ * fd per level, and opens interface files and child cgroups relative to
+ * those with openat(2), so no path is resolved more than one component
+ * at a time. The walk and all parsing run without the GIL into arrays
+ * kept by the reader; Python objects are only built afterwards.
+ *
+ * Files of disabled controllers do not exist in a cgroup, and cgroups
+ * may be removed while they are being read, so ENOENT and ENODEV (and
+ * EOPNOTSUPP for pressure files with PSI disabled) only mark a file as
+ * absent.
+ */
+
+static PyObject *py_cg_obj_new(PyTypeObject *obj,
+			       PyObject *args_unused,
+			       PyObject *kwargs_unused)
+{
+	py_cgroup_stats_t *self = NULL;
+
+	self = (py_cgroup_stats_t *)obj->tp_alloc(obj, 0);
+	if (self == NULL) {
+		return NULL;
+	}
+	self->root_fd = -1;
+	return (PyObject *)self;
+}
+
+static int py_cg_obj_init(PyObject *obj,
+			  PyObject *args,
+			  PyObject *kwargs)
+{
+	py_cgroup_stats_t *self = (py_cgroup_stats_t *)obj;
+	const char *root = CGROUP_ROOT_PATH;
+	const char *kwnames [] = {
+		"root",
+		NULL
+	};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+					 "|s",
+					 discard_const_p(char *, kwnames),
+					 &root)) {
+		return -1;
+	}
+
+	/* read() may be walking root_fd without the GIL */
+	if (self->root_fd != -1) {
+		PyErr_SetString(
+			PyExc_RuntimeError,
+			"CgroupStats is already open."
+		);
+		return -1;
+	}
+
+	self->root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (self->root_fd == -1) {
+		PyErr_Format(
+			PyExc_RuntimeError,
+			"%s: open() failed: %s",
+			root, strerror(errno)
+		);
+		return -1;
+	}
+
+	/* v1 hierarchies and the hybrid layout lack cgroup.controllers */
+	if (faccessat(self->root_fd, "cgroup.controllers", F_OK, 0) != 0) {
+		PyErr_Format(
+			PyExc_ValueError,
+			"%s: not a cgroup v2 hierarchy.",
+			root
+		);
+		close(self->root_fd);
+		self->root_fd = -1;
+		return -1;
+	}
+
+	self->root = strdup(root);
+	if (self->root == NULL) {
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	return 0;
+}
+
+static void free_reader(cgroup_reader_t *rd)
+{
+	if (rd == NULL) {
+		return;
+	}
+
+	fd_buf_free(&rd->buf);
+	free(rd->stats);
+	free(rd->io);
+	free(rd->paths);
+	free(rd);
+}
+
+/*
+ * As with DiskStats, one reader is kept for reuse so that sequential
+ * reads do not allocate, and a read that runs while another holds it
+ * gets a reader of its own.
+ */
+static cgroup_reader_t *get_reader(py_cgroup_stats_t *self)
+{
+	cgroup_reader_t *rd = self->spare;
+
+	if (rd != NULL) {
+		self->spare = NULL;
+		return rd;
+	}
+
+	rd = calloc(1, sizeof(cgroup_reader_t));
+	if (rd == NULL) {
+		PyErr_NoMemory();
+	}
+	return rd;
+}
+
+static void put_reader(py_cgroup_stats_t *self, cgroup_reader_t *rd)
+{
+	rd->stats_cnt = 0;
+	rd->io_cnt = 0;
+	rd->paths_len = 0;
+	rd->err = 0;
+	rd->errpath[0] = '\0';
+
+	if (self->spare == NULL) {
+		self->spare = rd;
+		return;
+	}
+
+	free_reader(rd);
+}
+
+void py_cg_obj_dealloc(py_cgroup_stats_t *self)
+{
+	if (self->root_fd != -1) {
+		close(self->root_fd);
+	}
+	free(self->root);
+	free_reader(self->spare);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static bool grow_array(void **array, size_t *alloc, size_t need,
+		       size_t size)
+{
+	size_t new_alloc = *alloc ? *alloc : 16;
+	void *new = NULL;
+
+	if (need <= *alloc) {
+		return true;
+	}
+
+	while (new_alloc < need) {
+		new_alloc *= 2;
+	}
+
+	new = realloc(*array, new_alloc * size);
+	if (new == NULL) {
+		errno = ENOMEM;
+		return false;
+	}
+
+	*array = new;
+	*alloc = new_alloc;
+	return true;
+}
+
+static void set_reader_error(cgroup_reader_t *rd, const cgstat_t *cg,
+			     const char *name, int err)
+{
+	const char *path = rd->paths + cg->path_off;
+
+	snprintf(rd->errpath, sizeof(rd->errpath), "%s%s%s",
+		 path, (name[0] && strcmp(path, "/")) ? "/" : "", name);
+	rd->err = err;
+}
+
+/*
+ * Read `name` relative to the cgroup directory. Returns false with
+ * errno cleared if the file does not exist or is not supported.
+ */
+static bool read_cgroup_file_at(int dirfd, const char *name, fd_buf_t *buf)
+{
+	bool ok;
+	int fd, err;
+
+	fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		ok = false;
+	} else {
+		ok = fd_buf_pread(fd, buf);
+		err = errno;
+		close(fd);
+		errno = err;
+	}
+
+	if (!ok && ((errno == ENOENT) || (errno == ENODEV) ||
+		    (errno == EOPNOTSUPP))) {
+		errno = 0;
+	}
+	return ok;
+}
+
+static bool read_cgroup_io(cgroup_reader_t *rd, size_t idx)
+{
+	const char *p = rd->buf.data, *end = rd->buf.data + rd->buf.len;
+
+	rd->stats[idx].io_off = rd->io_cnt;
+	while (p < end) {
+		const char *eol = memchr(p, '\n', end - p);
+
+		if (eol == NULL) {
+			eol = end;
+		}
+
+		if (eol != p) {
+			if (!grow_array((void **)&rd->io, &rd->io_alloc,
+					rd->io_cnt + 1, sizeof(cgio_t))) {
+				return false;
+			}
+
+			if (!parse_cgroup_io_line(p, eol,
+						  &rd->io[rd->io_cnt])) {
+				return false;
+			}
+			rd->io_cnt++;
+			rd->stats[idx].io_cnt++;
+		}
+
+		p = eol + 1;
+	}
+
+	return true;
+}
+
+static const char *pressure_files[CGROUP_PRESSURE_NTYPES] = {
+	[CGROUP_PRESSURE_CPU] = "cpu.pressure",
+	[CGROUP_PRESSURE_MEMORY] = "memory.pressure",
+	[CGROUP_PRESSURE_IO] = "io.pressure",
+};
+
+/* Runs without the GIL */
+static bool read_cgroup_files(cgroup_reader_t *rd, int dirfd, size_t idx)
+{
+	cgstat_t *cg = &rd->stats[idx];
+	const char *name = NULL, *p = NULL;
+	int i;
+
+	name = "cpu.stat";
+	if (read_cgroup_file_at(dirfd, name, &rd->buf)) {
+		if (!parse_cgroup_cpu_buf(rd->buf.data, rd->buf.len, &cg->cpu)) {
+			goto invalid;
+		}
+		cg->have |= CGROUP_HAVE_CPU;
+	} else if (errno != 0) {
+		goto fail;
+	}
+
+	name = "memory.current";
+	if (read_cgroup_file_at(dirfd, name, &rd->buf)) {
+		p = rd->buf.data;
+		if (!scan_ulonglong(&p, p + rd->buf.len, &cg->memory_current)) {
+			goto invalid;
+		}
+		cg->have |= CGROUP_HAVE_MEMORY_CURRENT;
+	} else if (errno != 0) {
+		goto fail;
+	}
+
+	name = "memory.stat";
+	if (read_cgroup_file_at(dirfd, name, &rd->buf)) {
+		if (!parse_cgroup_memory_buf(rd->buf.data, rd->buf.len,
+					     &cg->memory)) {
+			goto invalid;
+		}
+		cg->have |= CGROUP_HAVE_MEMORY_STAT;
+	} else if (errno != 0) {
+		goto fail;
+	}
+
+	name = "io.stat";
+	if (read_cgroup_file_at(dirfd, name, &rd->buf)) {
+		/* may move rd->io, but never rd->stats */
+		if (!read_cgroup_io(rd, idx)) {
+			goto fail;
+		}
+		cg->have |= CGROUP_HAVE_IO;
+	} else if (errno != 0) {
+		goto fail;
+	}
+
+	for (i = 0; i < CGROUP_PRESSURE_NTYPES; i++) {
+		name = pressure_files[i];
+		if (read_cgroup_file_at(dirfd, name, &rd->buf)) {
+			if (!parse_cgroup_pressure_buf(rd->buf.data,
+						       rd->buf.len,
+						       &cg->pressure[i])) {
+				goto invalid;
+			}
+			cg->have |= CGROUP_HAVE_PRESSURE(i);
+		} else if (errno != 0) {
+			goto fail;
+		}
+	}
+
+	return true;
+
+invalid:
+	errno = EINVAL;
+fail:
+	set_reader_error(rd, cg, name, errno);
+	return false;
+}
+
+/* Append `name` to the path of `parent_off` and return its offset */
+static bool add_cgroup_path(cgroup_reader_t *rd, size_t parent_off,
+			    const char *name, size_t *off_out)
+{
+	size_t parent_len = strlen(rd->paths + parent_off);
+	size_t name_len = strlen(name);
+	size_t off = rd->paths_len;
+	bool is_root = (parent_len == 1);
+
+	if (!grow_array((void **)&rd->paths, &rd->paths_alloc,
+			off + parent_len + name_len + 2, 1)) {
+		return false;
+	}
+
+	memcpy(rd->paths + off, rd->paths + parent_off, parent_len);
+	if (!is_root) {
+		rd->paths[off + parent_len++] = '/';
+	}
+	memcpy(rd->paths + off + parent_len, name, name_len + 1);
+
+	rd->paths_len = off + parent_len + name_len + 1;
+	*off_out = off;
+	return true;
+}
+
+/* Depth first, one directory fd held per level; runs without the GIL */
+static bool walk_cgroup(cgroup_reader_t *rd, int dirfd, size_t path_off)
+{
+	struct dirent *entry = NULL;
+	DIR *dir = NULL;
+	size_t idx;
+	int fd;
+
+	if (!grow_array((void **)&rd->stats, &rd->stats_alloc,
+			rd->stats_cnt + 1, sizeof(cgstat_t))) {
+		rd->err = errno;
+		return false;
+	}
+
+	idx = rd->stats_cnt++;
+	rd->stats[idx] = (cgstat_t) { .path_off = path_off };
+	if (!read_cgroup_files(rd, dirfd, idx)) {
+		return false;
+	}
+
+	/*
+	 * A new open file description rather than a dup(2), which would share
+	 * the directory offset with other readers of `dirfd` (the root fd is
+	 * walked by every read()).
+	 */
+	fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		set_reader_error(rd, &rd->stats[idx], "", errno);
+		return false;
+	}
+
+	dir = fdopendir(fd);
+	if (dir == NULL) {
+		set_reader_error(rd, &rd->stats[idx], "", errno);
+		close(fd);
+		return false;
+	}
+
+	for (errno = 0; (entry = readdir(dir)) != NULL; errno = 0) {
+		size_t child_off;
+		bool ok;
+		int child;
+
+		if ((entry->d_type != DT_DIR) ||
+		    (strcmp(entry->d_name, ".") == 0) ||
+		    (strcmp(entry->d_name, "..") == 0)) {
+			continue;
+		}
+
+		child = openat(dirfd, entry->d_name,
+			       O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (child == -1) {
+			if ((errno == ENOENT) || (errno == ENODEV)) {
+				continue;
+			}
+			set_reader_error(rd, &rd->stats[idx], entry->d_name,
+					 errno);
+			closedir(dir);
+			return false;
+		}
+
+		ok = add_cgroup_path(rd, rd->stats[idx].path_off,
+				     entry->d_name, &child_off);
+		if (!ok) {
+			rd->err = errno;
+		} else {
+			ok = walk_cgroup(rd, child, child_off);
+		}
+		close(child);
+
+		if (!ok) {
+			closedir(dir);
+			return false;
+		}
+	}
+
+	if (errno != 0) {
+		set_reader_error(rd, &rd->stats[idx], "", errno);
+		closedir(dir);
+		return false;
+	}
+
+	closedir(dir);
+	return true;
+}
+
+static bool read_cgroups(py_cgroup_stats_t *self, cgroup_reader_t *rd)
+{
+	if (!grow_array((void **)&rd->paths, &rd->paths_alloc, 2, 1)) {
+		rd->err = errno;
+		return false;
+	}
+	memcpy(rd->paths, "/", 2);
+	rd->paths_len = 2;
+
+	return walk_cgroup(rd, self->root_fd, 0);
+}
+
+static PyObject *none_ref(void)
+{
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject *cgstat_to_py_dict(const cgroup_reader_t *rd,
+				   const cgstat_t *cg)
+{
+	PyObject *out = NULL, *pressure = NULL;
+	PyObject *vals[4] = { NULL, NULL, NULL, NULL };
+	int i;
+
+	out = PyDict_New();
+	pressure = PyDict_New();
+	if ((out == NULL) || (pressure == NULL)) {
+		goto fail;
+	}
+
+	vals[0] = (cg->have & CGROUP_HAVE_CPU) ?
+		  cgcpu_to_py_dict(&cg->cpu) : none_ref();
+	vals[1] = (cg->have & CGROUP_HAVE_MEMORY_CURRENT) ?
+		  PyLong_FromUnsignedLongLong(cg->memory_current) :
+		  none_ref();
+	vals[2] = (cg->have & CGROUP_HAVE_MEMORY_STAT) ?
+		  cgmemory_to_py_dict(&cg->memory) : none_ref();
+	vals[3] = (cg->have & CGROUP_HAVE_IO) ?
+		  cgio_to_py_dict(rd->io + cg->io_off, cg->io_cnt) :
+		  none_ref();
+	for (i = 0; i < 4; i++) {
+		if (vals[i] == NULL) {
+			goto fail;
+		}
+	}
+
+	if ((PyDict_SetItemString(out, "cpu", vals[0]) != 0) ||
+	    (PyDict_SetItemString(out, "memory_current", vals[1]) != 0) ||
+	    (PyDict_SetItemString(out, "memory", vals[2]) != 0) ||
+	    (PyDict_SetItemString(out, "io", vals[3]) != 0)) {
+		goto fail;
+	}
+
+	for (i = 0; i < CGROUP_PRESSURE_NTYPES; i++) {
+		static const char *keys[CGROUP_PRESSURE_NTYPES] = {
+			[CGROUP_PRESSURE_CPU] = "cpu",
+			[CGROUP_PRESSURE_MEMORY] = "memory",
+			[CGROUP_PRESSURE_IO] = "io",
+		};
+		PyObject *val = NULL;
+		int rv;
+
+		val = (cg->have & CGROUP_HAVE_PRESSURE(i)) ?
+		      cgpressure_to_py_dict(&cg->pressure[i]) :
+		      none_ref();
+		if (val == NULL) {
+			goto fail;
+		}
+
+		rv = PyDict_SetItemString(pressure, keys[i], val);
+		Py_DECREF(val);
+		if (rv != 0) {
+			goto fail;
+		}
+	}
+
+	if (PyDict_SetItemString(out, "pressure", pressure) != 0) {
+		goto fail;
+	}
+
+	for (i = 0; i < 4; i++) {
+		Py_DECREF(vals[i]);
+	}
+	Py_DECREF(pressure);
+	return out;
+
+fail:
+	for (i = 0; i < 4; i++) {
+		Py_XDECREF(vals[i]);
+	}
+	Py_XDECREF(pressure);
+	Py_XDECREF(out);
+	return NULL;
+}
+
+PyDoc_STRVAR(py_cg_read__doc__,
+"read()\n"
+"--\n\n"
+"Walk the hierarchy below root and read cpu.stat, memory.current,\n"
+"memory.stat, io.stat and the cpu, memory and io pressure files of\n"
+"every cgroup. The walk and parsing run without the GIL.\n\n"
+"Parameters\n"
+"----------\n"
+"None\n\n"
+"Returns\n"
+"-------\n"
+"dict mapping the path of each cgroup relative to root, \"/\" for\n"
+"root itself and otherwise as in /proc/<pid>/cgroup when root is\n"
+"/sys/fs/cgroup, to a dict with the keys:\n"
+"cpu: dict of cpu.stat, times in microseconds.\n"
+"memory_current: int, bytes.\n"
+"memory: dict of selected memory.stat counters, sizes in bytes.\n"
+"io: dict of io.stat keyed by (major, minor) tuples, as used for\n"
+"    DiskStats devices, with the keys rbytes, wbytes, rios, wios,\n"
+"    dbytes and dios.\n"
+"pressure: dict with the keys cpu, memory and io, each a dict with\n"
+"    some and full, themselves dicts of avg10, avg60, avg300 (percent)\n"
+"    and total_usec. full is None where the kernel does not report it.\n"
+"Values are None if the file does not exist in a cgroup, e.g. because\n"
+"its controller is not enabled there. Cgroups are listed parents\n"
+"first; cgroups removed during the walk may be left out.\n"
+);
+
+static PyObject *py_cg_read(PyObject *obj,
+			    PyObject *args_unused,
+			    PyObject *kwargs_unused)
+{
+	py_cgroup_stats_t *self = (py_cgroup_stats_t *)obj;
+	cgroup_reader_t *rd = NULL;
+	PyObject *out = NULL;
+	size_t i;
+	bool ok;
+
+	if (self->root_fd == -1) {
+		PyErr_SetString(
+			PyExc_RuntimeError,
+			"CgroupStats is not initialized."
+		);
+		return NULL;
+	}
+
+	rd = get_reader(self);
+	if (rd == NULL) {
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	ok = read_cgroups(self, rd);
+	Py_END_ALLOW_THREADS
+
+	if (!ok) {
+		if (rd->errpath[0] != '\0') {
+			PyErr_Format(
+				PyExc_RuntimeError,
+				"%s%s: %s",
+				self->root, rd->errpath, strerror(rd->err)
+			);
+		} else {
+			PyErr_NoMemory();
+		}
+		put_reader(self, rd);
+		return NULL;
+	}
+
+	out = PyDict_New();
+	for (i = 0; (out != NULL) && (i < rd->stats_cnt); i++) {
+		const cgstat_t *cg = &rd->stats[i];
+		PyObject *val = NULL;
+		int rv;
+
+		val = cgstat_to_py_dict(rd, cg);
+		if (val == NULL) {
+			Py_CLEAR(out);
+			break;
+		}
+
+		rv = PyDict_SetItemString(out, rd->paths + cg->path_off, val);
+		Py_DECREF(val);
+		if (rv != 0) {
+			Py_CLEAR(out);
+		}
+	}
+
+	put_reader(self, rd);
+	return out;
+}
+
+static PyObject *py_cg_root(PyObject *obj, void *closure)
+{
+	py_cgroup_stats_t *self = (py_cgroup_stats_t *)obj;
+
+	if (self->root == NULL) {
+		Py_RETURN_NONE;
+	}
+	return PyUnicode_FromString(self->root);
+}
+
+static PyMethodDef py_cg_obj_methods[] = {
+	{
+		.ml_name = "read",
+		.ml_meth = (PyCFunction)py_cg_read,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = py_cg_read__doc__
+	},
+	{ NULL, NULL, 0, NULL }
+};
+
+static PyGetSetDef py_cg_obj_getsetters[] = {
+	{
+		.name	= discard_const_p(char, "root"),
+		.get	= (getter)py_cg_root,
+		.doc	= "path of the cgroup hierarchy that is walked",
+	},
+	{ .name = NULL }
+};
+
+PyDoc_STRVAR(py_cgroup_stats__doc__,
+"CgroupStats(root=\"/sys/fs/cgroup\")\n"
+"--\n\n"
+"Per-cgroup resource accounting from a cgroup v2 hierarchy. The root\n"
+"directory is opened once and kept open; each read() walks the\n"
+"cgroups below it relative to directory fds instead of resolving full\n"
+"paths. root may be any cgroup within the hierarchy to read only its\n"
+"subtree; on hybrid systems the v2 hierarchy is usually mounted at\n"
+"/sys/fs/cgroup/unified.\n"
+);
+
+PyTypeObject PyCgroupStats = {
+	.tp_name = "ixprocfs.CgroupStats",
+	.tp_basicsize = sizeof(py_cgroup_stats_t),
+	.tp_methods = py_cg_obj_methods,
+	.tp_getset = py_cg_obj_getsetters,
+	.tp_new = py_cg_obj_new,
+	.tp_init = py_cg_obj_init,
+	.tp_doc = py_cgroup_stats__doc__,
+	.tp_dealloc = (destructor)py_cg_obj_dealloc,
+	.tp_flags = Py_TPFLAGS_DEFAULT|Py_TPFLAGS_BASETYPE,
+};
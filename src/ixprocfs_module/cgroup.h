@@ -0,0 +1,158 @@
+/*
+ * Python language bindings for procfs-diskstats
+ *
+ * Copyright (C) Andrew Walker, 2022
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CGROUP_H_
+#define _CGROUP_H_
+
+#include <Python.h>
+#include "../common/includes.h"
+#include "../utils/fdbuf.h"
+
+#define CGROUP_ROOT_PATH "/sys/fs/cgroup"
+
+/* cpu.stat, times in microseconds */
+typedef struct cgroup_cpu {
+	unsigned long long usage_usec;
+	unsigned long long user_usec;
+	unsigned long long system_usec;
+	unsigned long long nr_periods;
+	unsigned long long nr_throttled;
+	unsigned long long throttled_usec;
+	unsigned long long nr_bursts;
+	unsigned long long burst_usec;
+} cgcpu_t;
+
+/* Selected lines of memory.stat, sizes in bytes */
+typedef struct cgroup_memory {
+	unsigned long long anon;
+	unsigned long long file;
+	unsigned long long kernel;
+	unsigned long long kernel_stack;
+	unsigned long long pagetables;
+	unsigned long long sock;
+	unsigned long long shmem;
+	unsigned long long file_mapped;
+	unsigned long long file_dirty;
+	unsigned long long file_writeback;
+	unsigned long long swapcached;
+	unsigned long long anon_thp;
+	unsigned long long slab_reclaimable;
+	unsigned long long slab_unreclaimable;
+	unsigned long long slab;
+	unsigned long long pgfault;
+	unsigned long long pgmajfault;
+	unsigned long long workingset_refault_anon;
+	unsigned long long workingset_refault_file;
+} cgmemory_t;
+
+/* One line of io.stat, device numbers as in diskstats_t */
+typedef struct cgroup_io {
+	uint major;
+	uint minor;
+	unsigned long long rbytes;
+	unsigned long long wbytes;
+	unsigned long long rios;
+	unsigned long long wios;
+	unsigned long long dbytes;
+	unsigned long long dios;
+} cgio_t;
+
+/* One line of a *.pressure file (PSI), averages in percent */
+typedef struct cgroup_psi {
+	double avg10;
+	double avg60;
+	double avg300;
+	unsigned long long total_usec;
+} cgpsi_t;
+
+typedef struct cgroup_pressure {
+	cgpsi_t some;
+	cgpsi_t full;
+	bool has_full; /* cpu.pressure has no full line before Linux 5.13 */
+} cgpressure_t;
+
+enum {
+	CGROUP_PRESSURE_CPU,
+	CGROUP_PRESSURE_MEMORY,
+	CGROUP_PRESSURE_IO,
+	CGROUP_PRESSURE_NTYPES,
+};
+
+/* Files that were present, controllers may be disabled per cgroup */
+#define CGROUP_HAVE_CPU 0x01
+#define CGROUP_HAVE_MEMORY_CURRENT 0x02
+#define CGROUP_HAVE_MEMORY_STAT 0x04
+#define CGROUP_HAVE_IO 0x08
+#define CGROUP_HAVE_PRESSURE(type) (0x10 << (type))
+
+typedef struct cgroup_stat {
+	size_t path_off; /* into the reader's path arena */
+	uint have; /* CGROUP_HAVE_* */
+	cgcpu_t cpu;
+	unsigned long long memory_current;
+	cgmemory_t memory;
+	size_t io_off; /* into the reader's io array */
+	int io_cnt;
+	cgpressure_t pressure[CGROUP_PRESSURE_NTYPES];
+} cgstat_t;
+
+/* cgroup_parsers.c */
+extern bool parse_cgroup_cpu_buf(const char *buf, size_t len, cgcpu_t *out);
+extern bool parse_cgroup_memory_buf(const char *buf, size_t len,
+				    cgmemory_t *out);
+extern bool parse_cgroup_pressure_buf(const char *buf, size_t len,
+				      cgpressure_t *out);
+extern bool parse_cgroup_io_line(const char *p, const char *eol,
+				 cgio_t *out);
+extern PyObject *cgcpu_to_py_dict(const cgcpu_t *cpu);
+extern PyObject *cgmemory_to_py_dict(const cgmemory_t *memory);
+extern PyObject *cgio_to_py_dict(const cgio_t *io, int cnt);
+extern PyObject *cgpressure_to_py_dict(const cgpressure_t *pressure);
+
+/* cgroup.c */
+
+/*
+ * State of one read, private to the thread that fills it while the GIL
+ * is released, as with diskstats_reader_t. Arrays only grow, so reads
+ * of a stable hierarchy do not allocate.
+ */
+typedef struct cgroup_reader {
+	fd_buf_t buf;
+	cgstat_t *stats; /* preorder of the walk */
+	size_t stats_cnt;
+	size_t stats_alloc;
+	cgio_t *io;
+	size_t io_cnt;
+	size_t io_alloc;
+	char *paths; /* NUL-terminated paths relative to the root */
+	size_t paths_len;
+	size_t paths_alloc;
+	char errpath[PATH_MAX]; /* file that failed, with errno in err */
+	int err;
+} cgroup_reader_t;
+
+typedef struct {
+	PyObject_HEAD
+	int root_fd; /* O_DIRECTORY, held for the lifetime of the object */
+	char *root;
+	cgroup_reader_t *spare; /* reader kept for reuse by the next call */
+} py_cgroup_stats_t;
+
+extern PyTypeObject PyCgroupStats;
+#endif /* _CGROUP_H_ */
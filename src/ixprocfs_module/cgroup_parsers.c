@@ -0,0 +1,467 @@
+/*
+ * Python language bindings for procfs-diskstats
+ *
+ * Copyright (C) Andrew Walker, 2022
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Python.h>
+#include <stddef.h>
+#include "cgroup.h"
+#include "../utils/scan.h"
+
+/*
+ * Parsers for the cgroup v2 interface files. Like the /proc/<pid>
+ * parsers they decode the buffer filled by fd_buf_pread() in place with
+ * the cursor helpers of scan.h, so they neither copy nor allocate and
+ * can run without the GIL. Keys the kernel adds in later versions are
+ * skipped.
+ */
+
+typedef struct {
+	const char *key;
+	size_t key_len;
+	size_t offset;
+} cg_field_t;
+
+#define CG_FIELD(type, field) \
+	{ #field, sizeof(#field) - 1, offsetof(type, field) }
+
+static const cg_field_t cgcpu_fields[] = {
+	CG_FIELD(cgcpu_t, usage_usec),
+	CG_FIELD(cgcpu_t, user_usec),
+	CG_FIELD(cgcpu_t, system_usec),
+	CG_FIELD(cgcpu_t, nr_periods),
+	CG_FIELD(cgcpu_t, nr_throttled),
+	CG_FIELD(cgcpu_t, throttled_usec),
+	CG_FIELD(cgcpu_t, nr_bursts),
+	CG_FIELD(cgcpu_t, burst_usec),
+};
+
+static const cg_field_t cgmemory_fields[] = {
+	CG_FIELD(cgmemory_t, anon),
+	CG_FIELD(cgmemory_t, file),
+	CG_FIELD(cgmemory_t, kernel),
+	CG_FIELD(cgmemory_t, kernel_stack),
+	CG_FIELD(cgmemory_t, pagetables),
+	CG_FIELD(cgmemory_t, sock),
+	CG_FIELD(cgmemory_t, shmem),
+	CG_FIELD(cgmemory_t, file_mapped),
+	CG_FIELD(cgmemory_t, file_dirty),
+	CG_FIELD(cgmemory_t, file_writeback),
+	CG_FIELD(cgmemory_t, swapcached),
+	CG_FIELD(cgmemory_t, anon_thp),
+	CG_FIELD(cgmemory_t, slab_reclaimable),
+	CG_FIELD(cgmemory_t, slab_unreclaimable),
+	CG_FIELD(cgmemory_t, slab),
+	CG_FIELD(cgmemory_t, pgfault),
+	CG_FIELD(cgmemory_t, pgmajfault),
+	CG_FIELD(cgmemory_t, workingset_refault_anon),
+	CG_FIELD(cgmemory_t, workingset_refault_file),
+};
+
+static const cg_field_t cgio_fields[] = {
+	CG_FIELD(cgio_t, rbytes),
+	CG_FIELD(cgio_t, wbytes),
+	CG_FIELD(cgio_t, rios),
+	CG_FIELD(cgio_t, wios),
+	CG_FIELD(cgio_t, dbytes),
+	CG_FIELD(cgio_t, dios),
+};
+
+static const cg_field_t cgpsi_fields[] = {
+	{ "total", 5, offsetof(cgpsi_t, total_usec) },
+};
+
+#undef CG_FIELD
+
+static const cg_field_t *find_cg_field(const cg_field_t *fields,
+				       size_t nfields,
+				       const char *key, size_t key_len)
+{
+	size_t i;
+
+	for (i = 0; i < nfields; i++) {
+		if ((fields[i].key_len == key_len) &&
+		    (memcmp(fields[i].key, key, key_len) == 0)) {
+			return &fields[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* Lines of "key value" (cpu.stat, memory.stat) */
+static bool parse_cg_flat_keyed(const char *buf, size_t len,
+				const cg_field_t *fields, size_t nfields,
+				void *out)
+{
+	const char *p = buf, *end = buf + len;
+
+	while (p < end) {
+		const cg_field_t *field = NULL;
+		const char *eol = NULL, *key_end = NULL;
+
+		eol = memchr(p, '\n', end - p);
+		if (eol == NULL) {
+			eol = end;
+		}
+
+		key_end = scan_skip_token(p, eol);
+		field = find_cg_field(fields, nfields, p, key_end - p);
+		if (field != NULL) {
+			const char *val = scan_skip_ws(key_end, eol);
+
+			if (!scan_ulonglong(&val, eol,
+					    (unsigned long long *)((char *)out +
+								   field->offset))) {
+				errno = EINVAL;
+				return false;
+			}
+		}
+
+		p = eol + 1;
+	}
+
+	return true;
+}
+
+bool parse_cgroup_cpu_buf(const char *buf, size_t len, cgcpu_t *out)
+{
+	*out = (cgcpu_t) { .usage_usec = 0 };
+	return parse_cg_flat_keyed(buf, len, cgcpu_fields,
+				   ARRAY_SIZE(cgcpu_fields), out);
+}
+
+bool parse_cgroup_memory_buf(const char *buf, size_t len, cgmemory_t *out)
+{
+	*out = (cgmemory_t) { .anon = 0 };
+	return parse_cg_flat_keyed(buf, len, cgmemory_fields,
+				   ARRAY_SIZE(cgmemory_fields), out);
+}
+
+/*
+ * "key=value" tokens after the first one on a line (io.stat, pressure).
+ * Only keys in `fields` are decoded; avg keys of the pressure files are
+ * handled by the caller through `avg_fn`.
+ */
+typedef bool (*cg_avg_fn)(const char *key, size_t key_len,
+			  const char **pp, const char *eol, void *out);
+
+static bool parse_cg_nested_keyed(const char *p, const char *eol,
+				  const cg_field_t *fields, size_t nfields,
+				  cg_avg_fn avg_fn, void *out)
+{
+	for (p = scan_skip_ws(p, eol); p < eol; p = scan_skip_ws(p, eol)) {
+		const char *tok_end = scan_skip_token(p, eol);
+		const char *eq = memchr(p, '=', tok_end - p);
+		const cg_field_t *field = NULL;
+		const char *val = NULL;
+
+		if (eq == NULL) {
+			errno = EINVAL;
+			return false;
+		}
+
+		val = eq + 1;
+		field = find_cg_field(fields, nfields, p, eq - p);
+		if (field != NULL) {
+			if (!scan_ulonglong(&val, eol,
+					    (unsigned long long *)((char *)out +
+								   field->offset))) {
+				errno = EINVAL;
+				return false;
+			}
+		} else if ((avg_fn != NULL) &&
+			   !avg_fn(p, eq - p, &val, eol, out)) {
+			errno = EINVAL;
+			return false;
+		}
+
+		p = tok_end;
+	}
+
+	return true;
+}
+
+static bool scan_devno(const char **pp, const char *end, uint *major,
+		       uint *minor)
+{
+	const char *p = *pp;
+	unsigned long long val[2] = { 0, 0 };
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		const char *start = p;
+
+		for (; (p < end) && (*p >= '0') && (*p <= '9'); p++) {
+			val[i] = (val[i] * 10) + (*p - '0');
+			if (val[i] > UINT_MAX) {
+				return false;
+			}
+		}
+
+		if (p == start) {
+			return false;
+		}
+
+		if (i == 0) {
+			if ((p == end) || (*p != ':')) {
+				return false;
+			}
+			p++;
+		}
+	}
+
+	if ((p < end) && !scan_is_space(*p)) {
+		return false;
+	}
+
+	*major = (uint)val[0];
+	*minor = (uint)val[1];
+	*pp = p;
+	return true;
+}
+
+/* "MAJ:MIN rbytes=... wbytes=... rios=... wios=... dbytes=... dios=..." */
+bool parse_cgroup_io_line(const char *p, const char *eol, cgio_t *out)
+{
+	*out = (cgio_t) { .major = 0 };
+
+	if (!scan_devno(&p, eol, &out->major, &out->minor)) {
+		errno = EINVAL;
+		return false;
+	}
+
+	return parse_cg_nested_keyed(p, eol, cgio_fields,
+				     ARRAY_SIZE(cgio_fields), NULL, out);
+}
+
+/*
+ * PSI averages are printed with two decimals ("%lu.%02lu"). Decode them
+ * by hand rather than with strtod(), which depends on the locale.
+ */
+static bool scan_psi_avg(const char **pp, const char *end, double *out)
+{
+	const char *p = *pp;
+	unsigned long long ip = 0, frac = 0, scale = 1;
+
+	if ((p == end) || (*p < '0') || (*p > '9')) {
+		return false;
+	}
+
+	for (; (p < end) && (*p >= '0') && (*p <= '9'); p++) {
+		ip = (ip * 10) + (*p - '0');
+	}
+
+	if ((p < end) && (*p == '.')) {
+		for (p++; (p < end) && (*p >= '0') && (*p <= '9') &&
+		     (scale < 1000000000ULL); p++) {
+			frac = (frac * 10) + (*p - '0');
+			scale *= 10;
+		}
+	}
+
+	if ((p < end) && !scan_is_space(*p)) {
+		return false;
+	}
+
+	*out = (double)ip + ((double)frac / scale);
+	*pp = p;
+	return true;
+}
+
+static bool psi_avg_fn(const char *key, size_t key_len, const char **pp,
+		       const char *eol, void *out)
+{
+	cgpsi_t *psi = out;
+	double *avg = NULL;
+
+	if ((key_len == 5) && (memcmp(key, "avg10", 5) == 0)) {
+		avg = &psi->avg10;
+	} else if ((key_len == 5) && (memcmp(key, "avg60", 5) == 0)) {
+		avg = &psi->avg60;
+	} else if ((key_len == 6) && (memcmp(key, "avg300", 6) == 0)) {
+		avg = &psi->avg300;
+	} else {
+		return true;
+	}
+
+	return scan_psi_avg(pp, eol, avg);
+}
+
+/*
+ * "some avg10=0.00 avg60=0.00 avg300=0.00 total=0" followed by the
+ * same for "full". total is in microseconds and is returned as
+ * total_usec.
+ */
+bool parse_cgroup_pressure_buf(const char *buf, size_t len,
+			       cgpressure_t *out)
+{
+	const char *p = buf, *end = buf + len;
+
+	*out = (cgpressure_t) { .has_full = false };
+
+	while (p < end) {
+		const char *eol = NULL, *tok_end = NULL;
+		cgpsi_t *psi = NULL;
+
+		eol = memchr(p, '\n', end - p);
+		if (eol == NULL) {
+			eol = end;
+		}
+
+		tok_end = scan_skip_token(p, eol);
+		if (((tok_end - p) == 4) && (memcmp(p, "some", 4) == 0)) {
+			psi = &out->some;
+		} else if (((tok_end - p) == 4) && (memcmp(p, "full", 4) == 0)) {
+			psi = &out->full;
+			out->has_full = true;
+		}
+
+		if ((psi != NULL) &&
+		    !parse_cg_nested_keyed(tok_end, eol, cgpsi_fields,
+					   ARRAY_SIZE(cgpsi_fields),
+					   psi_avg_fn, psi)) {
+			return false;
+		}
+
+		p = eol + 1;
+	}
+
+	return true;
+}
+
+static PyObject *cg_fields_to_py_dict(const void *in,
+				      const cg_field_t *fields,
+				      size_t nfields)
+{
+	PyObject *out = NULL;
+	size_t i;
+
+	out = PyDict_New();
+	if (out == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < nfields; i++) {
+		PyObject *val = NULL;
+		int rv;
+
+		val = PyLong_FromUnsignedLongLong(
+			*(const unsigned long long *)((const char *)in +
+						      fields[i].offset));
+		if (val == NULL) {
+			Py_DECREF(out);
+			return NULL;
+		}
+
+		rv = PyDict_SetItemString(out, fields[i].key, val);
+		Py_DECREF(val);
+		if (rv != 0) {
+			Py_DECREF(out);
+			return NULL;
+		}
+	}
+
+	return out;
+}
+
+PyObject *cgcpu_to_py_dict(const cgcpu_t *cpu)
+{
+	return cg_fields_to_py_dict(cpu, cgcpu_fields,
+				    ARRAY_SIZE(cgcpu_fields));
+}
+
+PyObject *cgmemory_to_py_dict(const cgmemory_t *memory)
+{
+	return cg_fields_to_py_dict(memory, cgmemory_fields,
+				    ARRAY_SIZE(cgmemory_fields));
+}
+
+/* Keyed by (major, minor) tuples, as accepted by DiskStats */
+PyObject *cgio_to_py_dict(const cgio_t *io, int cnt)
+{
+	PyObject *out = NULL;
+	int i;
+
+	out = PyDict_New();
+	if (out == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		PyObject *key = NULL, *val = NULL;
+		int rv;
+
+		key = Py_BuildValue("(II)", io[i].major, io[i].minor);
+		if (key == NULL) {
+			Py_DECREF(out);
+			return NULL;
+		}
+
+		val = cg_fields_to_py_dict(&io[i], cgio_fields,
+					   ARRAY_SIZE(cgio_fields));
+		if (val == NULL) {
+			Py_DECREF(key);
+			Py_DECREF(out);
+			return NULL;
+		}
+
+		rv = PyDict_SetItem(out, key, val);
+		Py_DECREF(key);
+		Py_DECREF(val);
+		if (rv != 0) {
+			Py_DECREF(out);
+			return NULL;
+		}
+	}
+
+	return out;
+}
+
+static PyObject *cgpsi_to_py_dict(const cgpsi_t *psi)
+{
+	return Py_BuildValue(
+		"{sdsdsdsK}",
+		"avg10", psi->avg10,
+		"avg60", psi->avg60,
+		"avg300", psi->avg300,
+		"total_usec", psi->total_usec
+	);
+}
+
+PyObject *cgpressure_to_py_dict(const cgpressure_t *pressure)
+{
+	PyObject *some = NULL, *full = NULL;
+
+	some = cgpsi_to_py_dict(&pressure->some);
+	if (some == NULL) {
+		return NULL;
+	}
+
+	if (pressure->has_full) {
+		full = cgpsi_to_py_dict(&pressure->full);
+		if (full == NULL) {
+			Py_DECREF(some);
+			return NULL;
+		}
+	} else {
+		Py_INCREF(Py_None);
+		full = Py_None;
+	}
+
+	return Py_BuildValue("{sNsN}", "some", some, "full", full);
+}
@@ -18,9 +18,14 @@
  */
 
 #include <Python.h>
+#include <stddef.h>
+#include <unistd.h>
 #include "diskstats.h"
 #include "../utils/iter.h"
-#include "../utils/parser.h"
+#include "../utils/scan.h"
+
+static bool read_procfs_diskstats(py_diskstats_t *self,
+				  diskstats_reader_t *rd);
 
 static PyObject *py_ds_obj_new(PyTypeObject *obj,
 			       PyObject *args_unused,
@@ -32,6 +37,8 @@ static PyObject *py_ds_obj_new(PyTypeObject *obj,
 	if (self == NULL) {
 		return NULL;
 	}
+	self->stats_fd = -1;
+	self->read_fn = read_procfs_diskstats;
 	return (PyObject *)self;
 }
 
@@ -40,274 +47,1079 @@ static int py_ds_obj_init(PyObject *obj,
 			  PyObject *kwargs)
 {
 	py_diskstats_t *self = (py_diskstats_t *)obj;
+	PyObject *devices = NULL, *groups = NULL;
+	bool whole_disks_only = false, resolve_names = false;
+	int history = 0, history_devices = 0;
+	const char *kwnames [] = {
+		"devices",
+		"whole_disks_only",
+		"history",
+		"history_devices",
+		"groups",
+		"resolve_names",
+		NULL
+	};
 
-	self->stats_file = fopen(DISKSTATS_PATH, "r");
-	if (self->stats_file == NULL) {
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+					 "|ObiiOb",
+					 discard_const_p(char *, kwnames),
+					 &devices,
+					 &whole_disks_only,
+					 &history,
+					 &history_devices,
+					 &groups,
+					 &resolve_names)) {
+		return -1;
+	}
+
+	/*
+	 * read() uses stats_fd, the filter and the groups without the GIL.
+	 * A failed __init__() may have set up the latter two already.
+	 */
+	if ((self->stats_fd != -1) || (self->filter != NULL) ||
+	    (self->groups != NULL)) {
 		PyErr_SetString(
 			PyExc_RuntimeError,
-			"Failed to open stats file."
+			"DiskStats is already initialized."
 		);
 		return -1;
 	}
-	self->stats = calloc(100, sizeof(diskstats_t));
-	if (self->stats == NULL) {
-		fclose(self->stats_file);
-		self->stats_file = NULL;
+
+	self->resolve_names = resolve_names;
+
+	if ((groups != NULL) && (groups != Py_None)) {
+		self->groups = diskstats_groups_new(groups, &self->group_cnt);
+		if (self->groups == NULL) {
+			return -1;
+		}
+	}
+
+	if (devices == Py_None) {
+		devices = NULL;
+	}
+
+	if ((devices != NULL) || whole_disks_only) {
+		self->filter = diskstats_filter_new(devices, whole_disks_only);
+		if (self->filter == NULL) {
+			return -1;
+		}
+	}
+
+	self->stats_fd = open(DISKSTATS_PATH, O_RDONLY | O_CLOEXEC);
+	if (self->stats_fd == -1) {
 		PyErr_SetString(
-			PyExc_MemoryError,
-			"Failed to allocate stats array."
+			PyExc_RuntimeError,
+			"Failed to open stats file."
 		);
 		return -1;
 	}
-	self->stats_alloc = 100;
-	self->stats_cnt = 0;
+
+	if (history) {
+		return diskstats_setup_history(self, history, history_devices);
+	}
 	return 0;
 }
 
-void py_ds_obj_dealloc(py_diskstats_t *self)
+static void free_reader(diskstats_reader_t *rd)
 {
-	if (self->stats_file) {
-		fclose(self->stats_file);
-		self->stats_file = NULL;
+	if (rd == NULL) {
+		return;
 	}
-	free(self->stats);
-	self->stats_alloc = 0;
-	Py_TYPE(self)->tp_free((PyObject *)self);
-}
 
-static inline bool parse_major(char *token, diskstats_t *stat)
-{
-	return parse_major_minor(token, &stat->major);
+	fd_buf_free(&rd->buf);
+	free(rd->stats);
+	free(rd);
 }
 
-static inline bool parse_minor(char *token, diskstats_t *stat)
+/*
+ * Readers are taken and returned with the GIL held. One reader is kept
+ * for reuse so that sequential calls do not allocate; a call that runs
+ * while another holds it gets a reader of its own.
+ */
+static diskstats_reader_t *get_reader(py_diskstats_t *self)
 {
-	return parse_major_minor(token, &stat->minor);
-}
+	diskstats_reader_t *rd = self->spare;
 
-static inline bool parse_dev_name(char *token, diskstats_t *stat)
-{
-	strlcpy(stat->name, token, sizeof(stat->name));
-	return true;
-}
+	if (rd != NULL) {
+		self->spare = NULL;
+		return rd;
+	}
 
-static inline bool parse_reads_completed(char *token, diskstats_t *stat)
-{
-	return parse_ulong(token, &stat->reads_completed);
+	rd = calloc(1, sizeof(diskstats_reader_t));
+	if (rd == NULL) {
+		PyErr_NoMemory();
+	}
+	return rd;
 }
 
-static inline bool parse_reads_merged(char *token, diskstats_t *stat)
+static void put_reader(py_diskstats_t *self, diskstats_reader_t *rd)
 {
-	return parse_ulong(token, &stat->reads_merged);
-}
+	diskstats_disks_put(rd->disks);
+	diskstats_disks_put(rd->new_disks);
+	diskstats_names_put(rd->names);
+	rd->disks = NULL;
+	rd->new_disks = NULL;
+	rd->names = NULL;
+	rd->stats_cnt = 0;
 
-static inline bool parse_sectors_read(char *token, diskstats_t *stat)
-{
-	return parse_ulong(token, &stat->sectors_read);
-}
+	if (self->spare == NULL) {
+		self->spare = rd;
+		return;
+	}
 
-static inline bool parse_reading_ms(char *token, diskstats_t *stat)
-{
-	return parse_uint(token, &stat->time_reading_ms);
+	free_reader(rd);
 }
 
-static inline bool parse_writes_completed(char *token, diskstats_t *stat)
+void py_ds_obj_dealloc(py_diskstats_t *self)
 {
-	return parse_ulong(token, &stat->writes_completed);
+	if (self->stats_fd != -1) {
+		close(self->stats_fd);
+		self->stats_fd = -1;
+	}
+	free_reader(self->spare);
+	self->spare = NULL;
+	Py_CLEAR(self->rates_prev);
+	diskstats_filter_free(self->filter);
+	self->filter = NULL;
+	diskstats_history_free(self->history);
+	self->history = NULL;
+	diskstats_topology_put(self->topology);
+	self->topology = NULL;
+	diskstats_groups_free(self->groups, self->group_cnt);
+	self->groups = NULL;
+	self->group_cnt = 0;
+	diskstats_names_put(self->names);
+	self->names = NULL;
+	Py_TYPE(self)->tp_free((PyObject *)self);
 }
 
-static inline bool parse_writes_merged(char *token, diskstats_t *stat)
+/*
+ * Layout of the counters following the device name on a line of
+ * /proc/diskstats (and of /sys/block/<dev>/stat, which carries the same
+ * counters without the leading major, minor and name). Older kernels
+ * emit fewer columns, in which case the missing counters are left zero.
+ */
+static const struct {
+	size_t offset;
+	bool is_uint;
+} diskstats_counters[] = {
+	{ offsetof(diskstats_t, reads_completed), false },
+	{ offsetof(diskstats_t, reads_merged), false },
+	{ offsetof(diskstats_t, sectors_read), false },
+	{ offsetof(diskstats_t, time_reading_ms), true },
+	{ offsetof(diskstats_t, writes_completed), false },
+	{ offsetof(diskstats_t, writes_merged), false },
+	{ offsetof(diskstats_t, sectors_written), false },
+	{ offsetof(diskstats_t, time_writing_ms), true },
+	{ offsetof(diskstats_t, num_ios_in_progress), true },
+	{ offsetof(diskstats_t, time_doing_ios_ms), true },
+	{ offsetof(diskstats_t, weighted_time_doing_ios_ms), true },
+	{ offsetof(diskstats_t, discards_completed), false },
+	{ offsetof(diskstats_t, discards_merged), false },
+	{ offsetof(diskstats_t, sectors_discarded), false },
+	{ offsetof(diskstats_t, time_spent_discarding_ms), true },
+	{ offsetof(diskstats_t, flush_requests_completed), false },
+	{ offsetof(diskstats_t, time_spent_flushing_ms), true },
+};
+
+bool parse_disk_counters(const char *p, const char *eol, diskstats_t *stat)
 {
-	return parse_ulong(token, &stat->writes_merged);
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(diskstats_counters); i++) {
+		char *field = (char *)stat + diskstats_counters[i].offset;
+		bool ok;
+
+		p = scan_skip_ws(p, eol);
+		if (p == eol) {
+			break;
+		}
+
+		if (diskstats_counters[i].is_uint) {
+			ok = scan_uint(&p, eol, (uint *)field);
+		} else {
+			ok = scan_ulong(&p, eol, (unsigned long *)field);
+		}
+
+		if (!ok) {
+			return false;
+		}
+	}
+
+	return true;
 }
 
-static inline bool parse_sectors_written(char *token, diskstats_t *stat)
+/*
+ * Parse the "major minor name" prefix of a line of /proc/diskstats and
+ * advance `*pp` past it. `eol` points at the terminating newline or the
+ * end of the buffer.
+ */
+static bool parse_disk_header(const char **pp, const char *eol,
+			      diskstats_t *stat)
 {
-	return parse_ulong(token, &stat->sectors_written);
+	const char *p = *pp;
+	const char *name = NULL;
+	size_t name_len;
+
+	p = scan_skip_ws(p, eol);
+	if (!scan_uint(&p, eol, &stat->major)) {
+		return false;
+	}
+
+	p = scan_skip_ws(p, eol);
+	if (!scan_uint(&p, eol, &stat->minor)) {
+		return false;
+	}
+
+	name = scan_skip_ws(p, eol);
+	p = scan_skip_token(name, eol);
+	if (p == name) {
+		return false;
+	}
+
+	name_len = p - name;
+	if (name_len >= sizeof(stat->name)) {
+		name_len = sizeof(stat->name) - 1;
+	}
+	memcpy(stat->name, name, name_len);
+
+	*pp = p;
+	return true;
 }
 
-static inline bool parse_writing_ms(char *token, diskstats_t *stat)
+/*
+ * Make room for at least `cnt` entries in the stats array of a reader.
+ * Does not require the GIL.
+ */
+bool diskstats_reserve(diskstats_reader_t *rd, int cnt)
 {
-	return parse_uint(token, &stat->time_writing_ms);
+	diskstats_t *new = NULL;
+
+	if (rd->stats_alloc >= cnt) {
+		return true;
+	}
+
+	new = realloc(rd->stats, cnt * sizeof(diskstats_t));
+	if (new == NULL) {
+		return false;
+	}
+
+	rd->stats = new;
+	rd->stats_alloc = cnt;
+	return true;
 }
 
-static inline bool parse_ios_in_progress(char *token, diskstats_t *stat)
+static bool grow_stats(diskstats_reader_t *rd)
 {
-	return parse_uint(token, &stat->num_ios_in_progress);
+	return diskstats_reserve(rd, rd->stats_alloc ? rd->stats_alloc * 2 : 100);
 }
 
-static inline bool parse_time_doing_ios(char *token, diskstats_t *stat)
+/*
+ * Parse the buffer in a single forward pass. When a filter is set it is
+ * applied as soon as the device name has been decoded, and the counters
+ * of lines that are not selected are never converted. `sig_out` is set
+ * to the signature (see diskstats_topology_signature()) of every device
+ * in the file, selected or not.
+ */
+static bool parse_disk_stats(const diskstats_filter_t *filter,
+			     const diskstats_disks_t *disks,
+			     diskstats_reader_t *rd,
+			     uint64_t *sig_out)
 {
-	return parse_uint(token, &stat->time_doing_ios_ms);
+	const char *p = rd->buf.data;
+	const char *end = rd->buf.data + rd->buf.len;
+	uint64_t sig = 0;
+	int lines = 0;
+
+	rd->stats_cnt = 0;
+
+	while (p < end) {
+		const char *eol = memchr(p, '\n', end - p);
+		diskstats_t *stat = NULL;
+
+		if (eol == NULL) {
+			eol = end;
+		}
+
+		if (eol == p) {
+			p = eol + 1;
+			continue;
+		}
+
+		if ((rd->stats_cnt == rd->stats_alloc) && !grow_stats(rd)) {
+			return false;
+		}
+
+		stat = &rd->stats[rd->stats_cnt];
+		memset(stat, 0, sizeof(*stat));
+		lines++;
+
+		if (!parse_disk_header(&p, eol, stat)) {
+			errno = EINVAL;
+			return false;
+		}
+		sig += hash_u64(((uint64_t)stat->major << 32) | stat->minor);
+
+		if ((filter == NULL) ||
+		    diskstats_filter_match(filter, disks, stat)) {
+			if (!parse_disk_counters(p, eol, stat)) {
+				errno = EINVAL;
+				return false;
+			}
+			rd->stats_cnt++;
+		}
+
+		p = eol + 1;
+	}
+
+	*sig_out = sig + hash_u64(lines);
+	return true;
 }
 
-static inline bool parse_weighted_time_doing_ios(char *token, diskstats_t *stat)
+static bool filter_disk_stats(py_diskstats_t *self, diskstats_reader_t *rd)
 {
-	return parse_uint(token, &stat->weighted_time_doing_ios_ms);
+	const diskstats_filter_t *filter = self->filter;
+	uint64_t sig;
+
+	if (!parse_disk_stats(filter, rd->disks, rd, &sig)) {
+		return false;
+	}
+
+	if ((filter == NULL) || !filter->whole_disks_only ||
+	    ((rd->disks != NULL) && (sig == rd->disks->signature))) {
+		return true;
+	}
+
+	/*
+	 * The set of block devices changed (or this is the first read), so
+	 * the list of whole disks may be stale. Read a new one and parse
+	 * the same buffer again so that new disks are not dropped. The new
+	 * set is published to the filter once the GIL is held again.
+	 */
+	rd->new_disks = diskstats_disks_read(sig);
+	if (rd->new_disks == NULL) {
+		return false;
+	}
+	return parse_disk_stats(filter, rd->new_disks, rd, &sig);
 }
 
-static inline bool parse_discards_completed(char *token, diskstats_t *stat)
+/*
+ * Timestamp the sample at the midpoint of the read so that time spent
+ * in the kernel generating the file is split evenly between adjacent
+ * intervals.
+ */
+void diskstats_set_ts(diskstats_reader_t *rd, const struct timespec *start,
+		      const struct timespec *end)
 {
-	return parse_ulong(token, &stat->discards_completed);
+	long long mid_ns;
+
+	mid_ns = ((end->tv_sec - start->tv_sec) * 1000000000LL +
+		  (end->tv_nsec - start->tv_nsec)) / 2;
+	mid_ns += start->tv_nsec;
+	rd->ts.tv_sec = start->tv_sec + (mid_ns / 1000000000LL);
+	rd->ts.tv_nsec = mid_ns % 1000000000LL;
 }
 
-static inline bool parse_discards_merged(char *token, diskstats_t *stat)
+static bool read_procfs_diskstats(py_diskstats_t *self,
+				  diskstats_reader_t *rd)
 {
-	return parse_ulong(token, &stat->discards_merged);
+	struct timespec start, end;
+	bool ok;
+
+	/* pread(2) does not use the file offset, so the fd can be shared */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ok = fd_buf_pread(self->stats_fd, &rd->buf);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	diskstats_set_ts(rd, &start, &end);
+	if (!ok) {
+		return false;
+	}
+
+	return filter_disk_stats(self, rd);
 }
 
-static inline bool parse_sectors_discarded(char *token, diskstats_t *stat)
+/*
+ * Attach device identifiers to a read, resolving them again if the set
+ * of devices differs from the one the cached map was built for.
+ */
+static bool resolve_names(py_diskstats_t *self, diskstats_reader_t *rd)
 {
-	return parse_ulong(token, &stat->sectors_discarded);
+	diskstats_names_t *names = self->names;
+	uint64_t sig;
+
+	sig = diskstats_topology_signature(rd->stats, rd->stats_cnt);
+	if ((names == NULL) || (names->signature != sig)) {
+		Py_BEGIN_ALLOW_THREADS
+		names = diskstats_names_read(rd->stats, rd->stats_cnt, sig);
+		Py_END_ALLOW_THREADS
+
+		if (names == NULL) {
+			PyErr_Format(
+				PyExc_RuntimeError,
+				"Failed to resolve device names: %s",
+				strerror(errno)
+			);
+			return false;
+		}
+
+		diskstats_names_put(self->names);
+		self->names = names;
+	}
+
+	names->refcnt++;
+	rd->names = names;
+	return true;
 }
 
-static inline bool parse_time_spent_discarding(char *token, diskstats_t *stat)
+/*
+ * Take a sample into a private reader. The file is read and parsed
+ * without the GIL, so concurrent callers on the same object proceed in
+ * parallel; the shared state is updated afterwards with the GIL held.
+ * Returns a reader to be handed back with put_reader() or NULL with an
+ * exception set.
+ */
+static diskstats_reader_t *read_disk_stats(py_diskstats_t *self)
 {
-	return parse_uint(token, &stat->time_spent_discarding_ms);
+	diskstats_reader_t *rd = NULL;
+	bool ok;
+
+	rd = get_reader(self);
+	if (rd == NULL) {
+		return NULL;
+	}
+
+	if ((self->filter != NULL) && (self->filter->disks != NULL)) {
+		rd->disks = self->filter->disks;
+		rd->disks->refcnt++;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	ok = self->read_fn(self, rd);
+	Py_END_ALLOW_THREADS
+
+	if (!ok) {
+		PyErr_Format(
+			PyExc_RuntimeError,
+			"Failed to read disk stats: %s",
+			strerror(errno)
+		);
+		put_reader(self, rd);
+		return NULL;
+	}
+
+	if (rd->new_disks != NULL) {
+		diskstats_disks_put(self->filter->disks);
+		self->filter->disks = rd->new_disks;
+		rd->new_disks->refcnt++;
+	}
+
+	if (self->history) {
+		diskstats_history_push(self->history, rd->stats,
+				       rd->stats_cnt, &rd->ts);
+	}
+
+	if (self->resolve_names && !resolve_names(self, rd)) {
+		put_reader(self, rd);
+		return NULL;
+	}
+
+	return rd;
 }
 
-static inline bool parse_flush_requests_completed(char *token, diskstats_t *stat)
+/*
+ * Allocate the history ring. If `capacity` is zero it is sized from a
+ * first read: twice the number of devices currently selected, so that
+ * devices added later are still recorded.
+ */
+int diskstats_setup_history(py_diskstats_t *self, int slots, int capacity)
 {
-	return parse_ulong(token, &stat->flush_requests_completed);
+	if (slots < 2) {
+		PyErr_SetString(
+			PyExc_ValueError,
+			"history must hold at least two samples."
+		);
+		return -1;
+	}
+
+	if (capacity < 0) {
+		PyErr_SetString(
+			PyExc_ValueError,
+			"history_devices must not be negative."
+		);
+		return -1;
+	}
+
+	if (capacity == 0) {
+		diskstats_reader_t *rd = read_disk_stats(self);
+
+		if (rd == NULL) {
+			return -1;
+		}
+		capacity = rd->stats_cnt * 2 > 16 ? rd->stats_cnt * 2 : 16;
+		put_reader(self, rd);
+	}
+
+	diskstats_history_free(self->history);
+	self->history = diskstats_history_new(slots, capacity);
+	if (self->history == NULL) {
+		PyErr_SetString(
+			PyExc_MemoryError,
+			"Failed to allocate history."
+		);
+		return -1;
+	}
+
+	return 0;
 }
 
-static inline bool parse_time_spent_flushing(char *token, diskstats_t *stat)
+PyDoc_STRVAR(py_ds_read__doc__,
+"read_data()\n"
+"--\n\n"
+"Read /proc/diskstats and return an entry per device. Entries are\n"
+"read-only views of a shared snapshot of the read, and their fields\n"
+"are converted to Python objects only when accessed.\n\n"
+"Parameters\n"
+"----------\n"
+"None\n\n"
+"Returns\n"
+"-------\n"
+"list of DiskStatsEntry\n"
+);
+
+/*
+ * Hand the stats array of a read over to a new snapshot and replace it
+ * with one of the same size, so that the next read does not have to
+ * grow it again. The snapshot is immutable from here on and may be
+ * shared between threads.
+ */
+static void snapshot_set_names(PyObject *obj, diskstats_names_t *names)
 {
-	return parse_uint(token, &stat->time_spent_flushing_ms);
-}
+	py_diskstats_snapshot_t *snap = (py_diskstats_snapshot_t *)obj;
 
-static const struct {
-	bool (*fn)(char *token, diskstats_t *statp);
-} functable[] = {
-	{ parse_major },
-	{ parse_minor },
-	{ parse_dev_name },
-	{ parse_reads_completed },
-	{ parse_reads_merged },
-	{ parse_sectors_read },
-	{ parse_reading_ms },
-	{ parse_writes_completed },
-	{ parse_writes_merged },
-	{ parse_sectors_written },
-	{ parse_writing_ms },
-	{ parse_ios_in_progress },
-	{ parse_time_doing_ios },
-	{ parse_weighted_time_doing_ios },
-	{ parse_discards_completed },
-	{ parse_discards_merged },
-	{ parse_sectors_discarded },
-	{ parse_time_spent_discarding },
-	{ parse_flush_requests_completed },
-	{ parse_time_spent_flushing },
-};
+	if (names != NULL) {
+		names->refcnt++;
+		snap->names = names;
+	}
+}
 
-int parse_disk_line(char *token, int idx, void *state)
+static PyObject *take_snapshot(diskstats_reader_t *rd)
 {
-	py_diskstats_t *self = (py_diskstats_t *)state;
-	diskstats_t *stats = &self->stats[self->stats_cnt - 1];
+	PyObject *out = NULL;
+	diskstats_t *next = NULL;
 
-	if (idx > (int)ARRAY_SIZE(functable)) {
-		errno = ERANGE;
-		return ITER_STATE_ERROR;
+	next = malloc(rd->stats_alloc * sizeof(diskstats_t));
+	if ((next == NULL) && (rd->stats_alloc > 0)) {
+		PyErr_SetString(
+			PyExc_MemoryError,
+			"Failed to allocate stats array."
+		);
+		return NULL;
 	}
 
-	if (!functable[idx].fn(token, stats)) {
-		return ITER_STATE_ERROR;
+	out = init_diskstats_snapshot(rd->stats, rd->stats_cnt, &rd->ts);
+	if (out == NULL) {
+		free(next);
+		return NULL;
 	}
+	snapshot_set_names(out, rd->names);
 
-	return ITER_STATE_CONTINUE;
+	rd->stats = next;
+	rd->stats_cnt = 0;
+	return out;
 }
 
-int read_disk_line(char *line, int idx, ssize_t line_len, void *state)
+static PyObject *diskstats_to_py_diskstats(py_diskstats_t *self,
+					   diskstats_reader_t *rd)
 {
-	py_diskstats_t *self = (py_diskstats_t *)state;
-	iter_line_cb_t cb = {
-		.fn = parse_disk_line,
-		.state = self,
-	};
+	py_diskstats_snapshot_t *snap = NULL;
+	PyObject *out = NULL;
+	int i;
 
-	if (idx == self->stats_alloc) {
-		diskstats_t *new = NULL;
-		new = realloc(self->stats, (self->stats_alloc * 4 * sizeof(diskstats_t)));
-		if (new == NULL) {
-			return ITER_STATE_ERROR;
+	snap = (py_diskstats_snapshot_t *)take_snapshot(rd);
+	put_reader(self, rd);
+	if (snap == NULL) {
+		return NULL;
+	}
+
+	out = PyList_New(snap->stats_cnt);
+	if (out == NULL) {
+		Py_DECREF(snap);
+		return NULL;
+	}
+
+	for (i = 0; i < snap->stats_cnt; i++) {
+		PyObject *entry = NULL;
+
+		entry = init_diskstats((PyObject *)snap, &snap->stats[i]);
+		if (entry == NULL) {
+			Py_DECREF(snap);
+			Py_DECREF(out);
+			return NULL;
 		}
 
-		self->stats = new;
+		PyList_SET_ITEM(out, i, entry);
 	}
 
-	self->stats_cnt = idx + 1;
-	return iter_line(line, " ", &cb);
+	Py_DECREF(snap);
+	return out;
 }
 
-int read_disk_stats_impl(py_diskstats_t *self)
+static PyObject *py_ds_obj_read(PyObject *obj,
+				PyObject *args_unused,
+				PyObject *kwargs_unused)
 {
-	iter_file_cb_t cb = {
-		.fn = read_disk_line,
-		.state = self,
-	};
+	py_diskstats_t *self = (py_diskstats_t *)obj;
+	diskstats_reader_t *rd = NULL;
+
+	rd = read_disk_stats(self);
+	if (rd == NULL) {
+		return NULL;
+	}
 
-	self->stats_cnt = 0;
-	return iter_file(self->stats_file, &cb);
+	return diskstats_to_py_diskstats(self, rd);
 }
 
-PyDoc_STRVAR(py_ds_read__doc__,
-"read()\n"
+PyDoc_STRVAR(py_ds_read_rates__doc__,
+"read_rates()\n"
 "--\n\n"
-"Stat the glfs object. Performs fresh stat and updates\n"
-"cache for object.\n\n"
+"Read /proc/diskstats and return per-device rates for the interval\n"
+"since the previous call to read_rates(). The first call only primes\n"
+"the previous sample and returns an empty list. Devices that appeared,\n"
+"disappeared or had their counters reset during the interval are\n"
+"omitted.\n\n"
 "Parameters\n"
 "----------\n"
 "None\n\n"
 "Returns\n"
 "-------\n"
-"stat_result\n"
+"list of dicts with the keys device_name, major, minor, interval_ms,\n"
+"reads_per_sec, reads_merged_per_sec, read_bytes_per_sec,\n"
+"writes_per_sec, writes_merged_per_sec, write_bytes_per_sec,\n"
+"discards_per_sec, discard_bytes_per_sec, flushes_per_sec,\n"
+"r_await, w_await, d_await, f_await (milliseconds), aqu_sz and\n"
+"util (percent).\n"
 );
 
-static PyObject *diskstats_to_py_diskstats(py_diskstats_t *self)
+static PyObject *rate_to_py_dict(diskstats_rate_t *r)
+{
+	return Py_BuildValue(
+		"{sssIsIsdsdsdsdsdsdsdsdsdsdsdsdsdsdsdsd}",
+		"device_name", r->name,
+		"major", r->major,
+		"minor", r->minor,
+		"interval_ms", r->interval_ms,
+		"reads_per_sec", r->reads_per_sec,
+		"reads_merged_per_sec", r->reads_merged_per_sec,
+		"read_bytes_per_sec", r->read_bytes_per_sec,
+		"writes_per_sec", r->writes_per_sec,
+		"writes_merged_per_sec", r->writes_merged_per_sec,
+		"write_bytes_per_sec", r->write_bytes_per_sec,
+		"discards_per_sec", r->discards_per_sec,
+		"discard_bytes_per_sec", r->discard_bytes_per_sec,
+		"flushes_per_sec", r->flushes_per_sec,
+		"r_await", r->r_await,
+		"w_await", r->w_await,
+		"d_await", r->d_await,
+		"f_await", r->f_await,
+		"aqu_sz", r->aqu_sz,
+		"util", r->util
+	);
+}
+
+static PyObject *rates_to_py_list(diskstats_rate_t *rates, int cnt)
 {
 	PyObject *out = NULL;
 	int i;
 
-	out = PyList_New(self->stats_cnt);
+	out = PyList_New(cnt);
 	if (out == NULL) {
 		return NULL;
 	}
 
-	for (i = 0; i < self->stats_cnt; i++) {
+	for (i = 0; i < cnt; i++) {
 		PyObject *entry = NULL;
 
-		entry = init_diskstats(&self->stats[i]);
+		entry = rate_to_py_dict(&rates[i]);
 		if (entry == NULL) {
 			Py_DECREF(out);
 			return NULL;
 		}
 
-		if (PyList_SetItem(out, i, entry)) {
-			Py_DECREF(out);
-			return NULL;
-		}
+		PyList_SET_ITEM(out, i, entry);
 	}
 
 	return out;
 }
 
-static PyObject *py_ds_obj_read(PyObject *obj,
-				PyObject *args_unused,
-				PyObject *kwargs_unused)
+static inline bool ts_before(const struct timespec *a,
+			     const struct timespec *b)
+{
+	return (a->tv_sec < b->tv_sec) ||
+	       ((a->tv_sec == b->tv_sec) && (a->tv_nsec < b->tv_nsec));
+}
+
+static PyObject *py_ds_obj_read_rates(PyObject *obj,
+				      PyObject *args_unused,
+				      PyObject *kwargs_unused)
 {
 	py_diskstats_t *self = (py_diskstats_t *)obj;
-	int rv;
+	py_diskstats_snapshot_t *cur = NULL, *prev = NULL;
+	diskstats_reader_t *rd = NULL;
+	diskstats_rate_t *rates = NULL;
+	PyObject *out = NULL;
+	int cnt = 0;
+
+	rd = read_disk_stats(self);
+	if (rd == NULL) {
+		return NULL;
+	}
+
+	cur = (py_diskstats_snapshot_t *)take_snapshot(rd);
+	put_reader(self, rd);
+	if (cur == NULL) {
+		return NULL;
+	}
+
+	/*
+	 * The current sample becomes the baseline for the next call. The
+	 * baseline is an immutable snapshot, so publishing it is a pointer
+	 * swap with the GIL held and the rates below can be computed from
+	 * both samples without it. A sample that lost a race against a
+	 * newer one from another thread is not published and yields no
+	 * rates.
+	 */
+	prev = (py_diskstats_snapshot_t *)self->rates_prev;
+	if ((prev != NULL) && !ts_before(&prev->ts, &cur->ts)) {
+		Py_DECREF(cur);
+		return PyList_New(0);
+	}
+
+	Py_INCREF(cur);
+	self->rates_prev = (PyObject *)cur;
+	if (prev == NULL) {
+		Py_DECREF(cur);
+		return PyList_New(0);
+	}
+
+	rates = calloc(cur->stats_cnt + 1, sizeof(diskstats_rate_t));
+	if (rates == NULL) {
+		Py_DECREF(prev);
+		Py_DECREF(cur);
+		PyErr_SetString(
+			PyExc_MemoryError,
+			"Failed to allocate rates array."
+		);
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	cnt = diskstats_compute_rates(prev->stats, prev->stats_cnt, &prev->ts,
+				      cur->stats, cur->stats_cnt, &cur->ts,
+				      rates);
+	Py_END_ALLOW_THREADS
+
+	Py_DECREF(prev);
+	Py_DECREF(cur);
+	out = rates_to_py_list(rates, cnt == -1 ? 0 : cnt);
+	free(rates);
+	return out;
+}
+
+PyDoc_STRVAR(py_ds_read_snapshot__doc__,
+"read_snapshot()\n"
+"--\n\n"
+"Read /proc/diskstats and return the result as a DiskStatsSnapshot.\n"
+"The parsed array is handed to the snapshot without copying and no\n"
+"per-device Python objects are created. The snapshot supports the\n"
+"buffer protocol, see DiskStatsSnapshot for the layout.\n\n"
+"Parameters\n"
+"----------\n"
+"None\n\n"
+"Returns\n"
+"-------\n"
+"DiskStatsSnapshot\n"
+);
+
+static PyObject *py_ds_obj_read_snapshot(PyObject *obj,
+					 PyObject *args_unused,
+					 PyObject *kwargs_unused)
+{
+	py_diskstats_t *self = (py_diskstats_t *)obj;
+	diskstats_reader_t *rd = NULL;
+	PyObject *out = NULL;
+
+	rd = read_disk_stats(self);
+	if (rd == NULL) {
+		return NULL;
+	}
+
+	out = take_snapshot(rd);
+	put_reader(self, rd);
+	return out;
+}
+
+/*
+ * Return a reference to a topology that matches the set of devices in
+ * `rd`, reading a new one from sysfs if the cached one does not. With
+ * `rd` NULL any cached topology will do. The reference must be dropped
+ * with diskstats_topology_put().
+ */
+static diskstats_topology_t *get_topology(py_diskstats_t *self,
+					  const diskstats_reader_t *rd)
+{
+	diskstats_topology_t *topo = self->topology;
+	uint64_t sig = 0;
+
+	if (rd != NULL) {
+		sig = diskstats_topology_signature(rd->stats, rd->stats_cnt);
+	}
+
+	if ((topo != NULL) && ((rd == NULL) || (topo->signature == sig))) {
+		topo->refcnt++;
+		return topo;
+	}
 
 	Py_BEGIN_ALLOW_THREADS
-	rv = read_disk_stats_impl(self);
+	topo = diskstats_topology_read(self->groups, self->group_cnt, sig);
 	Py_END_ALLOW_THREADS
 
-	if (rv == ITER_STATE_ERROR) {
+	if (topo == NULL) {
+		PyErr_Format(
+			PyExc_RuntimeError,
+			"Failed to read block device topology: %s",
+			strerror(errno)
+		);
 		return NULL;
 	}
 
-	return diskstats_to_py_diskstats(self);
+	diskstats_topology_put(self->topology);
+	self->topology = topo;
+	topo->refcnt++;
+	return topo;
+}
+
+PyDoc_STRVAR(py_ds_read_rollups__doc__,
+"read_rollups()\n"
+"--\n\n"
+"Read disk stats and aggregate them up the block device topology.\n"
+"Every stacked device (dm, md) gets a rollup of the counters of its\n"
+"direct members (/sys/class/block/<dev>/slaves), and every group\n"
+"passed to the constructor gets a rollup of its listed members.\n"
+"Members that are not part of the read (e.g. excluded by the devices\n"
+"filter) do not contribute. The topology is cached and only re-read\n"
+"from sysfs when the set of devices changes.\n\n"
+"Parameters\n"
+"----------\n"
+"None\n\n"
+"Returns\n"
+"-------\n"
+"tuple of (devices, rollups), both DiskStatsSnapshot. Rollup entries\n"
+"are named after the stacked device or group; groups have major and\n"
+"minor 0.\n"
+);
+
+static PyObject *py_ds_obj_read_rollups(PyObject *obj,
+					PyObject *args_unused,
+					PyObject *kwargs_unused)
+{
+	py_diskstats_t *self = (py_diskstats_t *)obj;
+	PyObject *leaves = NULL, *rollups = NULL;
+	diskstats_reader_t *rd = NULL;
+	diskstats_topology_t *topo = NULL;
+	diskstats_t *rollup_stats = NULL;
+	int cnt;
+
+	rd = read_disk_stats(self);
+	if (rd == NULL) {
+		return NULL;
+	}
+
+	topo = get_topology(self, rd);
+	if (topo == NULL) {
+		put_reader(self, rd);
+		return NULL;
+	}
+
+	rollup_stats = calloc(diskstats_topology_rollup_cnt(topo) + 1,
+			      sizeof(diskstats_t));
+	if (rollup_stats == NULL) {
+		diskstats_topology_put(topo);
+		put_reader(self, rd);
+		PyErr_NoMemory();
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	cnt = diskstats_topology_rollup(topo, rd->stats, rd->stats_cnt,
+					rollup_stats);
+	Py_END_ALLOW_THREADS
+
+	diskstats_topology_put(topo);
+	if (cnt == -1) {
+		free(rollup_stats);
+		put_reader(self, rd);
+		PyErr_NoMemory();
+		return NULL;
+	}
+
+	rollups = init_diskstats_snapshot(rollup_stats, cnt, &rd->ts);
+	if (rollups == NULL) {
+		free(rollup_stats);
+		put_reader(self, rd);
+		return NULL;
+	}
+	snapshot_set_names(rollups, rd->names);
+
+	leaves = take_snapshot(rd);
+	put_reader(self, rd);
+	if (leaves == NULL) {
+		Py_DECREF(rollups);
+		return NULL;
+	}
+
+	return Py_BuildValue("(NN)", leaves, rollups);
+}
+
+PyDoc_STRVAR(py_ds_topology__doc__,
+"topology()\n"
+"--\n\n"
+"Return the cached block device topology used by read_rollups(),\n"
+"reading it from sysfs if it has not been read yet.\n\n"
+"Parameters\n"
+"----------\n"
+"None\n\n"
+"Returns\n"
+"-------\n"
+"dict of device or group name to a dict with the keys kind (disk,\n"
+"partition, dm, md or group), major, minor, parent (disk of a\n"
+"partition or None) and members (list of member device names).\n"
+);
+
+static PyObject *py_ds_obj_topology(PyObject *obj,
+				    PyObject *args_unused,
+				    PyObject *kwargs_unused)
+{
+	py_diskstats_t *self = (py_diskstats_t *)obj;
+	diskstats_topology_t *topo = NULL;
+	PyObject *out = NULL;
+
+	topo = get_topology(self, NULL);
+	if (topo == NULL) {
+		return NULL;
+	}
+
+	out = diskstats_topology_to_dict(topo);
+	diskstats_topology_put(topo);
+	return out;
+}
+
+PyDoc_STRVAR(py_ds_history__doc__,
+"history(device, window=60.0)\n"
+"--\n\n"
+"Summarize latency and utilization of a device over the samples in\n"
+"the history ring (see the history argument of DiskStats) that were\n"
+"taken within `window` seconds of the newest one. Every read method\n"
+"records a sample.\n\n"
+"Parameters\n"
+"----------\n"
+"device: device name or (major, minor) tuple\n"
+"window: float, seconds\n\n"
+"Returns\n"
+"-------\n"
+"dict with the keys\n"
+"    intervals - number of sample intervals used\n"
+"    window - seconds actually covered by those intervals\n"
+"    await - dict of cnt, mean, max, p50, p95 and p99 of the\n"
+"        per-interval mean time (ms) per completed read, write or\n"
+"        discard. Intervals without completed I/O are not counted.\n"
+"    util - same statistics for per-interval utilization (percent)\n"
+);
+
+static PyObject *window_stat_to_py_dict(diskstats_window_stat_t *st)
+{
+	return Py_BuildValue(
+		"{sisdsdsdsdsd}",
+		"cnt", st->cnt,
+		"mean", st->mean,
+		"max", st->max,
+		"p50", st->p50,
+		"p95", st->p95,
+		"p99", st->p99
+	);
+}
+
+static PyObject *py_ds_obj_history(PyObject *obj,
+				   PyObject *args,
+				   PyObject *kwargs)
+{
+	py_diskstats_t *self = (py_diskstats_t *)obj;
+	PyObject *device = NULL, *await = NULL, *util = NULL, *out = NULL;
+	double window = 60.0;
+	diskstats_window_t result;
+	uint major, minor;
+	const char *kwnames [] = {
+		"device",
+		"window",
+		NULL
+	};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+					 "O|d",
+					 discard_const_p(char *, kwnames),
+					 &device,
+					 &window)) {
+		return NULL;
+	}
+
+	if (self->history == NULL) {
+		PyErr_SetString(
+			PyExc_RuntimeError,
+			"History is not enabled for this object."
+		);
+		return NULL;
+	}
+
+	if (PyUnicode_Check(device)) {
+		const char *name = PyUnicode_AsUTF8(device);
+
+		if (name == NULL) {
+			return NULL;
+		}
+
+		if (!diskstats_history_resolve(self->history, name,
+					       &major, &minor)) {
+			PyErr_SetObject(PyExc_KeyError, device);
+			return NULL;
+		}
+	} else if (!PyArg_ParseTuple(device, "II", &major, &minor)) {
+		return NULL;
+	}
+
+	diskstats_history_window(self->history, major, minor,
+				 window * 1000.0, &result);
+
+	await = window_stat_to_py_dict(&result.await);
+	if (await == NULL) {
+		return NULL;
+	}
+
+	util = window_stat_to_py_dict(&result.util);
+	if (util == NULL) {
+		Py_DECREF(await);
+		return NULL;
+	}
+
+	out = Py_BuildValue(
+		"{sisdsOsO}",
+		"intervals", result.intervals,
+		"window", result.window_ms / 1000.0,
+		"await", await,
+		"util", util
+	);
+	Py_DECREF(await);
+	Py_DECREF(util);
+	return out;
 }
 
 static PyMethodDef py_ds_obj_methods[] = {
@@ -317,6 +1129,36 @@ static PyMethodDef py_ds_obj_methods[] = {
 		.ml_flags = METH_NOARGS,
 		.ml_doc = py_ds_read__doc__
 	},
+	{
+		.ml_name = "read_rates",
+		.ml_meth = (PyCFunction)py_ds_obj_read_rates,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = py_ds_read_rates__doc__
+	},
+	{
+		.ml_name = "read_snapshot",
+		.ml_meth = (PyCFunction)py_ds_obj_read_snapshot,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = py_ds_read_snapshot__doc__
+	},
+	{
+		.ml_name = "read_rollups",
+		.ml_meth = (PyCFunction)py_ds_obj_read_rollups,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = py_ds_read_rollups__doc__
+	},
+	{
+		.ml_name = "topology",
+		.ml_meth = (PyCFunction)py_ds_obj_topology,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = py_ds_topology__doc__
+	},
+	{
+		.ml_name = "history",
+		.ml_meth = (PyCFunction)py_ds_obj_history,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = py_ds_history__doc__
+	},
 	{ NULL, NULL, 0, NULL }
 };
 
@@ -326,16 +1168,32 @@ static PyGetSetDef py_ds_obj_getsetters[] = {
 
 
 PyDoc_STRVAR(py_diskstats_handle__doc__,
-"GLFS object handle\n"
-"This handle provides methods to work with glusster objects (files and\n"
-"directories), instead of absolute paths.\n"
-"The intention using glfs objects is to operate based on parent parent\n"
-"object and looking up or creating objects within, OR to be used on the\n"
-"actual object thus looked up or created, and retrieve information regarding\n"
-"the same.\n"
-"The object handles may be used to open / create a gluster FD object for\n"
-"gluster FD - based operations\n"
-"The object handle is automatically closed when it is deallocated.\n"
+"DiskStats(devices=None, whole_disks_only=False, history=0,\n"
+"          history_devices=0, groups=None, resolve_names=False)\n"
+"--\n\n"
+"Reader for /proc/diskstats. The file is held open for the lifetime\n"
+"of the object. One object may be shared between threads: each call\n"
+"reads and parses into private buffers without holding the GIL, so\n"
+"concurrent calls run in parallel.\n\n"
+"devices - optional sequence of device selectors. Each may be a device\n"
+"    name (\"sda\"), an fnmatch glob (\"nvme*n1\"), a \"major:minor\"\n"
+"    string or a (major, minor) tuple. Only matching devices are parsed\n"
+"    and returned.\n"
+"whole_disks_only - skip partitions, i.e. report only devices that\n"
+"    appear in /sys/block.\n"
+"history - if non-zero, keep the last `history` samples in a\n"
+"    fixed-size ring for history() queries.\n"
+"history_devices - maximum number of devices recorded per history\n"
+"    sample. Defaults to twice the number of devices selected when\n"
+"    the object is created. Memory used by the ring is\n"
+"    history * history_devices * 160 bytes and is allocated up front.\n"
+"groups - optional dict of group name (e.g. a pool) to a list of member\n"
+"    device names. read_rollups() reports the summed counters of each\n"
+"    group.\n"
+"resolve_names - resolve the device-mapper name, /dev/disk/by-id link,\n"
+"    serial number and WWN of every device, available as the dm_name,\n"
+"    by_id, serial and wwn attributes of DiskStatsEntry. They are\n"
+"    resolved once and again only when the set of devices changes.\n"
 );
 
 PyTypeObject PyDiskStats = {
@@ -21,7 +21,10 @@
 #define _DISKSTATS_H_
 
 #include <Python.h>
+#include <time.h>
 #include "../common/includes.h"
+#include "../utils/fdbuf.h"
+#include "../utils/hashtab.h"
 
 #define DISKSTATS_PATH "/proc/diskstats"
 #define DISKSTATS_NAME_BUF 32 /* DBEV_NAME_SIZE */
@@ -48,20 +51,269 @@ typedef struct procfs_diskstats {
 	uint time_spent_flushing_ms;
 } diskstats_t;
 
+/*
+ * Per-device rates between two samples of /proc/diskstats. Field
+ * semantics follow `iostat -x`: await values are milliseconds per
+ * completed request, aqu_sz is the average queue length and util is
+ * the percentage of elapsed time during which the device was busy.
+ */
+typedef struct procfs_diskstats_rate {
+	uint major;
+	uint minor;
+	char name[DISKSTATS_NAME_BUF];
+	double interval_ms;
+	double reads_per_sec;
+	double reads_merged_per_sec;
+	double read_bytes_per_sec;
+	double writes_per_sec;
+	double writes_merged_per_sec;
+	double write_bytes_per_sec;
+	double discards_per_sec;
+	double discard_bytes_per_sec;
+	double flushes_per_sec;
+	double r_await;
+	double w_await;
+	double d_await;
+	double f_await;
+	double aqu_sz;
+	double util;
+} diskstats_rate_t;
+
+/* diskstats_filter.c */
+
+/*
+ * Entries of /sys/block, for whole_disks_only. Immutable once built and
+ * shared by reference between the filter and reads in progress.
+ */
+typedef struct diskstats_disks {
+	int refcnt; /* only changed with the GIL held */
+	uint64_t signature; /* of the device set it was read for */
+	char (*names)[DISKSTATS_NAME_BUF];
+	int cnt;
+	hashtab_t idx;
+} diskstats_disks_t;
+
+typedef struct diskstats_filter {
+	bool whole_disks_only;
+	bool has_selectors;
+	char (*names)[DISKSTATS_NAME_BUF];
+	int names_cnt;
+	hashtab_t names_idx;
+	uint64_t *devnos;
+	int devnos_cnt;
+	hashtab_t devnos_idx;
+	char **globs;
+	int globs_cnt;
+	diskstats_disks_t *disks; /* latest set read, for whole_disks_only */
+} diskstats_filter_t;
+
+extern diskstats_filter_t *diskstats_filter_new(PyObject *devices,
+						bool whole_disks_only);
+extern void diskstats_filter_free(diskstats_filter_t *filter);
+extern diskstats_disks_t *diskstats_disks_read(uint64_t signature);
+extern void diskstats_disks_put(diskstats_disks_t *disks);
+extern bool diskstats_filter_match(const diskstats_filter_t *filter,
+				   const diskstats_disks_t *disks,
+				   const diskstats_t *stat);
+
+/* diskstats_history.c */
+typedef struct diskstats_history diskstats_history_t;
+
 typedef struct {
-	PyObject_HEAD
-	FILE *stats_file;
+	int cnt;
+	double mean;
+	double max;
+	double p50;
+	double p95;
+	double p99;
+} diskstats_window_stat_t;
+
+typedef struct {
+	int intervals;
+	double window_ms;
+	diskstats_window_stat_t await;
+	diskstats_window_stat_t util;
+} diskstats_window_t;
+
+extern diskstats_history_t *diskstats_history_new(int slots, int capacity);
+extern void diskstats_history_free(diskstats_history_t *hist);
+extern void diskstats_history_push(diskstats_history_t *hist,
+				   const diskstats_t *stats, int stats_cnt,
+				   const struct timespec *ts);
+extern bool diskstats_history_resolve(const diskstats_history_t *hist,
+				      const char *name, uint *major,
+				      uint *minor);
+extern void diskstats_history_window(diskstats_history_t *hist,
+				     uint major, uint minor,
+				     double window_ms,
+				     diskstats_window_t *out);
+
+/* diskstats_topology.c */
+enum {
+	TOPO_KIND_DISK,
+	TOPO_KIND_PARTITION,
+	TOPO_KIND_DM,
+	TOPO_KIND_MD,
+	TOPO_KIND_GROUP,
+};
+
+typedef struct {
+	char name[DISKSTATS_NAME_BUF];
+	uint major;
+	uint minor;
+	int kind;
+	int parent; /* disk of a partition, or -1 */
+	int member_off; /* slaves, or group members */
+	int member_cnt;
+} diskstats_topo_node_t;
+
+typedef struct {
+	char name[DISKSTATS_NAME_BUF];
+	char (*members)[DISKSTATS_NAME_BUF];
+	int member_cnt;
+} diskstats_group_t;
+
+typedef struct diskstats_topology {
+	int refcnt; /* only changed with the GIL held */
+	diskstats_topo_node_t *nodes; /* devices, then one node per group */
+	int node_cnt;
+	int node_alloc;
+	int *members; /* node indexes */
+	int member_cnt;
+	int member_alloc;
+	hashtab_t by_name;
+	const diskstats_group_t *groups; /* owned by the DiskStats object */
+	int group_cnt;
+	uint64_t signature; /* of the device set it was read for */
+} diskstats_topology_t;
+
+extern diskstats_group_t *diskstats_groups_new(PyObject *groups,
+					       int *cnt_out);
+extern void diskstats_groups_free(diskstats_group_t *groups, int cnt);
+extern diskstats_topology_t *diskstats_topology_read(const diskstats_group_t *groups,
+						     int group_cnt,
+						     uint64_t signature);
+extern void diskstats_topology_put(diskstats_topology_t *topo);
+extern uint64_t diskstats_topology_signature(const diskstats_t *stats,
+					     int cnt);
+extern int diskstats_topology_rollup_cnt(const diskstats_topology_t *topo);
+extern int diskstats_topology_rollup(const diskstats_topology_t *topo,
+				     const diskstats_t *stats, int stats_cnt,
+				     diskstats_t *out);
+extern const char *diskstats_topo_kind_name(int kind);
+extern PyObject *diskstats_topology_to_dict(const diskstats_topology_t *topo);
+
+typedef struct py_diskstats py_diskstats_t;
+
+/* diskstats_names.c */
+typedef struct {
+	uint64_t devno;
+	char dm_name[128];
+	char by_id[256]; /* name of a link in /dev/disk/by-id */
+	char serial[128];
+	char wwn[128];
+} diskstats_ident_t;
+
+typedef struct diskstats_names {
+	int refcnt; /* only changed with the GIL held */
+	uint64_t signature; /* of the device set it was read for */
+	diskstats_ident_t *idents;
+	int cnt;
+	hashtab_t by_devno;
+} diskstats_names_t;
+
+extern diskstats_names_t *diskstats_names_read(const diskstats_t *stats,
+					       int cnt, uint64_t signature);
+extern const diskstats_ident_t *diskstats_names_lookup(const diskstats_names_t *names,
+						       uint major, uint minor);
+extern void diskstats_names_put(diskstats_names_t *names);
+
+/*
+ * State of one read. While the GIL is released a reader is private to
+ * the thread that fills it, so concurrent reads of one DiskStats object
+ * never share a buffer. Anything shared with other threads (filter,
+ * history, topology, the read_rates() baseline) is only modified with
+ * the GIL held, by swapping in a new reference.
+ */
+typedef struct diskstats_reader {
+	fd_buf_t buf;
 	diskstats_t *stats;
 	int stats_alloc;
 	int stats_cnt;
-} py_diskstats_t;
+	struct timespec ts; /* CLOCK_MONOTONIC midpoint of the read */
+	diskstats_disks_t *disks; /* whole disks used to filter the read */
+	diskstats_disks_t *new_disks; /* rebuilt during the read, or NULL */
+	diskstats_names_t *names; /* identifiers, with resolve_names */
+} diskstats_reader_t;
+
+struct py_diskstats {
+	PyObject_HEAD
+	/* fills a reader; called without the GIL */
+	bool (*read_fn)(py_diskstats_t *self, diskstats_reader_t *rd);
+	int stats_fd;
+	diskstats_reader_t *spare; /* reader kept for reuse by the next call */
+
+	/* DiskStatsSnapshot of the previous read_rates() call */
+	PyObject *rates_prev;
+	diskstats_filter_t *filter;
+	diskstats_history_t *history;
+	diskstats_group_t *groups;
+	int group_cnt;
+	diskstats_topology_t *topology;
+	bool resolve_names;
+	diskstats_names_t *names;
+};
+
+/* diskstats_sysfs.c */
+typedef struct {
+	py_diskstats_t base;
+	int *fds; /* /sys/class/block/<dev>/stat */
+	diskstats_t *devs; /* major, minor and name of each fd */
+	int dev_cnt;
+} py_sysfs_diskstats_t;
 
 typedef struct {
 	PyObject_HEAD
-	diskstats_t stat;
+	PyObject *owner; /* DiskStatsSnapshot holding `stat` */
+	const diskstats_t *stat;
 } py_diskstats_entry_t;
 
+typedef struct {
+	PyObject_HEAD
+	diskstats_t *stats;
+	int stats_cnt;
+	Py_ssize_t shape;
+	struct timespec ts;
+	diskstats_names_t *names; /* may be NULL */
+	/* built on first lookup */
+	bool indexed;
+	hashtab_t by_name;
+	hashtab_t by_devno;
+} py_diskstats_snapshot_t;
+
 extern PyTypeObject PyDiskStats;
 extern PyTypeObject PyDiskStatsEntry;
-PyObject *init_diskstats(diskstats_t *stats_in);
+extern PyTypeObject PyDiskStatsSnapshot;
+extern PyTypeObject PySysfsDiskStats;
+PyObject *init_diskstats(PyObject *owner, const diskstats_t *stat);
+PyObject *init_diskstats_snapshot(diskstats_t *stats, int stats_cnt,
+				  const struct timespec *ts);
+
+/* diskstats.c */
+extern bool parse_disk_counters(const char *p, const char *eol,
+				diskstats_t *stat);
+extern void diskstats_set_ts(diskstats_reader_t *rd,
+			     const struct timespec *start,
+			     const struct timespec *end);
+extern bool diskstats_reserve(diskstats_reader_t *rd, int cnt);
+extern int diskstats_setup_history(py_diskstats_t *self, int slots,
+				   int capacity);
+extern void py_ds_obj_dealloc(py_diskstats_t *self);
+
+/* diskstats_rate.c */
+extern int diskstats_compute_rates(const diskstats_t *prev, int prev_cnt,
+				   const struct timespec *prev_ts,
+				   const diskstats_t *cur, int cur_cnt,
+				   const struct timespec *cur_ts,
+				   diskstats_rate_t *rates_out);
 #endif /* _DISKSTATS_H_ */
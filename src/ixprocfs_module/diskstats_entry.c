@@ -18,26 +18,21 @@
  */
 
 #include <Python.h>
+#include <stddef.h>
 #include "diskstats.h"
 
-static PyObject *py_dse_obj_new(PyTypeObject *obj,
-			        PyObject *args_unused,
-			        PyObject *kwargs_unused)
-{
-	py_diskstats_t *self = NULL;
-
-	self = (py_diskstats_t *)obj->tp_alloc(obj, 0);
-	if (self == NULL) {
-		return NULL;
-	}
-	return (PyObject *)self;
-}
+/*
+ * DiskStatsEntry is a view of one device in a DiskStatsSnapshot. It
+ * holds a reference to the snapshot and a pointer into its (immutable)
+ * array, so creating an entry copies nothing and fields are only
+ * converted to Python objects when they are accessed.
+ */
 
-static int py_dse_obj_init(PyObject *obj,
-			   PyObject *args,
-			   PyObject *kwargs)
+static void py_dse_obj_dealloc(py_diskstats_entry_t *self)
 {
-	return 0;
+	Py_CLEAR(self->owner);
+	self->stat = NULL;
+	Py_TYPE(self)->tp_free((PyObject *)self);
 }
 
 static PyObject *py_dse_obj_counters(PyObject *obj,
@@ -45,28 +40,30 @@ static PyObject *py_dse_obj_counters(PyObject *obj,
 				     PyObject *kwargs_unused)
 {
 	py_diskstats_entry_t *self = (py_diskstats_entry_t *)obj;
+	const diskstats_t *stat = self->stat;
+
 	return Py_BuildValue(
-		"(IIskkkIkkkIIIIIkkkIkI)",
-		self->stat.major,
-		self->stat.minor,
-		self->stat.name,
-		self->stat.reads_completed,
-		self->stat.reads_merged,
-		self->stat.sectors_read,
-		self->stat.time_reading_ms,
-		self->stat.writes_completed,
-		self->stat.writes_merged,
-		self->stat.sectors_written,
-		self->stat.time_writing_ms,
-		self->stat.num_ios_in_progress,
-		self->stat.time_doing_ios_ms,
-		self->stat.weighted_time_doing_ios_ms,
-		self->stat.discards_completed,
-		self->stat.discards_merged,
-		self->stat.sectors_discarded,
-		self->stat.time_spent_discarding_ms,
-		self->stat.flush_requests_completed,
-		self->stat.time_spent_flushing_ms
+		"(IIskkkIkkkIIIIkkkIkI)",
+		stat->major,
+		stat->minor,
+		stat->name,
+		stat->reads_completed,
+		stat->reads_merged,
+		stat->sectors_read,
+		stat->time_reading_ms,
+		stat->writes_completed,
+		stat->writes_merged,
+		stat->sectors_written,
+		stat->time_writing_ms,
+		stat->num_ios_in_progress,
+		stat->time_doing_ios_ms,
+		stat->weighted_time_doing_ios_ms,
+		stat->discards_completed,
+		stat->discards_merged,
+		stat->sectors_discarded,
+		stat->time_spent_discarding_ms,
+		stat->flush_requests_completed,
+		stat->time_spent_flushing_ms
 	);
 }
 
@@ -75,35 +72,97 @@ static PyObject *py_dse_obj_counters_dict(PyObject *obj,
 					  PyObject *kwargs_unused)
 {
 	py_diskstats_entry_t *self = (py_diskstats_entry_t *)obj;
+	const diskstats_t *stat = self->stat;
+
 	return Py_BuildValue(
-		"{sIsIsssksksksIsksksksIsIsIsIsIsksksksIsksI}",
-		"major", self->stat.major,
-		"minor", self->stat.minor,
-		"device_name", self->stat.name,
-		"reads_completed", self->stat.reads_completed,
-		"reads_merged", self->stat.reads_merged,
-		"sectors_read", self->stat.sectors_read,
-		"time_reading_ms", self->stat.time_reading_ms,
-		"writes_completed", self->stat.writes_completed,
-		"writes_merged", self->stat.writes_merged,
-		"sectors_written", self->stat.sectors_written,
-		"time_writing_ms", self->stat.time_writing_ms,
-		"num_ios_in_progress", self->stat.num_ios_in_progress,
-		"time_doing_ios_ms", self->stat.time_doing_ios_ms,
-		"weighted_time_doing_ios_ms", self->stat.weighted_time_doing_ios_ms,
-		"discards_completed", self->stat.discards_completed,
-		"discards_merged", self->stat.discards_merged,
-		"sectors_discarded", self->stat.sectors_discarded,
-		"discarding_ms", self->stat.time_spent_discarding_ms,
-		"requests_completed", self->stat.flush_requests_completed,
-		"time_spent_flushing_ms", self->stat.time_spent_flushing_ms
+		"{sIsIsssksksksIsksksksIsIsIsIsksksksIsksI}",
+		"major", stat->major,
+		"minor", stat->minor,
+		"device_name", stat->name,
+		"reads_completed", stat->reads_completed,
+		"reads_merged", stat->reads_merged,
+		"sectors_read", stat->sectors_read,
+		"time_reading_ms", stat->time_reading_ms,
+		"writes_completed", stat->writes_completed,
+		"writes_merged", stat->writes_merged,
+		"sectors_written", stat->sectors_written,
+		"time_writing_ms", stat->time_writing_ms,
+		"num_ios_in_progress", stat->num_ios_in_progress,
+		"time_doing_ios_ms", stat->time_doing_ios_ms,
+		"weighted_time_doing_ios_ms", stat->weighted_time_doing_ios_ms,
+		"discards_completed", stat->discards_completed,
+		"discards_merged", stat->discards_merged,
+		"sectors_discarded", stat->sectors_discarded,
+		"discarding_ms", stat->time_spent_discarding_ms,
+		"requests_completed", stat->flush_requests_completed,
+		"time_spent_flushing_ms", stat->time_spent_flushing_ms
 	);
 }
 
 static PyObject *py_dse_obj_name(PyObject *obj, void *closure)
 {
 	py_diskstats_entry_t *self = (py_diskstats_entry_t *)obj;
-        return Py_BuildValue("s", self->stat.name);
+	return PyUnicode_FromString(self->stat->name);
+}
+
+/*
+ * Device identifiers are kept by the owning snapshot when the DiskStats
+ * object was created with resolve_names=True. The closure is the offset
+ * of the string in diskstats_ident_t. Missing identifiers are None.
+ */
+static PyObject *py_dse_obj_ident(PyObject *obj, void *closure)
+{
+	py_diskstats_entry_t *self = (py_diskstats_entry_t *)obj;
+	py_diskstats_snapshot_t *snap = (py_diskstats_snapshot_t *)self->owner;
+	const diskstats_ident_t *ident = NULL;
+	const char *str = NULL;
+
+	ident = diskstats_names_lookup(snap->names, self->stat->major,
+				       self->stat->minor);
+	if (ident == NULL) {
+		Py_RETURN_NONE;
+	}
+
+	str = (const char *)ident + (uintptr_t)closure;
+	if (*str == '\0') {
+		Py_RETURN_NONE;
+	}
+
+	return PyUnicode_FromString(str);
+}
+
+#define DSE_IDENT(fname, docstr) { \
+	.name = discard_const_p(char, #fname), \
+	.get = (getter)py_dse_obj_ident, \
+	.doc = docstr, \
+	.closure = (void *)offsetof(diskstats_ident_t, fname), \
+}
+
+/*
+ * Generic getter for the numeric fields. The closure of each getset
+ * entry is the offset of the field in diskstats_t, tagged in the low
+ * bit when the field is a uint rather than an unsigned long.
+ */
+#define DSE_ULONG(field) ((void *)(uintptr_t)(offsetof(diskstats_t, field) << 1))
+#define DSE_UINT(field) ((void *)(uintptr_t)((offsetof(diskstats_t, field) << 1) | 1))
+
+static PyObject *py_dse_obj_field(PyObject *obj, void *closure)
+{
+	py_diskstats_entry_t *self = (py_diskstats_entry_t *)obj;
+	uintptr_t tag = (uintptr_t)closure;
+	const char *field = (const char *)self->stat + (tag >> 1);
+
+	if (tag & 1) {
+		return PyLong_FromUnsignedLong(*(const uint *)field);
+	}
+
+	return PyLong_FromUnsignedLong(*(const unsigned long *)field);
+}
+
+#define DSE_GETTER(fname, type) { \
+	.name = discard_const_p(char, #fname), \
+	.get = (getter)py_dse_obj_field, \
+	.closure = type(fname), \
 }
 
 static PyMethodDef py_dse_obj_methods[] = {
@@ -128,6 +187,29 @@ static PyGetSetDef py_dse_obj_getsetters[] = {
 		.get	= (getter)py_dse_obj_name,
 		.doc	= "device name",
 	},
+	DSE_GETTER(major, DSE_UINT),
+	DSE_GETTER(minor, DSE_UINT),
+	DSE_GETTER(reads_completed, DSE_ULONG),
+	DSE_GETTER(reads_merged, DSE_ULONG),
+	DSE_GETTER(sectors_read, DSE_ULONG),
+	DSE_GETTER(time_reading_ms, DSE_UINT),
+	DSE_GETTER(writes_completed, DSE_ULONG),
+	DSE_GETTER(writes_merged, DSE_ULONG),
+	DSE_GETTER(sectors_written, DSE_ULONG),
+	DSE_GETTER(time_writing_ms, DSE_UINT),
+	DSE_GETTER(num_ios_in_progress, DSE_UINT),
+	DSE_GETTER(time_doing_ios_ms, DSE_UINT),
+	DSE_GETTER(weighted_time_doing_ios_ms, DSE_UINT),
+	DSE_GETTER(discards_completed, DSE_ULONG),
+	DSE_GETTER(discards_merged, DSE_ULONG),
+	DSE_GETTER(sectors_discarded, DSE_ULONG),
+	DSE_GETTER(time_spent_discarding_ms, DSE_UINT),
+	DSE_GETTER(flush_requests_completed, DSE_ULONG),
+	DSE_GETTER(time_spent_flushing_ms, DSE_UINT),
+	DSE_IDENT(dm_name, "device-mapper name"),
+	DSE_IDENT(by_id, "name of a /dev/disk/by-id link to the device"),
+	DSE_IDENT(serial, "serial number"),
+	DSE_IDENT(wwn, "WWN or WWID"),
 	{ .name = NULL }
 };
 
@@ -135,19 +217,25 @@ static PyObject *py_dse_obj_repr(PyObject *obj)
 {
 	py_diskstats_entry_t *self = (py_diskstats_entry_t *)obj;
 	return PyUnicode_FromFormat(
-		"ixprocfs.DiskStatsEntry(major=%u, minor:%u, device_name=%s)",
-		self->stat.major, self->stat.minor, self->stat.name
-        );
+		"ixprocfs.DiskStatsEntry(major=%u, minor=%u, device_name=%s)",
+		self->stat->major, self->stat->minor, self->stat->name
+	);
 }
 
-PyObject *init_diskstats(diskstats_t *stats_in)
+/*
+ * Create a view of `stat`, which must point into memory kept alive and
+ * unchanged by `owner`.
+ */
+PyObject *init_diskstats(PyObject *owner, const diskstats_t *stat)
 {
 	py_diskstats_entry_t *out = NULL;
 	out = PyObject_New(py_diskstats_entry_t, &PyDiskStatsEntry);
 	if (out == NULL) {
 		return NULL;
 	}
-	memcpy(&out->stat, stats_in, sizeof(diskstats_t));
+	Py_INCREF(owner);
+	out->owner = owner;
+	out->stat = stat;
 	return (PyObject *)out;
 }
 
@@ -156,9 +244,10 @@ PyTypeObject PyDiskStatsEntry = {
 	.tp_basicsize = sizeof(py_diskstats_entry_t),
 	.tp_methods = py_dse_obj_methods,
 	.tp_getset = py_dse_obj_getsetters,
-	.tp_new = py_dse_obj_new,
-	.tp_init = py_dse_obj_init,
 	.tp_repr = py_dse_obj_repr,
-	.tp_doc = "Diskstats entry object",
-	.tp_flags = Py_TPFLAGS_DEFAULT|Py_TPFLAGS_BASETYPE,
+	.tp_doc = "Diskstats entry object\n"
+		  "Read-only view of one device in a DiskStatsSnapshot. Fields\n"
+		  "are available as attributes and converted on access.",
+	.tp_dealloc = (destructor)py_dse_obj_dealloc,
+	.tp_flags = Py_TPFLAGS_DEFAULT,
 };
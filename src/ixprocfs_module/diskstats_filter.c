@@ -0,0 +1,360 @@
+/*
+ * Python language bindings for procfs-diskstats
+ *
+ * Copyright (C) Andrew Walker, 2022
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Python.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include "diskstats.h"
+
+/*
+ * Device selection for DiskStats. The filter is compiled once when the
+ * DiskStats object is created and is consulted by the parser right after
+ * the device name has been decoded, so lines that are not selected cost
+ * only the scan for the next newline.
+ */
+
+#define SYS_BLOCK_PATH "/sys/block"
+
+static inline uint64_t devno_key(uint major, uint minor)
+{
+	return ((uint64_t)major << 32) | minor;
+}
+
+static bool match_name(int val, const void *key, const void *priv)
+{
+	const char (*names)[DISKSTATS_NAME_BUF] = priv;
+	return strcmp(names[val], (const char *)key) == 0;
+}
+
+static bool match_devno(int val, const void *key, const void *priv)
+{
+	const uint64_t *devnos = priv;
+	return devnos[val] == *(const uint64_t *)key;
+}
+
+static bool is_glob(const char *str)
+{
+	return strpbrk(str, "*?[") != NULL;
+}
+
+static bool parse_devno_str(const char *str, uint *major, uint *minor)
+{
+	char trailing;
+
+	return sscanf(str, "%u:%u%c", major, minor, &trailing) == 2;
+}
+
+static bool add_name(diskstats_filter_t *filter, const char *name)
+{
+	int idx = filter->names_cnt;
+
+	if (strlen(name) >= DISKSTATS_NAME_BUF) {
+		PyErr_Format(
+			PyExc_ValueError,
+			"%s: device name too long.", name
+		);
+		return false;
+	}
+
+	strlcpy(filter->names[idx], name, DISKSTATS_NAME_BUF);
+	if (!hashtab_insert(&filter->names_idx,
+			    hash_str(name, strlen(name)), idx)) {
+		PyErr_NoMemory();
+		return false;
+	}
+	filter->names_cnt++;
+	return true;
+}
+
+static bool add_devno(diskstats_filter_t *filter, uint major, uint minor)
+{
+	int idx = filter->devnos_cnt;
+
+	filter->devnos[idx] = devno_key(major, minor);
+	if (!hashtab_insert(&filter->devnos_idx,
+			    hash_u64(filter->devnos[idx]), idx)) {
+		PyErr_NoMemory();
+		return false;
+	}
+	filter->devnos_cnt++;
+	return true;
+}
+
+static bool add_glob(diskstats_filter_t *filter, const char *pattern)
+{
+	char *dup = strdup(pattern);
+
+	if (dup == NULL) {
+		PyErr_NoMemory();
+		return false;
+	}
+
+	filter->globs[filter->globs_cnt++] = dup;
+	return true;
+}
+
+static bool add_selector(diskstats_filter_t *filter, PyObject *item)
+{
+	const char *str = NULL;
+	uint major, minor;
+
+	if (PyTuple_Check(item)) {
+		if (!PyArg_ParseTuple(item, "II", &major, &minor)) {
+			return false;
+		}
+		return add_devno(filter, major, minor);
+	}
+
+	if (!PyUnicode_Check(item)) {
+		PyErr_SetString(
+			PyExc_TypeError,
+			"Device selectors must be strings or "
+			"(major, minor) tuples."
+		);
+		return false;
+	}
+
+	str = PyUnicode_AsUTF8(item);
+	if (str == NULL) {
+		return false;
+	}
+
+	if (parse_devno_str(str, &major, &minor)) {
+		return add_devno(filter, major, minor);
+	}
+
+	if (is_glob(str)) {
+		return add_glob(filter, str);
+	}
+
+	return add_name(filter, str);
+}
+
+/*
+ * Compile a filter from a sequence of device names, fnmatch(3) globs,
+ * "major:minor" strings and (major, minor) tuples. Requires the GIL.
+ * Returns NULL with an exception set on failure.
+ */
+diskstats_filter_t *diskstats_filter_new(PyObject *devices,
+					 bool whole_disks_only)
+{
+	diskstats_filter_t *filter = NULL;
+	PyObject *seq = NULL;
+	Py_ssize_t i, cnt = 0;
+
+	if (devices != NULL) {
+		seq = PySequence_Fast(devices, "devices must be a sequence");
+		if (seq == NULL) {
+			return NULL;
+		}
+		cnt = PySequence_Fast_GET_SIZE(seq);
+	}
+
+	filter = calloc(1, sizeof(diskstats_filter_t));
+	if (filter == NULL) {
+		Py_XDECREF(seq);
+		PyErr_NoMemory();
+		return NULL;
+	}
+
+	filter->whole_disks_only = whole_disks_only;
+	filter->has_selectors = cnt > 0;
+	filter->names = calloc(cnt + 1, DISKSTATS_NAME_BUF);
+	filter->devnos = calloc(cnt + 1, sizeof(uint64_t));
+	filter->globs = calloc(cnt + 1, sizeof(char *));
+	if ((filter->names == NULL) || (filter->devnos == NULL) ||
+	    (filter->globs == NULL) ||
+	    !hashtab_init(&filter->names_idx, cnt) ||
+	    !hashtab_init(&filter->devnos_idx, cnt)) {
+		Py_XDECREF(seq);
+		diskstats_filter_free(filter);
+		PyErr_NoMemory();
+		return NULL;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		if (!add_selector(filter, PySequence_Fast_GET_ITEM(seq, i))) {
+			Py_XDECREF(seq);
+			diskstats_filter_free(filter);
+			return NULL;
+		}
+	}
+
+	Py_XDECREF(seq);
+	return filter;
+}
+
+void diskstats_filter_free(diskstats_filter_t *filter)
+{
+	int i;
+
+	if (filter == NULL) {
+		return;
+	}
+
+	if (filter->globs != NULL) {
+		for (i = 0; i < filter->globs_cnt; i++) {
+			free(filter->globs[i]);
+		}
+	}
+	free(filter->globs);
+	free(filter->names);
+	free(filter->devnos);
+	hashtab_free(&filter->names_idx);
+	hashtab_free(&filter->devnos_idx);
+	diskstats_disks_put(filter->disks);
+	free(filter);
+}
+
+void diskstats_disks_put(diskstats_disks_t *disks)
+{
+	if ((disks == NULL) || (--disks->refcnt > 0)) {
+		return;
+	}
+
+	free(disks->names);
+	hashtab_free(&disks->idx);
+	free(disks);
+}
+
+/*
+ * Whole disks (including md, dm, loop and zvols) are the entries of
+ * /sys/block; partitions only appear beneath their parent disk. Called
+ * with the GIL released whenever the signature of the device set in
+ * /proc/diskstats changes. The set is never modified once built, so a
+ * reader can keep using the one it started with while another reader
+ * replaces it.
+ * Returns a set holding one reference or NULL with errno set.
+ */
+diskstats_disks_t *diskstats_disks_read(uint64_t signature)
+{
+	diskstats_disks_t *disks = NULL;
+	DIR *dirp = NULL;
+	struct dirent *entry = NULL;
+	int alloc = 0;
+
+	disks = calloc(1, sizeof(diskstats_disks_t));
+	if (disks == NULL) {
+		return NULL;
+	}
+	disks->refcnt = 1;
+	disks->signature = signature;
+
+	dirp = opendir(SYS_BLOCK_PATH);
+	if (dirp == NULL) {
+		goto fail;
+	}
+
+	while ((entry = readdir(dirp)) != NULL) {
+		int idx = disks->cnt;
+
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+
+		if (idx == alloc) {
+			char (*new)[DISKSTATS_NAME_BUF] = NULL;
+			int new_alloc = alloc ? alloc * 2 : 64;
+
+			new = realloc(disks->names, new_alloc * DISKSTATS_NAME_BUF);
+			if (new == NULL) {
+				goto fail;
+			}
+			disks->names = new;
+			alloc = new_alloc;
+		}
+
+		strlcpy(disks->names[idx], entry->d_name, DISKSTATS_NAME_BUF);
+		if (!hashtab_insert(&disks->idx,
+				    hash_str(disks->names[idx],
+					     strlen(disks->names[idx])),
+				    idx)) {
+			goto fail;
+		}
+		disks->cnt++;
+	}
+
+	closedir(dirp);
+	return disks;
+
+fail:
+	if (dirp != NULL) {
+		closedir(dirp);
+	}
+	/* only this thread has seen the set, so it is safe without the GIL */
+	diskstats_disks_put(disks);
+	return NULL;
+}
+
+/*
+ * Decide whether a device is selected. Only the major, minor and name
+ * of `stat` need to be filled in. `disks` is the set of whole disks to
+ * use for whole_disks_only, and may be NULL if the filter does not have
+ * that set.
+ */
+bool diskstats_filter_match(const diskstats_filter_t *filter,
+			    const diskstats_disks_t *disks,
+			    const diskstats_t *stat)
+{
+	uint64_t hash = 0;
+	int i;
+
+	if (filter->whole_disks_only) {
+		if (disks == NULL) {
+			return false;
+		}
+
+		hash = hash_str(stat->name, strlen(stat->name));
+		if (hashtab_lookup(&disks->idx, hash, match_name,
+				   stat->name, disks->names) == -1) {
+			return false;
+		}
+	}
+
+	if (!filter->has_selectors) {
+		return true;
+	}
+
+	if (filter->names_cnt) {
+		if (hash == 0) {
+			hash = hash_str(stat->name, strlen(stat->name));
+		}
+		if (hashtab_lookup(&filter->names_idx, hash, match_name,
+				   stat->name, filter->names) != -1) {
+			return true;
+		}
+	}
+
+	if (filter->devnos_cnt) {
+		uint64_t key = devno_key(stat->major, stat->minor);
+
+		if (hashtab_lookup(&filter->devnos_idx, hash_u64(key),
+				   match_devno, &key, filter->devnos) != -1) {
+			return true;
+		}
+	}
+
+	for (i = 0; i < filter->globs_cnt; i++) {
+		if (fnmatch(filter->globs[i], stat->name, 0) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
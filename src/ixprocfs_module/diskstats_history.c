@@ -0,0 +1,284 @@
+/*
+ * Python language bindings for procfs-diskstats
+ *
+ * Copyright (C) Andrew Walker, 2022
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Python.h>
+#include "diskstats.h"
+
+/*
+ * Fixed-capacity history of DiskStats samples. All memory is allocated
+ * when the ring is created: `slots` samples of at most `capacity`
+ * devices each, plus scratch space used to compute percentiles. Pushing
+ * a sample is a memcpy into the oldest slot, and queries walk the ring
+ * in place, so no allocation happens after setup.
+ */
+
+struct diskstats_history {
+	int slots;
+	int capacity;
+	int head; /* slot that the next sample is written to */
+	int cnt; /* number of valid samples */
+	struct timespec *ts;
+	int *stats_cnt;
+	diskstats_t *stats; /* slots * capacity entries */
+	double *await_buf; /* scratch, slots entries */
+	double *util_buf; /* scratch, slots entries */
+};
+
+diskstats_history_t *diskstats_history_new(int slots, int capacity)
+{
+	diskstats_history_t *hist = NULL;
+
+	hist = calloc(1, sizeof(diskstats_history_t));
+	if (hist == NULL) {
+		return NULL;
+	}
+
+	hist->slots = slots;
+	hist->capacity = capacity;
+	hist->ts = calloc(slots, sizeof(struct timespec));
+	hist->stats_cnt = calloc(slots, sizeof(int));
+	hist->stats = calloc((size_t)slots * capacity, sizeof(diskstats_t));
+	hist->await_buf = calloc(slots, sizeof(double));
+	hist->util_buf = calloc(slots, sizeof(double));
+	if ((hist->ts == NULL) || (hist->stats_cnt == NULL) ||
+	    (hist->stats == NULL) || (hist->await_buf == NULL) ||
+	    (hist->util_buf == NULL)) {
+		diskstats_history_free(hist);
+		return NULL;
+	}
+
+	return hist;
+}
+
+void diskstats_history_free(diskstats_history_t *hist)
+{
+	if (hist == NULL) {
+		return;
+	}
+
+	free(hist->ts);
+	free(hist->stats_cnt);
+	free(hist->stats);
+	free(hist->await_buf);
+	free(hist->util_buf);
+	free(hist);
+}
+
+/*
+ * Record a sample. Devices beyond the capacity chosen at setup are not
+ * recorded. Concurrent reads may finish out of order; a sample that is
+ * not newer than the newest one recorded is dropped so that the ring
+ * stays sorted by time.
+ */
+void diskstats_history_push(diskstats_history_t *hist,
+			    const diskstats_t *stats, int stats_cnt,
+			    const struct timespec *ts)
+{
+	int cnt = stats_cnt < hist->capacity ? stats_cnt : hist->capacity;
+
+	if (hist->cnt > 0) {
+		const struct timespec *newest = NULL;
+
+		newest = &hist->ts[(hist->head + hist->slots - 1) % hist->slots];
+		if ((ts->tv_sec < newest->tv_sec) ||
+		    ((ts->tv_sec == newest->tv_sec) &&
+		     (ts->tv_nsec <= newest->tv_nsec))) {
+			return;
+		}
+	}
+
+	memcpy(&hist->stats[(size_t)hist->head * hist->capacity], stats,
+	       cnt * sizeof(diskstats_t));
+	hist->stats_cnt[hist->head] = cnt;
+	hist->ts[hist->head] = *ts;
+
+	hist->head = (hist->head + 1) % hist->slots;
+	if (hist->cnt < hist->slots) {
+		hist->cnt++;
+	}
+}
+
+/* i = 0 is the newest sample */
+static inline int slot_of(const diskstats_history_t *hist, int i)
+{
+	return (hist->head - 1 - i + hist->slots) % hist->slots;
+}
+
+static inline double ts_to_ms(const struct timespec *ts)
+{
+	return (ts->tv_sec * 1000.0) + (ts->tv_nsec / 1000000.0);
+}
+
+static const diskstats_t *find_dev(const diskstats_history_t *hist,
+				   int slot, uint major, uint minor,
+				   int *hint)
+{
+	const diskstats_t *stats = &hist->stats[(size_t)slot * hist->capacity];
+	int i, cnt = hist->stats_cnt[slot];
+
+	if ((*hint < cnt) && (stats[*hint].major == major) &&
+	    (stats[*hint].minor == minor)) {
+		return &stats[*hint];
+	}
+
+	for (i = 0; i < cnt; i++) {
+		if ((stats[i].major == major) && (stats[i].minor == minor)) {
+			*hint = i;
+			return &stats[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Resolve a device name to major:minor using the newest sample that
+ * contains it.
+ */
+bool diskstats_history_resolve(const diskstats_history_t *hist,
+			       const char *name, uint *major, uint *minor)
+{
+	int i, j;
+
+	for (i = 0; i < hist->cnt; i++) {
+		int slot = slot_of(hist, i);
+		const diskstats_t *stats = &hist->stats[(size_t)slot * hist->capacity];
+
+		for (j = 0; j < hist->stats_cnt[slot]; j++) {
+			if (strcmp(stats[j].name, name) == 0) {
+				*major = stats[j].major;
+				*minor = stats[j].minor;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/* linear interpolation between closest ranks; `vals` must be sorted */
+static double percentile(const double *vals, int cnt, double pct)
+{
+	double rank = (pct / 100.0) * (cnt - 1);
+	int lo = (int)rank;
+	int hi = lo + 1 < cnt ? lo + 1 : lo;
+
+	return vals[lo] + ((vals[hi] - vals[lo]) * (rank - lo));
+}
+
+static void summarize(double *vals, int cnt, diskstats_window_stat_t *out)
+{
+	double sum = 0;
+	int i;
+
+	*out = (diskstats_window_stat_t) { .cnt = cnt };
+	if (cnt == 0) {
+		return;
+	}
+
+	qsort(vals, cnt, sizeof(double), cmp_double);
+	for (i = 0; i < cnt; i++) {
+		sum += vals[i];
+	}
+
+	out->mean = sum / cnt;
+	out->max = vals[cnt - 1];
+	out->p50 = percentile(vals, cnt, 50);
+	out->p95 = percentile(vals, cnt, 95);
+	out->p99 = percentile(vals, cnt, 99);
+}
+
+/*
+ * Compute statistics over the per-interval await and util of a device
+ * for the samples taken within `window_ms` of the newest one. await is
+ * the mean time per completed read, write or discard in the interval
+ * (intervals without any completed I/O do not contribute to it). Only
+ * intervals where the device is present at both ends are counted.
+ */
+void diskstats_history_window(diskstats_history_t *hist,
+			      uint major, uint minor, double window_ms,
+			      diskstats_window_t *out)
+{
+	const diskstats_t *cur = NULL, *prev = NULL;
+	double newest_ms, cur_ms, prev_ms;
+	int i, hint = 0, n_await = 0, n_util = 0;
+
+	*out = (diskstats_window_t) { .intervals = 0 };
+	if (hist->cnt < 2) {
+		summarize(hist->await_buf, 0, &out->await);
+		summarize(hist->util_buf, 0, &out->util);
+		return;
+	}
+
+	newest_ms = ts_to_ms(&hist->ts[slot_of(hist, 0)]);
+	cur = find_dev(hist, slot_of(hist, 0), major, minor, &hint);
+	cur_ms = newest_ms;
+
+	for (i = 1; i < hist->cnt; i++) {
+		int slot = slot_of(hist, i);
+		unsigned long ios;
+		uint ticks, busy;
+		double interval;
+
+		prev_ms = ts_to_ms(&hist->ts[slot]);
+		if (newest_ms - prev_ms > window_ms) {
+			break;
+		}
+
+		prev = find_dev(hist, slot, major, minor, &hint);
+		interval = cur_ms - prev_ms;
+		if ((cur == NULL) || (prev == NULL) || (interval <= 0) ||
+		    (cur->reads_completed < prev->reads_completed) ||
+		    (cur->writes_completed < prev->writes_completed)) {
+			goto next;
+		}
+
+		/* unsigned arithmetic handles wrap of the 32-bit counters */
+		ios = (cur->reads_completed - prev->reads_completed) +
+		      (cur->writes_completed - prev->writes_completed) +
+		      (cur->discards_completed - prev->discards_completed);
+		ticks = (cur->time_reading_ms - prev->time_reading_ms) +
+			(cur->time_writing_ms - prev->time_writing_ms) +
+			(cur->time_spent_discarding_ms - prev->time_spent_discarding_ms);
+		busy = cur->time_doing_ios_ms - prev->time_doing_ios_ms;
+
+		if (ios) {
+			hist->await_buf[n_await++] = (double)ticks / ios;
+		}
+		hist->util_buf[n_util] = (busy * 100.0) / interval;
+		if (hist->util_buf[n_util] > 100.0) {
+			hist->util_buf[n_util] = 100.0;
+		}
+		n_util++;
+next:
+		cur = prev;
+		cur_ms = prev_ms;
+	}
+
+	out->intervals = n_util;
+	out->window_ms = newest_ms - cur_ms;
+	summarize(hist->await_buf, n_await, &out->await);
+	summarize(hist->util_buf, n_util, &out->util);
+}
@@ -0,0 +1,234 @@
+/*
+ * Python language bindings for procfs-diskstats
+ *
+ * Copyright (C) Andrew Walker, 2022
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Python.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/sysmacros.h>
+#include "diskstats.h"
+
+/*
+ * Persistent identifiers for the devices of a read: the device-mapper
+ * name (/sys/dev/block/M:m/dm/name), the serial number and WWN/WWID
+ * from sysfs, and a /dev/disk/by-id link. Resolving these costs a few
+ * sysfs reads per device plus a stat(2) of every by-id link, so the map
+ * is built once and only rebuilt when the set of devices in a read
+ * changes. Like the topology it is never modified after it is built;
+ * snapshots hold a reference to the map that was current when they
+ * were taken.
+ */
+
+#define SYS_DEV_BLOCK_PATH "/sys/dev/block"
+#define DEV_DISK_BY_ID_PATH "/dev/disk/by-id"
+#define BY_ID_WWN_PREFIX "wwn-"
+
+static inline uint64_t devno_key(uint major, uint minor)
+{
+	return ((uint64_t)major << 32) | minor;
+}
+
+static bool match_ident_devno(int val, const void *key, const void *priv)
+{
+	const diskstats_ident_t *idents = priv;
+	return idents[val].devno == *(const uint64_t *)key;
+}
+
+static int find_ident(const diskstats_names_t *names, uint64_t devno)
+{
+	return hashtab_lookup(&names->by_devno, hash_u64(devno),
+			      match_ident_devno, &devno, names->idents);
+}
+
+/*
+ * Read a sysfs attribute of a device into `buf` without trailing
+ * whitespace. `buf` is left empty if the attribute does not exist.
+ */
+static void read_attr(uint major, uint minor, const char *attr,
+		      char *buf, size_t bufsz)
+{
+	char path[PATH_MAX];
+	ssize_t len;
+	int fd;
+
+	*buf = '\0';
+	snprintf(path, sizeof(path), "%s/%u:%u/%s",
+		 SYS_DEV_BLOCK_PATH, major, minor, attr);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return;
+	}
+
+	len = pread(fd, buf, bufsz - 1, 0);
+	close(fd);
+	if (len <= 0) {
+		*buf = '\0';
+		return;
+	}
+
+	while ((len > 0) && isspace((unsigned char)buf[len - 1])) {
+		len--;
+	}
+	buf[len] = '\0';
+}
+
+static void read_ident(diskstats_ident_t *ident, uint major, uint minor)
+{
+	read_attr(major, minor, "dm/name", ident->dm_name,
+		  sizeof(ident->dm_name));
+
+	/* nvme and virtio report these on the disk, scsi on the device */
+	read_attr(major, minor, "serial", ident->serial, sizeof(ident->serial));
+	if (*ident->serial == '\0') {
+		read_attr(major, minor, "device/serial", ident->serial,
+			  sizeof(ident->serial));
+	}
+
+	read_attr(major, minor, "wwid", ident->wwn, sizeof(ident->wwn));
+	if (*ident->wwn == '\0') {
+		read_attr(major, minor, "device/wwid", ident->wwn,
+			  sizeof(ident->wwn));
+	}
+}
+
+/*
+ * Assign /dev/disk/by-id links to devices. A device usually has several
+ * links (bus-model-serial, wwn-..., dm-name-...); the first one in sort
+ * order that is not a wwn- link is used, so the choice is stable across
+ * rebuilds. wwn- links supply the WWN of devices that do not report
+ * one in sysfs.
+ */
+static void read_by_id(diskstats_names_t *names)
+{
+	DIR *dirp = NULL;
+	struct dirent *entry = NULL;
+	size_t wwn_len = strlen(BY_ID_WWN_PREFIX);
+
+	dirp = opendir(DEV_DISK_BY_ID_PATH);
+	if (dirp == NULL) {
+		return;
+	}
+
+	while ((entry = readdir(dirp)) != NULL) {
+		diskstats_ident_t *ident = NULL;
+		struct stat st;
+		int idx;
+
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+
+		if ((fstatat(dirfd(dirp), entry->d_name, &st, 0) == -1) ||
+		    !S_ISBLK(st.st_mode)) {
+			continue;
+		}
+
+		idx = find_ident(names, devno_key(major(st.st_rdev),
+						  minor(st.st_rdev)));
+		if (idx == -1) {
+			continue;
+		}
+		ident = &names->idents[idx];
+
+		if (strncmp(entry->d_name, BY_ID_WWN_PREFIX, wwn_len) == 0) {
+			if (*ident->wwn == '\0') {
+				strlcpy(ident->wwn, entry->d_name + wwn_len,
+					sizeof(ident->wwn));
+			}
+			continue;
+		}
+
+		if ((*ident->by_id == '\0') ||
+		    (strcmp(entry->d_name, ident->by_id) < 0)) {
+			strlcpy(ident->by_id, entry->d_name, sizeof(ident->by_id));
+		}
+	}
+
+	closedir(dirp);
+}
+
+/*
+ * Resolve identifiers for every device in `stats`. Called without the
+ * GIL. Returns a map holding one reference or NULL with errno set.
+ */
+diskstats_names_t *diskstats_names_read(const diskstats_t *stats, int cnt,
+					uint64_t signature)
+{
+	diskstats_names_t *names = NULL;
+	int i;
+
+	names = calloc(1, sizeof(diskstats_names_t));
+	if (names == NULL) {
+		return NULL;
+	}
+	names->refcnt = 1;
+	names->signature = signature;
+
+	names->idents = calloc(cnt + 1, sizeof(diskstats_ident_t));
+	if ((names->idents == NULL) || !hashtab_init(&names->by_devno, cnt)) {
+		diskstats_names_put(names);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		diskstats_ident_t *ident = &names->idents[names->cnt];
+
+		ident->devno = devno_key(stats[i].major, stats[i].minor);
+		if (find_ident(names, ident->devno) != -1) {
+			continue;
+		}
+
+		read_ident(ident, stats[i].major, stats[i].minor);
+		if (!hashtab_insert(&names->by_devno, hash_u64(ident->devno),
+				    names->cnt)) {
+			diskstats_names_put(names);
+			errno = ENOMEM;
+			return NULL;
+		}
+		names->cnt++;
+	}
+
+	read_by_id(names);
+	return names;
+}
+
+const diskstats_ident_t *diskstats_names_lookup(const diskstats_names_t *names,
+						uint major, uint minor)
+{
+	int idx;
+
+	if (names == NULL) {
+		return NULL;
+	}
+
+	idx = find_ident(names, devno_key(major, minor));
+	return idx == -1 ? NULL : &names->idents[idx];
+}
+
+void diskstats_names_put(diskstats_names_t *names)
+{
+	if ((names == NULL) || (--names->refcnt > 0)) {
+		return;
+	}
+
+	free(names->idents);
+	hashtab_free(&names->by_devno);
+	free(names);
+}
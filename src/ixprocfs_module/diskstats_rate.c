@@ -0,0 +1,153 @@
+/*
+ * Python language bindings for procfs-diskstats
+ *
+ * Copyright (C) Andrew Walker, 2022
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Python.h>
+#include "diskstats.h"
+
+#define SECTOR_SIZE 512
+
+static inline double timespec_diff_ms(const struct timespec *start,
+				      const struct timespec *end)
+{
+	return ((double)(end->tv_sec - start->tv_sec) * 1000.0) +
+	       ((double)(end->tv_nsec - start->tv_nsec) / 1000000.0);
+}
+
+/*
+ * The kernel reports the *_ms counters as 32-bit unsigned values that
+ * wrap. Unsigned subtraction yields the correct delta across a single
+ * wrap, which is all that can happen within a sane sampling interval.
+ */
+static inline uint delta_u32(uint cur, uint prev)
+{
+	return cur - prev;
+}
+
+static inline double per_req(uint ms, unsigned long reqs)
+{
+	return reqs ? (double)ms / (double)reqs : 0.0;
+}
+
+/*
+ * Find the previous sample for a device. Devices are normally listed
+ * in the same order each time, so try the slot following the previous
+ * match first. When a device is inserted or removed the hint realigns
+ * after one linear search and the remaining lines match directly.
+ */
+static const diskstats_t *find_prev(const diskstats_t *prev, int prev_cnt,
+				    const diskstats_t *cur, int *hint)
+{
+	int i;
+
+	if ((*hint < prev_cnt) &&
+	    (prev[*hint].major == cur->major) &&
+	    (prev[*hint].minor == cur->minor)) {
+		return &prev[(*hint)++];
+	}
+
+	for (i = 0; i < prev_cnt; i++) {
+		if ((prev[i].major == cur->major) &&
+		    (prev[i].minor == cur->minor)) {
+			*hint = i + 1;
+			return &prev[i];
+		}
+	}
+
+	return NULL;
+}
+
+static void compute_rate(const diskstats_t *p, const diskstats_t *c,
+			 double interval_ms, diskstats_rate_t *r)
+{
+	double secs = interval_ms / 1000.0;
+	unsigned long reads = c->reads_completed - p->reads_completed;
+	unsigned long writes = c->writes_completed - p->writes_completed;
+	unsigned long discards = c->discards_completed - p->discards_completed;
+	unsigned long flushes = c->flush_requests_completed - p->flush_requests_completed;
+	uint busy = delta_u32(c->time_doing_ios_ms, p->time_doing_ios_ms);
+
+	*r = (diskstats_rate_t) {
+		.major = c->major,
+		.minor = c->minor,
+		.interval_ms = interval_ms,
+		.reads_per_sec = reads / secs,
+		.reads_merged_per_sec = (c->reads_merged - p->reads_merged) / secs,
+		.read_bytes_per_sec = ((double)(c->sectors_read - p->sectors_read) * SECTOR_SIZE) / secs,
+		.writes_per_sec = writes / secs,
+		.writes_merged_per_sec = (c->writes_merged - p->writes_merged) / secs,
+		.write_bytes_per_sec = ((double)(c->sectors_written - p->sectors_written) * SECTOR_SIZE) / secs,
+		.discards_per_sec = discards / secs,
+		.discard_bytes_per_sec = ((double)(c->sectors_discarded - p->sectors_discarded) * SECTOR_SIZE) / secs,
+		.flushes_per_sec = flushes / secs,
+		.r_await = per_req(delta_u32(c->time_reading_ms, p->time_reading_ms), reads),
+		.w_await = per_req(delta_u32(c->time_writing_ms, p->time_writing_ms), writes),
+		.d_await = per_req(delta_u32(c->time_spent_discarding_ms, p->time_spent_discarding_ms), discards),
+		.f_await = per_req(delta_u32(c->time_spent_flushing_ms, p->time_spent_flushing_ms), flushes),
+		.aqu_sz = delta_u32(c->weighted_time_doing_ios_ms, p->weighted_time_doing_ios_ms) / interval_ms,
+		.util = (busy * 100.0) / interval_ms,
+	};
+
+	if (r->util > 100.0) {
+		r->util = 100.0;
+	}
+	strlcpy(r->name, c->name, sizeof(r->name));
+}
+
+/*
+ * Compute per-device rates for every device present in both samples.
+ * Devices that only appear in one of the samples are skipped, as are
+ * devices whose completion counters went backwards (removed and re-added
+ * with the same major:minor between samples). `rates_out` must have
+ * room for `cur_cnt` entries. Returns number of entries written or -1
+ * if the interval is not positive.
+ */
+int diskstats_compute_rates(const diskstats_t *prev, int prev_cnt,
+			    const struct timespec *prev_ts,
+			    const diskstats_t *cur, int cur_cnt,
+			    const struct timespec *cur_ts,
+			    diskstats_rate_t *rates_out)
+{
+	double interval_ms;
+	int i, hint = 0, cnt = 0;
+
+	interval_ms = timespec_diff_ms(prev_ts, cur_ts);
+	if (interval_ms <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < cur_cnt; i++) {
+		const diskstats_t *p = NULL;
+
+		p = find_prev(prev, prev_cnt, &cur[i], &hint);
+		if (p == NULL) {
+			continue;
+		}
+
+		if ((cur[i].reads_completed < p->reads_completed) ||
+		    (cur[i].writes_completed < p->writes_completed)) {
+			continue;
+		}
+
+		compute_rate(p, &cur[i], interval_ms, &rates_out[cnt]);
+		cnt++;
+	}
+
+	return cnt;
+}
@@ -0,0 +1,428 @@
+/*
+ * Python language bindings for procfs-diskstats
+ *
+ * Copyright (C) Andrew Walker, 2022
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Python.h>
+#include <stddef.h>
+#include <sys/sysmacros.h>
+#include "diskstats.h"
+
+/*
+ * Immutable snapshot of one read of /proc/diskstats. The diskstats_t
+ * array is handed over from the DiskStats object without copying and is
+ * exported read-only through the buffer protocol as a one-dimensional
+ * array of structs.
+ */
+
+#define DS_FIELD(type, field) { #field, type, offsetof(diskstats_t, field), \
+	sizeof(((diskstats_t *)0)->field) }
+#define DS_UL (sizeof(unsigned long) == 8 ? "Q" : "I")
+
+static const struct {
+	const char *name;
+	const char *code;
+	size_t offset;
+	size_t size;
+} diskstats_buffer_fields[] = {
+	DS_FIELD("I", major),
+	DS_FIELD("I", minor),
+	DS_FIELD("s", name),
+	DS_FIELD(DS_UL, reads_completed),
+	DS_FIELD(DS_UL, reads_merged),
+	DS_FIELD(DS_UL, sectors_read),
+	DS_FIELD("I", time_reading_ms),
+	DS_FIELD(DS_UL, writes_completed),
+	DS_FIELD(DS_UL, writes_merged),
+	DS_FIELD(DS_UL, sectors_written),
+	DS_FIELD("I", time_writing_ms),
+	DS_FIELD("I", num_ios_in_progress),
+	DS_FIELD("I", time_doing_ios_ms),
+	DS_FIELD("I", weighted_time_doing_ios_ms),
+	DS_FIELD(DS_UL, discards_completed),
+	DS_FIELD(DS_UL, discards_merged),
+	DS_FIELD(DS_UL, sectors_discarded),
+	DS_FIELD("I", time_spent_discarding_ms),
+	DS_FIELD(DS_UL, flush_requests_completed),
+	DS_FIELD("I", time_spent_flushing_ms),
+};
+
+static char diskstats_buffer_format[1024];
+
+/*
+ * Build the PEP 3118 format string describing diskstats_t. Padding is
+ * spelled out explicitly from the compiler's offsets so the description
+ * is exact for the ABI the module was built for.
+ */
+static const char *get_buffer_format(void)
+{
+	size_t i, off = 0, len = 0;
+	char *fmt = diskstats_buffer_format;
+	size_t sz = sizeof(diskstats_buffer_format);
+
+	if (*fmt != '\0') {
+		return fmt;
+	}
+
+	len += snprintf(fmt + len, sz - len, "T{");
+	for (i = 0; i < ARRAY_SIZE(diskstats_buffer_fields); i++) {
+		if (diskstats_buffer_fields[i].offset > off) {
+			len += snprintf(fmt + len, sz - len, "%zux",
+					diskstats_buffer_fields[i].offset - off);
+		}
+
+		if (*diskstats_buffer_fields[i].code == 's') {
+			len += snprintf(fmt + len, sz - len, "=%zus:%s:",
+					diskstats_buffer_fields[i].size,
+					diskstats_buffer_fields[i].name);
+		} else {
+			len += snprintf(fmt + len, sz - len, "=%s:%s:",
+					diskstats_buffer_fields[i].code,
+					diskstats_buffer_fields[i].name);
+		}
+		off = diskstats_buffer_fields[i].offset + diskstats_buffer_fields[i].size;
+	}
+
+	if (sizeof(diskstats_t) > off) {
+		len += snprintf(fmt + len, sz - len, "%zux", sizeof(diskstats_t) - off);
+	}
+	snprintf(fmt + len, sz - len, "}");
+	return fmt;
+}
+
+static int py_dss_getbuffer(PyObject *obj, Py_buffer *view, int flags)
+{
+	py_diskstats_snapshot_t *self = (py_diskstats_snapshot_t *)obj;
+	static diskstats_t empty;
+
+	if (flags & PyBUF_WRITABLE) {
+		PyErr_SetString(
+			PyExc_BufferError,
+			"DiskStatsSnapshot is read-only."
+		);
+		view->obj = NULL;
+		return -1;
+	}
+
+	Py_INCREF(obj);
+	*view = (Py_buffer) {
+		.buf = self->stats ? self->stats : &empty,
+		.obj = obj,
+		.len = self->stats_cnt * sizeof(diskstats_t),
+		.itemsize = sizeof(diskstats_t),
+		.readonly = 1,
+		.ndim = 1,
+	};
+
+	if (flags & PyBUF_FORMAT) {
+		view->format = discard_const_p(char, get_buffer_format());
+	}
+
+	if ((flags & PyBUF_ND) == PyBUF_ND) {
+		view->shape = &self->shape;
+	}
+
+	if ((flags & PyBUF_STRIDES) == PyBUF_STRIDES) {
+		view->strides = &view->itemsize;
+	}
+
+	return 0;
+}
+
+static PyBufferProcs py_dss_as_buffer = {
+	.bf_getbuffer = py_dss_getbuffer,
+};
+
+static Py_ssize_t py_dss_len(PyObject *obj)
+{
+	py_diskstats_snapshot_t *self = (py_diskstats_snapshot_t *)obj;
+	return self->stats_cnt;
+}
+
+static PyObject *py_dss_item(PyObject *obj, Py_ssize_t idx)
+{
+	py_diskstats_snapshot_t *self = (py_diskstats_snapshot_t *)obj;
+
+	if ((idx < 0) || (idx >= self->stats_cnt)) {
+		PyErr_SetString(
+			PyExc_IndexError,
+			"DiskStatsSnapshot index out of range"
+		);
+		return NULL;
+	}
+
+	return init_diskstats(obj, &self->stats[idx]);
+}
+
+static PySequenceMethods py_dss_as_sequence = {
+	.sq_length = py_dss_len,
+	.sq_item = py_dss_item,
+};
+
+static PyObject *py_dss_timestamp(PyObject *obj, void *closure)
+{
+	py_diskstats_snapshot_t *self = (py_diskstats_snapshot_t *)obj;
+	return PyFloat_FromDouble(self->ts.tv_sec + (self->ts.tv_nsec / 1e9));
+}
+
+static inline uint64_t devno_key(uint major, uint minor)
+{
+	return ((uint64_t)major << 32) | minor;
+}
+
+static bool match_name(int val, const void *key, const void *priv)
+{
+	const diskstats_t *stats = priv;
+	return strcmp(stats[val].name, (const char *)key) == 0;
+}
+
+static bool match_devno(int val, const void *key, const void *priv)
+{
+	const diskstats_t *stats = priv;
+	return devno_key(stats[val].major, stats[val].minor) ==
+	       *(const uint64_t *)key;
+}
+
+static bool build_index(py_diskstats_snapshot_t *self)
+{
+	int i;
+
+	if (!hashtab_init(&self->by_name, self->stats_cnt) ||
+	    !hashtab_init(&self->by_devno, self->stats_cnt)) {
+		hashtab_free(&self->by_name);
+		PyErr_NoMemory();
+		return false;
+	}
+
+	for (i = 0; i < self->stats_cnt; i++) {
+		diskstats_t *st = &self->stats[i];
+
+		/* sized up front, so these cannot fail */
+		hashtab_insert(&self->by_name,
+			       hash_str(st->name, strlen(st->name)), i);
+		hashtab_insert(&self->by_devno,
+			       hash_u64(devno_key(st->major, st->minor)), i);
+	}
+
+	self->indexed = true;
+	return true;
+}
+
+/*
+ * Resolve a lookup key to an array index. Keys may be a device name, a
+ * (major, minor) tuple or an encoded dev_t as found in st_rdev.
+ * Returns -1 if the device is not present, -2 with an exception set on
+ * error.
+ */
+static int lookup_key(py_diskstats_snapshot_t *self, PyObject *key)
+{
+	uint64_t devno;
+	uint major, minor;
+
+	if (!self->indexed && !build_index(self)) {
+		return -2;
+	}
+
+	if (PyUnicode_Check(key)) {
+		Py_ssize_t len;
+		const char *name = PyUnicode_AsUTF8AndSize(key, &len);
+
+		if (name == NULL) {
+			return -2;
+		}
+
+		return hashtab_lookup(&self->by_name, hash_str(name, len),
+				      match_name, name, self->stats);
+	}
+
+	if (PyTuple_Check(key)) {
+		if (!PyArg_ParseTuple(key, "II", &major, &minor)) {
+			return -2;
+		}
+	} else if (PyLong_Check(key)) {
+		unsigned long long dev = PyLong_AsUnsignedLongLong(key);
+
+		if ((dev == (unsigned long long)-1) && PyErr_Occurred()) {
+			return -2;
+		}
+		major = major(dev);
+		minor = minor(dev);
+	} else {
+		PyErr_SetString(
+			PyExc_TypeError,
+			"Key must be a device name, a (major, minor) tuple "
+			"or a device number."
+		);
+		return -2;
+	}
+
+	devno = devno_key(major, minor);
+	return hashtab_lookup(&self->by_devno, hash_u64(devno),
+			      match_devno, &devno, self->stats);
+}
+
+PyDoc_STRVAR(py_dss_get__doc__,
+"get(key)\n"
+"--\n\n"
+"Look up a device in the snapshot by hash.\n\n"
+"Parameters\n"
+"----------\n"
+"key: device name, (major, minor) tuple or device number (st_rdev)\n\n"
+"Returns\n"
+"-------\n"
+"DiskStatsEntry or None if the device is not in the snapshot\n"
+);
+
+static PyObject *py_dss_get(PyObject *obj, PyObject *key)
+{
+	py_diskstats_snapshot_t *self = (py_diskstats_snapshot_t *)obj;
+	int idx;
+
+	idx = lookup_key(self, key);
+	if (idx == -2) {
+		return NULL;
+	} else if (idx == -1) {
+		Py_RETURN_NONE;
+	}
+
+	return init_diskstats(obj, &self->stats[idx]);
+}
+
+PyDoc_STRVAR(py_dss_find__doc__,
+"find(key)\n"
+"--\n\n"
+"Look up the position of a device in the snapshot by hash, e.g. to\n"
+"index an array created from the snapshot's buffer.\n\n"
+"Parameters\n"
+"----------\n"
+"key: device name, (major, minor) tuple or device number (st_rdev)\n\n"
+"Returns\n"
+"-------\n"
+"int index or -1 if the device is not in the snapshot\n"
+);
+
+static PyObject *py_dss_find(PyObject *obj, PyObject *key)
+{
+	py_diskstats_snapshot_t *self = (py_diskstats_snapshot_t *)obj;
+	int idx;
+
+	idx = lookup_key(self, key);
+	if (idx == -2) {
+		return NULL;
+	}
+
+	return PyLong_FromLong(idx);
+}
+
+static PyMethodDef py_dss_obj_methods[] = {
+	{
+		.ml_name = "get",
+		.ml_meth = (PyCFunction)py_dss_get,
+		.ml_flags = METH_O,
+		.ml_doc = py_dss_get__doc__
+	},
+	{
+		.ml_name = "find",
+		.ml_meth = (PyCFunction)py_dss_find,
+		.ml_flags = METH_O,
+		.ml_doc = py_dss_find__doc__
+	},
+	{ NULL, NULL, 0, NULL }
+};
+
+static PyGetSetDef py_dss_obj_getsetters[] = {
+	{
+		.name	= discard_const_p(char, "timestamp"),
+		.get	= (getter)py_dss_timestamp,
+		.doc	= "CLOCK_MONOTONIC time of the read in seconds",
+	},
+	{ .name = NULL }
+};
+
+void py_dss_obj_dealloc(py_diskstats_snapshot_t *self)
+{
+	free(self->stats);
+	self->stats = NULL;
+	hashtab_free(&self->by_name);
+	hashtab_free(&self->by_devno);
+	diskstats_names_put(self->names);
+	self->names = NULL;
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/*
+ * Takes ownership of `stats`, which must have been allocated with
+ * malloc(3).
+ */
+PyObject *init_diskstats_snapshot(diskstats_t *stats, int stats_cnt,
+				  const struct timespec *ts)
+{
+	py_diskstats_snapshot_t *out = NULL;
+
+	out = PyObject_New(py_diskstats_snapshot_t, &PyDiskStatsSnapshot);
+	if (out == NULL) {
+		return NULL;
+	}
+
+	out->stats = stats;
+	out->stats_cnt = stats_cnt;
+	out->shape = stats_cnt;
+	out->ts = *ts;
+	out->names = NULL;
+	out->indexed = false;
+	out->by_name = (hashtab_t) { .hashes = NULL };
+	out->by_devno = (hashtab_t) { .hashes = NULL };
+	return (PyObject *)out;
+}
+
+PyDoc_STRVAR(py_diskstats_snapshot__doc__,
+"Read-only snapshot of /proc/diskstats\n"
+"Supports len(), indexing (returning DiskStatsEntry), hash lookups by\n"
+"name or device number with get() and find(), and the buffer\n"
+"protocol. The buffer is a one-dimensional array of C diskstats_t\n"
+"structs whose PEP 3118 format names every field, so it can be wrapped\n"
+"without copying, e.g. numpy.asarray(snapshot) or\n"
+"numpy.frombuffer(snapshot, dtype=DTYPE) with the equivalent dtype on\n"
+"64-bit Linux:\n\n"
+"    numpy.dtype([\n"
+"        ('major', 'u4'), ('minor', 'u4'), ('name', 'S32'),\n"
+"        ('reads_completed', 'u8'), ('reads_merged', 'u8'),\n"
+"        ('sectors_read', 'u8'), ('time_reading_ms', 'u4'),\n"
+"        ('writes_completed', 'u8'), ('writes_merged', 'u8'),\n"
+"        ('sectors_written', 'u8'), ('time_writing_ms', 'u4'),\n"
+"        ('num_ios_in_progress', 'u4'), ('time_doing_ios_ms', 'u4'),\n"
+"        ('weighted_time_doing_ios_ms', 'u4'),\n"
+"        ('discards_completed', 'u8'), ('discards_merged', 'u8'),\n"
+"        ('sectors_discarded', 'u8'),\n"
+"        ('time_spent_discarding_ms', 'u4'),\n"
+"        ('flush_requests_completed', 'u8'),\n"
+"        ('time_spent_flushing_ms', 'u4'),\n"
+"    ], align=True)\n\n"
+"The *_ms fields are 32-bit counters that wrap.\n"
+);
+
+PyTypeObject PyDiskStatsSnapshot = {
+	.tp_name = "ixprocfs.DiskStatsSnapshot",
+	.tp_basicsize = sizeof(py_diskstats_snapshot_t),
+	.tp_methods = py_dss_obj_methods,
+	.tp_getset = py_dss_obj_getsetters,
+	.tp_as_buffer = &py_dss_as_buffer,
+	.tp_as_sequence = &py_dss_as_sequence,
+	.tp_doc = py_diskstats_snapshot__doc__,
+	.tp_dealloc = (destructor)py_dss_obj_dealloc,
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+};
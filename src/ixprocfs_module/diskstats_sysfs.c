@@ -0,0 +1,274 @@
+/*
+ * Python language bindings for procfs-diskstats
+ *
+ * Copyright (C) Andrew Walker, 2022
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Python.h>
+#include <unistd.h>
+#include "diskstats.h"
+#include "../utils/iter.h"
+
+/*
+ * Reader for a fixed set of devices through /sys/class/block/<dev>/stat.
+ * Each stat file is opened once and kept open, so that a sample costs
+ * one pread(2) per selected device rather than a read of the whole of
+ * /proc/diskstats. /sys/class/block covers both whole disks
+ * (/sys/block/<dev>) and partitions (/sys/block/<dev>/<part>).
+ *
+ * This is a subtype of DiskStats that only replaces how the stats array
+ * is filled, so read_data(), read_rates() and read_snapshot() work
+ * unchanged.
+ */
+
+#define SYS_CLASS_BLOCK_PATH "/sys/class/block"
+
+static bool read_sysfs_dev(const char *name, diskstats_t *dev)
+{
+	char path[PATH_MAX];
+	char buf[32];
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s/dev", SYS_CLASS_BLOCK_PATH, name);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return false;
+	}
+
+	len = pread(fd, buf, sizeof(buf) - 1, 0);
+	close(fd);
+	if (len <= 0) {
+		errno = len ? errno : EINVAL;
+		return false;
+	}
+	buf[len] = '\0';
+
+	if (sscanf(buf, "%u:%u", &dev->major, &dev->minor) != 2) {
+		errno = EINVAL;
+		return false;
+	}
+
+	strlcpy(dev->name, name, sizeof(dev->name));
+	return true;
+}
+
+static bool open_sysfs_dev(py_sysfs_diskstats_t *self, const char *name)
+{
+	char path[PATH_MAX];
+	diskstats_t *dev = &self->devs[self->dev_cnt];
+	int fd;
+
+	if (strlen(name) >= sizeof(dev->name)) {
+		PyErr_Format(
+			PyExc_ValueError,
+			"%s: device name too long.", name
+		);
+		return false;
+	}
+
+	if (!read_sysfs_dev(name, dev)) {
+		PyErr_Format(
+			PyExc_RuntimeError,
+			"%s: failed to read device number: %s",
+			name, strerror(errno)
+		);
+		return false;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s/stat", SYS_CLASS_BLOCK_PATH, name);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		PyErr_Format(
+			PyExc_RuntimeError,
+			"%s: open() failed: %s",
+			path, strerror(errno)
+		);
+		return false;
+	}
+
+	self->fds[self->dev_cnt++] = fd;
+	return true;
+}
+
+/*
+ * A device that has been removed since the fd was opened fails with
+ * ENODEV (or ENOENT); it is left out of the sample rather than failing
+ * the whole read.
+ */
+static bool read_sysfs_diskstats(py_diskstats_t *base,
+				 diskstats_reader_t *rd)
+{
+	py_sysfs_diskstats_t *self = (py_sysfs_diskstats_t *)base;
+	struct timespec start, end;
+	int i;
+
+	if (!diskstats_reserve(rd, self->dev_cnt)) {
+		return false;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < self->dev_cnt; i++) {
+		diskstats_t *stat = &rd->stats[rd->stats_cnt];
+		const char *data = NULL;
+
+		if (!fd_buf_pread(self->fds[i], &rd->buf)) {
+			if ((errno == ENODEV) || (errno == ENOENT)) {
+				continue;
+			}
+			return false;
+		}
+
+		*stat = (diskstats_t) {
+			.major = self->devs[i].major,
+			.minor = self->devs[i].minor,
+		};
+		memcpy(stat->name, self->devs[i].name, sizeof(stat->name));
+
+		data = rd->buf.data;
+		if (!parse_disk_counters(data, data + rd->buf.len, stat)) {
+			errno = EINVAL;
+			return false;
+		}
+		rd->stats_cnt++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	diskstats_set_ts(rd, &start, &end);
+	return true;
+}
+
+static void close_sysfs_devs(py_sysfs_diskstats_t *self)
+{
+	int i;
+
+	for (i = 0; i < self->dev_cnt; i++) {
+		close(self->fds[i]);
+	}
+	free(self->fds);
+	free(self->devs);
+	self->fds = NULL;
+	self->devs = NULL;
+	self->dev_cnt = 0;
+}
+
+static int py_sds_obj_init(PyObject *obj,
+			   PyObject *args,
+			   PyObject *kwargs)
+{
+	py_sysfs_diskstats_t *self = (py_sysfs_diskstats_t *)obj;
+	PyObject *devices = NULL, *seq = NULL;
+	Py_ssize_t i, cnt;
+	int history = 0;
+	const char *kwnames [] = {
+		"devices",
+		"history",
+		NULL
+	};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+					 "O|i",
+					 discard_const_p(char *, kwnames),
+					 &devices,
+					 &history)) {
+		return -1;
+	}
+
+	/* read() may be using fds and devs without the GIL */
+	if (self->fds != NULL) {
+		PyErr_SetString(
+			PyExc_RuntimeError,
+			"SysfsDiskStats is already initialized."
+		);
+		return -1;
+	}
+
+	seq = PySequence_Fast(devices, "devices must be a sequence");
+	if (seq == NULL) {
+		return -1;
+	}
+
+	cnt = PySequence_Fast_GET_SIZE(seq);
+	self->fds = calloc(cnt + 1, sizeof(int));
+	self->devs = calloc(cnt + 1, sizeof(diskstats_t));
+	if ((self->fds == NULL) || (self->devs == NULL)) {
+		Py_DECREF(seq);
+		close_sysfs_devs(self);
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+		const char *name = NULL;
+
+		if (!PyUnicode_Check(item)) {
+			PyErr_SetString(
+				PyExc_TypeError,
+				"Device names must be strings."
+			);
+			break;
+		}
+
+		name = PyUnicode_AsUTF8(item);
+		if ((name == NULL) || !open_sysfs_dev(self, name)) {
+			break;
+		}
+	}
+	Py_DECREF(seq);
+
+	if (i != cnt) {
+		close_sysfs_devs(self);
+		return -1;
+	}
+
+	self->base.read_fn = read_sysfs_diskstats;
+
+	if (history) {
+		return diskstats_setup_history(&self->base, history, cnt);
+	}
+	return 0;
+}
+
+void py_sds_obj_dealloc(py_sysfs_diskstats_t *self)
+{
+	close_sysfs_devs(self);
+	py_ds_obj_dealloc(&self->base);
+}
+
+PyDoc_STRVAR(py_sysfs_diskstats__doc__,
+"SysfsDiskStats(devices, history=0)\n"
+"--\n\n"
+"DiskStats for a fixed set of devices, read from\n"
+"/sys/class/block/<dev>/stat. The stat files are opened once and kept\n"
+"open, so each read is one pread per device instead of a read of the\n"
+"whole of /proc/diskstats. Intended for sampling a few devices at short\n"
+"intervals. Entries are returned in the order the devices were given.\n"
+"Devices removed after construction are omitted from results.\n\n"
+"devices - sequence of whole disk or partition names, e.g.\n"
+"    [\"sda\", \"sdb1\"].\n"
+"history - as for DiskStats. One slot per device is reserved.\n"
+);
+
+PyTypeObject PySysfsDiskStats = {
+	.tp_name = "ixprocfs.SysfsDiskStats",
+	.tp_base = &PyDiskStats,
+	.tp_basicsize = sizeof(py_sysfs_diskstats_t),
+	.tp_init = py_sds_obj_init,
+	.tp_doc = py_sysfs_diskstats__doc__,
+	.tp_dealloc = (destructor)py_sds_obj_dealloc,
+	.tp_flags = Py_TPFLAGS_DEFAULT|Py_TPFLAGS_BASETYPE,
+};
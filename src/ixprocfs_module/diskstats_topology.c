@@ -0,0 +1,652 @@
+/*
+ * Python language bindings for procfs-diskstats
+ *
+ * Copyright (C) Andrew Walker, 2022
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Python.h>
+#include <dirent.h>
+#include <unistd.h>
+#include "diskstats.h"
+
+/*
+ * Block device topology for DiskStats rollups. The hierarchy is read
+ * from sysfs: partitions from /sys/class/block/<dev>/partition and the
+ * position of the device in the sysfs tree, stacked devices (dm, md)
+ * from /sys/class/block/<dev>/slaves. /sys/class/block/<dev>/holders is
+ * the inverse of the slaves links and so adds no information. The
+ * result is cached and only rebuilt when the set of devices in a read
+ * changes. A topology is never modified after it has been read; a
+ * rebuild reads a new one and replaces the cached reference, so reads in
+ * progress keep using the one they started with.
+ */
+
+#define SYS_CLASS_BLOCK_PATH "/sys/class/block"
+
+static const char *topo_kind_names[] = {
+	[TOPO_KIND_DISK] = "disk",
+	[TOPO_KIND_PARTITION] = "partition",
+	[TOPO_KIND_DM] = "dm",
+	[TOPO_KIND_MD] = "md",
+	[TOPO_KIND_GROUP] = "group",
+};
+
+const char *diskstats_topo_kind_name(int kind)
+{
+	return topo_kind_names[kind];
+}
+
+static inline uint64_t devno_key(uint major, uint minor)
+{
+	return ((uint64_t)major << 32) | minor;
+}
+
+static bool match_node_name(int val, const void *key, const void *priv)
+{
+	const diskstats_topo_node_t *nodes = priv;
+	return strcmp(nodes[val].name, (const char *)key) == 0;
+}
+
+static bool match_stats_devno(int val, const void *key, const void *priv)
+{
+	const diskstats_t *stats = priv;
+	return devno_key(stats[val].major, stats[val].minor) ==
+	       *(const uint64_t *)key;
+}
+
+static int find_node(const diskstats_topology_t *topo, const char *name)
+{
+	return hashtab_lookup(&topo->by_name, hash_str(name, strlen(name)),
+			      match_node_name, name, topo->nodes);
+}
+
+static bool sysfs_exists(const char *name, const char *attr)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s/%s", SYS_CLASS_BLOCK_PATH, name, attr);
+	return access(path, F_OK) == 0;
+}
+
+static bool read_node(const char *name, diskstats_topo_node_t *node,
+		      char *parent, size_t parent_sz)
+{
+	char path[PATH_MAX], link[PATH_MAX], buf[32];
+	char *slash = NULL;
+	ssize_t len;
+	int fd;
+
+	*node = (diskstats_topo_node_t) { .parent = -1 };
+	strlcpy(node->name, name, sizeof(node->name));
+	*parent = '\0';
+
+	snprintf(path, sizeof(path), "%s/%s/dev", SYS_CLASS_BLOCK_PATH, name);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return false;
+	}
+	len = pread(fd, buf, sizeof(buf) - 1, 0);
+	close(fd);
+	if (len <= 0) {
+		return false;
+	}
+	buf[len] = '\0';
+
+	if (sscanf(buf, "%u:%u", &node->major, &node->minor) != 2) {
+		return false;
+	}
+
+	if (sysfs_exists(name, "partition")) {
+		node->kind = TOPO_KIND_PARTITION;
+
+		/* .../block/<disk>/<part> */
+		snprintf(path, sizeof(path), "%s/%s", SYS_CLASS_BLOCK_PATH, name);
+		len = readlink(path, link, sizeof(link) - 1);
+		if (len > 0) {
+			link[len] = '\0';
+			slash = strrchr(link, '/');
+			if (slash != NULL) {
+				*slash = '\0';
+				slash = strrchr(link, '/');
+				strlcpy(parent, slash ? slash + 1 : link, parent_sz);
+			}
+		}
+	} else if (sysfs_exists(name, "dm")) {
+		node->kind = TOPO_KIND_DM;
+	} else if (sysfs_exists(name, "md")) {
+		node->kind = TOPO_KIND_MD;
+	} else {
+		node->kind = TOPO_KIND_DISK;
+	}
+
+	return true;
+}
+
+static bool add_member(diskstats_topology_t *topo, int idx)
+{
+	if (topo->member_cnt == topo->member_alloc) {
+		int *new = NULL;
+		int new_alloc = topo->member_alloc ? topo->member_alloc * 2 : 64;
+
+		new = realloc(topo->members, new_alloc * sizeof(int));
+		if (new == NULL) {
+			return false;
+		}
+		topo->members = new;
+		topo->member_alloc = new_alloc;
+	}
+
+	topo->members[topo->member_cnt++] = idx;
+	return true;
+}
+
+static bool read_slaves(diskstats_topology_t *topo, int idx)
+{
+	char path[PATH_MAX];
+	DIR *dirp = NULL;
+	struct dirent *entry = NULL;
+	diskstats_topo_node_t *node = &topo->nodes[idx];
+
+	node->member_off = topo->member_cnt;
+	node->member_cnt = 0;
+
+	snprintf(path, sizeof(path), "%s/%s/slaves", SYS_CLASS_BLOCK_PATH,
+		 node->name);
+	dirp = opendir(path);
+	if (dirp == NULL) {
+		return true;
+	}
+
+	while ((entry = readdir(dirp)) != NULL) {
+		int member;
+
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+
+		member = find_node(topo, entry->d_name);
+		if (member == -1) {
+			continue;
+		}
+
+		if (!add_member(topo, member)) {
+			closedir(dirp);
+			return false;
+		}
+		node->member_cnt++;
+	}
+
+	closedir(dirp);
+	return true;
+}
+
+/* room for `cnt` device nodes followed by the user groups */
+static bool reserve_nodes(diskstats_topology_t *topo, int cnt)
+{
+	diskstats_topo_node_t *new = NULL;
+	int new_alloc = topo->node_alloc ? topo->node_alloc : 64;
+
+	if (cnt + topo->group_cnt <= topo->node_alloc) {
+		return true;
+	}
+
+	while (new_alloc < cnt + topo->group_cnt) {
+		new_alloc *= 2;
+	}
+
+	new = realloc(topo->nodes, new_alloc * sizeof(*new));
+	if (new == NULL) {
+		return false;
+	}
+
+	topo->nodes = new;
+	topo->node_alloc = new_alloc;
+	return true;
+}
+
+static void clear_topology(diskstats_topology_t *topo)
+{
+	topo->node_cnt = 0;
+	topo->member_cnt = 0;
+	hashtab_clear(&topo->by_name);
+}
+
+/*
+ * Build the topology from sysfs. User groups are appended as nodes of
+ * kind TOPO_KIND_GROUP whose members are resolved by name; names that do
+ * not exist are ignored.
+ */
+static bool read_topology(diskstats_topology_t *topo)
+{
+	DIR *dirp = NULL;
+	struct dirent *entry = NULL;
+	char (*parents)[DISKSTATS_NAME_BUF] = NULL;
+	int parents_alloc = 0;
+	int i, j;
+
+	clear_topology(topo);
+
+	dirp = opendir(SYS_CLASS_BLOCK_PATH);
+	if (dirp == NULL) {
+		return false;
+	}
+
+	while ((entry = readdir(dirp)) != NULL) {
+		int idx = topo->node_cnt;
+
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+
+		if (!reserve_nodes(topo, idx + 1)) {
+			goto fail;
+		}
+
+		if (idx >= parents_alloc) {
+			char (*new)[DISKSTATS_NAME_BUF] = NULL;
+
+			new = realloc(parents, topo->node_alloc * DISKSTATS_NAME_BUF);
+			if (new == NULL) {
+				goto fail;
+			}
+			parents = new;
+			parents_alloc = topo->node_alloc;
+		}
+
+		if (strlen(entry->d_name) >= DISKSTATS_NAME_BUF) {
+			continue;
+		}
+
+		if (!read_node(entry->d_name, &topo->nodes[idx], parents[idx],
+			       DISKSTATS_NAME_BUF)) {
+			/* device went away while we were looking at it */
+			continue;
+		}
+
+		if (!hashtab_insert(&topo->by_name,
+				    hash_str(entry->d_name, strlen(entry->d_name)),
+				    idx)) {
+			goto fail;
+		}
+		topo->node_cnt++;
+	}
+	closedir(dirp);
+	dirp = NULL;
+
+	if (!reserve_nodes(topo, topo->node_cnt)) {
+		goto fail;
+	}
+
+	for (i = 0; i < topo->node_cnt; i++) {
+		if (parents[i][0] != '\0') {
+			topo->nodes[i].parent = find_node(topo, parents[i]);
+		}
+
+		if (!read_slaves(topo, i)) {
+			goto fail;
+		}
+	}
+
+	for (i = 0; i < topo->group_cnt; i++) {
+		diskstats_topo_node_t *node = &topo->nodes[topo->node_cnt + i];
+
+		*node = (diskstats_topo_node_t) {
+			.kind = TOPO_KIND_GROUP,
+			.parent = -1,
+			.member_off = topo->member_cnt,
+		};
+		strlcpy(node->name, topo->groups[i].name, sizeof(node->name));
+
+		for (j = 0; j < topo->groups[i].member_cnt; j++) {
+			int member = find_node(topo, topo->groups[i].members[j]);
+
+			if (member == -1) {
+				continue;
+			}
+
+			if (!add_member(topo, member)) {
+				goto fail;
+			}
+			node->member_cnt++;
+		}
+	}
+
+	free(parents);
+	return true;
+
+fail:
+	if (dirp != NULL) {
+		closedir(dirp);
+	}
+	free(parents);
+	clear_topology(topo);
+	return false;
+}
+
+/*
+ * Read a new topology for the given user groups, which must outlive it.
+ * Called without the GIL. Returns a topology holding one reference or
+ * NULL with errno set.
+ */
+diskstats_topology_t *diskstats_topology_read(const diskstats_group_t *groups,
+					      int group_cnt,
+					      uint64_t signature)
+{
+	diskstats_topology_t *topo = NULL;
+	int err;
+
+	topo = calloc(1, sizeof(diskstats_topology_t));
+	if (topo == NULL) {
+		return NULL;
+	}
+
+	topo->refcnt = 1;
+	topo->groups = groups;
+	topo->group_cnt = group_cnt;
+	topo->signature = signature;
+
+	if (!read_topology(topo)) {
+		err = errno;
+		diskstats_topology_put(topo);
+		errno = err;
+		return NULL;
+	}
+
+	return topo;
+}
+
+/*
+ * Order-independent fingerprint of the device set in a read, used to
+ * decide when the topology has to be rebuilt.
+ */
+uint64_t diskstats_topology_signature(const diskstats_t *stats, int cnt)
+{
+	uint64_t sig = hash_u64(cnt);
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		sig += hash_u64(devno_key(stats[i].major, stats[i].minor));
+	}
+
+	return sig;
+}
+
+static void add_counters(diskstats_t *dst, const diskstats_t *src)
+{
+	/* the *_ms sums wrap like their 32-bit sources */
+	dst->reads_completed += src->reads_completed;
+	dst->reads_merged += src->reads_merged;
+	dst->sectors_read += src->sectors_read;
+	dst->time_reading_ms += src->time_reading_ms;
+	dst->writes_completed += src->writes_completed;
+	dst->writes_merged += src->writes_merged;
+	dst->sectors_written += src->sectors_written;
+	dst->time_writing_ms += src->time_writing_ms;
+	dst->num_ios_in_progress += src->num_ios_in_progress;
+	dst->time_doing_ios_ms += src->time_doing_ios_ms;
+	dst->weighted_time_doing_ios_ms += src->weighted_time_doing_ios_ms;
+	dst->discards_completed += src->discards_completed;
+	dst->discards_merged += src->discards_merged;
+	dst->sectors_discarded += src->sectors_discarded;
+	dst->time_spent_discarding_ms += src->time_spent_discarding_ms;
+	dst->flush_requests_completed += src->flush_requests_completed;
+	dst->time_spent_flushing_ms += src->time_spent_flushing_ms;
+}
+
+/*
+ * Sum the counters of the direct members of every stacked device (dm,
+ * md) and user group into `out`, which must have room for
+ * diskstats_topology_rollup_cnt() entries. Members missing from `stats`
+ * (e.g. excluded by a filter) do not contribute. Returns the number of
+ * entries written or -1 on allocation failure.
+ */
+int diskstats_topology_rollup(const diskstats_topology_t *topo,
+			      const diskstats_t *stats, int stats_cnt,
+			      diskstats_t *out)
+{
+	hashtab_t by_devno = { .hashes = NULL };
+	int i, j, cnt = 0;
+
+	if (!hashtab_init(&by_devno, stats_cnt)) {
+		return -1;
+	}
+
+	for (i = 0; i < stats_cnt; i++) {
+		hashtab_insert(&by_devno,
+			       hash_u64(devno_key(stats[i].major, stats[i].minor)),
+			       i);
+	}
+
+	for (i = 0; i < topo->node_cnt + topo->group_cnt; i++) {
+		const diskstats_topo_node_t *node = &topo->nodes[i];
+		diskstats_t *dst = &out[cnt];
+
+		if ((node->kind != TOPO_KIND_GROUP) && (node->member_cnt == 0)) {
+			continue;
+		}
+
+		*dst = (diskstats_t) {
+			.major = node->major,
+			.minor = node->minor,
+		};
+		memcpy(dst->name, node->name, sizeof(dst->name));
+
+		for (j = 0; j < node->member_cnt; j++) {
+			const diskstats_topo_node_t *m = NULL;
+			uint64_t key;
+			int idx;
+
+			m = &topo->nodes[topo->members[node->member_off + j]];
+			key = devno_key(m->major, m->minor);
+			idx = hashtab_lookup(&by_devno, hash_u64(key),
+					     match_stats_devno, &key, stats);
+			if (idx != -1) {
+				add_counters(dst, &stats[idx]);
+			}
+		}
+		cnt++;
+	}
+
+	hashtab_free(&by_devno);
+	return cnt;
+}
+
+int diskstats_topology_rollup_cnt(const diskstats_topology_t *topo)
+{
+	int i, cnt = topo->group_cnt;
+
+	for (i = 0; i < topo->node_cnt; i++) {
+		if (topo->nodes[i].member_cnt) {
+			cnt++;
+		}
+	}
+
+	return cnt;
+}
+
+/*
+ * Parse user groups from a mapping of group name to a sequence of member
+ * device names. Requires the GIL. Returns NULL with an exception set on
+ * failure.
+ */
+diskstats_group_t *diskstats_groups_new(PyObject *groups, int *cnt_out)
+{
+	diskstats_group_t *out = NULL;
+	PyObject *key = NULL, *value = NULL;
+	Py_ssize_t pos = 0;
+	int cnt = 0;
+
+	if (!PyDict_Check(groups)) {
+		PyErr_SetString(
+			PyExc_TypeError,
+			"groups must be a dict."
+		);
+		return NULL;
+	}
+
+	out = calloc(PyDict_Size(groups) + 1, sizeof(diskstats_group_t));
+	if (out == NULL) {
+		PyErr_NoMemory();
+		return NULL;
+	}
+
+	while (PyDict_Next(groups, &pos, &key, &value)) {
+		diskstats_group_t *group = &out[cnt];
+		PyObject *seq = NULL;
+		const char *name = NULL;
+		Py_ssize_t i;
+
+		name = PyUnicode_Check(key) ? PyUnicode_AsUTF8(key) : NULL;
+		if (name == NULL) {
+			if (!PyErr_Occurred()) {
+				PyErr_SetString(
+					PyExc_TypeError,
+					"Group names must be strings."
+				);
+			}
+			goto fail;
+		}
+		strlcpy(group->name, name, sizeof(group->name));
+
+		seq = PySequence_Fast(value, "Group members must be a sequence");
+		if (seq == NULL) {
+			goto fail;
+		}
+
+		cnt++;
+		group->members = calloc(PySequence_Fast_GET_SIZE(seq) + 1,
+					DISKSTATS_NAME_BUF);
+		if (group->members == NULL) {
+			Py_DECREF(seq);
+			PyErr_NoMemory();
+			goto fail;
+		}
+
+		for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+			PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+			const char *member = NULL;
+
+			member = PyUnicode_Check(item) ? PyUnicode_AsUTF8(item) : NULL;
+			if (member == NULL) {
+				if (!PyErr_Occurred()) {
+					PyErr_SetString(
+						PyExc_TypeError,
+						"Group members must be device names."
+					);
+				}
+				Py_DECREF(seq);
+				goto fail;
+			}
+			strlcpy(group->members[group->member_cnt++], member,
+				DISKSTATS_NAME_BUF);
+		}
+		Py_DECREF(seq);
+	}
+
+	*cnt_out = cnt;
+	return out;
+
+fail:
+	diskstats_groups_free(out, cnt);
+	return NULL;
+}
+
+void diskstats_groups_free(diskstats_group_t *groups, int cnt)
+{
+	int i;
+
+	if (groups == NULL) {
+		return;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		free(groups[i].members);
+	}
+	free(groups);
+}
+
+void diskstats_topology_put(diskstats_topology_t *topo)
+{
+	if ((topo == NULL) || (--topo->refcnt > 0)) {
+		return;
+	}
+
+	free(topo->nodes);
+	free(topo->members);
+	hashtab_free(&topo->by_name);
+	free(topo);
+}
+
+/*
+ * Describe a topology as a dict of device (or group) name to
+ * {"kind", "major", "minor", "parent", "members"}.
+ */
+PyObject *diskstats_topology_to_dict(const diskstats_topology_t *topo)
+{
+	PyObject *out = NULL;
+	int i, j;
+
+	out = PyDict_New();
+	if (out == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < topo->node_cnt + topo->group_cnt; i++) {
+		const diskstats_topo_node_t *node = &topo->nodes[i];
+		PyObject *members = NULL, *entry = NULL;
+		int rv;
+
+		members = PyList_New(node->member_cnt);
+		if (members == NULL) {
+			goto fail;
+		}
+
+		for (j = 0; j < node->member_cnt; j++) {
+			int m = topo->members[node->member_off + j];
+			PyObject *name = PyUnicode_FromString(topo->nodes[m].name);
+
+			if (name == NULL) {
+				Py_DECREF(members);
+				goto fail;
+			}
+			PyList_SET_ITEM(members, j, name);
+		}
+
+		entry = Py_BuildValue(
+			"{sssIsIszsN}",
+			"kind", diskstats_topo_kind_name(node->kind),
+			"major", node->major,
+			"minor", node->minor,
+			"parent", node->parent == -1 ? NULL : topo->nodes[node->parent].name,
+			"members", members
+		);
+		if (entry == NULL) {
+			goto fail;
+		}
+
+		rv = PyDict_SetItemString(out, node->name, entry);
+		Py_DECREF(entry);
+		if (rv != 0) {
+			goto fail;
+		}
+	}
+
+	return out;
+
+fail:
+	Py_DECREF(out);
+	return NULL;
+}
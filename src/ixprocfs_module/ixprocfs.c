@@ -1,4 +1,5 @@
 #include <Python.h>
+#include "cgroup.h"
 #include "diskstats.h"
 #include "proc_fd.h"
 #include "proc_pid.h"
@@ -33,6 +34,16 @@ PyObject* module_init(void)
 		return NULL;
 	}
 
+	if (PyType_Ready(&PyDiskStatsSnapshot) < 0) {
+		Py_DECREF(m);
+		return NULL;
+	}
+
+	if (PyType_Ready(&PySysfsDiskStats) < 0) {
+		Py_DECREF(m);
+		return NULL;
+	}
+
 	if (PyType_Ready(&PyProcFd) < 0) {
 		Py_DECREF(m);
 		return NULL;
@@ -48,16 +59,61 @@ PyObject* module_init(void)
 		return NULL;
 	}
 
+	if (PyType_Ready(&PyProcPidSnapshot) < 0) {
+		Py_DECREF(m);
+		return NULL;
+	}
+
+	if (PyType_Ready(&PyProcPidSampler) < 0) {
+		Py_DECREF(m);
+		return NULL;
+	}
+
+	if (PyType_Ready(&PyPidHandle) < 0) {
+		Py_DECREF(m);
+		return NULL;
+	}
+
+	if (PyType_Ready(&PyProcTree) < 0) {
+		Py_DECREF(m);
+		return NULL;
+	}
+
+	if (PyType_Ready(&PyCgroupStats) < 0) {
+		Py_DECREF(m);
+		return NULL;
+	}
+
 	if (PyModule_AddObject(m, "DiskStats", (PyObject *)&PyDiskStats) < 0) {
 		Py_DECREF(m);
 		return NULL;
 	}
 
+	if (PyModule_AddObject(m, "SysfsDiskStats", (PyObject *)&PySysfsDiskStats) < 0) {
+		Py_DECREF(m);
+		return NULL;
+	}
+
 	if (PyModule_AddObject(m, "ProcPid", (PyObject *)&PyProcPid) < 0) {
 		Py_DECREF(m);
 		return NULL;
 	}
 
+	if (PyModule_AddObject(m, "ProcPidSampler", (PyObject *)&PyProcPidSampler) < 0) {
+		Py_DECREF(m);
+		return NULL;
+	}
+
+	if (PyModule_AddObject(m, "PidHandle", (PyObject *)&PyPidHandle) < 0) {
+		Py_DECREF(m);
+		return NULL;
+	}
+
+	if (PyModule_AddObject(m, "CgroupStats", (PyObject *)&PyCgroupStats) < 0) {
+		Py_DECREF(m);
+		return NULL;
+	}
+
 	return m;
 }
 
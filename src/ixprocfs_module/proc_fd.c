@@ -21,6 +21,7 @@
 #include "proc_fd.h"
 #include "../utils/iter.h"
 #include "../utils/parser.h"
+#include "../utils/workpool.h"
 
 static PyObject *py_fd_obj_new(PyTypeObject *obj,
 			       PyObject *args_unused,
@@ -48,16 +49,25 @@ void py_fd_obj_dealloc(py_procfd_base_t *self)
 }
 
 PyDoc_STRVAR(py_fd_read__doc__,
-"read()\n"
+"check_open_paths(paths_to_check, fast=True, case_insensitive=False,\n"
+"                 do_stat=False, workers=1, pids=None, filter=None)\n"
 "--\n\n"
-"Stat the glfs object. Performs fresh stat and updates\n"
-"cache for object.\n\n"
+"Find processes with files open under the given paths.\n\n"
 "Parameters\n"
 "----------\n"
-"None\n\n"
+"paths_to_check: list of paths. Directories match every file beneath them.\n"
+"fast: bool, report only the first matching file of each process.\n"
+"case_insensitive: bool, compare paths ignoring case.\n"
+"do_stat: bool, also stat(2) every open file.\n"
+"workers: int, number of threads to scan processes with. Results are\n"
+"    returned in pid order regardless of the number of workers.\n"
+"pids: iterable of pids to check instead of every process in /proc.\n"
+"    pids that do not exist are skipped.\n"
+"filter: dict selecting the processes to check, see ProcPid.snapshot().\n"
+"    It is applied before /proc/<pid>/fd is opened.\n\n"
 "Returns\n"
 "-------\n"
-"stat_result\n"
+"list of dicts with keys procfd_path, file_name and pid_path\n"
 );
 
 struct path_entry {
@@ -69,10 +79,30 @@ struct check_open_path_state {
 	struct path_entry *paths;
 	Py_ssize_t path_cnt;
 	bool fast;
-	iter_procfd_cb_t *wrapper; /* backpointer to callback */
+	bool do_stat;
 	int (*strcmp_fn)(const char *s1, const char *s2);
 	int (*strncmp_fn)(const char *s1, const char *s2, size_t n);
-	PyObject *result;
+};
+
+/*
+ * Matches found for one pid. Filled by a single worker without the
+ * GIL and converted to Python objects afterwards, in pid order.
+ */
+struct pid_matches {
+	procfd_info_t *matches;
+	int cnt;
+	int alloc;
+	int err; /* errno of a failure, or 0 */
+	const char *err_op;
+	char err_path[64];
+};
+
+struct check_open_path_pool {
+	const struct check_open_path_state *state;
+	const pidfilter_t *filter; /* checked before fd/ is opened */
+	struct pid_list pids;
+	struct pid_matches *results; /* one per pid */
+	fd_buf_t *bufs; /* one per worker, for the filter */
 };
 
 static bool init_open_path_state(PyObject *path_list,
@@ -154,7 +184,7 @@ static bool init_open_path_state(PyObject *path_list,
 	return true;
 }
 
-static bool path_check(struct check_open_path_state *state,
+static bool path_check(const struct check_open_path_state *state,
 		       procfd_path_t path)
 {
 	Py_ssize_t i;
@@ -164,7 +194,7 @@ static bool path_check(struct check_open_path_state *state,
 	}
 
 	for (i = 0; i < state->path_cnt; i++) {
-		struct path_entry *entry = NULL;
+		const struct path_entry *entry = NULL;
 		entry = &state->paths[i];
 
 		if (S_ISDIR(entry->st.st_mode)) {
@@ -181,86 +211,272 @@ static bool path_check(struct check_open_path_state *state,
 	return false;
 }
 
-static bool format_output_impl(struct check_open_path_state *state,
-			       const char *proc_fd_path,
-			       procfd_info_t *info)
+static bool add_match(struct pid_matches *res, const procfd_info_t *info)
+{
+	if (res->cnt == res->alloc) {
+		int new_alloc = res->alloc ? res->alloc * 2 : 4;
+		procfd_info_t *new = NULL;
+
+		new = realloc(res->matches, new_alloc * sizeof(procfd_info_t));
+		if (new == NULL) {
+			return false;
+		}
+		res->matches = new;
+		res->alloc = new_alloc;
+	}
+
+	res->matches[res->cnt++] = *info;
+	return true;
+}
+
+static void set_pid_error(struct pid_matches *res, const char *op,
+			  const char *path)
+{
+	res->err = errno;
+	res->err_op = op;
+	strlcpy(res->err_path, path, sizeof(res->err_path));
+}
+
+/*
+ * Check the open files of one process. Runs on a pool worker without
+ * the GIL. A process that exits, or a file that is closed, while it is
+ * being scanned is skipped.
+ */
+static void check_open_pid_fn(size_t item, int worker, void *priv)
 {
-	PyObject *entry = NULL;
+	struct check_open_path_pool *pool = (struct check_open_path_pool *)priv;
+	const struct check_open_path_state *state = pool->state;
+	struct pid_matches *res = &pool->results[item];
+	char fd_dir[64], path[PATH_MAX];
+	struct dirent *entry = NULL;
+	DIR *base = NULL;
+
+	if (pool->filter != NULL) {
+		pidsample_req_t req = {
+			.filter = pool->filter,
+			.stat_fields = pidfilter_stat_fields(pool->filter)
+		};
+		pidsample_t sample;
+
+		snprintf(fd_dir, sizeof(fd_dir), "/proc/%d",
+			 pool->pids.pids[item]);
+		if (!read_pid_sample(fd_dir, pool->pids.pids[item], &req,
+				     &pool->bufs[worker], &sample)) {
+			if ((errno != ENOENT) && (errno != ESRCH)) {
+				set_pid_error(res, "read", fd_dir);
+			}
+			return;
+		}
 
-	entry = Py_BuildValue(
-		"{s:s,s:s,s:s}",
-		"procfd_path", proc_fd_path,
-		"file_name", info->readlink,
-		"pid_path", state->wrapper->_dir_internal
-	);
+		if (sample.filtered) {
+			return;
+		}
+	}
+
+	snprintf(fd_dir, sizeof(fd_dir), "/proc/%d/fd", pool->pids.pids[item]);
+	base = opendir(fd_dir);
+	if (base == NULL) {
+		if ((errno != ENOENT) && (errno != ESRCH)) {
+			set_pid_error(res, "opendir", fd_dir);
+		}
+		return;
+	}
+
+	while ((entry = readdir(base)) != NULL) {
+		procfd_info_t info = { .fd = 0 };
+		ssize_t sz;
+
+		if ((entry->d_name[0] == '.') ||
+		    (strcmp(entry->d_name, "0") == 0) ||
+		    (strcmp(entry->d_name, "1") == 0) ||
+		    (strcmp(entry->d_name, "2") == 0)) {
+			continue;
+		}
+		if (!parse_uint(entry->d_name, &info.fd)) {
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "%s/%s", fd_dir, entry->d_name);
+		sz = readlink(path, info.readlink, sizeof(info.readlink) - 1);
+		if (sz == -1) {
+			if ((errno != ENOENT) && (errno != ESRCH)) {
+				set_pid_error(res, "readlink", path);
+				break;
+			}
+			continue;
+		}
+		info.valid_data |= PROCFD_INFO_READLINK;
+
+		if (state->do_stat) {
+			if (stat(path, &info.st) == -1) {
+				if ((errno != ENOENT) && (errno != ESRCH)) {
+					set_pid_error(res, "stat", path);
+					break;
+				}
+				continue;
+			}
+			info.valid_data |= PROCFD_INFO_STAT;
+		}
+
+		if (!path_check(state, info.readlink)) {
+			continue;
+		}
+
+		if (!add_match(res, &info)) {
+			errno = ENOMEM;
+			set_pid_error(res, "realloc", path);
+			break;
+		}
 
-	if (entry == NULL) {
+		if (state->fast) {
+			break;
+		}
+	}
+
+	closedir(base);
+}
+
+/* pool->pids is already filled in if the caller passed pids */
+static bool check_open_pids(struct check_open_path_pool *pool, int workers,
+			    bool have_pids)
+{
+	if (!have_pids && !list_proc_pids(&pool->pids)) {
+		return false;
+	}
+
+	pool->results = calloc(pool->pids.cnt + 1, sizeof(struct pid_matches));
+	pool->bufs = calloc(workers, sizeof(fd_buf_t));
+	if ((pool->results == NULL) || (pool->bufs == NULL)) {
+		errno = ENOMEM;
 		return false;
 	}
 
-	if (PyList_Append(state->result, entry) != 0) {
-		Py_DECREF(entry);
+	if (!workpool_run(pool->pids.cnt, workers, check_open_pid_fn, pool)) {
+		errno = ENOMEM;
 		return false;
 	}
 
 	return true;
 }
 
-static int check_open_path_impl(const char *proc_fd_path, procfd_info_t *info, void *priv)
+static void free_open_pool(struct check_open_path_pool *pool, int workers)
 {
-	struct check_open_path_state *state = (struct check_open_path_state *)priv;
-	bool ok;
+	size_t i;
+
+	if (pool->bufs != NULL) {
+		for (i = 0; i < (size_t)workers; i++) {
+			fd_buf_free(&pool->bufs[i]);
+		}
+	}
+	free(pool->bufs);
 
-	if (!path_check(state, info->readlink)) {
-		return ITER_STATE_CONTINUE;
+	if (pool->results != NULL) {
+		for (i = 0; i < pool->pids.cnt; i++) {
+			free(pool->results[i].matches);
+		}
 	}
+	free(pool->results);
+	free_pid_list(&pool->pids);
+}
 
-	ITER_END_ALLOW_THREADS(state->wrapper);
-	ok = format_output_impl(state, proc_fd_path, info);
-	ITER_ALLOW_THREADS(state->wrapper);
+static PyObject *format_output(struct check_open_path_pool *pool)
+{
+	PyObject *out = NULL;
+	size_t i;
+	int j;
 
-	if (!ok) {
-		return ITER_STATE_ERROR;
+	out = Py_BuildValue("[]");
+	if (out == NULL) {
+		return NULL;
 	}
 
-	if (state->fast) {
-		return ITER_STATE_BREAK;
+	for (i = 0; i < pool->pids.cnt; i++) {
+		const struct pid_matches *res = &pool->results[i];
+		char pid_path[64], fd_path[96];
+
+		if (res->err) {
+			PyErr_Format(
+				PyExc_RuntimeError,
+				"%s: %s() failed: %s",
+				res->err_path, res->err_op, strerror(res->err)
+			);
+			Py_DECREF(out);
+			return NULL;
+		}
+
+		snprintf(pid_path, sizeof(pid_path), "/proc/%d/fd",
+			 pool->pids.pids[i]);
+
+		for (j = 0; j < res->cnt; j++) {
+			PyObject *entry = NULL;
+			int rv;
+
+			snprintf(fd_path, sizeof(fd_path), "%s/%u", pid_path,
+				 res->matches[j].fd);
+			entry = Py_BuildValue(
+				"{s:s,s:s,s:s}",
+				"procfd_path", fd_path,
+				"file_name", res->matches[j].readlink,
+				"pid_path", pid_path
+			);
+			if (entry == NULL) {
+				Py_DECREF(out);
+				return NULL;
+			}
+
+			rv = PyList_Append(out, entry);
+			Py_DECREF(entry);
+			if (rv != 0) {
+				Py_DECREF(out);
+				return NULL;
+			}
+		}
 	}
 
-	return ITER_STATE_CONTINUE;
+	return out;
 }
 
 static PyObject *py_fd_check_open_path(PyObject *obj,
 				       PyObject *args,
 				       PyObject *kwargs)
 {
-	PyObject *pypaths = NULL;
-	int rv;
-	bool case_insensitive = false, do_stat = false;
+	PyObject *pypaths = NULL, *pypids = Py_None, *pyfilter = Py_None;
+	PyObject *out = NULL;
+	pidfilter_t *filter = NULL;
+	int workers = 1;
+	bool case_insensitive = false, ok;
 	struct check_open_path_state state = { .fast = true, .paths = NULL };
-	iter_procfd_cb_t cb = {
-		.fn = check_open_path_impl,
-		.state = &state,
-		.desired_info = PROCFD_INFO_READLINK
-	};
-	iter_procfd_cb_t *cbp = &cb;
+	struct check_open_path_pool pool = { .state = &state };
 	const char *kwnames [] = {
 		"paths_to_check",
 		"fast",
 		"case_insensitive",
 		"do_stat",
+		"workers",
+		"pids",
+		"filter",
 		NULL
 	};
 
-	state.wrapper = &cb;
-
 	if (!PyArg_ParseTupleAndKeywords(args, kwargs,
-					 "O|bbb",
+					 "O|bbbiOO",
 					 discard_const_p(char *, kwnames),
 					 &pypaths,
 					 &state.fast,
 					 &case_insensitive,
-					 &do_stat)) {
+					 &state.do_stat,
+					 &workers,
+					 &pypids,
+					 &pyfilter)) {
+		return NULL;
+	}
+
+	if ((workers < 1) || (workers > WORKPOOL_MAX_WORKERS)) {
+		PyErr_Format(
+			PyExc_ValueError,
+			"workers must be between 1 and %d.",
+			WORKPOOL_MAX_WORKERS
+		);
 		return NULL;
 	}
 
@@ -272,28 +488,43 @@ static PyObject *py_fd_check_open_path(PyObject *obj,
 		state.strncmp_fn = strncmp;
 	}
 
-	if (do_stat) {
-		cb.desired_info |= PROCFD_INFO_STAT;
+	if (pyfilter != Py_None) {
+		filter = pidfilter_new(pyfilter);
+		if (filter == NULL) {
+			return NULL;
+		}
+		pool.filter = filter;
 	}
 
-	if (!init_open_path_state(pypaths, &state)) {
+	if ((pypids != Py_None) && !pid_list_from_py(pypids, &pool.pids)) {
+		pidfilter_free(filter);
 		return NULL;
 	}
 
-	state.result = Py_BuildValue("[]");
-	if (state.result == NULL) {
-		free(state.paths);
+	if (!init_open_path_state(pypaths, &state)) {
+		free_pid_list(&pool.pids);
+		pidfilter_free(filter);
 		return NULL;
 	}
-	ITER_ALLOW_THREADS(cbp);
-	rv = iter_proc_fd_paths(NULL, &cb);
-	ITER_END_ALLOW_THREADS(cbp);
 
-	if (rv == ITER_STATE_ERROR) {
-		return NULL;
+	Py_BEGIN_ALLOW_THREADS
+	ok = check_open_pids(&pool, workers, pypids != Py_None);
+	Py_END_ALLOW_THREADS
+
+	if (ok) {
+		out = format_output(&pool);
+	} else {
+		PyErr_Format(
+			PyExc_RuntimeError,
+			"Failed to scan processes: %s",
+			strerror(errno)
+		);
 	}
 
-	return state.result;
+	free_open_pool(&pool, workers);
+	pidfilter_free(filter);
+	free(state.paths);
+	return out;
 }
 
 static PyMethodDef py_fd_obj_methods[] = {
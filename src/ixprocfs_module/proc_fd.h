@@ -39,16 +39,4 @@ typedef struct {
 	int valid_data;
 } procfd_info_t;
 
-typedef struct {
-        PyThreadState *_save;
-	const char *_dir_internal; /* stack in iterator "/proc/<pid>" path */
-	uint _pid_internal;
-	int _cnt_internal; /* internal pid fd counter */
-	int (*fn)(const char *proc_fd_path, procfd_info_t *info,  void *state);
-	procfd_info_t data_out;
-	int desired_info;
-	void *state;
-} iter_procfd_cb_t;
-
-extern int iter_proc_fd_paths(struct pid_list *, iter_procfd_cb_t *);
 #endif /* _PROCFD_H_ */
@@ -21,6 +21,7 @@
 #include "proc_pid.h"
 #include "../utils/iter.h"
 #include "../utils/parser.h"
+#include "../utils/workpool.h"
 
 static PyObject *py_pid_obj_new(PyTypeObject *obj,
 			       PyObject *args_unused,
@@ -64,6 +65,251 @@ static PyObject *py_pid_getpid(PyObject *obj,
 	return init_pidstats(pid);
 }
 
+PyDoc_STRVAR(py_pid_snapshot__doc__,
+"snapshot(workers=1, fields=None, status=None, io=False,\n"
+"         smaps_rollup=False, schedstat=False, tasks=False, pids=None,\n"
+"         filter=None)\n"
+"--\n\n"
+"Read /proc/<pid>/stat and /proc/<pid>/statm of every process in a\n"
+"single pass over /proc. Reading and parsing run without the GIL and\n"
+"the results are kept in one C array; PidEntry objects are only\n"
+"created when entries of the snapshot are accessed. Processes that\n"
+"exit during the pass are left out.\n\n"
+"Parameters\n"
+"----------\n"
+"workers: int, number of threads to read processes with. The list of\n"
+"    pids is shared between them with work stealing.\n"
+"fields: sequence of PidEntry stat field names, e.g. (\"state\", \"ppid\").\n"
+"    Parsing of /proc/<pid>/stat stops after the last requested field\n"
+"    and other fields are left zero. pid and comm are always filled in.\n"
+"    None parses every field.\n"
+"status: sequence of status field names (see get_status()) to also\n"
+"    read /proc/<pid>/status for, True for all of them. Use\n"
+"    ProcPidSnapshot.status() to access them. None skips the file.\n"
+"io: bool, also read /proc/<pid>/io, see ProcPidSnapshot.io().\n"
+"smaps_rollup: bool, also read /proc/<pid>/smaps_rollup for PSS and\n"
+"    USS, see ProcPidSnapshot.smaps_rollup(). The kernel walks every\n"
+"    mapping of the process to produce it, so this is by far the most\n"
+"    expensive file to read; use several workers for large process\n"
+"    tables.\n"
+"schedstat: bool, also read schedstat (CPU run time, run-queue wait\n"
+"    time and timeslices), see ProcPidSnapshot.schedstat().\n"
+"tasks: bool, read every thread in /proc/<pid>/task/<tid> instead of\n"
+"    every process. Entries are then ordered by thread id and\n"
+"    ProcPidSnapshot.tgids gives the process of each thread.\n"
+"pids: iterable of pids to read instead of every process in /proc.\n"
+"    Each is read directly without listing /proc; pids that do not\n"
+"    exist are left out of the snapshot. Note that /proc/<tid> can be\n"
+"    opened for any thread id, although only processes are listed.\n"
+"filter: dict selecting processes (threads if tasks=True) in C while\n"
+"    they are read. Keys, all optional and combined with AND:\n"
+"    comm: fnmatch(3) pattern or sequence of patterns for the name.\n"
+"    state: string of state letters, e.g. \"DZ\".\n"
+"    ppid, session, uid (effective): int or sequence of ints.\n"
+"    min_rss_bytes: int.\n"
+"    Criteria on stat are checked before statm is read, and uid needs\n"
+"    /proc/<pid>/status; other files are only read for processes\n"
+"    that pass.\n\n"
+"Returns\n"
+"-------\n"
+"ProcPidSnapshot, ordered by pid\n"
+);
+
+static PyObject *py_pid_snapshot(PyObject *obj,
+				 PyObject *args,
+				 PyObject *kwargs)
+{
+	PyObject *pyfields = Py_None, *pystatus = Py_None, *pypids = Py_None;
+	PyObject *out = NULL;
+	pidsample_req_t req = { .io = false };
+	PyObject *pyfilter = Py_None;
+	struct pid_list pids = { .pids = NULL };
+	pidfilter_t *filter = NULL;
+	int workers = 1;
+	const char *kwnames [] = {
+		"workers",
+		"fields",
+		"status",
+		"io",
+		"smaps_rollup",
+		"schedstat",
+		"tasks",
+		"pids",
+		"filter",
+		NULL
+	};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+					 "|iOObbbbOO",
+					 discard_const_p(char *, kwnames),
+					 &workers,
+					 &pyfields,
+					 &pystatus,
+					 &req.io,
+					 &req.smaps_rollup,
+					 &req.schedstat,
+					 &req.tasks,
+					 &pypids,
+					 &pyfilter)) {
+		return NULL;
+	}
+
+	if ((workers < 1) || (workers > WORKPOOL_MAX_WORKERS)) {
+		PyErr_Format(
+			PyExc_ValueError,
+			"workers must be between 1 and %d.",
+			WORKPOOL_MAX_WORKERS
+		);
+		return NULL;
+	}
+
+	if (!pidstat_mask_from_py(pyfields, &req.stat_fields) ||
+	    !pidstatus_mask_from_py(pystatus, &req.status_fields)) {
+		return NULL;
+	}
+
+	if (pyfilter != Py_None) {
+		filter = pidfilter_new(pyfilter);
+		if (filter == NULL) {
+			return NULL;
+		}
+		req.filter = filter;
+	}
+
+	if ((pypids != Py_None) && !pid_list_from_py(pypids, &pids)) {
+		pidfilter_free(filter);
+		return NULL;
+	}
+
+	out = proc_pid_snapshot(workers, &req,
+				(pypids != Py_None) ? &pids : NULL);
+	free_pid_list(&pids);
+	pidfilter_free(filter);
+	return out;
+}
+
+PyDoc_STRVAR(py_pid_get_status__doc__,
+"get_status(pid=-1, fields=None)\n"
+"--\n\n"
+"Read /proc/<pid>/status. Only the requested lines are converted.\n\n"
+"Parameters\n"
+"----------\n"
+"pid: int, defaults to the current process\n"
+"fields: sequence of field names, None for all of them. Available\n"
+"    fields are uid and gid (tuples of real, effective, saved set and\n"
+"    filesystem id), vm_peak_kb, vm_size_kb, vm_hwm_kb, vm_rss_kb,\n"
+"    rss_anon_kb, rss_file_kb, rss_shmem_kb, vm_data_kb, vm_swap_kb,\n"
+"    threads, cpus_allowed (hex mask), voluntary_ctxt_switches and\n"
+"    nonvoluntary_ctxt_switches.\n\n"
+"Returns\n"
+"-------\n"
+"dict\n"
+);
+
+static PyObject *py_pid_get_status(PyObject *obj,
+				   PyObject *args,
+				   PyObject *kwargs)
+{
+	PyObject *pyfields = Py_None;
+	pidstatus_t status = { .threads = 0 };
+	pidstatus_mask_t fields = PIDSTATUS_ALL_FIELDS;
+	fd_buf_t buf = { .data = NULL };
+	char path[64];
+	bool ok;
+	int pid = -1, err = 0;
+	const char *kwnames [] = {
+		"pid",
+		"fields",
+		NULL
+	};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+					 "|iO",
+					 discard_const_p(char *, kwnames),
+					 &pid,
+					 &pyfields)) {
+		return NULL;
+	}
+
+	if ((pyfields != Py_None) &&
+	    !pidstatus_mask_from_py(pyfields, &fields)) {
+		return NULL;
+	}
+
+	if (pid == -1) {
+		pid = getpid();
+	}
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+
+	Py_BEGIN_ALLOW_THREADS
+	ok = read_pid_file_at(AT_FDCWD, path, &buf) &&
+	     parse_pid_status_buf(buf.data, fields, &status);
+	if (!ok) {
+		err = errno;
+	}
+	fd_buf_free(&buf);
+	Py_END_ALLOW_THREADS
+
+	if (!ok) {
+		PyErr_Format(
+			PyExc_RuntimeError,
+			"%s: %s",
+			path, strerror(err)
+		);
+		return NULL;
+	}
+
+	return pidstatus_to_py_dict(&status, fields);
+}
+
+PyDoc_STRVAR(py_pid_tree__doc__,
+"tree(workers=1, fd_count=False)\n"
+"--\n\n"
+"Build the process tree from one snapshot of the process table (see\n"
+"snapshot()), linking processes by ppid and summing RSS, CPU time,\n"
+"threads and optionally open files over every subtree.\n\n"
+"Parameters\n"
+"----------\n"
+"workers: int, number of threads to read the process table with.\n"
+"fd_count: bool, also count the entries of /proc/<pid>/fd. This needs\n"
+"    the same privileges as reading them.\n\n"
+"Returns\n"
+"-------\n"
+"ProcTree\n"
+);
+
+static PyObject *py_pid_tree(PyObject *obj,
+			     PyObject *args,
+			     PyObject *kwargs)
+{
+	int workers = 1;
+	bool fd_count = false;
+	const char *kwnames [] = {
+		"workers",
+		"fd_count",
+		NULL
+	};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+					 "|ib",
+					 discard_const_p(char *, kwnames),
+					 &workers,
+					 &fd_count)) {
+		return NULL;
+	}
+
+	if ((workers < 1) || (workers > WORKPOOL_MAX_WORKERS)) {
+		PyErr_Format(
+			PyExc_ValueError,
+			"workers must be between 1 and %d.",
+			WORKPOOL_MAX_WORKERS
+		);
+		return NULL;
+	}
+
+	return proc_tree_new(workers, fd_count);
+}
+
 static PyMethodDef py_pid_obj_methods[] = {
 	{
 		.ml_name = "get_pid",
@@ -71,6 +317,24 @@ static PyMethodDef py_pid_obj_methods[] = {
 		.ml_flags = METH_VARARGS,
 		.ml_doc = "Retrieve PidEntry by id"
 	},
+	{
+		.ml_name = "get_status",
+		.ml_meth = (PyCFunction)py_pid_get_status,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = py_pid_get_status__doc__
+	},
+	{
+		.ml_name = "snapshot",
+		.ml_meth = (PyCFunction)py_pid_snapshot,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = py_pid_snapshot__doc__
+	},
+	{
+		.ml_name = "tree",
+		.ml_meth = (PyCFunction)py_pid_tree,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = py_pid_tree__doc__
+	},
 	{ NULL, NULL, 0, NULL }
 };
 
@@ -21,7 +21,10 @@
 #define _PROC_PID_H_
 
 #include <Python.h>
+#include <time.h>
 #include "../common/includes.h"
+#include "../utils/fdbuf.h"
+#include "../utils/hashtab.h"
 /* proc_pid.c */
 typedef struct {
 	PyObject_HEAD
@@ -31,21 +34,19 @@ typedef struct {
 struct pid_list {
 	pid_t *pids;
 	size_t cnt;
+	size_t alloc;
 };
 
-typedef struct {
-	PyThreadState *_save;
-	struct pid_list *pids;
-	int (*fn)(const char *proc_pid_path, pid_t pid, void *state);
-	void *state;
-} iter_proc_pid_cb_t;
-
-extern int iter_proc_pids(iter_proc_pid_cb_t *);
+extern bool list_proc_pids(struct pid_list *out);
+extern bool list_proc_tasks(pid_t pid, struct pid_list *out);
+extern void sort_pid_list(struct pid_list *pids);
+extern bool pid_list_from_py(PyObject *pypids, struct pid_list *out);
+extern void free_pid_list(struct pid_list *pids);
 
 /* proc_pid_parse.c */
 typedef struct procfs_pid_stat {
 	int pid;
-	char comm[18]; /* TASK_COMM_LEN + 2 */
+	char comm[66]; /* kernel threads use up to 64 bytes, plus parens */
 	char state;
 	int ppid;
 	int pgrp;
@@ -98,6 +99,18 @@ typedef struct procfs_pid_stat {
 	int exit_code;
 } pidstat_t;
 
+/*
+ * Set of /proc/<pid>/stat fields to parse. Bit n selects field n + 1 as
+ * numbered in proc(5), so bit 0 is pid and bit 2 is state.
+ */
+typedef uint64_t pidstat_mask_t;
+#define PIDSTAT_PID ((pidstat_mask_t)1 << 0)
+#define PIDSTAT_COMM ((pidstat_mask_t)1 << 1)
+#define PIDSTAT_STATE ((pidstat_mask_t)1 << 2)
+#define PIDSTAT_PPID ((pidstat_mask_t)1 << 3)
+#define PIDSTAT_SESSION ((pidstat_mask_t)1 << 5)
+#define PIDSTAT_ALL_FIELDS (~(pidstat_mask_t)0)
+
 typedef struct procfs_pid_statm {
 	unsigned long size;
 	unsigned long resident;
@@ -108,6 +121,88 @@ typedef struct procfs_pid_statm {
 	// dt /* unused since Linux 2.6 */
 } pidstatm_t;
 
+/*
+ * Selected lines of /proc/<pid>/status. Memory sizes are in kB as
+ * reported by the kernel.
+ */
+enum {
+	PIDSTATUS_UID,
+	PIDSTATUS_GID,
+	PIDSTATUS_VM_PEAK,
+	PIDSTATUS_VM_SIZE,
+	PIDSTATUS_VM_HWM,
+	PIDSTATUS_VM_RSS,
+	PIDSTATUS_RSS_ANON,
+	PIDSTATUS_RSS_FILE,
+	PIDSTATUS_RSS_SHMEM,
+	PIDSTATUS_VM_DATA,
+	PIDSTATUS_VM_SWAP,
+	PIDSTATUS_THREADS,
+	PIDSTATUS_CPUS_ALLOWED,
+	PIDSTATUS_VOLUNTARY_CTXT_SWITCHES,
+	PIDSTATUS_NONVOLUNTARY_CTXT_SWITCHES,
+	PIDSTATUS_NFIELDS,
+};
+
+typedef struct procfs_pid_status {
+	uint uid[4]; /* real, effective, saved set, filesystem */
+	uint gid[4];
+	unsigned long vm_peak_kb;
+	unsigned long vm_size_kb;
+	unsigned long vm_hwm_kb;
+	unsigned long vm_rss_kb;
+	unsigned long rss_anon_kb;
+	unsigned long rss_file_kb;
+	unsigned long rss_shmem_kb;
+	unsigned long vm_data_kb;
+	unsigned long vm_swap_kb;
+	int threads;
+	char cpus_allowed[128]; /* hex mask, truncated on huge systems */
+	unsigned long voluntary_ctxt_switches;
+	unsigned long nonvoluntary_ctxt_switches;
+} pidstatus_t;
+
+/* Set of PIDSTATUS_* fields to parse, bit n selects field n */
+typedef uint32_t pidstatus_mask_t;
+#define PIDSTATUS_ALL_FIELDS (((pidstatus_mask_t)1 << PIDSTATUS_NFIELDS) - 1)
+
+/* /proc/<pid>/io, readable by the owner of the process and root */
+typedef struct procfs_pid_io {
+	unsigned long long rchar;
+	unsigned long long wchar;
+	unsigned long long syscr;
+	unsigned long long syscw;
+	unsigned long long read_bytes;
+	unsigned long long write_bytes;
+	unsigned long long cancelled_write_bytes;
+} pidio_t;
+
+/*
+ * /proc/<pid>/smaps_rollup (linux 4.14+), in kB. Proportional set size
+ * splits shared pages between the processes mapping them, so unlike RSS
+ * it can be summed over a group of processes.
+ */
+typedef struct procfs_pid_smaps {
+	unsigned long long rss_kb;
+	unsigned long long pss_kb;
+	unsigned long long pss_anon_kb;
+	unsigned long long pss_file_kb;
+	unsigned long long pss_shmem_kb;
+	unsigned long long shared_clean_kb;
+	unsigned long long shared_dirty_kb;
+	unsigned long long private_clean_kb;
+	unsigned long long private_dirty_kb;
+	unsigned long long swap_kb;
+	unsigned long long swap_pss_kb;
+} pidsmaps_t;
+
+/* /proc/<pid>/task/<tid>/schedstat (CONFIG_SCHED_INFO) */
+typedef struct procfs_pid_schedstat {
+	unsigned long long run_ns; /* time spent on the cpu */
+	unsigned long long wait_ns; /* time spent runnable on a run-queue */
+	unsigned long long timeslices;
+} pidschedstat_t;
+
 typedef struct {
 	PyObject_HEAD
 	pid_t pid;
@@ -119,5 +214,187 @@ extern PyTypeObject PyProcPid;
 extern PyTypeObject PyPidEntry;
 extern int read_pid_stats(FILE *statsfile, pidstat_t *stats_out);
 extern int read_pid_statm(FILE *statsfile, pidstatm_t *stats_out);
+extern bool parse_pid_stat_buf(const char *buf, pidstat_mask_t fields,
+			       pidstat_t *stats_out);
+extern bool parse_pid_statm_buf(char *buf, pidstatm_t *stats_out);
 extern PyObject *init_pidstats(pid_t pid);
+extern bool pidstat_mask_from_py(PyObject *fields, pidstat_mask_t *mask_out);
+extern PyObject *pidstat_mask_to_py(pidstat_mask_t mask);
+extern pidstat_mask_t pidstat_field_mask(const char *name);
+extern bool parse_pid_status_buf(const char *buf, pidstatus_mask_t fields,
+				 pidstatus_t *status_out);
+extern bool pidstatus_mask_from_py(PyObject *fields,
+				   pidstatus_mask_t *mask_out);
+extern PyObject *pidstatus_to_py_dict(const pidstatus_t *status,
+				      pidstatus_mask_t fields);
+extern bool parse_pid_io_buf(const char *buf, pidio_t *io_out);
+extern PyObject *pidio_to_py_dict(const pidio_t *io);
+extern bool parse_pid_smaps_rollup_buf(const char *buf, pidsmaps_t *smaps_out);
+extern PyObject *pidsmaps_to_py_dict(const pidsmaps_t *smaps);
+extern bool parse_pid_schedstat_buf(const char *buf,
+				    pidschedstat_t *schedstat_out);
+extern PyObject *pidschedstat_to_py_dict(const pidschedstat_t *schedstat);
+
+/* proc_pid_filter.c */
+
+/*
+ * Process selection compiled from a Python dict. Criteria are combined
+ * with AND; lists within one criterion with OR. Criteria are grouped by
+ * the file they need so that a scan can drop a process after reading
+ * stat, before opening anything else.
+ */
+typedef struct pidfilter {
+	char **comm_globs; /* fnmatch(3) patterns, without the parens */
+	int comm_cnt;
+	char states[32]; /* state letters, empty for any */
+	pid_t *ppids;
+	int ppids_cnt;
+	pid_t *sessions;
+	int sessions_cnt;
+	unsigned long long min_rss_bytes; /* from statm, 0 for any */
+	int *uids; /* effective uid, from status */
+	int uids_cnt;
+} pidfilter_t;
+
+extern pidfilter_t *pidfilter_new(PyObject *spec);
+extern void pidfilter_free(pidfilter_t *filter);
+extern pidstat_mask_t pidfilter_stat_fields(const pidfilter_t *filter);
+extern bool pidfilter_match_stat(const pidfilter_t *filter,
+				 const pidstat_t *stat);
+extern bool pidfilter_match_statm(const pidfilter_t *filter,
+				  const pidstatm_t *statm);
+extern bool pidfilter_match_status(const pidfilter_t *filter,
+				   const pidstatus_t *status);
+
+/* proc_pid_snapshot.c */
+
+/* What to read for each process of a snapshot */
+typedef struct {
+	const pidfilter_t *filter; /* NULL selects every process */
+	pidstat_mask_t stat_fields;
+	pidstatus_mask_t status_fields; /* status is not read if 0 */
+	bool io;
+	bool smaps_rollup; /* expensive, walks every mapping */
+	bool schedstat;
+	bool tasks; /* sample every thread rather than every process */
+	bool fd_count;
+} pidsample_req_t;
+
+typedef struct {
+	pid_t pid; /* thread id if sampling tasks */
+	pid_t tgid;
+	pidstat_t stat;
+	pidstatm_t statm;
+	pidstatus_t status;
+	pidio_t io;
+	bool io_valid; /* false if io was not requested or not permitted */
+	pidsmaps_t smaps;
+	bool smaps_valid; /* also false for kernel threads */
+	pidschedstat_t schedstat;
+	bool schedstat_valid;
+	int fd_count; /* -1 if not requested or not permitted */
+	bool filtered; /* rejected by req->filter, only partially read */
+} pidsample_t;
+
+typedef struct {
+	PyObject_HEAD
+	pidsample_t *samples; /* sorted by pid */
+	int cnt;
+	struct timespec ts;
+	pidsample_req_t req; /* what was read for each process */
+	hashtab_t by_key; /* (pid, starttime), see proc_pid_snapshot_index() */
+} py_proc_pid_snapshot_t;
+
+extern PyTypeObject PyProcPidSnapshot;
+extern bool read_pid_file_at(int dirfd, const char *name, fd_buf_t *buf);
+extern int count_pid_fds_at(int dirfd, const char *path, bool self_pid);
+extern bool read_pid_sample(const char *proc_pid_path, pid_t pid,
+			    const pidsample_req_t *req, fd_buf_t *buf,
+			    pidsample_t *out);
+extern bool read_pid_sample_at(int dirfd, pid_t pid,
+			       const pidsample_req_t *req, fd_buf_t *buf,
+			       pidsample_t *out);
+extern PyObject *pidsample_to_entry(const pidsample_t *sample);
+extern PyObject *proc_pid_snapshot(int workers, const pidsample_req_t *req,
+				   const struct pid_list *pids);
+extern bool proc_pid_snapshot_index(py_proc_pid_snapshot_t *snap);
+extern const pidsample_t *proc_pid_snapshot_find(const py_proc_pid_snapshot_t *snap,
+						 pid_t pid,
+						 unsigned long long starttime);
+
+/* proc_pid_handle.c */
+typedef struct {
+	PyObject_HEAD
+	pid_t pid;
+	int dirfd; /* O_PATH descriptor of /proc/<pid>, -1 once closed */
+	int busy; /* reads in progress without the GIL */
+	unsigned long long starttime;
+} py_pid_handle_t;
+
+extern PyTypeObject PyPidHandle;
+
+/* proc_pid_sampler.c */
+typedef struct {
+	pid_t pid;
+	pid_t tgid;
+	char comm[66];
+	double interval_ms;
+	double cpu_percent; /* of one CPU, so up to 100 * threads */
+	double user_percent;
+	double system_percent;
+	double minflt_per_sec;
+	double majflt_per_sec;
+	long rss_bytes;
+	long rss_delta_bytes;
+	bool io_valid;
+	double rchar_per_sec;
+	double wchar_per_sec;
+	double read_bytes_per_sec; /* storage I/O */
+	double write_bytes_per_sec;
+	bool schedstat_valid;
+	double run_percent; /* of one CPU, from schedstat */
+	double wait_percent; /* runnable but waiting for a CPU */
+	double timeslices_per_sec;
+} pidrate_t;
+
+typedef struct {
+	PyObject_HEAD
+	int workers;
+	bool io;
+	bool tasks;
+	pidfilter_t *filter;
+	/* ProcPidSnapshot of the previous sample(), indexed by key */
+	PyObject *prev;
+} py_proc_pid_sampler_t;
+
+extern PyTypeObject PyProcPidSampler;
+
+/* proc_pid_group.c */
+extern PyObject *proc_pid_snapshot_group_by(const py_proc_pid_snapshot_t *snap,
+					    PyObject *pykey, PyObject *pyfields,
+					    PyObject *pyops);
+
+/* proc_tree.c */
+typedef struct {
+	unsigned long long rss_bytes;
+	unsigned long long cpu_ticks; /* utime + stime */
+	long threads;
+	long fds; /* processes whose fds could not be counted add nothing */
+	int processes;
+} proctree_sum_t;
+
+typedef struct {
+	PyObject_HEAD
+	py_proc_pid_snapshot_t *snap; /* processes, indexed like the arrays */
+	int *parent; /* index of the parent process, -1 for roots */
+	int *child_off; /* cnt + 1 offsets into children */
+	int *children; /* indexes, in pid order for each parent */
+	int *preorder; /* indexes, subtrees are contiguous */
+	int *preorder_pos; /* position of each process in preorder */
+	proctree_sum_t *sums; /* per subtree, including its root */
+	hashtab_t by_pid;
+} py_proc_tree_t;
+
+extern PyTypeObject PyProcTree;
+extern PyObject *proc_tree_new(int workers, bool fd_count);
 #endif /* _PROC_PID_H_ */
@@ -0,0 +1,387 @@
+/*
+ * Python language bindings for procfs-diskstats
+ *
+ * Copyright (C) Andrew Walker, 2022
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Python.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include "proc_pid.h"
+
+/*
+ * Process selection for scans of /proc. As with the DiskStats device
+ * filter, the spec is compiled once with the GIL held and then only
+ * read, so any number of worker threads can match against it. Scans
+ * check the criteria on stat first and only read statm and status for
+ * processes that are still selected.
+ */
+
+/* An int in the range 0 to `max` */
+static bool id_from_py(PyObject *pyval, const char *key, long long max,
+		       int *id_out)
+{
+	long long val;
+
+	if (!PyLong_Check(pyval)) {
+		PyErr_Format(
+			PyExc_TypeError,
+			"%s: expected ints.", key
+		);
+		return false;
+	}
+
+	val = PyLong_AsLongLong(pyval);
+	if ((val == -1) && PyErr_Occurred()) {
+		return false;
+	}
+
+	if ((val < 0) || (val > max)) {
+		PyErr_Format(
+			PyExc_OverflowError,
+			"%s: %lld is out of range.", key, val
+		);
+		return false;
+	}
+
+	/* uids above INT_MAX wrap the same way as in pidfilter_match_status() */
+	*id_out = (int)val;
+	return true;
+}
+
+/* A single int or a non-empty sequence of ints */
+static bool ids_from_py(PyObject *pyval, const char *key, long long max,
+			int **ids_out, int *cnt_out)
+{
+	PyObject *seq = NULL;
+	Py_ssize_t i, sz;
+	int *ids = NULL;
+
+	if (PyLong_Check(pyval)) {
+		ids = calloc(1, sizeof(int));
+		if (ids == NULL) {
+			PyErr_NoMemory();
+			return false;
+		}
+		if (!id_from_py(pyval, key, max, &ids[0])) {
+			free(ids);
+			return false;
+		}
+		*ids_out = ids;
+		*cnt_out = 1;
+		return true;
+	}
+
+	seq = PySequence_Fast(pyval, "filter values must be ints or sequences");
+	if (seq == NULL) {
+		return false;
+	}
+
+	sz = PySequence_Fast_GET_SIZE(seq);
+	if ((sz == 0) || (sz > INT_MAX)) {
+		Py_DECREF(seq);
+		PyErr_Format(
+			PyExc_ValueError,
+			"%s: expected a non-empty sequence.", key
+		);
+		return false;
+	}
+
+	ids = calloc(sz + 1, sizeof(int));
+	if (ids == NULL) {
+		Py_DECREF(seq);
+		PyErr_NoMemory();
+		return false;
+	}
+
+	for (i = 0; i < sz; i++) {
+		if (!id_from_py(PySequence_Fast_GET_ITEM(seq, i), key, max,
+				&ids[i])) {
+			Py_DECREF(seq);
+			free(ids);
+			return false;
+		}
+	}
+
+	Py_DECREF(seq);
+	*ids_out = ids;
+	*cnt_out = (int)sz;
+	return true;
+}
+
+static bool add_comm_glob(pidfilter_t *filter, PyObject *pyval)
+{
+	const char *pattern = NULL;
+	char *dup = NULL;
+
+	pattern = PyUnicode_AsUTF8(pyval);
+	if (pattern == NULL) {
+		return false;
+	}
+
+	dup = strdup(pattern);
+	if (dup == NULL) {
+		PyErr_NoMemory();
+		return false;
+	}
+
+	filter->comm_globs[filter->comm_cnt++] = dup;
+	return true;
+}
+
+static bool comm_from_py(pidfilter_t *filter, PyObject *pyval)
+{
+	PyObject *seq = NULL;
+	Py_ssize_t i, sz;
+
+	if (PyUnicode_Check(pyval)) {
+		filter->comm_globs = calloc(1, sizeof(char *));
+		if (filter->comm_globs == NULL) {
+			PyErr_NoMemory();
+			return false;
+		}
+		return add_comm_glob(filter, pyval);
+	}
+
+	seq = PySequence_Fast(pyval, "comm must be a string or a sequence");
+	if (seq == NULL) {
+		return false;
+	}
+
+	sz = PySequence_Fast_GET_SIZE(seq);
+	if (sz == 0) {
+		Py_DECREF(seq);
+		PyErr_SetString(
+			PyExc_ValueError,
+			"comm: expected a non-empty sequence."
+		);
+		return false;
+	}
+
+	filter->comm_globs = calloc(sz + 1, sizeof(char *));
+	if (filter->comm_globs == NULL) {
+		Py_DECREF(seq);
+		PyErr_NoMemory();
+		return false;
+	}
+
+	for (i = 0; i < sz; i++) {
+		if (!add_comm_glob(filter, PySequence_Fast_GET_ITEM(seq, i))) {
+			Py_DECREF(seq);
+			return false;
+		}
+	}
+
+	Py_DECREF(seq);
+	return true;
+}
+
+static bool add_criterion(pidfilter_t *filter, const char *key,
+			  PyObject *pyval)
+{
+	const char *str = NULL;
+
+	if (strcmp(key, "comm") == 0) {
+		return comm_from_py(filter, pyval);
+	} else if (strcmp(key, "state") == 0) {
+		str = PyUnicode_AsUTF8(pyval);
+		if (str == NULL) {
+			return false;
+		}
+		if ((*str == '\0') || (strlen(str) >= sizeof(filter->states))) {
+			PyErr_SetString(
+				PyExc_ValueError,
+				"state must be a string of state letters, e.g. \"DZ\"."
+			);
+			return false;
+		}
+		strlcpy(filter->states, str, sizeof(filter->states));
+		return true;
+	} else if (strcmp(key, "ppid") == 0) {
+		return ids_from_py(pyval, key, INT_MAX, &filter->ppids,
+				   &filter->ppids_cnt);
+	} else if (strcmp(key, "session") == 0) {
+		return ids_from_py(pyval, key, INT_MAX, &filter->sessions,
+				   &filter->sessions_cnt);
+	} else if (strcmp(key, "uid") == 0) {
+		return ids_from_py(pyval, key, UINT_MAX, &filter->uids,
+				   &filter->uids_cnt);
+	} else if (strcmp(key, "min_rss_bytes") == 0) {
+		filter->min_rss_bytes = PyLong_AsUnsignedLongLong(pyval);
+		return !PyErr_Occurred();
+	}
+
+	PyErr_Format(
+		PyExc_ValueError,
+		"%s: unknown filter key.", key
+	);
+	return false;
+}
+
+/*
+ * Compile a filter from a dict with any of the keys comm, state, ppid,
+ * session, min_rss_bytes and uid. Requires the GIL. Returns NULL with an
+ * exception set on failure.
+ */
+pidfilter_t *pidfilter_new(PyObject *spec)
+{
+	pidfilter_t *filter = NULL;
+	PyObject *pykey = NULL, *pyval = NULL;
+	Py_ssize_t pos = 0;
+
+	if (!PyDict_Check(spec)) {
+		PyErr_SetString(
+			PyExc_TypeError,
+			"filter must be a dict."
+		);
+		return NULL;
+	}
+
+	filter = calloc(1, sizeof(pidfilter_t));
+	if (filter == NULL) {
+		PyErr_NoMemory();
+		return NULL;
+	}
+
+	while (PyDict_Next(spec, &pos, &pykey, &pyval)) {
+		const char *key = NULL;
+
+		if (!PyUnicode_Check(pykey)) {
+			PyErr_SetString(
+				PyExc_TypeError,
+				"filter keys must be strings."
+			);
+			pidfilter_free(filter);
+			return NULL;
+		}
+
+		key = PyUnicode_AsUTF8(pykey);
+		if ((key == NULL) || !add_criterion(filter, key, pyval)) {
+			pidfilter_free(filter);
+			return NULL;
+		}
+	}
+
+	return filter;
+}
+
+void pidfilter_free(pidfilter_t *filter)
+{
+	int i;
+
+	if (filter == NULL) {
+		return;
+	}
+
+	if (filter->comm_globs != NULL) {
+		for (i = 0; i < filter->comm_cnt; i++) {
+			free(filter->comm_globs[i]);
+		}
+	}
+	free(filter->comm_globs);
+	free(filter->ppids);
+	free(filter->sessions);
+	free(filter->uids);
+	free(filter);
+}
+
+/* stat fields that pidfilter_match_stat() looks at */
+pidstat_mask_t pidfilter_stat_fields(const pidfilter_t *filter)
+{
+	pidstat_mask_t mask = PIDSTAT_PID | PIDSTAT_COMM;
+
+	if (filter->states[0] != '\0') {
+		mask |= PIDSTAT_STATE;
+	}
+	if (filter->ppids_cnt) {
+		mask |= PIDSTAT_PPID;
+	}
+	if (filter->sessions_cnt) {
+		mask |= PIDSTAT_SESSION;
+	}
+	return mask;
+}
+
+static bool id_in(const int *ids, int cnt, int id)
+{
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		if (ids[i] == id) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool comm_matches(const pidfilter_t *filter, const char *comm)
+{
+	char name[sizeof(((pidstat_t *)NULL)->comm)];
+	size_t len = strlen(comm);
+	int i;
+
+	/* comm is kept with its parens, see parse_pid_stat_buf() */
+	if ((len >= 2) && (comm[0] == '(') && (comm[len - 1] == ')')) {
+		memcpy(name, comm + 1, len - 2);
+		name[len - 2] = '\0';
+	} else {
+		strlcpy(name, comm, sizeof(name));
+	}
+
+	for (i = 0; i < filter->comm_cnt; i++) {
+		if (fnmatch(filter->comm_globs[i], name, 0) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Does not require the GIL, as the ones below */
+bool pidfilter_match_stat(const pidfilter_t *filter, const pidstat_t *stat)
+{
+	if ((filter->states[0] != '\0') &&
+	    ((stat->state == '\0') ||
+	     (strchr(filter->states, stat->state) == NULL))) {
+		return false;
+	}
+
+	if (filter->ppids_cnt &&
+	    !id_in(filter->ppids, filter->ppids_cnt, stat->ppid)) {
+		return false;
+	}
+
+	if (filter->sessions_cnt &&
+	    !id_in(filter->sessions, filter->sessions_cnt, stat->session)) {
+		return false;
+	}
+
+	return (filter->comm_cnt == 0) || comm_matches(filter, stat->comm);
+}
+
+bool pidfilter_match_statm(const pidfilter_t *filter, const pidstatm_t *statm)
+{
+	return (filter->min_rss_bytes == 0) ||
+	       ((unsigned long long)statm->resident * sysconf(_SC_PAGESIZE) >=
+		filter->min_rss_bytes);
+}
+
+/* status is only needed, and only read, if uid is part of the filter */
+bool pidfilter_match_status(const pidfilter_t *filter,
+			    const pidstatus_t *status)
+{
+	return (filter->uids_cnt == 0) ||
+	       id_in(filter->uids, filter->uids_cnt, (int)status->uid[1]);
+}
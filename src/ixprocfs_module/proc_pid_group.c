@@ -0,0 +1,586 @@
+/*
+ * Python language bindings for procfs-diskstats
+ *
+ * Copyright (C) Andrew Walker, 2022
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Python.h>
+#include <stddef.h>
+#include <unistd.h>
+#include "proc_pid.h"
+
+/*
+ * Hash aggregation over a ProcPidSnapshot. Processes are grouped by one
+ * key through a hashtab whose values are group indexes; every group
+ * remembers its first process so keys never have to be copied. Counts,
+ * sums and maxima are accumulated into flat arrays without the GIL and
+ * only the final table is converted to Python objects.
+ */
+
+enum {
+	GROUP_KEY_COMM,
+	GROUP_KEY_STATE,
+	GROUP_KEY_PPID,
+	GROUP_KEY_PGRP,
+	GROUP_KEY_SESSION,
+	GROUP_KEY_TTY_NR,
+	GROUP_KEY_TGID,
+	GROUP_KEY_UID,
+};
+
+static const struct {
+	const char *name;
+	int key;
+} group_keys[] = {
+	{ "comm", GROUP_KEY_COMM },
+	{ "state", GROUP_KEY_STATE },
+	{ "ppid", GROUP_KEY_PPID },
+	{ "pgrp", GROUP_KEY_PGRP },
+	{ "session", GROUP_KEY_SESSION },
+	{ "tty_nr", GROUP_KEY_TTY_NR },
+	{ "tgid", GROUP_KEY_TGID },
+	{ "uid", GROUP_KEY_UID }, /* effective, from status */
+};
+
+enum {
+	GROUP_TYPE_ULONG,
+	GROUP_TYPE_LONG,
+	GROUP_TYPE_ULONGLONG,
+	GROUP_TYPE_PAGES, /* unsigned long, converted to bytes */
+};
+
+static const struct {
+	const char *name; /* stat fields use their PidEntry name */
+	size_t offset; /* in pidsample_t */
+	int type;
+	bool statm;
+} group_fields[] = {
+	{ "minflt", offsetof(pidsample_t, stat.minflt), GROUP_TYPE_ULONG, false },
+	{ "majflt", offsetof(pidsample_t, stat.majflt), GROUP_TYPE_ULONG, false },
+	{ "utime", offsetof(pidsample_t, stat.utime), GROUP_TYPE_ULONG, false },
+	{ "stime", offsetof(pidsample_t, stat.stime), GROUP_TYPE_ULONG, false },
+	{ "cutime", offsetof(pidsample_t, stat.cutime), GROUP_TYPE_LONG, false },
+	{ "cstime", offsetof(pidsample_t, stat.cstime), GROUP_TYPE_LONG, false },
+	{ "num_threads", offsetof(pidsample_t, stat.num_threads), GROUP_TYPE_LONG, false },
+	{ "vsize", offsetof(pidsample_t, stat.vsize), GROUP_TYPE_ULONG, false },
+	{ "rss", offsetof(pidsample_t, stat.rss), GROUP_TYPE_LONG, false },
+	{ "delayacct_blkio_ticks", offsetof(pidsample_t, stat.delayacct_blkio_ticks), GROUP_TYPE_ULONGLONG, false },
+	{ "guest_time", offsetof(pidsample_t, stat.guest_time), GROUP_TYPE_ULONG, false },
+	{ "vm_bytes", offsetof(pidsample_t, statm.size), GROUP_TYPE_PAGES, true },
+	{ "rss_bytes", offsetof(pidsample_t, statm.resident), GROUP_TYPE_PAGES, true },
+	{ "shared_bytes", offsetof(pidsample_t, statm.shared), GROUP_TYPE_PAGES, true },
+	{ "data_bytes", offsetof(pidsample_t, statm.data), GROUP_TYPE_PAGES, true },
+};
+
+#define GROUP_OP_COUNT 0x1
+#define GROUP_OP_SUM 0x2
+#define GROUP_OP_MAX 0x4
+
+struct group_by {
+	const pidsample_t *samples;
+	int cnt;
+	int key;
+	int fields[ARRAY_SIZE(group_fields)];
+	int nfields;
+	int ops;
+	long page_size;
+	hashtab_t ht;
+	int ngroups;
+	int *first; /* sample index of the first process of each group */
+	int *counts;
+	long long *sums; /* ngroups * nfields */
+	long long *maxs;
+};
+
+static long long group_key_num(int key, const pidsample_t *sample)
+{
+	switch (key) {
+	case GROUP_KEY_STATE:
+		return sample->stat.state;
+	case GROUP_KEY_PPID:
+		return sample->stat.ppid;
+	case GROUP_KEY_PGRP:
+		return sample->stat.pgrp;
+	case GROUP_KEY_SESSION:
+		return sample->stat.session;
+	case GROUP_KEY_TTY_NR:
+		return sample->stat.tty_nr;
+	case GROUP_KEY_TGID:
+		return sample->tgid;
+	case GROUP_KEY_UID:
+		return sample->status.uid[1];
+	}
+
+	return 0;
+}
+
+static uint64_t group_key_hash(int key, const pidsample_t *sample)
+{
+	if (key == GROUP_KEY_COMM) {
+		return hash_str(sample->stat.comm, strlen(sample->stat.comm));
+	}
+
+	return hash_u64((uint64_t)group_key_num(key, sample));
+}
+
+static bool match_group(int val, const void *key, const void *priv)
+{
+	const struct group_by *gb = priv;
+	const pidsample_t *first = &gb->samples[gb->first[val]];
+	const pidsample_t *sample = key;
+
+	if (gb->key == GROUP_KEY_COMM) {
+		return strcmp(first->stat.comm, sample->stat.comm) == 0;
+	}
+
+	return group_key_num(gb->key, first) ==
+	       group_key_num(gb->key, sample);
+}
+
+static long long group_field_value(const struct group_by *gb, int field,
+				   const pidsample_t *sample)
+{
+	const char *p = (const char *)sample + group_fields[field].offset;
+
+	switch (group_fields[field].type) {
+	case GROUP_TYPE_ULONG:
+		return (long long)*(const unsigned long *)p;
+	case GROUP_TYPE_LONG:
+		return *(const long *)p;
+	case GROUP_TYPE_ULONGLONG:
+		return (long long)*(const unsigned long long *)p;
+	case GROUP_TYPE_PAGES:
+		return (long long)*(const unsigned long *)p * gb->page_size;
+	}
+
+	return 0;
+}
+
+/* Runs without the GIL, every array is sized for one group per process */
+static void group_by_run(struct group_by *gb)
+{
+	int i, j;
+
+	for (i = 0; i < gb->cnt; i++) {
+		const pidsample_t *sample = &gb->samples[i];
+		uint64_t hash = group_key_hash(gb->key, sample);
+		long long *sums = NULL, *maxs = NULL;
+		int g;
+
+		g = hashtab_lookup(&gb->ht, hash, match_group, sample, gb);
+		if (g == -1) {
+			g = gb->ngroups++;
+			gb->first[g] = i;
+			hashtab_insert(&gb->ht, hash, g);
+		}
+
+		gb->counts[g]++;
+		sums = &gb->sums[(size_t)g * gb->nfields];
+		maxs = &gb->maxs[(size_t)g * gb->nfields];
+		for (j = 0; j < gb->nfields; j++) {
+			long long val = group_field_value(gb, gb->fields[j],
+							  sample);
+
+			sums[j] += val;
+			if ((gb->counts[g] == 1) || (val > maxs[j])) {
+				maxs[j] = val;
+			}
+		}
+	}
+}
+
+static void group_by_free(struct group_by *gb)
+{
+	hashtab_free(&gb->ht);
+	free(gb->first);
+	free(gb->counts);
+	free(gb->sums);
+	free(gb->maxs);
+}
+
+static bool group_key_from_py(const py_proc_pid_snapshot_t *snap,
+			      PyObject *pykey, int *key_out)
+{
+	const char *name = NULL;
+	size_t i;
+
+	name = PyUnicode_Check(pykey) ? PyUnicode_AsUTF8(pykey) : NULL;
+	if (name == NULL) {
+		if (!PyErr_Occurred()) {
+			PyErr_SetString(
+				PyExc_TypeError,
+				"key must be a string."
+			);
+		}
+		return false;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(group_keys); i++) {
+		if (strcmp(group_keys[i].name, name) == 0) {
+			break;
+		}
+	}
+
+	if (i == ARRAY_SIZE(group_keys)) {
+		PyErr_Format(
+			PyExc_ValueError,
+			"%s: unknown group key.",
+			name
+		);
+		return false;
+	}
+
+	switch (group_keys[i].key) {
+	case GROUP_KEY_COMM:
+	case GROUP_KEY_TGID:
+		break;
+	case GROUP_KEY_UID:
+		if (!(snap->req.status_fields &
+		      ((pidstatus_mask_t)1 << PIDSTATUS_UID))) {
+			PyErr_SetString(
+				PyExc_ValueError,
+				"uid: snapshot was taken without the uid "
+				"status field."
+			);
+			return false;
+		}
+		break;
+	default:
+		if (!(snap->req.stat_fields & pidstat_field_mask(name))) {
+			PyErr_Format(
+				PyExc_ValueError,
+				"%s: stat field was not parsed in snapshot.",
+				name
+			);
+			return false;
+		}
+		break;
+	}
+
+	*key_out = group_keys[i].key;
+	return true;
+}
+
+static bool group_field_parsed(const py_proc_pid_snapshot_t *snap,
+			       size_t field)
+{
+	return group_fields[field].statm ||
+	       (snap->req.stat_fields &
+		pidstat_field_mask(group_fields[field].name));
+}
+
+/* None selects every field that was parsed in the snapshot */
+static bool group_fields_from_py(const py_proc_pid_snapshot_t *snap,
+				 PyObject *pyfields, struct group_by *gb)
+{
+	PyObject *seq = NULL;
+	Py_ssize_t i;
+	size_t j;
+
+	if (pyfields == Py_None) {
+		for (j = 0; j < ARRAY_SIZE(group_fields); j++) {
+			if (group_field_parsed(snap, j)) {
+				gb->fields[gb->nfields++] = j;
+			}
+		}
+		return true;
+	}
+
+	if (PyUnicode_Check(pyfields)) {
+		PyErr_SetString(
+			PyExc_TypeError,
+			"fields must be a sequence of field names."
+		);
+		return false;
+	}
+
+	seq = PySequence_Fast(pyfields, "fields must be a sequence of field names.");
+	if (seq == NULL) {
+		return false;
+	}
+
+	for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+		PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+		const char *name = NULL;
+		int k;
+
+		name = PyUnicode_Check(item) ? PyUnicode_AsUTF8(item) : NULL;
+		if (name == NULL) {
+			if (!PyErr_Occurred()) {
+				PyErr_SetString(
+					PyExc_TypeError,
+					"fields must be a sequence of field names."
+				);
+			}
+			Py_DECREF(seq);
+			return false;
+		}
+
+		for (j = 0; j < ARRAY_SIZE(group_fields); j++) {
+			if (strcmp(group_fields[j].name, name) == 0) {
+				break;
+			}
+		}
+
+		if (j == ARRAY_SIZE(group_fields)) {
+			PyErr_Format(
+				PyExc_ValueError,
+				"%s: unknown group field.",
+				name
+			);
+			Py_DECREF(seq);
+			return false;
+		}
+
+		if (!group_field_parsed(snap, j)) {
+			PyErr_Format(
+				PyExc_ValueError,
+				"%s: stat field was not parsed in snapshot.",
+				name
+			);
+			Py_DECREF(seq);
+			return false;
+		}
+
+		/* ignore duplicates */
+		for (k = 0; k < gb->nfields; k++) {
+			if (gb->fields[k] == (int)j) {
+				break;
+			}
+		}
+		if (k == gb->nfields) {
+			gb->fields[gb->nfields++] = j;
+		}
+	}
+
+	Py_DECREF(seq);
+	return true;
+}
+
+/* None selects count and sum */
+static bool group_ops_from_py(PyObject *pyops, int *ops_out)
+{
+	PyObject *seq = NULL;
+	Py_ssize_t i;
+	int ops = 0;
+
+	if (pyops == Py_None) {
+		*ops_out = GROUP_OP_COUNT | GROUP_OP_SUM;
+		return true;
+	}
+
+	if (PyUnicode_Check(pyops)) {
+		PyErr_SetString(
+			PyExc_TypeError,
+			"ops must be a sequence of operation names."
+		);
+		return false;
+	}
+
+	seq = PySequence_Fast(pyops, "ops must be a sequence of operation names.");
+	if (seq == NULL) {
+		return false;
+	}
+
+	for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+		PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+		const char *name = NULL;
+
+		name = PyUnicode_Check(item) ? PyUnicode_AsUTF8(item) : NULL;
+		if (name == NULL) {
+			if (!PyErr_Occurred()) {
+				PyErr_SetString(
+					PyExc_TypeError,
+					"ops must be a sequence of operation names."
+				);
+			}
+			Py_DECREF(seq);
+			return false;
+		}
+
+		if (strcmp(name, "count") == 0) {
+			ops |= GROUP_OP_COUNT;
+		} else if (strcmp(name, "sum") == 0) {
+			ops |= GROUP_OP_SUM;
+		} else if (strcmp(name, "max") == 0) {
+			ops |= GROUP_OP_MAX;
+		} else {
+			PyErr_Format(
+				PyExc_ValueError,
+				"%s: unknown operation, expected count, sum "
+				"or max.",
+				name
+			);
+			Py_DECREF(seq);
+			return false;
+		}
+	}
+
+	Py_DECREF(seq);
+	*ops_out = ops;
+	return true;
+}
+
+static PyObject *group_key_to_py(const struct group_by *gb, int g)
+{
+	const pidsample_t *first = &gb->samples[gb->first[g]];
+
+	switch (gb->key) {
+	case GROUP_KEY_COMM:
+		return PyUnicode_FromString(first->stat.comm);
+	case GROUP_KEY_STATE:
+		return PyUnicode_FromStringAndSize(&first->stat.state, 1);
+	}
+
+	return PyLong_FromLongLong(group_key_num(gb->key, first));
+}
+
+static int group_dict_set(PyObject *dict, const char *field,
+			  const char *op, long long val)
+{
+	PyObject *pyval = NULL;
+	char name[64];
+	int rv;
+
+	snprintf(name, sizeof(name), "%s_%s", field, op);
+	pyval = PyLong_FromLongLong(val);
+	if (pyval == NULL) {
+		return -1;
+	}
+
+	rv = PyDict_SetItemString(dict, name, pyval);
+	Py_DECREF(pyval);
+	return rv;
+}
+
+static PyObject *group_to_py_dict(const struct group_by *gb, int g)
+{
+	const long long *sums = &gb->sums[(size_t)g * gb->nfields];
+	const long long *maxs = &gb->maxs[(size_t)g * gb->nfields];
+	PyObject *out = NULL;
+	int j;
+
+	out = PyDict_New();
+	if (out == NULL) {
+		return NULL;
+	}
+
+	if (gb->ops & GROUP_OP_COUNT) {
+		PyObject *pycount = PyLong_FromLong(gb->counts[g]);
+		int rv;
+
+		if (pycount == NULL) {
+			Py_DECREF(out);
+			return NULL;
+		}
+		rv = PyDict_SetItemString(out, "count", pycount);
+		Py_DECREF(pycount);
+		if (rv != 0) {
+			Py_DECREF(out);
+			return NULL;
+		}
+	}
+
+	for (j = 0; j < gb->nfields; j++) {
+		const char *field = group_fields[gb->fields[j]].name;
+
+		if ((gb->ops & GROUP_OP_SUM) &&
+		    (group_dict_set(out, field, "sum", sums[j]) != 0)) {
+			Py_DECREF(out);
+			return NULL;
+		}
+
+		if ((gb->ops & GROUP_OP_MAX) &&
+		    (group_dict_set(out, field, "max", maxs[j]) != 0)) {
+			Py_DECREF(out);
+			return NULL;
+		}
+	}
+
+	return out;
+}
+
+PyObject *proc_pid_snapshot_group_by(const py_proc_pid_snapshot_t *snap,
+				     PyObject *pykey, PyObject *pyfields,
+				     PyObject *pyops)
+{
+	struct group_by gb = {
+		.samples = snap->samples,
+		.cnt = snap->cnt,
+		.page_size = sysconf(_SC_PAGESIZE),
+	};
+	PyObject *out = NULL;
+	size_t nvals;
+	int g;
+
+	if (!group_key_from_py(snap, pykey, &gb.key) ||
+	    !group_fields_from_py(snap, pyfields, &gb) ||
+	    !group_ops_from_py(pyops, &gb.ops)) {
+		return NULL;
+	}
+
+	nvals = (size_t)(gb.cnt + 1) * (gb.nfields + 1);
+	gb.first = calloc(gb.cnt + 1, sizeof(int));
+	gb.counts = calloc(gb.cnt + 1, sizeof(int));
+	gb.sums = calloc(nvals, sizeof(long long));
+	gb.maxs = calloc(nvals, sizeof(long long));
+	if ((gb.first == NULL) || (gb.counts == NULL) ||
+	    (gb.sums == NULL) || (gb.maxs == NULL) ||
+	    !hashtab_init(&gb.ht, gb.cnt)) {
+		group_by_free(&gb);
+		PyErr_NoMemory();
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	group_by_run(&gb);
+	Py_END_ALLOW_THREADS
+
+	out = PyDict_New();
+	if (out == NULL) {
+		group_by_free(&gb);
+		return NULL;
+	}
+
+	for (g = 0; g < gb.ngroups; g++) {
+		PyObject *pykey = NULL, *pyval = NULL;
+		int rv;
+
+		pykey = group_key_to_py(&gb, g);
+		if (pykey == NULL) {
+			Py_CLEAR(out);
+			break;
+		}
+
+		pyval = group_to_py_dict(&gb, g);
+		if (pyval == NULL) {
+			Py_DECREF(pykey);
+			Py_CLEAR(out);
+			break;
+		}
+
+		rv = PyDict_SetItem(out, pykey, pyval);
+		Py_DECREF(pykey);
+		Py_DECREF(pyval);
+		if (rv != 0) {
+			Py_CLEAR(out);
+			break;
+		}
+	}
+
+	group_by_free(&gb);
+	return out;
+}
@@ -0,0 +1,746 @@
+/*
+ * Python language bindings for procfs-diskstats
+ *
+ * Copyright (C) Andrew Walker, 2022
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Python.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
+#include "proc_pid.h"
+
+/*
+ * Handle to a single process for continuous monitoring. /proc/<pid> is
+ * opened once with O_PATH and every read is an openat(2) relative to
+ * it, which skips the path walk through procfs. The directory stays
+ * bound to the process it was opened for: once that process exits,
+ * reads fail with ESRCH or ENOENT even if the pid is reused.
+ */
+
+static void set_handle_error(py_pid_handle_t *self, int err,
+			     const char *what)
+{
+	if ((err == ENOENT) || (err == ESRCH)) {
+		PyErr_Format(
+			PyExc_ProcessLookupError,
+			"%d: process exited",
+			self->pid
+		);
+		return;
+	}
+
+	PyErr_Format(
+		PyExc_RuntimeError,
+		"/proc/%d/%s: %s",
+		self->pid, what, strerror(err)
+	);
+}
+
+/*
+ * Reserve the directory fd for a read without the GIL. close() is
+ * refused while reads are in progress, so the fd cannot be closed and
+ * reused underneath them.
+ */
+static bool handle_get(py_pid_handle_t *self)
+{
+	if (self->dirfd == -1) {
+		PyErr_SetString(
+			PyExc_ValueError,
+			"I/O operation on closed handle."
+		);
+		return false;
+	}
+
+	self->busy++;
+	return true;
+}
+
+static void handle_put(py_pid_handle_t *self)
+{
+	self->busy--;
+}
+
+static PyObject *py_pid_handle_new(PyTypeObject *obj,
+				   PyObject *args_unused,
+				   PyObject *kwargs_unused)
+{
+	py_pid_handle_t *self = NULL;
+
+	self = (py_pid_handle_t *)obj->tp_alloc(obj, 0);
+	if (self == NULL) {
+		return NULL;
+	}
+
+	self->dirfd = -1;
+	return (PyObject *)self;
+}
+
+static int py_pid_handle_init(PyObject *obj,
+			      PyObject *args,
+			      PyObject *kwargs)
+{
+	py_pid_handle_t *self = (py_pid_handle_t *)obj;
+	pidsample_t sample;
+	pidsample_req_t req = { .stat_fields = PIDSTAT_ALL_FIELDS };
+	fd_buf_t buf = { .data = NULL };
+	char path[32];
+	bool ok;
+	int pid, fd, err = 0;
+	const char *kwnames [] = {
+		"pid",
+		NULL
+	};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+					 "i",
+					 discard_const_p(char *, kwnames),
+					 &pid)) {
+		return -1;
+	}
+
+	if (self->dirfd != -1) {
+		PyErr_SetString(
+			PyExc_RuntimeError,
+			"Handle is already open."
+		);
+		return -1;
+	}
+
+	self->pid = pid;
+	snprintf(path, sizeof(path), "/proc/%d", pid);
+
+	Py_BEGIN_ALLOW_THREADS
+	fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	ok = (fd != -1) &&
+	     read_pid_sample_at(fd, pid, &req, &buf, &sample);
+	if (!ok) {
+		err = errno;
+	}
+	fd_buf_free(&buf);
+	Py_END_ALLOW_THREADS
+
+	if (!ok) {
+		if (fd != -1) {
+			close(fd);
+		}
+		set_handle_error(self, err, "stat");
+		return -1;
+	}
+
+	self->dirfd = fd;
+	self->starttime = sample.stat.starttime;
+	return 0;
+}
+
+void py_pid_handle_dealloc(py_pid_handle_t *self)
+{
+	if (self->dirfd != -1) {
+		close(self->dirfd);
+		self->dirfd = -1;
+	}
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+PyDoc_STRVAR(py_pid_handle_refresh__doc__,
+"refresh()\n"
+"--\n\n"
+"Read /proc/<pid>/stat and /proc/<pid>/statm of the process.\n\n"
+"Parameters\n"
+"----------\n"
+"None\n\n"
+"Returns\n"
+"-------\n"
+"PidEntry\n\n"
+"Raises\n"
+"------\n"
+"ProcessLookupError if the process exited\n"
+);
+
+static PyObject *py_pid_handle_refresh(PyObject *obj, PyObject *args_unused)
+{
+	py_pid_handle_t *self = (py_pid_handle_t *)obj;
+	pidsample_t sample;
+	pidsample_req_t req = { .stat_fields = PIDSTAT_ALL_FIELDS };
+	fd_buf_t buf = { .data = NULL };
+	bool ok;
+	int err = 0;
+
+	if (!handle_get(self)) {
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	ok = read_pid_sample_at(self->dirfd, self->pid, &req, &buf, &sample);
+	if (!ok) {
+		err = errno;
+	} else if (sample.stat.starttime != self->starttime) {
+		/* should not happen, the directory is bound to the process */
+		ok = false;
+		err = ESRCH;
+	}
+	fd_buf_free(&buf);
+	Py_END_ALLOW_THREADS
+
+	handle_put(self);
+	if (!ok) {
+		set_handle_error(self, err, "stat");
+		return NULL;
+	}
+
+	return pidsample_to_entry(&sample);
+}
+
+PyDoc_STRVAR(py_pid_handle_status__doc__,
+"status(fields=None)\n"
+"--\n\n"
+"Read /proc/<pid>/status of the process.\n\n"
+"Parameters\n"
+"----------\n"
+"fields: sequence of field names, see ProcPid.get_status(). None\n"
+"    reads every field.\n\n"
+"Returns\n"
+"-------\n"
+"dict\n"
+);
+
+static PyObject *py_pid_handle_status(PyObject *obj,
+				      PyObject *args,
+				      PyObject *kwargs)
+{
+	py_pid_handle_t *self = (py_pid_handle_t *)obj;
+	PyObject *pyfields = Py_None;
+	pidstatus_t status = { .threads = 0 };
+	pidstatus_mask_t fields = PIDSTATUS_ALL_FIELDS;
+	fd_buf_t buf = { .data = NULL };
+	bool ok;
+	int err = 0;
+	const char *kwnames [] = {
+		"fields",
+		NULL
+	};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+					 "|O",
+					 discard_const_p(char *, kwnames),
+					 &pyfields)) {
+		return NULL;
+	}
+
+	if ((pyfields != Py_None) &&
+	    !pidstatus_mask_from_py(pyfields, &fields)) {
+		return NULL;
+	}
+
+	if (!handle_get(self)) {
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	ok = read_pid_file_at(self->dirfd, "status", &buf) &&
+	     parse_pid_status_buf(buf.data, fields, &status);
+	if (!ok) {
+		err = errno;
+	}
+	fd_buf_free(&buf);
+	Py_END_ALLOW_THREADS
+
+	handle_put(self);
+	if (!ok) {
+		set_handle_error(self, err, "status");
+		return NULL;
+	}
+
+	return pidstatus_to_py_dict(&status, fields);
+}
+
+PyDoc_STRVAR(py_pid_handle_io__doc__,
+"io()\n"
+"--\n\n"
+"Read the /proc/<pid>/io counters of the process. This requires ptrace\n"
+"access to the process.\n\n"
+"Parameters\n"
+"----------\n"
+"None\n\n"
+"Returns\n"
+"-------\n"
+"dict with the keys rchar, wchar, syscr, syscw, read_bytes, write_bytes\n"
+"and cancelled_write_bytes\n"
+);
+
+static PyObject *py_pid_handle_io(PyObject *obj, PyObject *args_unused)
+{
+	py_pid_handle_t *self = (py_pid_handle_t *)obj;
+	pidio_t io = { .rchar = 0 };
+	fd_buf_t buf = { .data = NULL };
+	bool ok;
+	int err = 0;
+
+	if (!handle_get(self)) {
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	ok = read_pid_file_at(self->dirfd, "io", &buf) &&
+	     parse_pid_io_buf(buf.data, &io);
+	if (!ok) {
+		err = errno;
+	}
+	fd_buf_free(&buf);
+	Py_END_ALLOW_THREADS
+
+	handle_put(self);
+	if (!ok) {
+		set_handle_error(self, err, "io");
+		return NULL;
+	}
+
+	return pidio_to_py_dict(&io);
+}
+
+PyDoc_STRVAR(py_pid_handle_smaps_rollup__doc__,
+"smaps_rollup()\n"
+"--\n\n"
+"Read the /proc/<pid>/smaps_rollup memory totals of the process. This\n"
+"requires ptrace access to the process.\n\n"
+"Parameters\n"
+"----------\n"
+"None\n\n"
+"Returns\n"
+"-------\n"
+"dict, see ProcPidSnapshot.smaps_rollup(), or None for processes\n"
+"without an address space (kernel threads)\n"
+);
+
+static PyObject *py_pid_handle_smaps_rollup(PyObject *obj,
+					    PyObject *args_unused)
+{
+	py_pid_handle_t *self = (py_pid_handle_t *)obj;
+	pidsmaps_t smaps = { .rss_kb = 0 };
+	fd_buf_t buf = { .data = NULL };
+	bool ok, no_mm = false;
+	int err = 0;
+
+	if (!handle_get(self)) {
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	ok = read_pid_file_at(self->dirfd, "smaps_rollup", &buf) &&
+	     parse_pid_smaps_rollup_buf(buf.data, &smaps);
+	if (!ok) {
+		err = errno;
+		/* ESRCH also means no address space if the process is alive */
+		no_mm = (err == ESRCH) &&
+			read_pid_file_at(self->dirfd, "stat", &buf);
+	}
+	fd_buf_free(&buf);
+	Py_END_ALLOW_THREADS
+
+	handle_put(self);
+	if (no_mm) {
+		Py_RETURN_NONE;
+	}
+	if (!ok) {
+		set_handle_error(self, err, "smaps_rollup");
+		return NULL;
+	}
+
+	return pidsmaps_to_py_dict(&smaps);
+}
+
+PyDoc_STRVAR(py_pid_handle_fd_count__doc__,
+"fd_count()\n"
+"--\n\n"
+"Count the open file descriptors of the process.\n\n"
+"Parameters\n"
+"----------\n"
+"None\n\n"
+"Returns\n"
+"-------\n"
+"int\n"
+);
+
+static PyObject *py_pid_handle_fd_count(PyObject *obj, PyObject *args_unused)
+{
+	py_pid_handle_t *self = (py_pid_handle_t *)obj;
+	int cnt, err = 0;
+
+	if (!handle_get(self)) {
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	cnt = count_pid_fds_at(self->dirfd, "fd", self->pid == getpid());
+	if (cnt == -1) {
+		err = errno;
+	}
+	Py_END_ALLOW_THREADS
+
+	handle_put(self);
+	if (cnt == -1) {
+		set_handle_error(self, err, "fd");
+		return NULL;
+	}
+
+	return PyLong_FromLong(cnt);
+}
+
+PyDoc_STRVAR(py_pid_handle_read_file__doc__,
+"read_file(name)\n"
+"--\n\n"
+"Read a file of the process directory, e.g. \"status\" or \"io\".\n\n"
+"Parameters\n"
+"----------\n"
+"name: str, path relative to /proc/<pid>. \"..\" components and\n"
+"    symbolic links, including the magic links cwd, root, exe and\n"
+"    fd/<n>, are rejected so that the handle stays bound to its\n"
+"    process.\n\n"
+"Returns\n"
+"-------\n"
+"str\n"
+);
+
+/*
+ * Names must not leave the process directory, otherwise "../<pid>/..."
+ * would read another process and defeat the pid reuse protection.
+ */
+static bool name_is_beneath(const char *name)
+{
+	const char *p = name;
+
+	if (*name == '/') {
+		return false;
+	}
+
+	while (*p != '\0') {
+		size_t len = strcspn(p, "/");
+
+		if ((len == 2) && (p[0] == '.') && (p[1] == '.')) {
+			return false;
+		}
+
+		p += len;
+		if (*p == '/') {
+			p++;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Open `name` below `dirfd` one component at a time with O_NOFOLLOW, so
+ * that neither symlinks nor /proc magic links are followed. `name` has
+ * passed name_is_beneath(). Returns -1 with errno set, ELOOP for a
+ * link.
+ */
+static int open_beneath_walk(int dirfd, const char *name)
+{
+	char comp[NAME_MAX + 1];
+	const char *p = name;
+	struct stat st;
+	int cur = dirfd, fd = -1, err;
+
+	for (;;) {
+		size_t len = strcspn(p, "/");
+		bool last;
+
+		if (len > NAME_MAX) {
+			err = ENAMETOOLONG;
+			break;
+		}
+		memcpy(comp, p, len);
+		comp[len] = '\0';
+
+		p += len;
+		while (*p == '/') {
+			p++;
+		}
+		last = (*p == '\0');
+
+		if (last) {
+			fd = openat(cur, (len == 0) ? "." : comp,
+				    O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+			err = errno;
+			break;
+		}
+
+		if (len == 0) {
+			continue;
+		}
+
+		/* O_PATH opens a link itself, which fstat() then reports */
+		fd = openat(cur, comp, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+		if (fd == -1) {
+			err = errno;
+			break;
+		}
+		if (fstat(fd, &st) == -1) {
+			err = errno;
+		} else if (!S_ISDIR(st.st_mode)) {
+			err = S_ISLNK(st.st_mode) ? ELOOP : ENOTDIR;
+		} else {
+			err = 0;
+		}
+		if (err != 0) {
+			close(fd);
+			fd = -1;
+			break;
+		}
+		if (cur != dirfd) {
+			close(cur);
+		}
+		cur = fd;
+		fd = -1;
+	}
+
+	if (cur != dirfd) {
+		close(cur);
+	}
+	if (fd == -1) {
+		errno = err;
+	}
+	return fd;
+}
+
+/*
+ * Open `name` for reading without leaving `dirfd`. openat2(2) does the
+ * whole resolution in the kernel, older kernels fall back to a walk.
+ */
+static int open_beneath(int dirfd, const char *name)
+{
+#ifdef SYS_openat2
+	struct open_how how = {
+		.flags = O_RDONLY | O_CLOEXEC,
+		.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS |
+			   RESOLVE_NO_SYMLINKS,
+	};
+	int fd;
+
+	fd = syscall(SYS_openat2, dirfd, name, &how, sizeof(how));
+	if ((fd != -1) || (errno != ENOSYS)) {
+		return fd;
+	}
+#endif
+	return open_beneath_walk(dirfd, name);
+}
+
+static bool read_file_beneath(int dirfd, const char *name, fd_buf_t *buf)
+{
+	bool ok;
+	int fd, err;
+
+	fd = open_beneath(dirfd, name);
+	if (fd == -1) {
+		return false;
+	}
+
+	ok = fd_buf_pread(fd, buf);
+	err = errno;
+	close(fd);
+	errno = err;
+	return ok;
+}
+
+static PyObject *py_pid_handle_read_file(PyObject *obj, PyObject *args)
+{
+	py_pid_handle_t *self = (py_pid_handle_t *)obj;
+	fd_buf_t buf = { .data = NULL };
+	PyObject *out = NULL;
+	const char *name = NULL;
+	bool ok;
+	int err = 0;
+
+	if (!PyArg_ParseTuple(args, "s", &name)) {
+		return NULL;
+	}
+
+	if (!name_is_beneath(name)) {
+		PyErr_SetString(
+			PyExc_ValueError,
+			"name must be relative to the process directory and "
+			"must not contain \"..\" components."
+		);
+		return NULL;
+	}
+
+	if (!handle_get(self)) {
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	ok = read_file_beneath(self->dirfd, name, &buf);
+	if (!ok) {
+		err = errno;
+	}
+	Py_END_ALLOW_THREADS
+
+	handle_put(self);
+	if (!ok && ((err == ELOOP) || (err == EXDEV))) {
+		PyErr_Format(
+			PyExc_ValueError,
+			"%s: name resolves through a link.", name
+		);
+	} else if (!ok) {
+		set_handle_error(self, err, name);
+	} else {
+		out = PyUnicode_DecodeFSDefaultAndSize(buf.data, buf.len);
+	}
+
+	fd_buf_free(&buf);
+	return out;
+}
+
+PyDoc_STRVAR(py_pid_handle_close__doc__,
+"close()\n"
+"--\n\n"
+"Close the process directory. Further reads raise ValueError.\n\n"
+"Parameters\n"
+"----------\n"
+"None\n\n"
+"Returns\n"
+"-------\n"
+"None\n"
+);
+
+static PyObject *py_pid_handle_close(PyObject *obj, PyObject *args_unused)
+{
+	py_pid_handle_t *self = (py_pid_handle_t *)obj;
+
+	if (self->busy) {
+		PyErr_SetString(
+			PyExc_RuntimeError,
+			"Handle is in use by another thread."
+		);
+		return NULL;
+	}
+
+	if (self->dirfd != -1) {
+		close(self->dirfd);
+		self->dirfd = -1;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *py_pid_handle_pid(PyObject *obj, void *closure)
+{
+	py_pid_handle_t *self = (py_pid_handle_t *)obj;
+	return PyLong_FromLong(self->pid);
+}
+
+static PyObject *py_pid_handle_starttime(PyObject *obj, void *closure)
+{
+	py_pid_handle_t *self = (py_pid_handle_t *)obj;
+	return PyLong_FromUnsignedLongLong(self->starttime);
+}
+
+static PyObject *py_pid_handle_closed(PyObject *obj, void *closure)
+{
+	py_pid_handle_t *self = (py_pid_handle_t *)obj;
+	return PyBool_FromLong(self->dirfd == -1);
+}
+
+static PyMethodDef py_pid_handle_methods[] = {
+	{
+		.ml_name = "refresh",
+		.ml_meth = (PyCFunction)py_pid_handle_refresh,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = py_pid_handle_refresh__doc__
+	},
+	{
+		.ml_name = "status",
+		.ml_meth = (PyCFunction)py_pid_handle_status,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = py_pid_handle_status__doc__
+	},
+	{
+		.ml_name = "io",
+		.ml_meth = (PyCFunction)py_pid_handle_io,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = py_pid_handle_io__doc__
+	},
+	{
+		.ml_name = "smaps_rollup",
+		.ml_meth = (PyCFunction)py_pid_handle_smaps_rollup,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = py_pid_handle_smaps_rollup__doc__
+	},
+	{
+		.ml_name = "fd_count",
+		.ml_meth = (PyCFunction)py_pid_handle_fd_count,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = py_pid_handle_fd_count__doc__
+	},
+	{
+		.ml_name = "read_file",
+		.ml_meth = (PyCFunction)py_pid_handle_read_file,
+		.ml_flags = METH_VARARGS,
+		.ml_doc = py_pid_handle_read_file__doc__
+	},
+	{
+		.ml_name = "close",
+		.ml_meth = (PyCFunction)py_pid_handle_close,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = py_pid_handle_close__doc__
+	},
+	{ NULL, NULL, 0, NULL }
+};
+
+static PyGetSetDef py_pid_handle_getsetters[] = {
+	{
+		.name	= discard_const_p(char, "pid"),
+		.get	= (getter)py_pid_handle_pid,
+	},
+	{
+		.name	= discard_const_p(char, "starttime"),
+		.get	= (getter)py_pid_handle_starttime,
+		.doc	= "start time of the process in clock ticks after boot",
+	},
+	{
+		.name	= discard_const_p(char, "closed"),
+		.get	= (getter)py_pid_handle_closed,
+	},
+	{ .name = NULL }
+};
+
+PyDoc_STRVAR(py_pid_handle__doc__,
+"PidHandle(pid)\n"
+"--\n\n"
+"Persistent handle to /proc/<pid>, for processes that are monitored\n"
+"continuously. The directory is opened once and later reads are\n"
+"relative to it. The handle stays bound to the process it was opened\n"
+"for; reads raise ProcessLookupError once that process exits, even if\n"
+"its pid has been reused.\n\n"
+"Parameters\n"
+"----------\n"
+"pid: int\n"
+);
+
+PyTypeObject PyPidHandle = {
+	.tp_name = "ixprocfs.PidHandle",
+	.tp_basicsize = sizeof(py_pid_handle_t),
+	.tp_methods = py_pid_handle_methods,
+	.tp_getset = py_pid_handle_getsetters,
+	.tp_new = py_pid_handle_new,
+	.tp_init = py_pid_handle_init,
+	.tp_doc = py_pid_handle__doc__,
+	.tp_dealloc = (destructor)py_pid_handle_dealloc,
+	.tp_flags = Py_TPFLAGS_DEFAULT|Py_TPFLAGS_BASETYPE,
+};
@@ -22,64 +22,166 @@
 #include "../utils/iter.h"
 #include "../utils/parser.h"
 
+static int cmp_pid(const void *a, const void *b)
+{
+	pid_t pa = *(const pid_t *)a;
+	pid_t pb = *(const pid_t *)b;
+
+	return (pa > pb) - (pa < pb);
+}
+
 /*
- * The following two functions are for iterating contents of
- * /proc directory and calling API-user provided callback function
- * with the ("/proc/<pid>", <pid>, <void *>) for every pid in the
- * directory.
+ * Sort `pids` in ascending order and drop duplicates. Does not require
+ * the GIL.
  */
-static int __iter_proc_pid_paths_impl(struct dirent *entry, void *state)
+void sort_pid_list(struct pid_list *pids)
 {
-	iter_proc_pid_cb_t *cb = (iter_proc_pid_cb_t *)state;
+	size_t i, cnt = 0;
+
+	qsort(pids->pids, pids->cnt, sizeof(pid_t), cmp_pid);
+	for (i = 0; i < pids->cnt; i++) {
+		if ((cnt == 0) || (pids->pids[cnt - 1] != pids->pids[i])) {
+			pids->pids[cnt++] = pids->pids[i];
+		}
+	}
+	pids->cnt = cnt;
+}
+
+/*
+ * Fill `out` with the pids of an iterable of ints, sorted and without
+ * duplicates. Requires the GIL. Returns false with an exception set.
+ */
+bool pid_list_from_py(PyObject *pypids, struct pid_list *out)
+{
+	PyObject *seq = NULL;
+	Py_ssize_t i, sz;
+
+	seq = PySequence_Fast(pypids, "pids must be an iterable of ints.");
+	if (seq == NULL) {
+		return false;
+	}
+
+	sz = PySequence_Fast_GET_SIZE(seq);
+	out->pids = calloc(sz + 1, sizeof(pid_t));
+	if (out->pids == NULL) {
+		Py_DECREF(seq);
+		PyErr_SetString(
+			PyExc_MemoryError,
+			"Failed to allocate pid list."
+		);
+		return false;
+	}
+	out->alloc = sz + 1;
+	out->cnt = 0;
+
+	for (i = 0; i < sz; i++) {
+		long pid;
+
+		pid = PyLong_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+		if ((pid == -1) && PyErr_Occurred()) {
+			Py_DECREF(seq);
+			free_pid_list(out);
+			return false;
+		}
+
+		if ((pid <= 0) || (pid > INT_MAX)) {
+			PyErr_Format(
+				PyExc_ValueError,
+				"%ld: invalid pid.",
+				pid
+			);
+			Py_DECREF(seq);
+			free_pid_list(out);
+			return false;
+		}
+
+		out->pids[out->cnt++] = (pid_t)pid;
+	}
+
+	Py_DECREF(seq);
+	sort_pid_list(out);
+	return true;
+}
+
+static int list_proc_pids_impl(struct dirent *entry, void *state)
+{
+	struct pid_list *out = (struct pid_list *)state;
 	int pid;
-	char procfd_path[PATH_MAX];
 
 	if (!parse_int(entry->d_name, &pid)) {
 		return ITER_STATE_CONTINUE;
 	}
 
-	if (cb->pids) {
-		size_t i;
-		bool found = false;
+	if (out->cnt == out->alloc) {
+		size_t new_alloc = out->alloc ? out->alloc * 2 : 1024;
+		pid_t *new = NULL;
 
-		for (i = 0; i < cb->pids->cnt; i++) {
-			if (cb->pids->pids[i] == pid) {
-				found = true;
-				break;
-			}
-		}
-
-		if (!found) {
-			return ITER_STATE_CONTINUE;
+		new = realloc(out->pids, new_alloc * sizeof(pid_t));
+		if (new == NULL) {
+			return ITER_STATE_ERROR;
 		}
+		out->pids = new;
+		out->alloc = new_alloc;
 	}
 
-	snprintf(procfd_path, sizeof(procfd_path), "/proc/%s", entry->d_name);
-	return cb->fn(procfd_path, (pid_t)pid, cb->state);
+	out->pids[out->cnt++] = pid;
+	return ITER_STATE_CONTINUE;
 }
 
-int iter_proc_pids(iter_proc_pid_cb_t *cb_in)
+static bool list_pid_dir(const char *dir_path, struct pid_list *out)
 {
-	int rv;
 	DIR *base = NULL;
+	int rv;
 	iter_dir_cb_t cb = {
-		.fn = __iter_proc_pid_paths_impl,
-		._save = cb_in->_save,
-		.state = cb_in,
+		.fn = list_proc_pids_impl,
+		.state = out,
 	};
 
-	base = opendir("/proc");
+	out->cnt = 0;
+	base = opendir(dir_path);
 	if (base == NULL) {
-		ITER_END_ALLOW_THREADS(cb_in);
-		PyErr_Format(
-			PyExc_RuntimeError,
-			"/proc: opendir() failed: %s", strerror(errno)
-		);
-		ITER_ALLOW_THREADS(cb_in);
-		return ITER_STATE_ERROR;
+		return false;
 	}
 
 	rv = iter_dir(base, &cb);
 	closedir(base);
-	return rv;
+	if (rv == ITER_STATE_ERROR) {
+		/* readdir() failures are recorded in cb.err, ENOMEM is not */
+		errno = cb.err.saved_errno ? cb.err.saved_errno : ENOMEM;
+		return false;
+	}
+
+	qsort(out->pids, out->cnt, sizeof(pid_t), cmp_pid);
+	return true;
+}
+
+/*
+ * Collect the pids currently in /proc in ascending order, so that work
+ * on them can be split between threads and the results merged back in
+ * a stable order. Does not require the GIL. Returns false with errno
+ * set on failure.
+ */
+bool list_proc_pids(struct pid_list *out)
+{
+	return list_pid_dir("/proc", out);
+}
+
+/*
+ * As list_proc_pids(), for the thread ids in /proc/<pid>/task. Fails
+ * with ENOENT if the process exited.
+ */
+bool list_proc_tasks(pid_t pid, struct pid_list *out)
+{
+	char task_path[64];
+
+	snprintf(task_path, sizeof(task_path), "/proc/%d/task", pid);
+	return list_pid_dir(task_path, out);
+}
+
+void free_pid_list(struct pid_list *pids)
+{
+	free(pids->pids);
+	pids->pids = NULL;
+	pids->cnt = 0;
+	pids->alloc = 0;
 }
@@ -18,6 +18,7 @@
  */
 
 #include <Python.h>
+#include <stddef.h>
 #include "proc_pid.h"
 #include "../utils/iter.h"
 #include "../utils/parser.h"
@@ -25,366 +26,930 @@
 
 /*
  * /proc/<pid>/stat parser
+ *
+ * comm is printed as "(%s)" and may itself contain spaces and
+ * parentheses, so the line is split at the first '(' and the last ')'
+ * instead of on spaces. The fields after comm are single space
+ * separated and are decoded in one pass without copying, as described by
+ * pidstat_fields.
  */
 
-static inline bool parse_skip(char *token, pidstat_t *statp)
-{
-	/*
-	 * kernel stats have deprecated / obsolete fields.
-	 * we skip setting them, but have to have function
-	 * in our functables to avoid more complex logic
-	 * in iterator.
-	 */
-	return true;
-}
+enum {
+	PIDSTAT_TYPE_SKIP, /* obsolete, or hardcoded to zero by the kernel */
+	PIDSTAT_TYPE_COMM,
+	PIDSTAT_TYPE_CHAR,
+	PIDSTAT_TYPE_INT,
+	PIDSTAT_TYPE_UINT,
+	PIDSTAT_TYPE_LONG,
+	PIDSTAT_TYPE_ULONG,
+	PIDSTAT_TYPE_ULONGLONG,
+};
 
-static inline bool parse_pid(char *token, pidstat_t *statp)
-{
-	return parse_int(token, &statp->pid);
-}
+static const struct {
+	const char *name; /* NULL for fields that are not kept */
+	size_t offset;
+	int type;
+} pidstat_fields[] = {
+	{ "pid", offsetof(pidstat_t, pid), PIDSTAT_TYPE_INT },
+	{ "comm", offsetof(pidstat_t, comm), PIDSTAT_TYPE_COMM },
+	{ "state", offsetof(pidstat_t, state), PIDSTAT_TYPE_CHAR },
+	{ "ppid", offsetof(pidstat_t, ppid), PIDSTAT_TYPE_INT },
+	{ "pgrp", offsetof(pidstat_t, pgrp), PIDSTAT_TYPE_INT },
+	{ "session", offsetof(pidstat_t, session), PIDSTAT_TYPE_INT },
+	{ "tty_nr", offsetof(pidstat_t, tty_nr), PIDSTAT_TYPE_INT },
+	{ "tpgid", offsetof(pidstat_t, tpgid), PIDSTAT_TYPE_INT },
+	{ "flags", offsetof(pidstat_t, flags), PIDSTAT_TYPE_UINT },
+	{ "minflt", offsetof(pidstat_t, minflt), PIDSTAT_TYPE_ULONG },
+	{ "cminflt", offsetof(pidstat_t, cminflt), PIDSTAT_TYPE_ULONG },
+	{ "majflt", offsetof(pidstat_t, majflt), PIDSTAT_TYPE_ULONG },
+	{ "cmajflt", offsetof(pidstat_t, cmajflt), PIDSTAT_TYPE_ULONG },
+	{ "utime", offsetof(pidstat_t, utime), PIDSTAT_TYPE_ULONG },
+	{ "stime", offsetof(pidstat_t, stime), PIDSTAT_TYPE_ULONG },
+	{ "cutime", offsetof(pidstat_t, cutime), PIDSTAT_TYPE_LONG },
+	{ "cstime", offsetof(pidstat_t, cstime), PIDSTAT_TYPE_LONG },
+	{ "priority", offsetof(pidstat_t, priority), PIDSTAT_TYPE_LONG },
+	{ "nice", offsetof(pidstat_t, nice), PIDSTAT_TYPE_LONG },
+	{ "num_threads", offsetof(pidstat_t, num_threads), PIDSTAT_TYPE_LONG },
+	{ NULL, 0, PIDSTAT_TYPE_SKIP }, /* itrealvalue */
+	{ "starttime", offsetof(pidstat_t, starttime), PIDSTAT_TYPE_ULONGLONG },
+	{ "vsize", offsetof(pidstat_t, vsize), PIDSTAT_TYPE_ULONG },
+	{ "rss", offsetof(pidstat_t, rss), PIDSTAT_TYPE_LONG },
+	{ "rsslim", offsetof(pidstat_t, rsslim), PIDSTAT_TYPE_ULONG },
+	{ "startcode", offsetof(pidstat_t, startcode), PIDSTAT_TYPE_ULONG },
+	{ "endcode", offsetof(pidstat_t, endcode), PIDSTAT_TYPE_ULONG },
+	{ "startstack", offsetof(pidstat_t, startstack), PIDSTAT_TYPE_ULONG },
+	{ "kstkesp", offsetof(pidstat_t, kstkesp), PIDSTAT_TYPE_ULONG },
+	{ "kstkeip", offsetof(pidstat_t, kstkeip), PIDSTAT_TYPE_ULONG },
+	{ NULL, 0, PIDSTAT_TYPE_SKIP }, /* signal */
+	{ NULL, 0, PIDSTAT_TYPE_SKIP }, /* blocked */
+	{ NULL, 0, PIDSTAT_TYPE_SKIP }, /* sigignore */
+	{ NULL, 0, PIDSTAT_TYPE_SKIP }, /* sigcatch */
+	{ "wchan", offsetof(pidstat_t, wchan), PIDSTAT_TYPE_ULONG },
+	{ NULL, 0, PIDSTAT_TYPE_SKIP }, /* nswap */
+	{ NULL, 0, PIDSTAT_TYPE_SKIP }, /* cnswap */
+	{ "exit_signal", offsetof(pidstat_t, exit_signal), PIDSTAT_TYPE_INT },
+	{ "processor", offsetof(pidstat_t, processor), PIDSTAT_TYPE_INT },
+	{ "rt_priority", offsetof(pidstat_t, rt_priority), PIDSTAT_TYPE_UINT },
+	{ "policy", offsetof(pidstat_t, policy), PIDSTAT_TYPE_UINT },
+	{ "delayacct_blkio_ticks", offsetof(pidstat_t, delayacct_blkio_ticks), PIDSTAT_TYPE_ULONGLONG },
+	{ "guest_time", offsetof(pidstat_t, guest_time), PIDSTAT_TYPE_ULONG },
+	{ "cguest_time", offsetof(pidstat_t, cguest_time), PIDSTAT_TYPE_LONG },
+	{ "start_data", offsetof(pidstat_t, start_data), PIDSTAT_TYPE_ULONG },
+	{ "end_data", offsetof(pidstat_t, end_data), PIDSTAT_TYPE_ULONG },
+	{ "start_brk", offsetof(pidstat_t, start_brk), PIDSTAT_TYPE_ULONG },
+	{ "arg_start", offsetof(pidstat_t, arg_start), PIDSTAT_TYPE_ULONG },
+	{ "arg_end", offsetof(pidstat_t, arg_end), PIDSTAT_TYPE_ULONG },
+	{ "env_start", offsetof(pidstat_t, env_start), PIDSTAT_TYPE_ULONG },
+	{ "env_end", offsetof(pidstat_t, env_end), PIDSTAT_TYPE_ULONG },
+	{ "exit_code", offsetof(pidstat_t, exit_code), PIDSTAT_TYPE_INT },
+};
 
-static inline bool parse_comm(char *token, pidstat_t *statp)
+struct stat_state {
+	pidstat_t *stats;
+	iter_error_t err;
+};
+
+static int pidstat_last_field(pidstat_mask_t fields)
 {
-	strlcpy(statp->comm, token, sizeof(statp->comm));
-	return true;
+	/* pid and comm are always filled in */
+	if ((fields >> 2) == 0) {
+		return 1;
+	}
+	return (int)(sizeof(fields) * 8) - 1 - __builtin_clzll(fields);
 }
 
-static inline bool parse_state(char *token, pidstat_t *statp)
+/*
+ * Convert a sequence of field names, as used for PidEntry attributes, to
+ * a mask of /proc/<pid>/stat field indexes. pid and comm are always
+ * included and None selects every field. Sets a Python exception on
+ * failure.
+ */
+bool pidstat_mask_from_py(PyObject *fields, pidstat_mask_t *mask_out)
 {
-	statp->state = *token;
+	PyObject *seq = NULL;
+	Py_ssize_t i, j;
+	pidstat_mask_t mask = PIDSTAT_PID | PIDSTAT_COMM;
+
+	if (fields == Py_None) {
+		*mask_out = PIDSTAT_ALL_FIELDS;
+		return true;
+	}
+
+	if (PyUnicode_Check(fields)) {
+		PyErr_SetString(
+			PyExc_TypeError,
+			"fields must be a sequence of field names."
+		);
+		return false;
+	}
+
+	seq = PySequence_Fast(fields, "fields must be a sequence of field names.");
+	if (seq == NULL) {
+		return false;
+	}
+
+	for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+		PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+		const char *name = NULL;
+
+		name = PyUnicode_Check(item) ? PyUnicode_AsUTF8(item) : NULL;
+		if (name == NULL) {
+			if (!PyErr_Occurred()) {
+				PyErr_SetString(
+					PyExc_TypeError,
+					"fields must be a sequence of field names."
+				);
+			}
+			Py_DECREF(seq);
+			return false;
+		}
+
+		for (j = 0; j < (Py_ssize_t)ARRAY_SIZE(pidstat_fields); j++) {
+			if ((pidstat_fields[j].name != NULL) &&
+			    (strcmp(pidstat_fields[j].name, name) == 0)) {
+				break;
+			}
+		}
+
+		if (j == (Py_ssize_t)ARRAY_SIZE(pidstat_fields)) {
+			PyErr_Format(
+				PyExc_ValueError,
+				"%s: unknown stat field.",
+				name
+			);
+			Py_DECREF(seq);
+			return false;
+		}
+
+		mask |= (pidstat_mask_t)1 << j;
+	}
+
+	Py_DECREF(seq);
+	*mask_out = mask;
 	return true;
 }
 
-static inline bool parse_ppid(char *token, pidstat_t *statp)
+PyObject *pidstat_mask_to_py(pidstat_mask_t mask)
 {
-	return parse_int(token, &statp->ppid);
-}
+	PyObject *out = NULL;
+	size_t i;
 
-static inline bool parse_pgrp(char *token, pidstat_t *statp)
-{
-	return parse_int(token, &statp->pgrp);
-}
+	out = PyList_New(0);
+	if (out == NULL) {
+		return NULL;
+	}
 
-static inline bool parse_session(char *token, pidstat_t *statp)
-{
-	return parse_int(token, &statp->session);
-}
+	for (i = 0; i < ARRAY_SIZE(pidstat_fields); i++) {
+		PyObject *name = NULL;
+		int rv;
+
+		if ((pidstat_fields[i].name == NULL) ||
+		    !(mask & ((pidstat_mask_t)1 << i))) {
+			continue;
+		}
+
+		name = PyUnicode_FromString(pidstat_fields[i].name);
+		if (name == NULL) {
+			Py_DECREF(out);
+			return NULL;
+		}
+
+		rv = PyList_Append(out, name);
+		Py_DECREF(name);
+		if (rv != 0) {
+			Py_DECREF(out);
+			return NULL;
+		}
+	}
 
-static inline bool parse_tty_nr(char *token, pidstat_t *statp)
-{
-	return parse_int(token, &statp->tty_nr);
+	Py_SETREF(out, PyList_AsTuple(out));
+	return out;
 }
 
-static inline bool parse_tpgid(char *token, pidstat_t *statp)
+/* Mask bit of a stat field by name, 0 if there is no such field */
+pidstat_mask_t pidstat_field_mask(const char *name)
 {
-	return parse_int(token, &statp->tpgid);
-}
+	size_t i;
 
-static inline bool parse_flags(char *token, pidstat_t *statp)
-{
-	return parse_uint(token, &statp->flags);
-}
+	for (i = 0; i < ARRAY_SIZE(pidstat_fields); i++) {
+		if ((pidstat_fields[i].name != NULL) &&
+		    (strcmp(pidstat_fields[i].name, name) == 0)) {
+			return (pidstat_mask_t)1 << i;
+		}
+	}
 
-static inline bool parse_minflt(char *token, pidstat_t *statp)
-{
-	return parse_ulong(token, &statp->minflt);
+	return 0;
 }
 
-static inline bool parse_cminflt(char *token, pidstat_t *statp)
+/*
+ * Decode the decimal number in [p, end). Negative values are accepted
+ * for every type, as parse_ulong() does, and stored two's complement.
+ */
+static bool pidstat_decode(const char *p, const char *end, int type,
+			   void *out)
 {
-	return parse_ulong(token, &statp->cminflt);
-}
+	unsigned long long val = 0;
+	bool neg = false;
+
+	if (type == PIDSTAT_TYPE_CHAR) {
+		if (p == end) {
+			return false;
+		}
+		*(char *)out = *p;
+		return true;
+	}
 
-static inline bool parse_majflt(char *token, pidstat_t *statp)
-{
-	return parse_ulong(token, &statp->majflt);
-}
+	if ((p < end) && (*p == '-')) {
+		neg = true;
+		p++;
+	}
+	if (p == end) {
+		return false;
+	}
 
-static inline bool parse_cmajflt(char *token, pidstat_t *statp)
-{
-	return parse_ulong(token, &statp->cmajflt);
-}
+	for (; p < end; p++) {
+		uint digit = (uint)(*p - '0');
 
-static inline bool parse_utime(char *token, pidstat_t *statp)
-{
-	return parse_ulong(token, &statp->utime);
-}
+		if ((digit > 9) ||
+		    __builtin_mul_overflow(val, 10, &val) ||
+		    __builtin_add_overflow(val, digit, &val)) {
+			return false;
+		}
+	}
+	if (neg) {
+		val = -val;
+	}
 
-static inline bool parse_stime(char *token, pidstat_t *statp)
-{
-	return parse_ulong(token, &statp->stime);
-}
+	switch (type) {
+	case PIDSTAT_TYPE_INT:
+		*(int *)out = (int)val;
+		break;
+	case PIDSTAT_TYPE_UINT:
+		*(uint *)out = (uint)val;
+		break;
+	case PIDSTAT_TYPE_LONG:
+		*(long *)out = (long)val;
+		break;
+	case PIDSTAT_TYPE_ULONG:
+		*(unsigned long *)out = (unsigned long)val;
+		break;
+	case PIDSTAT_TYPE_ULONGLONG:
+		*(unsigned long long *)out = val;
+		break;
+	default:
+		break;
+	}
 
-static inline bool parse_cutime(char *token, pidstat_t *statp)
-{
-	return parse_long(token, &statp->cutime);
+	return true;
 }
 
-static inline bool parse_cstime(char *token, pidstat_t *statp)
+/*
+ * Parse /proc/<pid>/stat contents in `buf`. Does not require the GIL.
+ * Only the fields in `fields` are converted, and scanning stops after
+ * the last of them; pid and comm are always filled in. Fields missing
+ * on older kernels are left untouched, additional ones on newer kernels
+ * are ignored. comm keeps its surrounding parentheses. Returns false
+ * with errno set to EINVAL on malformed input.
+ */
+bool parse_pid_stat_buf(const char *buf, pidstat_mask_t fields,
+			pidstat_t *stats)
 {
-	return parse_long(token, &statp->cstime);
-}
+	const char *open = NULL, *close = NULL, *p = NULL, *end = NULL;
+	size_t comm_len;
+	int idx, last = pidstat_last_field(fields);
+
+	end = buf + strcspn(buf, "\n");
+	open = memchr(buf, '(', end - buf);
+	close = memrchr(buf, ')', end - buf);
+	if ((open == NULL) || (close == NULL) || (close < open) ||
+	    (open < buf + 2) || (open[-1] != ' ') ||
+	    !pidstat_decode(buf, open - 1, PIDSTAT_TYPE_INT, &stats->pid)) {
+		errno = EINVAL;
+		return false;
+	}
 
-static inline bool parse_priority(char *token, pidstat_t *statp)
-{
-	return parse_long(token, &statp->priority);
-}
+	comm_len = close - open + 1;
+	if (comm_len >= sizeof(stats->comm)) {
+		comm_len = sizeof(stats->comm) - 1;
+	}
+	memcpy(stats->comm, open, comm_len);
+	stats->comm[comm_len] = '\0';
 
-static inline bool parse_nice(char *token, pidstat_t *statp)
-{
-	return parse_long(token, &statp->nice);
-}
+	if (last >= (int)ARRAY_SIZE(pidstat_fields)) {
+		/* fields added by newer kernels are ignored */
+		last = ARRAY_SIZE(pidstat_fields) - 1;
+	}
 
-static inline bool parse_num_threads(char *token, pidstat_t *statp)
-{
-	return parse_long(token, &statp->num_threads);
-}
+	p = close + 1;
+	for (idx = 2; idx <= last; idx++) {
+		const char *tok_end = NULL;
+
+		if (p == end) {
+			/* older kernels print fewer fields */
+			break;
+		}
+		if (*p != ' ') {
+			errno = EINVAL;
+			return false;
+		}
+		p++;
+
+		tok_end = memchr(p, ' ', end - p);
+		if (tok_end == NULL) {
+			tok_end = end;
+		}
+
+		if ((pidstat_fields[idx].type != PIDSTAT_TYPE_SKIP) &&
+		    (fields & ((pidstat_mask_t)1 << idx)) &&
+		    !pidstat_decode(p, tok_end, pidstat_fields[idx].type,
+				    (char *)stats + pidstat_fields[idx].offset)) {
+			errno = EINVAL;
+			return false;
+		}
+		p = tok_end;
+	}
 
-static inline bool parse_starttime(char *token, pidstat_t *statp)
-{
-	return parse_ulonglong(token, &statp->starttime);
+	return true;
 }
 
-static inline bool parse_vsize(char *token, pidstat_t *statp)
+static int read_pidstats_line(char *line, int idx, ssize_t line_len, void *state)
 {
-	return parse_ulong(token, &statp->vsize);
-}
+	struct stat_state *st = (struct stat_state *)state;
 
-static inline bool parse_rss(char *token, pidstat_t *statp)
-{
-	return parse_long(token, &statp->rss);
-}
+	if (!parse_pid_stat_buf(line, PIDSTAT_ALL_FIELDS, st->stats)) {
+		st->err.saved_errno = errno;
+		snprintf(st->err.errstr, sizeof(st->err.errstr),
+			 "%s: failed to parse line", line);
+		return ITER_STATE_ERROR;
+	}
 
-static inline bool parse_rsslim(char *token, pidstat_t *statp)
-{
-	return parse_ulong(token, &statp->rsslim);
+	return ITER_STATE_DONE;
 }
 
-static inline bool parse_startcode(char *token, pidstat_t *statp)
+int read_pid_stats(FILE *statsfile, pidstat_t *stats)
 {
-	return parse_ulong(token, &statp->startcode);
-}
+	int rv;
+	struct stat_state state = {
+		.stats = stats
+	};
+	iter_file_cb_t cb = {
+		.fn = read_pidstats_line,
+		.state = &state,
+	};
 
-static inline bool parse_endcode(char *token, pidstat_t *statp)
-{
-	return parse_ulong(token, &statp->endcode);
-}
+	Py_BEGIN_ALLOW_THREADS
+	rewind(statsfile);
+	rv = iter_file(statsfile, &cb);
+	Py_END_ALLOW_THREADS
 
-static inline bool parse_startstack(char *token, pidstat_t *statp)
-{
-	return parse_ulong(token, &statp->startstack);
-}
+	if (rv == ITER_STATE_ERROR) {
+		/* parse errors are kept in state, read errors in cb */
+		const iter_error_t *err = *state.err.errstr ? &state.err : &cb.err;
 
-static inline bool parse_kstkesp(char *token, pidstat_t *statp)
-{
-	return parse_ulong(token, &statp->kstkesp);
+		PyErr_Format(
+			PyExc_RuntimeError,
+			"read_pid_stats(): %s: %s",
+			err->errstr,
+			strerror(err->saved_errno)
+		);
+	}
+	return rv;
 }
 
-static inline bool parse_kstkeip(char *token, pidstat_t *statp)
-{
-	return parse_ulong(token, &statp->kstkeip);
-}
+/*
+ * /proc/<pid>/status parser
+ *
+ * status has one "Key:\tvalue" line per field, about 60 in all, of
+ * which only a few are of interest. The key of each line is looked up
+ * in a perfect hash table built at compile time from the first and
+ * last character and the length of the keys in pidstatus_fields; a
+ * single compare then tells whether the line is wanted. Lines that are
+ * not wanted are skipped without converting the value, and parsing
+ * stops once every requested field has been seen.
+ */
 
-static inline bool parse_wchan(char *token, pidstat_t *statp)
-{
-	return parse_ulong(token, &statp->wchan);
-}
+enum {
+	PIDSTATUS_TYPE_IDS, /* four tab separated ids */
+	PIDSTATUS_TYPE_INT,
+	PIDSTATUS_TYPE_ULONG,
+	PIDSTATUS_TYPE_KB, /* "<n> kB" */
+	PIDSTATUS_TYPE_STR,
+};
 
-static inline bool parse_exit_signal(char *token, pidstat_t *statp)
-{
-	return parse_int(token, &statp->exit_signal);
-}
+static const struct {
+	const char *key;
+	size_t key_len;
+	const char *name;
+	size_t offset;
+	int type;
+} pidstatus_fields[] = {
+#define STATUS_FIELD(idx, key, field, type) \
+	[idx] = { key, sizeof(key) - 1, #field, offsetof(pidstatus_t, field), type }
+	STATUS_FIELD(PIDSTATUS_UID, "Uid", uid, PIDSTATUS_TYPE_IDS),
+	STATUS_FIELD(PIDSTATUS_GID, "Gid", gid, PIDSTATUS_TYPE_IDS),
+	STATUS_FIELD(PIDSTATUS_VM_PEAK, "VmPeak", vm_peak_kb, PIDSTATUS_TYPE_KB),
+	STATUS_FIELD(PIDSTATUS_VM_SIZE, "VmSize", vm_size_kb, PIDSTATUS_TYPE_KB),
+	STATUS_FIELD(PIDSTATUS_VM_HWM, "VmHWM", vm_hwm_kb, PIDSTATUS_TYPE_KB),
+	STATUS_FIELD(PIDSTATUS_VM_RSS, "VmRSS", vm_rss_kb, PIDSTATUS_TYPE_KB),
+	STATUS_FIELD(PIDSTATUS_RSS_ANON, "RssAnon", rss_anon_kb, PIDSTATUS_TYPE_KB),
+	STATUS_FIELD(PIDSTATUS_RSS_FILE, "RssFile", rss_file_kb, PIDSTATUS_TYPE_KB),
+	STATUS_FIELD(PIDSTATUS_RSS_SHMEM, "RssShmem", rss_shmem_kb, PIDSTATUS_TYPE_KB),
+	STATUS_FIELD(PIDSTATUS_VM_DATA, "VmData", vm_data_kb, PIDSTATUS_TYPE_KB),
+	STATUS_FIELD(PIDSTATUS_VM_SWAP, "VmSwap", vm_swap_kb, PIDSTATUS_TYPE_KB),
+	STATUS_FIELD(PIDSTATUS_THREADS, "Threads", threads, PIDSTATUS_TYPE_INT),
+	STATUS_FIELD(PIDSTATUS_CPUS_ALLOWED, "Cpus_allowed", cpus_allowed,
+		     PIDSTATUS_TYPE_STR),
+	STATUS_FIELD(PIDSTATUS_VOLUNTARY_CTXT_SWITCHES,
+		     "voluntary_ctxt_switches", voluntary_ctxt_switches,
+		     PIDSTATUS_TYPE_ULONG),
+	STATUS_FIELD(PIDSTATUS_NONVOLUNTARY_CTXT_SWITCHES,
+		     "nonvoluntary_ctxt_switches", nonvoluntary_ctxt_switches,
+		     PIDSTATUS_TYPE_ULONG),
+#undef STATUS_FIELD
+};
 
-static inline bool parse_processor(char *token, pidstat_t *statp)
-{
-	return parse_int(token, &statp->processor);
-}
+/*
+ * Collision free for the keys above; the compiler warns about
+ * duplicate initializers (-Woverride-init) if a new key collides.
+ */
+#define STATUS_HASH_SIZE 32
+#define STATUS_HASH(first, last, len) \
+	((((uint)(first) * 12) + ((uint)(last) * 3) + (uint)(len)) & \
+	 (STATUS_HASH_SIZE - 1))
+
+/* field index + 1, 0 for no key */
+static const uint8_t pidstatus_slots[STATUS_HASH_SIZE] = {
+	[STATUS_HASH('U', 'd', 3)] = PIDSTATUS_UID + 1,
+	[STATUS_HASH('G', 'd', 3)] = PIDSTATUS_GID + 1,
+	[STATUS_HASH('V', 'k', 6)] = PIDSTATUS_VM_PEAK + 1,
+	[STATUS_HASH('V', 'e', 6)] = PIDSTATUS_VM_SIZE + 1,
+	[STATUS_HASH('V', 'M', 5)] = PIDSTATUS_VM_HWM + 1,
+	[STATUS_HASH('V', 'S', 5)] = PIDSTATUS_VM_RSS + 1,
+	[STATUS_HASH('R', 'n', 7)] = PIDSTATUS_RSS_ANON + 1,
+	[STATUS_HASH('R', 'e', 7)] = PIDSTATUS_RSS_FILE + 1,
+	[STATUS_HASH('R', 'm', 8)] = PIDSTATUS_RSS_SHMEM + 1,
+	[STATUS_HASH('V', 'a', 6)] = PIDSTATUS_VM_DATA + 1,
+	[STATUS_HASH('V', 'p', 6)] = PIDSTATUS_VM_SWAP + 1,
+	[STATUS_HASH('T', 's', 7)] = PIDSTATUS_THREADS + 1,
+	[STATUS_HASH('C', 'd', 12)] = PIDSTATUS_CPUS_ALLOWED + 1,
+	[STATUS_HASH('v', 's', 23)] = PIDSTATUS_VOLUNTARY_CTXT_SWITCHES + 1,
+	[STATUS_HASH('n', 's', 26)] = PIDSTATUS_NONVOLUNTARY_CTXT_SWITCHES + 1,
+};
 
-static inline bool parse_rt_priority(char *token, pidstat_t *statp)
+static int pidstatus_find(const char *key, size_t len)
 {
-	return parse_uint(token, &statp->rt_priority);
+	int idx;
+
+	if (len == 0) {
+		return -1;
+	}
+
+	idx = pidstatus_slots[STATUS_HASH(key[0], key[len - 1], len)] - 1;
+	if ((idx == -1) || (pidstatus_fields[idx].key_len != len) ||
+	    (memcmp(pidstatus_fields[idx].key, key, len) != 0)) {
+		return -1;
+	}
+
+	return idx;
 }
 
-static inline bool parse_policy(char *token, pidstat_t *statp)
+static inline const char *skip_blanks(const char *p, const char *end)
 {
-	return parse_uint(token, &statp->policy);
+	while ((p < end) && ((*p == ' ') || (*p == '\t'))) {
+		p++;
+	}
+	return p;
 }
 
-static inline bool parse_delayacct_blkio_ticks(char *token, pidstat_t *statp)
+static inline const char *find_blank(const char *p, const char *end)
 {
-	return parse_ulonglong(token, &statp->delayacct_blkio_ticks);
+	while ((p < end) && (*p != ' ') && (*p != '\t')) {
+		p++;
+	}
+	return p;
 }
 
-static inline bool parse_guest_time(char *token, pidstat_t *statp)
+static bool pidstatus_decode(const char *p, const char *end, int type,
+			     void *out)
 {
-	return parse_ulong(token, &statp->guest_time);
+	const char *tok_end = NULL;
+	size_t len;
+	int i;
+
+	p = skip_blanks(p, end);
+
+	switch (type) {
+	case PIDSTATUS_TYPE_IDS:
+		for (i = 0; i < 4; i++) {
+			tok_end = find_blank(p, end);
+			if (!pidstat_decode(p, tok_end, PIDSTAT_TYPE_UINT,
+					    (uint *)out + i)) {
+				return false;
+			}
+			p = skip_blanks(tok_end, end);
+		}
+		return true;
+	case PIDSTATUS_TYPE_INT:
+		return pidstat_decode(p, find_blank(p, end), PIDSTAT_TYPE_INT,
+				      out);
+	case PIDSTATUS_TYPE_ULONG:
+	case PIDSTATUS_TYPE_KB:
+		return pidstat_decode(p, find_blank(p, end), PIDSTAT_TYPE_ULONG,
+				      out);
+	case PIDSTATUS_TYPE_STR:
+		/* only cpus_allowed, see pidstatus_t */
+		len = find_blank(p, end) - p;
+		if (len >= sizeof(((pidstatus_t *)NULL)->cpus_allowed)) {
+			len = sizeof(((pidstatus_t *)NULL)->cpus_allowed) - 1;
+		}
+		memcpy(out, p, len);
+		((char *)out)[len] = '\0';
+		return true;
+	default:
+		break;
+	}
+
+	return false;
 }
 
-static inline bool parse_cguest_time(char *token, pidstat_t *statp)
+/*
+ * Parse /proc/<pid>/status contents in `buf`. Does not require the
+ * GIL. Fields not in `fields`, or not reported by the kernel, are left
+ * untouched. Returns false with errno set to EINVAL on malformed input.
+ */
+bool parse_pid_status_buf(const char *buf, pidstatus_mask_t fields,
+			  pidstatus_t *status)
 {
-	return parse_long(token, &statp->cguest_time);
+	const char *p = buf, *end = buf + strlen(buf);
+	int todo = __builtin_popcount(fields & PIDSTATUS_ALL_FIELDS);
+
+	while ((p < end) && (todo > 0)) {
+		const char *eol = NULL, *colon = NULL;
+		int idx;
+
+		eol = memchr(p, '\n', end - p);
+		if (eol == NULL) {
+			eol = end;
+		}
+
+		colon = memchr(p, ':', eol - p);
+		if (colon != NULL) {
+			idx = pidstatus_find(p, colon - p);
+			if ((idx != -1) && (fields & (1U << idx))) {
+				if (!pidstatus_decode(colon + 1, eol,
+						      pidstatus_fields[idx].type,
+						      (char *)status +
+						      pidstatus_fields[idx].offset)) {
+					errno = EINVAL;
+					return false;
+				}
+				todo--;
+			}
+		}
+
+		p = eol + 1;
+	}
+
+	return true;
 }
 
-static inline bool parse_start_data(char *token, pidstat_t *statp)
+/*
+ * Convert a sequence of status field names to a mask. None and False
+ * select nothing, True selects every field. Sets a Python exception on
+ * failure.
+ */
+bool pidstatus_mask_from_py(PyObject *fields, pidstatus_mask_t *mask_out)
 {
-	return parse_ulong(token, &statp->start_data);
+	PyObject *seq = NULL;
+	Py_ssize_t i;
+	pidstatus_mask_t mask = 0;
+	int j;
+
+	if ((fields == Py_None) || (fields == Py_False)) {
+		*mask_out = 0;
+		return true;
+	}
+
+	if (fields == Py_True) {
+		*mask_out = PIDSTATUS_ALL_FIELDS;
+		return true;
+	}
+
+	if (PyUnicode_Check(fields)) {
+		PyErr_SetString(
+			PyExc_TypeError,
+			"status fields must be a sequence of field names."
+		);
+		return false;
+	}
+
+	seq = PySequence_Fast(fields,
+			      "status fields must be a sequence of field names.");
+	if (seq == NULL) {
+		return false;
+	}
+
+	for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+		PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+		const char *name = NULL;
+
+		name = PyUnicode_Check(item) ? PyUnicode_AsUTF8(item) : NULL;
+		if (name == NULL) {
+			if (!PyErr_Occurred()) {
+				PyErr_SetString(
+					PyExc_TypeError,
+					"status fields must be a sequence of field names."
+				);
+			}
+			Py_DECREF(seq);
+			return false;
+		}
+
+		for (j = 0; j < PIDSTATUS_NFIELDS; j++) {
+			if (strcmp(pidstatus_fields[j].name, name) == 0) {
+				break;
+			}
+		}
+
+		if (j == PIDSTATUS_NFIELDS) {
+			PyErr_Format(
+				PyExc_ValueError,
+				"%s: unknown status field.",
+				name
+			);
+			Py_DECREF(seq);
+			return false;
+		}
+
+		mask |= (pidstatus_mask_t)1 << j;
+	}
+
+	Py_DECREF(seq);
+	*mask_out = mask;
+	return true;
 }
 
-static inline bool parse_end_data(char *token, pidstat_t *statp)
+static PyObject *pidstatus_value_to_py(const pidstatus_t *status, int idx)
 {
-	return parse_ulong(token, &statp->end_data);
+	const void *val = (const char *)status + pidstatus_fields[idx].offset;
+	const uint *ids = val;
+
+	switch (pidstatus_fields[idx].type) {
+	case PIDSTATUS_TYPE_IDS:
+		return Py_BuildValue("(IIII)", ids[0], ids[1], ids[2], ids[3]);
+	case PIDSTATUS_TYPE_INT:
+		return PyLong_FromLong(*(const int *)val);
+	case PIDSTATUS_TYPE_ULONG:
+	case PIDSTATUS_TYPE_KB:
+		return PyLong_FromUnsignedLong(*(const unsigned long *)val);
+	case PIDSTATUS_TYPE_STR:
+		return PyUnicode_FromString(val);
+	default:
+		break;
+	}
+
+	Py_RETURN_NONE;
 }
 
-static inline bool parse_start_brk(char *token, pidstat_t *statp)
+/* dict of the fields in `fields`, keyed by field name */
+PyObject *pidstatus_to_py_dict(const pidstatus_t *status,
+			       pidstatus_mask_t fields)
 {
-	return parse_ulong(token, &statp->start_brk);
+	PyObject *out = NULL;
+	int i;
+
+	out = PyDict_New();
+	if (out == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < PIDSTATUS_NFIELDS; i++) {
+		PyObject *val = NULL;
+		int rv;
+
+		if (!(fields & (1U << i))) {
+			continue;
+		}
+
+		val = pidstatus_value_to_py(status, i);
+		if (val == NULL) {
+			Py_DECREF(out);
+			return NULL;
+		}
+
+		rv = PyDict_SetItemString(out, pidstatus_fields[i].name, val);
+		Py_DECREF(val);
+		if (rv != 0) {
+			Py_DECREF(out);
+			return NULL;
+		}
+	}
+
+	return out;
 }
 
-static inline bool parse_arg_start(char *token, pidstat_t *statp)
+/*
+ * Parsers for files of "Key: value [kB]" lines (io, smaps_rollup). Each
+ * file has a table of the keys to extract into unsigned long long
+ * members of its struct; lines with other keys are ignored.
+ */
+
+typedef struct {
+	const char *key;
+	size_t key_len;
+	const char *name;
+	size_t offset;
+} pid_kv_field_t;
+
+#define KV_FIELD(key, type, field) \
+	{ key, sizeof(key) - 1, #field, offsetof(type, field) }
+
+static const pid_kv_field_t pidio_fields[] = {
+	KV_FIELD("rchar", pidio_t, rchar),
+	KV_FIELD("wchar", pidio_t, wchar),
+	KV_FIELD("syscr", pidio_t, syscr),
+	KV_FIELD("syscw", pidio_t, syscw),
+	KV_FIELD("read_bytes", pidio_t, read_bytes),
+	KV_FIELD("write_bytes", pidio_t, write_bytes),
+	KV_FIELD("cancelled_write_bytes", pidio_t, cancelled_write_bytes),
+};
+
+static const pid_kv_field_t pidsmaps_fields[] = {
+	KV_FIELD("Rss", pidsmaps_t, rss_kb),
+	KV_FIELD("Pss", pidsmaps_t, pss_kb),
+	KV_FIELD("Pss_Anon", pidsmaps_t, pss_anon_kb),
+	KV_FIELD("Pss_File", pidsmaps_t, pss_file_kb),
+	KV_FIELD("Pss_Shmem", pidsmaps_t, pss_shmem_kb),
+	KV_FIELD("Shared_Clean", pidsmaps_t, shared_clean_kb),
+	KV_FIELD("Shared_Dirty", pidsmaps_t, shared_dirty_kb),
+	KV_FIELD("Private_Clean", pidsmaps_t, private_clean_kb),
+	KV_FIELD("Private_Dirty", pidsmaps_t, private_dirty_kb),
+	KV_FIELD("Swap", pidsmaps_t, swap_kb),
+	KV_FIELD("SwapPss", pidsmaps_t, swap_pss_kb),
+};
+
+#undef KV_FIELD
+
+/*
+ * Does not require the GIL. Returns false with errno set to EINVAL on
+ * malformed input.
+ */
+static bool parse_pid_kv_buf(const char *buf,
+			     const pid_kv_field_t *fields,
+			     size_t nfields,
+			     void *out)
 {
-	return parse_ulong(token, &statp->arg_start);
+	const char *p = buf, *end = buf + strlen(buf);
+	size_t i;
+
+	while (p < end) {
+		const char *eol = NULL, *colon = NULL, *val = NULL;
+
+		eol = memchr(p, '\n', end - p);
+		if (eol == NULL) {
+			eol = end;
+		}
+
+		colon = memchr(p, ':', eol - p);
+		for (i = 0; (colon != NULL) && (i < nfields); i++) {
+			if ((fields[i].key_len != (size_t)(colon - p)) ||
+			    (memcmp(fields[i].key, p, colon - p) != 0)) {
+				continue;
+			}
+
+			/* values in smaps_rollup are followed by " kB" */
+			val = skip_blanks(colon + 1, eol);
+			if (!pidstat_decode(val, find_blank(val, eol),
+					    PIDSTAT_TYPE_ULONGLONG,
+					    (char *)out + fields[i].offset)) {
+				errno = EINVAL;
+				return false;
+			}
+			break;
+		}
+
+		p = eol + 1;
+	}
+
+	return true;
 }
 
-static inline bool parse_arg_end(char *token, pidstat_t *statp)
+static PyObject *pid_kv_to_py_dict(const void *in,
+				   const pid_kv_field_t *fields,
+				   size_t nfields)
 {
-	return parse_ulong(token, &statp->arg_end);
+	PyObject *out = NULL;
+	size_t i;
+
+	out = PyDict_New();
+	if (out == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < nfields; i++) {
+		PyObject *val = NULL;
+		int rv;
+
+		val = PyLong_FromUnsignedLongLong(
+			*(const unsigned long long *)((const char *)in +
+						      fields[i].offset));
+		if (val == NULL) {
+			Py_DECREF(out);
+			return NULL;
+		}
+
+		rv = PyDict_SetItemString(out, fields[i].name, val);
+		Py_DECREF(val);
+		if (rv != 0) {
+			Py_DECREF(out);
+			return NULL;
+		}
+	}
+
+	return out;
 }
 
-static inline bool parse_env_start(char *token, pidstat_t *statp)
+bool parse_pid_io_buf(const char *buf, pidio_t *io)
 {
-	return parse_ulong(token, &statp->env_start);
+	return parse_pid_kv_buf(buf, pidio_fields, ARRAY_SIZE(pidio_fields),
+				io);
 }
 
-static inline bool parse_env_end(char *token, pidstat_t *statp)
+PyObject *pidio_to_py_dict(const pidio_t *io)
 {
-	return parse_ulong(token, &statp->env_end);
+	return pid_kv_to_py_dict(io, pidio_fields, ARRAY_SIZE(pidio_fields));
 }
 
-static inline bool parse_exit_code(char *token, pidstat_t *statp)
+bool parse_pid_smaps_rollup_buf(const char *buf, pidsmaps_t *smaps)
 {
-	if (strlen(token) != 2) {
-		abort();
-	}
-	token[1] = '\0';
-	return parse_int(token, &statp->exit_code);
+	return parse_pid_kv_buf(buf, pidsmaps_fields,
+				ARRAY_SIZE(pidsmaps_fields), smaps);
 }
 
-static const struct {
-	bool (*fn)(char *token, pidstat_t *statp);
-} pidstat_functable[] = {
-	{ parse_pid },
-	{ parse_comm },
-	{ parse_state },
-	{ parse_ppid },
-	{ parse_pgrp },
-	{ parse_session },
-	{ parse_tty_nr },
-	{ parse_tpgid },
-	{ parse_flags },
-	{ parse_minflt },
-	{ parse_cminflt },
-	{ parse_majflt },
-	{ parse_cmajflt },
-	{ parse_utime },
-	{ parse_stime },
-	{ parse_cutime },
-	{ parse_cstime },
-	{ parse_priority },
-	{ parse_nice },
-	{ parse_num_threads },
-	{ parse_skip }, /* itrealvalue */
-	{ parse_starttime },
-	{ parse_vsize },
-	{ parse_rss },
-	{ parse_rsslim },
-	{ parse_startcode },
-	{ parse_endcode },
-	{ parse_startstack },
-	{ parse_kstkesp },
-	{ parse_kstkeip },
-	{ parse_skip }, /* signal */
-	{ parse_skip }, /* blocked */
-	{ parse_skip }, /* sigignore */
-	{ parse_skip }, /* sigcatch */
-	{ parse_wchan },
-	{ parse_skip }, /* nswap */
-	{ parse_skip }, /* cnswap */
-	{ parse_exit_signal },
-	{ parse_processor },
-	{ parse_rt_priority },
-	{ parse_policy },
-	{ parse_delayacct_blkio_ticks },
-	{ parse_guest_time },
-	{ parse_cguest_time },
-	{ parse_start_data },
-	{ parse_end_data },
-	{ parse_start_brk },
-	{ parse_arg_start },
-	{ parse_arg_end },
-	{ parse_env_start },
-	{ parse_env_end },
-	{ parse_exit_code },
-};
-
-struct stat_state {
-	pidstat_t *stats;
-	iter_error_t err;
-};
-
-static int parse_pidstats_line(char *token, int idx, void *state)
+PyObject *pidsmaps_to_py_dict(const pidsmaps_t *smaps)
 {
-	struct stat_state *st = (struct stat_state *)state;
+	PyObject *out = NULL, *uss = NULL;
+	int rv;
 
-        if (idx > (int)ARRAY_SIZE(pidstat_functable)) {
-		abort();
-        }
+	out = pid_kv_to_py_dict(smaps, pidsmaps_fields,
+				ARRAY_SIZE(pidsmaps_fields));
+	if (out == NULL) {
+		return NULL;
+	}
 
-        if (!pidstat_functable[idx].fn(token, st->stats)) {
-		st->err.saved_errno = errno;
-		snprintf(st->err.errstr, sizeof(st->err.errstr),
-			 "%s: failed to parse value at idx %d in line",
-			 token, idx);
-                return ITER_STATE_ERROR;
-        }
+	/* memory that would be freed if the process exited */
+	uss = PyLong_FromUnsignedLongLong(smaps->private_clean_kb +
+					  smaps->private_dirty_kb);
+	if (uss == NULL) {
+		Py_DECREF(out);
+		return NULL;
+	}
 
-        return ITER_STATE_CONTINUE;
+	rv = PyDict_SetItemString(out, "uss_kb", uss);
+	Py_DECREF(uss);
+	if (rv != 0) {
+		Py_DECREF(out);
+		return NULL;
+	}
+
+	return out;
 }
 
-static int read_pidstats_line(char *line, int idx, ssize_t line_len, void *state)
+/*
+ * /proc/<pid>/task/<tid>/schedstat parser, three numbers on one line
+ */
+bool parse_pid_schedstat_buf(const char *buf, pidschedstat_t *schedstat)
 {
-	iter_line_cb_t cb = {
-		.fn = parse_pidstats_line,
-		.state = state,
+	const char *p = buf, *end = strchrnul(buf, '\n'), *tok_end = NULL;
+	unsigned long long *vals[] = {
+		&schedstat->run_ns,
+		&schedstat->wait_ns,
+		&schedstat->timeslices,
 	};
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(vals); i++) {
+		p = skip_blanks(p, end);
+		tok_end = find_blank(p, end);
+		if (!pidstat_decode(p, tok_end, PIDSTAT_TYPE_ULONGLONG,
+				    vals[i])) {
+			errno = EINVAL;
+			return false;
+		}
+		p = tok_end;
+	}
 
-	return iter_line(line, " ", &cb);
+	return true;
 }
 
-int read_pid_stats(FILE *statsfile, pidstat_t *stats)
+PyObject *pidschedstat_to_py_dict(const pidschedstat_t *schedstat)
 {
-	int rv;
-	struct stat_state state = {
-		.stats = stats
-	};
-	iter_file_cb_t cb = {
-		.fn = read_pidstats_line,
-		.state = &state,
-	};
-
-	Py_BEGIN_ALLOW_THREADS
-	rewind(statsfile);
-	rv = iter_file(statsfile, &cb);
-	Py_END_ALLOW_THREADS
-
-	if (rv == ITER_STATE_ERROR) {
-		PyErr_Format(
-			PyExc_RuntimeError,
-			"read_pid_stats(): %s: %s",
-			cb.err.errstr,
-			strerror(cb.err.saved_errno)
-		);
-	}
-	return rv;
+	return Py_BuildValue(
+		"{sKsKsK}",
+		"run_ns", schedstat->run_ns,
+		"wait_ns", schedstat->wait_ns,
+		"timeslices", schedstat->timeslices
+	);
 }
 
 /*
@@ -437,9 +1002,9 @@ static int parse_pidstatm_line(char *token, int idx, void *state)
 {
 	struct statm_state *st = (struct statm_state *)state;
 
-        if (idx > (int)ARRAY_SIZE(pidstatm_functable)) {
-		abort();
-        }
+	if (idx >= (int)ARRAY_SIZE(pidstatm_functable)) {
+		return ITER_STATE_DONE;
+	}
 
         if (!pidstatm_functable[idx].fn(token, st->stats)) {
 		st->err.saved_errno = errno;
@@ -488,3 +1053,32 @@ int read_pid_statm(FILE *statsfile, pidstatm_t *stats)
 	}
 	return rv;
 }
+
+/*
+ * Parse /proc/<pid>/statm contents read into `buf`, which is modified.
+ * Does not require the GIL.
+ */
+bool parse_pid_statm_buf(char *buf, pidstatm_t *stats)
+{
+	int rv;
+	struct statm_state state = {
+		.stats = stats
+	};
+	iter_line_cb_t cb = {
+		.fn = parse_pidstatm_line,
+		.state = &state,
+	};
+
+	if (*buf == '\0') {
+		errno = EINVAL;
+		return false;
+	}
+
+	rv = iter_line(buf, " \n", &cb);
+	if (rv == ITER_STATE_ERROR) {
+		errno = state.err.saved_errno ? state.err.saved_errno : EINVAL;
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,584 @@
+/*
+ * Python language bindings for procfs-diskstats
+ *
+ * Copyright (C) Andrew Walker, 2022
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Python.h>
+#include <unistd.h>
+#include "proc_pid.h"
+#include "../utils/workpool.h"
+
+/*
+ * Per-process rates between two snapshots of the process table. The
+ * previous snapshot is kept in C and processes are matched by
+ * (pid, starttime), so a reused pid is treated as a new process rather
+ * than producing a bogus delta. Processes that exited are dropped
+ * simply by replacing the previous snapshot with the current one.
+ */
+
+static inline double timespec_diff_ms(const struct timespec *start,
+				      const struct timespec *end)
+{
+	return ((double)(end->tv_sec - start->tv_sec) * 1000.0) +
+	       ((double)(end->tv_nsec - start->tv_nsec) / 1000000.0);
+}
+
+static inline bool ts_before(const struct timespec *a,
+			     const struct timespec *b)
+{
+	return (a->tv_sec < b->tv_sec) ||
+	       ((a->tv_sec == b->tv_sec) && (a->tv_nsec < b->tv_nsec));
+}
+
+/*
+ * Compute rates for the processes of `cur` that are also in `prev`.
+ * Does not require the GIL. Returns the number of entries written to
+ * `rates_out`, which must have room for cur->cnt entries.
+ */
+static int compute_pid_rates(const py_proc_pid_snapshot_t *prev,
+			     const py_proc_pid_snapshot_t *cur,
+			     pidrate_t *rates_out)
+{
+	double interval_ms = timespec_diff_ms(&prev->ts, &cur->ts);
+	double secs = interval_ms / 1000.0;
+	double ticks = (double)sysconf(_SC_CLK_TCK);
+	long page_size = sysconf(_SC_PAGESIZE);
+	int i, cnt = 0;
+
+	if (interval_ms <= 0) {
+		return 0;
+	}
+
+	for (i = 0; i < cur->cnt; i++) {
+		const pidsample_t *c = &cur->samples[i];
+		const pidsample_t *p = NULL;
+		pidrate_t *r = &rates_out[cnt];
+		double utime, stime;
+
+		p = proc_pid_snapshot_find(prev, c->pid, c->stat.starttime);
+		if (p == NULL) {
+			/* started during the interval */
+			continue;
+		}
+
+		utime = (double)(c->stat.utime - p->stat.utime) / ticks;
+		stime = (double)(c->stat.stime - p->stat.stime) / ticks;
+
+		r->pid = c->pid;
+		r->tgid = c->tgid;
+		strlcpy(r->comm, c->stat.comm, sizeof(r->comm));
+		r->interval_ms = interval_ms;
+		r->user_percent = utime * 100.0 / secs;
+		r->system_percent = stime * 100.0 / secs;
+		r->cpu_percent = r->user_percent + r->system_percent;
+		r->minflt_per_sec = (double)(c->stat.minflt - p->stat.minflt) / secs;
+		r->majflt_per_sec = (double)(c->stat.majflt - p->stat.majflt) / secs;
+		r->rss_bytes = (long)c->statm.resident * page_size;
+		r->rss_delta_bytes = ((long)c->statm.resident -
+				      (long)p->statm.resident) * page_size;
+
+		r->io_valid = c->io_valid && p->io_valid;
+		if (r->io_valid) {
+			r->rchar_per_sec = (double)(c->io.rchar - p->io.rchar) / secs;
+			r->wchar_per_sec = (double)(c->io.wchar - p->io.wchar) / secs;
+			r->read_bytes_per_sec =
+				(double)(c->io.read_bytes - p->io.read_bytes) / secs;
+			r->write_bytes_per_sec =
+				(double)(c->io.write_bytes - p->io.write_bytes) / secs;
+		}
+
+		r->schedstat_valid = c->schedstat_valid && p->schedstat_valid;
+		if (r->schedstat_valid) {
+			/* nanoseconds per second, as percent: / 1e7 */
+			r->run_percent = (double)(c->schedstat.run_ns -
+						  p->schedstat.run_ns) / secs / 1e7;
+			r->wait_percent = (double)(c->schedstat.wait_ns -
+						   p->schedstat.wait_ns) / secs / 1e7;
+			r->timeslices_per_sec = (double)(c->schedstat.timeslices -
+							 p->schedstat.timeslices) / secs;
+		}
+		cnt++;
+	}
+
+	return cnt;
+}
+
+static inline double pid_io_rate(const pidrate_t *r)
+{
+	return r->read_bytes_per_sec + r->write_bytes_per_sec;
+}
+
+static void io_heap_sift_down(const pidrate_t *rates, int *heap,
+			      int cnt, int i)
+{
+	for (;;) {
+		int smallest = i, l = (2 * i) + 1, r = l + 1, tmp;
+
+		if ((l < cnt) &&
+		    (pid_io_rate(&rates[heap[l]]) <
+		     pid_io_rate(&rates[heap[smallest]]))) {
+			smallest = l;
+		}
+		if ((r < cnt) &&
+		    (pid_io_rate(&rates[heap[r]]) <
+		     pid_io_rate(&rates[heap[smallest]]))) {
+			smallest = r;
+		}
+		if (smallest == i) {
+			return;
+		}
+
+		tmp = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = tmp;
+		i = smallest;
+	}
+}
+
+/*
+ * Select the `k` entries of `rates` with the highest storage read plus
+ * write rate, keeping a min-heap of k indices so that the whole rate
+ * array is never sorted. Entries without io counters are skipped.
+ * Writes the selected indices to `top_out` in descending order of rate
+ * and returns their number. Does not require the GIL.
+ */
+static int select_top_io(const pidrate_t *rates, int cnt, int k, int *top_out)
+{
+	int i, n = 0;
+
+	for (i = 0; i < cnt; i++) {
+		if (!rates[i].io_valid) {
+			continue;
+		}
+
+		if (n < k) {
+			int j = n++;
+
+			/* sift up */
+			top_out[j] = i;
+			while (j > 0) {
+				int parent = (j - 1) / 2, tmp;
+
+				if (pid_io_rate(&rates[top_out[parent]]) <=
+				    pid_io_rate(&rates[top_out[j]])) {
+					break;
+				}
+				tmp = top_out[parent];
+				top_out[parent] = top_out[j];
+				top_out[j] = tmp;
+				j = parent;
+			}
+		} else if ((k > 0) &&
+			   (pid_io_rate(&rates[i]) > pid_io_rate(&rates[top_out[0]]))) {
+			top_out[0] = i;
+			io_heap_sift_down(rates, top_out, n, 0);
+		}
+	}
+
+	/* heap sort in place, leaving the largest rate first */
+	for (i = n - 1; i > 0; i--) {
+		int tmp = top_out[0];
+
+		top_out[0] = top_out[i];
+		top_out[i] = tmp;
+		io_heap_sift_down(rates, top_out, i, 0);
+	}
+
+	return n;
+}
+
+static bool dict_set_double(PyObject *dict, const char *key, double val)
+{
+	PyObject *pyval = NULL;
+	int rv;
+
+	pyval = PyFloat_FromDouble(val);
+	if (pyval == NULL) {
+		return false;
+	}
+
+	rv = PyDict_SetItemString(dict, key, pyval);
+	Py_DECREF(pyval);
+	return rv == 0;
+}
+
+static PyObject *pid_rate_to_py_dict(const pidrate_t *r,
+				     const py_proc_pid_sampler_t *sampler)
+{
+	PyObject *out = NULL;
+
+	out = Py_BuildValue(
+		"{sisssdsdsdsdsdsdslsl}",
+		"pid", r->pid,
+		"comm", r->comm,
+		"interval_ms", r->interval_ms,
+		"cpu_percent", r->cpu_percent,
+		"user_percent", r->user_percent,
+		"system_percent", r->system_percent,
+		"minflt_per_sec", r->minflt_per_sec,
+		"majflt_per_sec", r->majflt_per_sec,
+		"rss_bytes", r->rss_bytes,
+		"rss_delta_bytes", r->rss_delta_bytes
+	);
+	if (out == NULL) {
+		return NULL;
+	}
+
+	if (sampler->io &&
+	    ((PyDict_SetItemString(out, "io_valid",
+				   r->io_valid ? Py_True : Py_False) != 0) ||
+	     !dict_set_double(out, "rchar_per_sec", r->rchar_per_sec) ||
+	     !dict_set_double(out, "wchar_per_sec", r->wchar_per_sec) ||
+	     !dict_set_double(out, "read_bytes_per_sec",
+			      r->read_bytes_per_sec) ||
+	     !dict_set_double(out, "write_bytes_per_sec",
+			      r->write_bytes_per_sec))) {
+		Py_DECREF(out);
+		return NULL;
+	}
+
+	if (sampler->tasks) {
+		PyObject *tgid = NULL;
+		int rv;
+
+		tgid = PyLong_FromLong(r->tgid);
+		if (tgid == NULL) {
+			Py_DECREF(out);
+			return NULL;
+		}
+
+		rv = PyDict_SetItemString(out, "tgid", tgid);
+		Py_DECREF(tgid);
+		if ((rv != 0) ||
+		    (PyDict_SetItemString(out, "schedstat_valid",
+					  r->schedstat_valid ? Py_True : Py_False) != 0) ||
+		    !dict_set_double(out, "run_percent", r->run_percent) ||
+		    !dict_set_double(out, "wait_percent", r->wait_percent) ||
+		    !dict_set_double(out, "timeslices_per_sec",
+				     r->timeslices_per_sec)) {
+			Py_DECREF(out);
+			return NULL;
+		}
+	}
+
+	return out;
+}
+
+/* `order` selects and orders entries of `rates`; NULL means all of them */
+static PyObject *pid_rates_to_py_list(const pidrate_t *rates,
+				      const int *order,
+				      int cnt,
+				      const py_proc_pid_sampler_t *sampler)
+{
+	PyObject *out = NULL;
+	int i;
+
+	out = PyList_New(cnt);
+	if (out == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		PyObject *entry = NULL;
+
+		entry = pid_rate_to_py_dict(&rates[order ? order[i] : i],
+					    sampler);
+		if (entry == NULL) {
+			Py_DECREF(out);
+			return NULL;
+		}
+
+		PyList_SET_ITEM(out, i, entry);
+	}
+
+	return out;
+}
+
+static PyObject *py_sampler_new(PyTypeObject *obj,
+				    PyObject *args_unused,
+				    PyObject *kwargs_unused)
+{
+	py_proc_pid_sampler_t *self = NULL;
+
+	self = (py_proc_pid_sampler_t *)obj->tp_alloc(obj, 0);
+	if (self == NULL) {
+		return NULL;
+	}
+	return (PyObject *)self;
+}
+
+static int py_sampler_init(PyObject *obj,
+			       PyObject *args,
+			       PyObject *kwargs)
+{
+	py_proc_pid_sampler_t *self = (py_proc_pid_sampler_t *)obj;
+	PyObject *pyfilter = Py_None;
+	int workers = 1;
+	bool io = false, tasks = false;
+	const char *kwnames [] = {
+		"workers",
+		"io",
+		"tasks",
+		"filter",
+		NULL
+	};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+					 "|ibbO",
+					 discard_const_p(char *, kwnames),
+					 &workers,
+					 &io,
+					 &tasks,
+					 &pyfilter)) {
+		return -1;
+	}
+
+	/*
+	 * sample() uses the filter with the GIL released, so it can not be
+	 * replaced once set up.
+	 */
+	if (self->workers != 0) {
+		PyErr_SetString(
+			PyExc_RuntimeError,
+			"Sampler is already initialized."
+		);
+		return -1;
+	}
+
+	if ((workers < 1) || (workers > WORKPOOL_MAX_WORKERS)) {
+		PyErr_Format(
+			PyExc_ValueError,
+			"workers must be between 1 and %d.",
+			WORKPOOL_MAX_WORKERS
+		);
+		return -1;
+	}
+
+	if (pyfilter != Py_None) {
+		self->filter = pidfilter_new(pyfilter);
+		if (self->filter == NULL) {
+			return -1;
+		}
+	}
+
+	self->workers = workers;
+	self->io = io;
+	self->tasks = tasks;
+	return 0;
+}
+
+void py_sampler_dealloc(py_proc_pid_sampler_t *self)
+{
+	Py_CLEAR(self->prev);
+	pidfilter_free(self->filter);
+	self->filter = NULL;
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+PyDoc_STRVAR(py_sampler_sample__doc__,
+"sample(top_io=None)\n"
+"--\n\n"
+"Take a snapshot of the process table and return per-process rates\n"
+"for the interval since the previous call to sample(). The first call\n"
+"only primes the previous sample and returns an empty list. Processes\n"
+"are matched by pid and start time, so processes that started during\n"
+"the interval, including ones that reused the pid of an exited\n"
+"process, are omitted until the next call.\n\n"
+"Parameters\n"
+"----------\n"
+"top_io: int, only return this many processes with the highest\n"
+"    read_bytes_per_sec + write_bytes_per_sec, highest first. The\n"
+"    selection is done in C. Requires a sampler created with io=True;\n"
+"    processes whose io counters could not be read are left out.\n"
+"    None returns every process.\n\n"
+"Returns\n"
+"-------\n"
+"list of dicts with the keys pid, comm, interval_ms, cpu_percent,\n"
+"user_percent, system_percent (percent of one CPU), minflt_per_sec,\n"
+"majflt_per_sec, rss_bytes and rss_delta_bytes, ordered by pid. With\n"
+"io=True also io_valid, rchar_per_sec, wchar_per_sec,\n"
+"read_bytes_per_sec and write_bytes_per_sec (storage I/O). With\n"
+"tasks=True there is one dict per thread, pid being the thread id,\n"
+"with the additional keys tgid, schedstat_valid, run_percent,\n"
+"wait_percent (time spent runnable on a run-queue, percent of the\n"
+"interval) and timeslices_per_sec.\n"
+);
+
+static PyObject *py_sampler_sample(PyObject *obj,
+				   PyObject *args,
+				   PyObject *kwargs)
+{
+	py_proc_pid_sampler_t *self = (py_proc_pid_sampler_t *)obj;
+	py_proc_pid_snapshot_t *cur = NULL, *prev = NULL;
+	pidrate_t *rates = NULL;
+	PyObject *out = NULL, *pytop = Py_None;
+	int *top = NULL;
+	bool ok;
+	int cnt = 0;
+	long top_io = -1;
+	pidsample_req_t req = {
+		.filter = self->filter,
+		.stat_fields = PIDSTAT_ALL_FIELDS,
+		.io = self->io,
+		.schedstat = self->tasks,
+		.tasks = self->tasks
+	};
+	const char *kwnames [] = {
+		"top_io",
+		NULL
+	};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+					 "|O",
+					 discard_const_p(char *, kwnames),
+					 &pytop)) {
+		return NULL;
+	}
+
+	if (pytop != Py_None) {
+		if (!self->io) {
+			PyErr_SetString(
+				PyExc_ValueError,
+				"top_io requires a sampler created with io=True."
+			);
+			return NULL;
+		}
+
+		top_io = PyLong_AsLong(pytop);
+		if ((top_io == -1) && PyErr_Occurred()) {
+			return NULL;
+		}
+
+		if (top_io < 0) {
+			PyErr_SetString(
+				PyExc_ValueError,
+				"top_io must not be negative."
+			);
+			return NULL;
+		}
+	}
+
+	cur = (py_proc_pid_snapshot_t *)proc_pid_snapshot(self->workers,
+							  &req, NULL);
+	if (cur == NULL) {
+		return NULL;
+	}
+
+	rates = calloc(cur->cnt + 1, sizeof(pidrate_t));
+	if (top_io >= 0) {
+		top = calloc(cur->cnt + 1, sizeof(int));
+	}
+	if ((rates == NULL) || ((top_io >= 0) && (top == NULL))) {
+		free(rates);
+		free(top);
+		Py_DECREF(cur);
+		PyErr_SetString(
+			PyExc_MemoryError,
+			"Failed to allocate rates array."
+		);
+		return NULL;
+	}
+
+	/*
+	 * As in DiskStats.read_rates(), the previous snapshot is immutable
+	 * once published and is replaced by a pointer swap with the GIL
+	 * held. The current one is still private here, so it can be
+	 * indexed while the GIL is released.
+	 */
+	prev = (py_proc_pid_snapshot_t *)self->prev;
+	Py_XINCREF(prev);
+
+	Py_BEGIN_ALLOW_THREADS
+	ok = proc_pid_snapshot_index(cur);
+	if (ok && (prev != NULL)) {
+		cnt = compute_pid_rates(prev, cur, rates);
+	}
+	if (top != NULL) {
+		cnt = select_top_io(rates, cnt,
+				    (top_io < cnt) ? (int)top_io : cnt, top);
+	}
+	Py_END_ALLOW_THREADS
+
+	Py_XDECREF(prev);
+	if (!ok) {
+		free(rates);
+		free(top);
+		Py_DECREF(cur);
+		PyErr_SetString(
+			PyExc_MemoryError,
+			"Failed to index process table."
+		);
+		return NULL;
+	}
+
+	/* a sample that lost a race against a newer one yields no rates */
+	prev = (py_proc_pid_snapshot_t *)self->prev;
+	if ((prev != NULL) && !ts_before(&prev->ts, &cur->ts)) {
+		free(rates);
+		free(top);
+		Py_DECREF(cur);
+		return PyList_New(0);
+	}
+
+	self->prev = (PyObject *)cur;
+	Py_XDECREF(prev);
+
+	out = pid_rates_to_py_list(rates, top, cnt, self);
+	free(rates);
+	free(top);
+	return out;
+}
+
+static PyMethodDef py_sampler_methods[] = {
+	{
+		.ml_name = "sample",
+		.ml_meth = (PyCFunction)py_sampler_sample,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = py_sampler_sample__doc__
+	},
+	{ NULL, NULL, 0, NULL }
+};
+
+PyDoc_STRVAR(py_proc_pid_sampler__doc__,
+"ProcPidSampler(workers=1, io=False, tasks=False, filter=None)\n"
+"--\n\n"
+"Stateful per-process rate sampler, for top-like views. Each call to\n"
+"sample() reads the process table (see ProcPid.snapshot()) and\n"
+"compares it with the previous call.\n\n"
+"Parameters\n"
+"----------\n"
+"workers: int, number of threads to read the process table with.\n"
+"io: bool, also read /proc/<pid>/io and report I/O rates. The counters\n"
+"    of other users' processes can only be read with sufficient\n"
+"    privileges (ptrace access).\n"
+"tasks: bool, sample every thread and its schedstat, to find threads\n"
+"    that spin or starve for CPU inside a process.\n"
+"filter: dict selecting the processes (or threads) to sample, see\n"
+"    ProcPid.snapshot(). Rates are only reported for processes that\n"
+"    were selected by two consecutive samples.\n"
+);
+
+PyTypeObject PyProcPidSampler = {
+	.tp_name = "ixprocfs.ProcPidSampler",
+	.tp_basicsize = sizeof(py_proc_pid_sampler_t),
+	.tp_methods = py_sampler_methods,
+	.tp_new = py_sampler_new,
+	.tp_init = py_sampler_init,
+	.tp_doc = py_proc_pid_sampler__doc__,
+	.tp_dealloc = (destructor)py_sampler_dealloc,
+	.tp_flags = Py_TPFLAGS_DEFAULT|Py_TPFLAGS_BASETYPE,
+};
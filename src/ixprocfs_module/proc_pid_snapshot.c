@@ -0,0 +1,1032 @@
+/*
+ * Python language bindings for procfs-diskstats
+ *
+ * Copyright (C) Andrew Walker, 2022
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Python.h>
+#include <dirent.h>
+#include <unistd.h>
+#include "proc_pid.h"
+#include "../utils/workpool.h"
+
+/*
+ * Process table snapshot. The pids in /proc are listed once, then stat
+ * and statm of every pid are read with pread(2) and parsed into a
+ * contiguous array, optionally on several threads (see workpool.h). All
+ * of this runs with the GIL released; Python objects are only created
+ * when entries are accessed.
+ */
+
+struct snapshot_state {
+	pidsample_req_t req;
+	struct pid_list pids; /* thread ids if req.tasks */
+	pid_t *tgids; /* process of each thread if req.tasks */
+	struct pid_list *tasks; /* per process while listing threads */
+	size_t ntasks; /* entries of tasks */
+	pidsample_t *samples; /* one slot per pid */
+	int *errs; /* errno per pid, 0 on success */
+	fd_buf_t *bufs; /* one per worker */
+};
+
+/*
+ * Read `name` relative to `dirfd`, which is AT_FDCWD for absolute paths
+ * or a /proc/<pid> directory fd (see PidHandle).
+ */
+bool read_pid_file_at(int dirfd, const char *name, fd_buf_t *buf)
+{
+	bool ok;
+	int fd, err;
+
+	fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return false;
+	}
+
+	ok = fd_buf_pread(fd, buf);
+	err = errno;
+	close(fd);
+	errno = err;
+	return ok;
+}
+
+/*
+ * Count the entries of the fd directory `path` relative to `dirfd`.
+ * Returns -1 with errno set on failure, EACCES for processes of other
+ * users.
+ */
+int count_pid_fds_at(int dirfd, const char *path, bool self_pid)
+{
+	DIR *dirp = NULL;
+	struct dirent *entry = NULL;
+	int fd, cnt = 0;
+
+	fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		return -1;
+	}
+
+	dirp = fdopendir(fd);
+	if (dirp == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	while ((entry = readdir(dirp)) != NULL) {
+		if (entry->d_name[0] != '.') {
+			cnt++;
+		}
+	}
+
+	if (self_pid) {
+		/* do not count the descriptor used to list the directory */
+		cnt--;
+	}
+
+	closedir(dirp);
+	return cnt;
+}
+
+/* `prefix` is "/proc/<pid>/", or "" for reads relative to a dirfd */
+static bool read_pid_sample_impl(int dirfd, const char *prefix,
+				 pid_t pid, const pidsample_req_t *req,
+				 fd_buf_t *buf, pidsample_t *out)
+{
+	const pidfilter_t *filter = req->filter;
+	pidstat_mask_t stat_fields = req->stat_fields;
+	pidstatus_mask_t status_fields = req->status_fields;
+	char path[PATH_MAX];
+
+	memset(out, 0, sizeof(*out));
+	out->pid = pid;
+
+	if (filter != NULL) {
+		stat_fields |= pidfilter_stat_fields(filter);
+		if (filter->uids_cnt) {
+			status_fields |= (pidstatus_mask_t)1 << PIDSTATUS_UID;
+		}
+	}
+
+	/* a process the filter rejects is not read any further */
+	snprintf(path, sizeof(path), "%sstat", prefix);
+	if (!read_pid_file_at(dirfd, path, buf) ||
+	    !parse_pid_stat_buf(buf->data, stat_fields, &out->stat)) {
+		return false;
+	}
+	if ((filter != NULL) && !pidfilter_match_stat(filter, &out->stat)) {
+		out->filtered = true;
+		return true;
+	}
+
+	snprintf(path, sizeof(path), "%sstatm", prefix);
+	if (!read_pid_file_at(dirfd, path, buf) ||
+	    !parse_pid_statm_buf(buf->data, &out->statm)) {
+		return false;
+	}
+	if ((filter != NULL) && !pidfilter_match_statm(filter, &out->statm)) {
+		out->filtered = true;
+		return true;
+	}
+
+	if (status_fields) {
+		snprintf(path, sizeof(path), "%sstatus", prefix);
+		if (!read_pid_file_at(dirfd, path, buf) ||
+		    !parse_pid_status_buf(buf->data, status_fields,
+					  &out->status)) {
+			return false;
+		}
+	}
+	if ((filter != NULL) && !pidfilter_match_status(filter, &out->status)) {
+		out->filtered = true;
+		return true;
+	}
+
+	if (req->io) {
+		/* io needs ptrace access; processes we may not trace lack it */
+		snprintf(path, sizeof(path), "%sio", prefix);
+		if (read_pid_file_at(dirfd, path, buf)) {
+			if (!parse_pid_io_buf(buf->data, &out->io)) {
+				return false;
+			}
+			out->io_valid = true;
+		} else if (errno != EACCES) {
+			return false;
+		}
+	}
+
+	if (req->smaps_rollup) {
+		/*
+		 * Same access check as io. Reading fails with ESRCH for
+		 * processes without an mm (kernel threads, zombies), which
+		 * still have valid stat.
+		 */
+		snprintf(path, sizeof(path), "%ssmaps_rollup", prefix);
+		if (read_pid_file_at(dirfd, path, buf)) {
+			if (!parse_pid_smaps_rollup_buf(buf->data, &out->smaps)) {
+				return false;
+			}
+			out->smaps_valid = true;
+		} else if ((errno != EACCES) && (errno != ESRCH)) {
+			return false;
+		}
+	}
+
+	if (req->schedstat) {
+		/* missing if the kernel lacks CONFIG_SCHED_INFO */
+		snprintf(path, sizeof(path), "%sschedstat", prefix);
+		if (read_pid_file_at(dirfd, path, buf)) {
+			if (!parse_pid_schedstat_buf(buf->data, &out->schedstat)) {
+				return false;
+			}
+			out->schedstat_valid = true;
+		} else if (errno != ENOENT) {
+			return false;
+		}
+	}
+
+	out->fd_count = -1;
+	if (req->fd_count) {
+		snprintf(path, sizeof(path), "%sfd", prefix);
+		out->fd_count = count_pid_fds_at(dirfd, path, pid == getpid());
+		if ((out->fd_count == -1) && (errno != EACCES)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Read and parse the files selected by `req` for one process. Does not
+ * require the GIL. A process that exits while it is being read fails
+ * with ENOENT (open) or ESRCH (read). A process that req->filter
+ * rejects succeeds with out->filtered set and is only partially read.
+ */
+bool read_pid_sample(const char *proc_pid_path, pid_t pid,
+		     const pidsample_req_t *req, fd_buf_t *buf,
+		     pidsample_t *out)
+{
+	char prefix[PATH_MAX];
+
+	snprintf(prefix, sizeof(prefix), "%s/", proc_pid_path);
+	return read_pid_sample_impl(AT_FDCWD, prefix, pid, req, buf, out);
+}
+
+/* As read_pid_sample(), relative to a /proc/<pid> directory fd */
+bool read_pid_sample_at(int dirfd, pid_t pid, const pidsample_req_t *req,
+			fd_buf_t *buf, pidsample_t *out)
+{
+	return read_pid_sample_impl(dirfd, "", pid, req, buf, out);
+}
+
+static void snapshot_pid_fn(size_t item, int worker, void *priv)
+{
+	struct snapshot_state *state = (struct snapshot_state *)priv;
+	pid_t pid = state->pids.pids[item];
+	pid_t tgid = pid;
+	char path[64];
+
+	if (state->tgids != NULL) {
+		tgid = state->tgids[item];
+		snprintf(path, sizeof(path), "/proc/%d/task/%d", tgid, pid);
+	} else {
+		snprintf(path, sizeof(path), "/proc/%d", pid);
+	}
+
+	state->errs[item] = 0;
+	if (!read_pid_sample(path, pid, &state->req, &state->bufs[worker],
+			     &state->samples[item])) {
+		state->errs[item] = errno;
+	}
+	state->samples[item].tgid = tgid;
+}
+
+static void list_tasks_fn(size_t item, int worker, void *priv)
+{
+	struct snapshot_state *state = (struct snapshot_state *)priv;
+
+	state->errs[item] = 0;
+	if (!list_proc_tasks(state->pids.pids[item], &state->tasks[item])) {
+		state->errs[item] = errno;
+	}
+}
+
+struct task_id {
+	pid_t tid;
+	pid_t tgid;
+};
+
+static int cmp_task_id(const void *a, const void *b)
+{
+	pid_t ta = ((const struct task_id *)a)->tid;
+	pid_t tb = ((const struct task_id *)b)->tid;
+
+	return (ta > tb) - (ta < tb);
+}
+
+/*
+ * Replace the process list in `state` with the threads of those
+ * processes, in tid order so that samples can still be looked up by
+ * id. Threads are listed on the worker pool as well; one opendir(3) per
+ * process is not free. Returns false with errno set.
+ */
+static bool snapshot_list_tasks(struct snapshot_state *state, int workers)
+{
+	struct task_id *ids = NULL;
+	size_t i, j, total = 0, nprocs = state->pids.cnt;
+
+	state->tasks = calloc(nprocs + 1, sizeof(struct pid_list));
+	state->errs = calloc(nprocs + 1, sizeof(int));
+	if ((state->tasks == NULL) || (state->errs == NULL)) {
+		errno = ENOMEM;
+		return false;
+	}
+	state->ntasks = nprocs;
+
+	if (!workpool_run(nprocs, workers, list_tasks_fn, state)) {
+		errno = ENOMEM;
+		return false;
+	}
+
+	for (i = 0; i < nprocs; i++) {
+		switch (state->errs[i]) {
+		case 0:
+			total += state->tasks[i].cnt;
+			break;
+		case ENOENT:
+			/* exited since the pids were listed */
+			break;
+		default:
+			errno = state->errs[i];
+			return false;
+		}
+	}
+
+	if (total > state->pids.alloc) {
+		pid_t *new = NULL;
+
+		new = realloc(state->pids.pids, total * sizeof(pid_t));
+		if (new == NULL) {
+			errno = ENOMEM;
+			return false;
+		}
+		state->pids.pids = new;
+		state->pids.alloc = total;
+	}
+
+	ids = calloc(total + 1, sizeof(struct task_id));
+	state->tgids = calloc(total + 1, sizeof(pid_t));
+	if ((ids == NULL) || (state->tgids == NULL)) {
+		free(ids);
+		errno = ENOMEM;
+		return false;
+	}
+
+	total = 0;
+	for (i = 0; i < nprocs; i++) {
+		for (j = 0; (state->errs[i] == 0) && (j < state->tasks[i].cnt); j++) {
+			ids[total].tid = state->tasks[i].pids[j];
+			ids[total].tgid = state->pids.pids[i];
+			total++;
+		}
+	}
+	qsort(ids, total, sizeof(struct task_id), cmp_task_id);
+
+	for (i = 0; i < total; i++) {
+		state->pids.pids[i] = ids[i].tid;
+		state->tgids[i] = ids[i].tgid;
+	}
+	state->pids.cnt = total;
+
+	free(ids);
+	free(state->errs);
+	state->errs = NULL;
+	return true;
+}
+
+/*
+ * Read every pid, or only those of `pids` (sorted and without
+ * duplicates) if not NULL, into `state`. Then drop processes that
+ * exited during the walk and close the gaps, keeping pid order. Returns
+ * the number of samples or -1 with errno set.
+ */
+static int snapshot_collect(struct snapshot_state *state, int workers,
+			    const struct pid_list *pids)
+{
+	size_t i;
+	int cnt = 0;
+
+	if (pids != NULL) {
+		/* requested pids are read directly, missing ones are skipped */
+		state->pids.pids = calloc(pids->cnt + 1, sizeof(pid_t));
+		if (state->pids.pids == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		memcpy(state->pids.pids, pids->pids, pids->cnt * sizeof(pid_t));
+		state->pids.cnt = pids->cnt;
+		state->pids.alloc = pids->cnt + 1;
+	} else if (!list_proc_pids(&state->pids)) {
+		return -1;
+	}
+
+	if (state->req.tasks && !snapshot_list_tasks(state, workers)) {
+		return -1;
+	}
+
+	state->samples = calloc(state->pids.cnt + 1, sizeof(pidsample_t));
+	state->errs = calloc(state->pids.cnt + 1, sizeof(int));
+	state->bufs = calloc(workers, sizeof(fd_buf_t));
+	if ((state->samples == NULL) || (state->errs == NULL) ||
+	    (state->bufs == NULL)) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (!workpool_run(state->pids.cnt, workers, snapshot_pid_fn, state)) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (i = 0; i < state->pids.cnt; i++) {
+		switch (state->errs[i]) {
+		case 0:
+			if (state->samples[i].filtered) {
+				break;
+			}
+			if ((size_t)cnt != i) {
+				state->samples[cnt] = state->samples[i];
+			}
+			cnt++;
+			break;
+		case ENOENT:
+		case ESRCH:
+			/* exited since the pids were listed */
+			break;
+		default:
+			errno = state->errs[i];
+			return -1;
+		}
+	}
+
+	return cnt;
+}
+
+static void snapshot_state_free(struct snapshot_state *state, int workers)
+{
+	int i;
+
+	if (state->bufs != NULL) {
+		for (i = 0; i < workers; i++) {
+			fd_buf_free(&state->bufs[i]);
+		}
+	}
+	if (state->tasks != NULL) {
+		for (i = 0; i < (int)state->ntasks; i++) {
+			free_pid_list(&state->tasks[i]);
+		}
+	}
+	free(state->tasks);
+	free(state->tgids);
+	free(state->bufs);
+	free(state->errs);
+	free(state->samples);
+	free_pid_list(&state->pids);
+}
+
+static void set_midpoint(struct timespec *ts, const struct timespec *start,
+			 const struct timespec *end)
+{
+	long long mid_ns;
+
+	mid_ns = ((end->tv_sec - start->tv_sec) * 1000000000LL +
+		  (end->tv_nsec - start->tv_nsec)) / 2;
+	mid_ns += start->tv_nsec;
+	ts->tv_sec = start->tv_sec + (mid_ns / 1000000000LL);
+	ts->tv_nsec = mid_ns % 1000000000LL;
+}
+
+static PyObject *init_proc_pid_snapshot(pidsample_t *samples, int cnt,
+					const struct timespec *ts,
+					const pidsample_req_t *req)
+{
+	py_proc_pid_snapshot_t *out = NULL;
+
+	out = PyObject_New(py_proc_pid_snapshot_t, &PyProcPidSnapshot);
+	if (out == NULL) {
+		return NULL;
+	}
+
+	out->samples = samples;
+	out->cnt = cnt;
+	out->ts = *ts;
+	out->req = *req;
+	/* owned by the caller, only valid while reading */
+	out->req.filter = NULL;
+	out->by_key = (hashtab_t) { .hashes = NULL };
+	return (PyObject *)out;
+}
+
+static int cmp_sample_pid(const void *a, const void *b)
+{
+	pid_t pa = ((const pidsample_t *)a)->pid;
+	pid_t pb = ((const pidsample_t *)b)->pid;
+
+	return (pa > pb) - (pa < pb);
+}
+
+PyObject *proc_pid_snapshot(int workers, const pidsample_req_t *req,
+			    const struct pid_list *pids)
+{
+	PyObject *out = NULL;
+	struct timespec start, end, ts;
+	struct snapshot_state state = { .req = *req };
+	int cnt;
+
+	Py_BEGIN_ALLOW_THREADS
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	cnt = snapshot_collect(&state, workers, pids);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	Py_END_ALLOW_THREADS
+
+	if (cnt == -1) {
+		PyErr_Format(
+			PyExc_RuntimeError,
+			"Failed to read process table: %s",
+			strerror(errno)
+		);
+		snapshot_state_free(&state, workers);
+		return NULL;
+	}
+
+	set_midpoint(&ts, &start, &end);
+	out = init_proc_pid_snapshot(state.samples, cnt, &ts, req);
+	if (out != NULL) {
+		/* now owned by the snapshot */
+		state.samples = NULL;
+	}
+	snapshot_state_free(&state, workers);
+	return out;
+}
+
+static inline uint64_t sample_key_hash(pid_t pid,
+				       unsigned long long starttime)
+{
+	return hash_u64(((uint64_t)(uint32_t)pid << 32) ^ starttime);
+}
+
+struct sample_key {
+	pid_t pid;
+	unsigned long long starttime;
+};
+
+static bool match_sample_key(int val, const void *key, const void *priv)
+{
+	const pidsample_t *samples = priv;
+	const struct sample_key *k = key;
+
+	return (samples[val].pid == k->pid) &&
+	       (samples[val].stat.starttime == k->starttime);
+}
+
+/*
+ * Index the samples by (pid, starttime) so that a later snapshot can
+ * find the same process even if a pid was reused in between. Does not
+ * require the GIL, but must be done before the snapshot is shared with
+ * other threads. Returns false with errno set on allocation failure.
+ */
+bool proc_pid_snapshot_index(py_proc_pid_snapshot_t *snap)
+{
+	int i;
+
+	if (!hashtab_init(&snap->by_key, snap->cnt)) {
+		errno = ENOMEM;
+		return false;
+	}
+
+	for (i = 0; i < snap->cnt; i++) {
+		const pidsample_t *sample = &snap->samples[i];
+
+		if (!hashtab_insert(&snap->by_key,
+				    sample_key_hash(sample->pid,
+						    sample->stat.starttime),
+				    i)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+const pidsample_t *proc_pid_snapshot_find(const py_proc_pid_snapshot_t *snap,
+					  pid_t pid,
+					  unsigned long long starttime)
+{
+	struct sample_key key = { .pid = pid, .starttime = starttime };
+	int idx;
+
+	idx = hashtab_lookup(&snap->by_key, sample_key_hash(pid, starttime),
+			     match_sample_key, &key, snap->samples);
+	return idx == -1 ? NULL : &snap->samples[idx];
+}
+
+PyObject *pidsample_to_entry(const pidsample_t *sample)
+{
+	py_proc_pid_entry_t *out = NULL;
+
+	out = PyObject_New(py_proc_pid_entry_t, &PyPidEntry);
+	if (out == NULL) {
+		return NULL;
+	}
+
+	out->pid = sample->pid;
+	out->pidstat = sample->stat;
+	out->pidstatm = sample->statm;
+	return (PyObject *)out;
+}
+
+static Py_ssize_t py_pps_length(PyObject *obj)
+{
+	py_proc_pid_snapshot_t *self = (py_proc_pid_snapshot_t *)obj;
+	return self->cnt;
+}
+
+static PyObject *py_pps_item(PyObject *obj, Py_ssize_t idx)
+{
+	py_proc_pid_snapshot_t *self = (py_proc_pid_snapshot_t *)obj;
+
+	if ((idx < 0) || (idx >= self->cnt)) {
+		PyErr_SetString(
+			PyExc_IndexError,
+			"snapshot index out of range"
+		);
+		return NULL;
+	}
+
+	return pidsample_to_entry(&self->samples[idx]);
+}
+
+static PySequenceMethods py_pps_as_sequence = {
+	.sq_length = py_pps_length,
+	.sq_item = py_pps_item,
+};
+
+/*
+ * Look up the entry for the pid in `pyval`. Sets `found` to NULL if it
+ * is not in the snapshot; returns false with an exception set if
+ * `pyval` is not an int.
+ */
+static bool pps_find(const py_proc_pid_snapshot_t *self, PyObject *pyval,
+		     const pidsample_t **found)
+{
+	pidsample_t key;
+	long pid;
+
+	pid = PyLong_AsLong(pyval);
+	if ((pid == -1) && PyErr_Occurred()) {
+		return false;
+	}
+
+	key.pid = (pid_t)pid;
+	*found = bsearch(&key, self->samples, self->cnt, sizeof(pidsample_t),
+			 cmp_sample_pid);
+	return true;
+}
+
+PyDoc_STRVAR(py_pps_get__doc__,
+"get(pid)\n"
+"--\n\n"
+"Look up a process in the snapshot.\n\n"
+"Parameters\n"
+"----------\n"
+"pid: int\n\n"
+"Returns\n"
+"-------\n"
+"PidEntry or None if the process is not in the snapshot\n"
+);
+
+static PyObject *py_pps_get(PyObject *obj, PyObject *pyval)
+{
+	py_proc_pid_snapshot_t *self = (py_proc_pid_snapshot_t *)obj;
+	const pidsample_t *found = NULL;
+
+	if (!pps_find(self, pyval, &found)) {
+		return NULL;
+	}
+
+	if (found == NULL) {
+		Py_RETURN_NONE;
+	}
+
+	return pidsample_to_entry(found);
+}
+
+PyDoc_STRVAR(py_pps_status__doc__,
+"status(pid)\n"
+"--\n\n"
+"Look up the /proc/<pid>/status fields of a process in the snapshot.\n"
+"Only available if the snapshot was taken with status fields.\n\n"
+"Parameters\n"
+"----------\n"
+"pid: int\n\n"
+"Returns\n"
+"-------\n"
+"dict or None if the process is not in the snapshot\n"
+);
+
+static PyObject *py_pps_status(PyObject *obj, PyObject *pyval)
+{
+	py_proc_pid_snapshot_t *self = (py_proc_pid_snapshot_t *)obj;
+	const pidsample_t *found = NULL;
+
+	if (self->req.status_fields == 0) {
+		PyErr_SetString(
+			PyExc_ValueError,
+			"Snapshot was taken without status fields."
+		);
+		return NULL;
+	}
+
+	if (!pps_find(self, pyval, &found)) {
+		return NULL;
+	}
+
+	if (found == NULL) {
+		Py_RETURN_NONE;
+	}
+
+	return pidstatus_to_py_dict(&found->status, self->req.status_fields);
+}
+
+PyDoc_STRVAR(py_pps_io__doc__,
+"io(pid)\n"
+"--\n\n"
+"Look up the /proc/<pid>/io counters of a process in the snapshot.\n"
+"Only available if the snapshot was taken with io=True.\n\n"
+"Parameters\n"
+"----------\n"
+"pid: int\n\n"
+"Returns\n"
+"-------\n"
+"dict or None if the process is not in the snapshot or its counters\n"
+"could not be read for lack of permission\n"
+);
+
+static PyObject *py_pps_io(PyObject *obj, PyObject *pyval)
+{
+	py_proc_pid_snapshot_t *self = (py_proc_pid_snapshot_t *)obj;
+	const pidsample_t *found = NULL;
+
+	if (!self->req.io) {
+		PyErr_SetString(
+			PyExc_ValueError,
+			"Snapshot was taken without io."
+		);
+		return NULL;
+	}
+
+	if (!pps_find(self, pyval, &found)) {
+		return NULL;
+	}
+
+	if ((found == NULL) || !found->io_valid) {
+		Py_RETURN_NONE;
+	}
+
+	return pidio_to_py_dict(&found->io);
+}
+
+PyDoc_STRVAR(py_pps_smaps_rollup__doc__,
+"smaps_rollup(pid)\n"
+"--\n\n"
+"Look up the /proc/<pid>/smaps_rollup memory totals of a process in the\n"
+"snapshot. Only available if the snapshot was taken with\n"
+"smaps_rollup=True.\n\n"
+"Parameters\n"
+"----------\n"
+"pid: int\n\n"
+"Returns\n"
+"-------\n"
+"dict with the keys rss_kb, pss_kb, pss_anon_kb, pss_file_kb,\n"
+"pss_shmem_kb, shared_clean_kb, shared_dirty_kb, private_clean_kb,\n"
+"private_dirty_kb, swap_kb, swap_pss_kb and uss_kb (private_clean_kb +\n"
+"private_dirty_kb), or None if the process is not in the snapshot, has\n"
+"no address space (kernel threads) or could not be read for lack of\n"
+"permission\n"
+);
+
+static PyObject *py_pps_smaps_rollup(PyObject *obj, PyObject *pyval)
+{
+	py_proc_pid_snapshot_t *self = (py_proc_pid_snapshot_t *)obj;
+	const pidsample_t *found = NULL;
+
+	if (!self->req.smaps_rollup) {
+		PyErr_SetString(
+			PyExc_ValueError,
+			"Snapshot was taken without smaps_rollup."
+		);
+		return NULL;
+	}
+
+	if (!pps_find(self, pyval, &found)) {
+		return NULL;
+	}
+
+	if ((found == NULL) || !found->smaps_valid) {
+		Py_RETURN_NONE;
+	}
+
+	return pidsmaps_to_py_dict(&found->smaps);
+}
+
+PyDoc_STRVAR(py_pps_schedstat__doc__,
+"schedstat(pid)\n"
+"--\n\n"
+"Look up the scheduler statistics of a process or thread in the\n"
+"snapshot. Only available if the snapshot was taken with\n"
+"schedstat=True.\n\n"
+"Parameters\n"
+"----------\n"
+"pid: int, thread id for snapshots taken with tasks=True\n\n"
+"Returns\n"
+"-------\n"
+"dict with the keys run_ns (time on a CPU), wait_ns (time runnable\n"
+"on a run-queue) and timeslices, or None if the entry is not in the\n"
+"snapshot or the kernel does not provide schedstat\n"
+);
+
+static PyObject *py_pps_schedstat(PyObject *obj, PyObject *pyval)
+{
+	py_proc_pid_snapshot_t *self = (py_proc_pid_snapshot_t *)obj;
+	const pidsample_t *found = NULL;
+
+	if (!self->req.schedstat) {
+		PyErr_SetString(
+			PyExc_ValueError,
+			"Snapshot was taken without schedstat."
+		);
+		return NULL;
+	}
+
+	if (!pps_find(self, pyval, &found)) {
+		return NULL;
+	}
+
+	if ((found == NULL) || !found->schedstat_valid) {
+		Py_RETURN_NONE;
+	}
+
+	return pidschedstat_to_py_dict(&found->schedstat);
+}
+
+PyDoc_STRVAR(py_pps_group_by__doc__,
+"group_by(key, fields=None, ops=None)\n"
+"--\n\n"
+"Aggregate the processes of the snapshot by a key, e.g. memory and\n"
+"CPU time per uid. Grouping runs in C without the GIL.\n\n"
+"Parameters\n"
+"----------\n"
+"key: str, one of comm, state, ppid, pgrp, session, tty_nr, tgid or uid\n"
+"    (effective, needs a snapshot taken with the uid status field).\n"
+"fields: sequence of field names to aggregate. Available are the stat\n"
+"    fields minflt, majflt, utime, stime, cutime, cstime, num_threads,\n"
+"    vsize, rss, delayacct_blkio_ticks and guest_time, and from statm\n"
+"    vm_bytes, rss_bytes, shared_bytes and data_bytes. Stat fields must\n"
+"    have been parsed by the snapshot. None selects every available\n"
+"    field.\n"
+"ops: sequence of count, sum and max. None selects count and sum.\n\n"
+"Returns\n"
+"-------\n"
+"dict mapping each key value to a dict with the keys count and\n"
+"<field>_sum and <field>_max for the requested fields and operations,\n"
+"in order of the first pid of each group\n"
+);
+
+static PyObject *py_pps_group_by(PyObject *obj,
+				 PyObject *args,
+				 PyObject *kwargs)
+{
+	py_proc_pid_snapshot_t *self = (py_proc_pid_snapshot_t *)obj;
+	PyObject *pykey = NULL, *pyfields = Py_None, *pyops = Py_None;
+	const char *kwnames [] = {
+		"key",
+		"fields",
+		"ops",
+		NULL
+	};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+					 "O|OO",
+					 discard_const_p(char *, kwnames),
+					 &pykey,
+					 &pyfields,
+					 &pyops)) {
+		return NULL;
+	}
+
+	return proc_pid_snapshot_group_by(self, pykey, pyfields, pyops);
+}
+
+static PyObject *pps_ids_to_py(const py_proc_pid_snapshot_t *self,
+			       bool tgids)
+{
+	PyObject *out = NULL;
+	int i;
+
+	out = PyTuple_New(self->cnt);
+	if (out == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < self->cnt; i++) {
+		PyObject *pid = PyLong_FromLong(tgids ?
+						self->samples[i].tgid :
+						self->samples[i].pid);
+
+		if (pid == NULL) {
+			Py_DECREF(out);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(out, i, pid);
+	}
+
+	return out;
+}
+
+static PyObject *py_pps_pids(PyObject *obj, void *closure)
+{
+	return pps_ids_to_py((py_proc_pid_snapshot_t *)obj, false);
+}
+
+static PyObject *py_pps_tgids(PyObject *obj, void *closure)
+{
+	return pps_ids_to_py((py_proc_pid_snapshot_t *)obj, true);
+}
+
+static PyObject *py_pps_tasks(PyObject *obj, void *closure)
+{
+	py_proc_pid_snapshot_t *self = (py_proc_pid_snapshot_t *)obj;
+	return PyBool_FromLong(self->req.tasks);
+}
+
+static PyObject *py_pps_timestamp(PyObject *obj, void *closure)
+{
+	py_proc_pid_snapshot_t *self = (py_proc_pid_snapshot_t *)obj;
+	return PyFloat_FromDouble(self->ts.tv_sec + (self->ts.tv_nsec / 1e9));
+}
+
+static PyObject *py_pps_fields(PyObject *obj, void *closure)
+{
+	py_proc_pid_snapshot_t *self = (py_proc_pid_snapshot_t *)obj;
+	return pidstat_mask_to_py(self->req.stat_fields);
+}
+
+static PyMethodDef py_pps_obj_methods[] = {
+	{
+		.ml_name = "get",
+		.ml_meth = (PyCFunction)py_pps_get,
+		.ml_flags = METH_O,
+		.ml_doc = py_pps_get__doc__
+	},
+	{
+		.ml_name = "status",
+		.ml_meth = (PyCFunction)py_pps_status,
+		.ml_flags = METH_O,
+		.ml_doc = py_pps_status__doc__
+	},
+	{
+		.ml_name = "io",
+		.ml_meth = (PyCFunction)py_pps_io,
+		.ml_flags = METH_O,
+		.ml_doc = py_pps_io__doc__
+	},
+	{
+		.ml_name = "smaps_rollup",
+		.ml_meth = (PyCFunction)py_pps_smaps_rollup,
+		.ml_flags = METH_O,
+		.ml_doc = py_pps_smaps_rollup__doc__
+	},
+	{
+		.ml_name = "schedstat",
+		.ml_meth = (PyCFunction)py_pps_schedstat,
+		.ml_flags = METH_O,
+		.ml_doc = py_pps_schedstat__doc__
+	},
+	{
+		.ml_name = "group_by",
+		.ml_meth = (PyCFunction)py_pps_group_by,
+		.ml_flags = METH_VARARGS | METH_KEYWORDS,
+		.ml_doc = py_pps_group_by__doc__
+	},
+	{ NULL, NULL, 0, NULL }
+};
+
+static PyGetSetDef py_pps_obj_getsetters[] = {
+	{
+		.name	= discard_const_p(char, "pids"),
+		.get	= (getter)py_pps_pids,
+		.doc	= "tuple of the pids in the snapshot, in ascending order",
+	},
+	{
+		.name	= discard_const_p(char, "tgids"),
+		.get	= (getter)py_pps_tgids,
+		.doc	= "tuple of the process id of each entry of pids",
+	},
+	{
+		.name	= discard_const_p(char, "tasks"),
+		.get	= (getter)py_pps_tasks,
+		.doc	= "True if entries are threads, pids are then thread ids",
+	},
+	{
+		.name	= discard_const_p(char, "timestamp"),
+		.get	= (getter)py_pps_timestamp,
+		.doc	= "CLOCK_MONOTONIC midpoint of the walk of /proc in seconds",
+	},
+	{
+		.name	= discard_const_p(char, "fields"),
+		.get	= (getter)py_pps_fields,
+		.doc	= "tuple of the stat fields that were parsed, others are zero",
+	},
+	{ .name = NULL }
+};
+
+void py_pps_obj_dealloc(py_proc_pid_snapshot_t *self)
+{
+	free(self->samples);
+	self->samples = NULL;
+	hashtab_free(&self->by_key);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+PyDoc_STRVAR(py_proc_pid_snapshot__doc__,
+"Snapshot of the process table\n"
+"Holds /proc/<pid>/stat and /proc/<pid>/statm of every process that\n"
+"existed during the walk of /proc, ordered by pid. Supports len(),\n"
+"indexing and get(pid), all returning PidEntry. Snapshots taken with\n"
+"tasks=True hold every thread of /proc/<pid>/task instead, ordered by\n"
+"thread id.\n"
+);
+
+PyTypeObject PyProcPidSnapshot = {
+	.tp_name = "ixprocfs.ProcPidSnapshot",
+	.tp_basicsize = sizeof(py_proc_pid_snapshot_t),
+	.tp_methods = py_pps_obj_methods,
+	.tp_getset = py_pps_obj_getsetters,
+	.tp_as_sequence = &py_pps_as_sequence,
+	.tp_doc = py_proc_pid_snapshot__doc__,
+	.tp_dealloc = (destructor)py_pps_obj_dealloc,
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+};
@@ -0,0 +1,552 @@
+/*
+ * Python language bindings for procfs-diskstats
+ *
+ * Copyright (C) Andrew Walker, 2022
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Python.h>
+#include <unistd.h>
+#include "proc_pid.h"
+
+/*
+ * Process tree built from one ProcPidSnapshot. Processes keep the
+ * indexes they have in the snapshot; parents are resolved once through
+ * a pid hash and the children of every process are stored as one
+ * compact array with per-process offsets. Subtree totals are computed
+ * by a single pass over the processes in reverse preorder, which visits
+ * children before their parents. All of this runs without the GIL and
+ * the tree is immutable afterwards.
+ */
+
+static inline uint64_t pid_hash(pid_t pid)
+{
+	return hash_u64((uint64_t)(uint32_t)pid);
+}
+
+static bool match_pid(int val, const void *key, const void *priv)
+{
+	const pidsample_t *samples = priv;
+	return samples[val].pid == *(const pid_t *)key;
+}
+
+static int find_pid(const py_proc_tree_t *tree, pid_t pid)
+{
+	return hashtab_lookup(&tree->by_pid, pid_hash(pid), match_pid, &pid,
+			      tree->snap->samples);
+}
+
+/*
+ * A parent must have started before its child. Anything else means the
+ * real parent exited and its pid was reused during the walk of /proc.
+ * Ordering by (starttime, pid) also rules out cycles.
+ */
+static inline bool is_parent_of(const pidsample_t *parent,
+				const pidsample_t *child)
+{
+	return (parent->stat.starttime < child->stat.starttime) ||
+	       ((parent->stat.starttime == child->stat.starttime) &&
+		(parent->pid < child->pid));
+}
+
+static void add_sums(proctree_sum_t *dst, const proctree_sum_t *src)
+{
+	dst->rss_bytes += src->rss_bytes;
+	dst->cpu_ticks += src->cpu_ticks;
+	dst->threads += src->threads;
+	dst->fds += src->fds;
+	dst->processes += src->processes;
+}
+
+/* Does not require the GIL. Returns false on allocation failure. */
+static bool build_proc_tree(py_proc_tree_t *tree)
+{
+	const pidsample_t *samples = tree->snap->samples;
+	long page_size = sysconf(_SC_PAGESIZE);
+	int cnt = tree->snap->cnt;
+	int *stack = NULL;
+	int i, j, sp = 0, n = 0;
+
+	tree->parent = calloc(cnt + 1, sizeof(int));
+	tree->child_off = calloc(cnt + 2, sizeof(int));
+	tree->children = calloc(cnt + 1, sizeof(int));
+	tree->preorder = calloc(cnt + 1, sizeof(int));
+	tree->preorder_pos = calloc(cnt + 1, sizeof(int));
+	tree->sums = calloc(cnt + 1, sizeof(proctree_sum_t));
+	stack = calloc(cnt + 1, sizeof(int));
+	if ((tree->parent == NULL) || (tree->child_off == NULL) ||
+	    (tree->children == NULL) || (tree->preorder == NULL) ||
+	    (tree->preorder_pos == NULL) || (tree->sums == NULL) ||
+	    (stack == NULL) || !hashtab_init(&tree->by_pid, cnt)) {
+		free(stack);
+		return false;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		if (!hashtab_insert(&tree->by_pid, pid_hash(samples[i].pid), i)) {
+			free(stack);
+			return false;
+		}
+	}
+
+	/* count children, child_off[p + 1] ends up as the offset of p + 1 */
+	for (i = 0; i < cnt; i++) {
+		int p = find_pid(tree, samples[i].stat.ppid);
+
+		if ((p != -1) && !is_parent_of(&samples[p], &samples[i])) {
+			p = -1;
+		}
+		tree->parent[i] = p;
+		if (p != -1) {
+			tree->child_off[p + 1]++;
+		}
+	}
+	for (i = 0; i < cnt; i++) {
+		tree->child_off[i + 1] += tree->child_off[i];
+	}
+
+	/* fill in pid order, using the stack as a per-parent cursor */
+	memcpy(stack, tree->child_off, cnt * sizeof(int));
+	for (i = 0; i < cnt; i++) {
+		if (tree->parent[i] != -1) {
+			tree->children[stack[tree->parent[i]]++] = i;
+		}
+	}
+
+	for (i = 0; i < cnt; i++) {
+		if (tree->parent[i] != -1) {
+			continue;
+		}
+
+		stack[sp++] = i;
+		while (sp > 0) {
+			int idx = stack[--sp];
+
+			tree->preorder_pos[idx] = n;
+			tree->preorder[n++] = idx;
+			/* push in reverse so that the lowest pid comes first */
+			for (j = tree->child_off[idx + 1] - 1;
+			     j >= tree->child_off[idx]; j--) {
+				stack[sp++] = tree->children[j];
+			}
+		}
+	}
+	free(stack);
+
+	for (i = 0; i < cnt; i++) {
+		proctree_sum_t *sum = &tree->sums[i];
+
+		sum->rss_bytes = (unsigned long long)samples[i].statm.resident *
+				 page_size;
+		sum->cpu_ticks = samples[i].stat.utime + samples[i].stat.stime;
+		sum->threads = samples[i].stat.num_threads;
+		sum->fds = (samples[i].fd_count > 0) ? samples[i].fd_count : 0;
+		sum->processes = 1;
+	}
+
+	for (i = n - 1; i >= 0; i--) {
+		int idx = tree->preorder[i];
+
+		if (tree->parent[idx] != -1) {
+			add_sums(&tree->sums[tree->parent[idx]], &tree->sums[idx]);
+		}
+	}
+
+	return true;
+}
+
+static void proc_tree_free(py_proc_tree_t *tree)
+{
+	free(tree->parent);
+	free(tree->child_off);
+	free(tree->children);
+	free(tree->preorder);
+	free(tree->preorder_pos);
+	free(tree->sums);
+	tree->parent = tree->child_off = tree->children = NULL;
+	tree->preorder = tree->preorder_pos = NULL;
+	tree->sums = NULL;
+	hashtab_free(&tree->by_pid);
+}
+
+PyObject *proc_tree_new(int workers, bool fd_count)
+{
+	py_proc_tree_t *tree = NULL;
+	pidsample_req_t req = {
+		.stat_fields = PIDSTAT_ALL_FIELDS,
+		.fd_count = fd_count
+	};
+	bool ok;
+
+	tree = PyObject_New(py_proc_tree_t, &PyProcTree);
+	if (tree == NULL) {
+		return NULL;
+	}
+
+	tree->parent = tree->child_off = tree->children = NULL;
+	tree->preorder = tree->preorder_pos = NULL;
+	tree->sums = NULL;
+	memset(&tree->by_pid, 0, sizeof(tree->by_pid));
+
+	tree->snap = (py_proc_pid_snapshot_t *)proc_pid_snapshot(workers,
+									&req, NULL);
+	if (tree->snap == NULL) {
+		Py_DECREF(tree);
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	ok = build_proc_tree(tree);
+	Py_END_ALLOW_THREADS
+
+	if (!ok) {
+		Py_DECREF(tree);
+		PyErr_SetString(
+			PyExc_MemoryError,
+			"Failed to build process tree."
+		);
+		return NULL;
+	}
+
+	return (PyObject *)tree;
+}
+
+static int py_tree_lookup(const py_proc_tree_t *self, PyObject *pyval)
+{
+	long pid;
+	int idx;
+
+	pid = PyLong_AsLong(pyval);
+	if ((pid == -1) && PyErr_Occurred()) {
+		return -1;
+	}
+
+	idx = find_pid(self, (pid_t)pid);
+	if (idx == -1) {
+		PyErr_Format(
+			PyExc_KeyError,
+			"%ld: process is not in the tree",
+			pid
+		);
+	}
+
+	return idx;
+}
+
+static PyObject *idx_array_to_py(const py_proc_tree_t *self,
+				 const int *idx, int cnt)
+{
+	PyObject *out = NULL;
+	int i;
+
+	out = PyTuple_New(cnt);
+	if (out == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		PyObject *pid = PyLong_FromLong(self->snap->samples[idx[i]].pid);
+
+		if (pid == NULL) {
+			Py_DECREF(out);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(out, i, pid);
+	}
+
+	return out;
+}
+
+static Py_ssize_t py_tree_length(PyObject *obj)
+{
+	py_proc_tree_t *self = (py_proc_tree_t *)obj;
+	return self->snap->cnt;
+}
+
+static PySequenceMethods py_tree_as_sequence = {
+	.sq_length = py_tree_length,
+};
+
+PyDoc_STRVAR(py_tree_get__doc__,
+"get(pid)\n"
+"--\n\n"
+"Look up a process in the tree.\n\n"
+"Parameters\n"
+"----------\n"
+"pid: int\n\n"
+"Returns\n"
+"-------\n"
+"PidEntry\n\n"
+"Raises\n"
+"------\n"
+"KeyError if the process is not in the tree\n"
+);
+
+static PyObject *py_tree_get(PyObject *obj, PyObject *pyval)
+{
+	py_proc_tree_t *self = (py_proc_tree_t *)obj;
+	int idx;
+
+	idx = py_tree_lookup(self, pyval);
+	if (idx == -1) {
+		return NULL;
+	}
+
+	return pidsample_to_entry(&self->snap->samples[idx]);
+}
+
+PyDoc_STRVAR(py_tree_parent__doc__,
+"parent(pid)\n"
+"--\n\n"
+"Parameters\n"
+"----------\n"
+"pid: int\n\n"
+"Returns\n"
+"-------\n"
+"pid of the parent process, or None for roots of the tree (init,\n"
+"kthreadd, processes whose parent is outside the pid namespace)\n\n"
+"Raises\n"
+"------\n"
+"KeyError if the process is not in the tree\n"
+);
+
+static PyObject *py_tree_parent(PyObject *obj, PyObject *pyval)
+{
+	py_proc_tree_t *self = (py_proc_tree_t *)obj;
+	int idx;
+
+	idx = py_tree_lookup(self, pyval);
+	if (idx == -1) {
+		return NULL;
+	}
+
+	if (self->parent[idx] == -1) {
+		Py_RETURN_NONE;
+	}
+
+	return PyLong_FromLong(self->snap->samples[self->parent[idx]].pid);
+}
+
+PyDoc_STRVAR(py_tree_children__doc__,
+"children(pid)\n"
+"--\n\n"
+"Parameters\n"
+"----------\n"
+"pid: int\n\n"
+"Returns\n"
+"-------\n"
+"tuple of the pids of the direct children, in ascending order\n\n"
+"Raises\n"
+"------\n"
+"KeyError if the process is not in the tree\n"
+);
+
+static PyObject *py_tree_children(PyObject *obj, PyObject *pyval)
+{
+	py_proc_tree_t *self = (py_proc_tree_t *)obj;
+	int idx;
+
+	idx = py_tree_lookup(self, pyval);
+	if (idx == -1) {
+		return NULL;
+	}
+
+	return idx_array_to_py(self, &self->children[self->child_off[idx]],
+			       self->child_off[idx + 1] - self->child_off[idx]);
+}
+
+PyDoc_STRVAR(py_tree_descendants__doc__,
+"descendants(pid)\n"
+"--\n\n"
+"Parameters\n"
+"----------\n"
+"pid: int\n\n"
+"Returns\n"
+"-------\n"
+"tuple of the pids of all processes below pid, depth first\n\n"
+"Raises\n"
+"------\n"
+"KeyError if the process is not in the tree\n"
+);
+
+static PyObject *py_tree_descendants(PyObject *obj, PyObject *pyval)
+{
+	py_proc_tree_t *self = (py_proc_tree_t *)obj;
+	int idx;
+
+	idx = py_tree_lookup(self, pyval);
+	if (idx == -1) {
+		return NULL;
+	}
+
+	/* the subtree follows its root in preorder */
+	return idx_array_to_py(self,
+			       &self->preorder[self->preorder_pos[idx] + 1],
+			       self->sums[idx].processes - 1);
+}
+
+PyDoc_STRVAR(py_tree_subtree__doc__,
+"subtree(pid)\n"
+"--\n\n"
+"Totals of a process and all of its descendants, computed when the\n"
+"tree was built.\n\n"
+"Parameters\n"
+"----------\n"
+"pid: int\n\n"
+"Returns\n"
+"-------\n"
+"dict with the keys processes, rss_bytes, cpu_seconds (utime + stime),\n"
+"threads and fds (zero unless the tree was built with fd_count=True,\n"
+"processes whose fds could not be read are not counted)\n\n"
+"Raises\n"
+"------\n"
+"KeyError if the process is not in the tree\n"
+);
+
+static PyObject *py_tree_subtree(PyObject *obj, PyObject *pyval)
+{
+	py_proc_tree_t *self = (py_proc_tree_t *)obj;
+	const proctree_sum_t *sum = NULL;
+	int idx;
+
+	idx = py_tree_lookup(self, pyval);
+	if (idx == -1) {
+		return NULL;
+	}
+
+	sum = &self->sums[idx];
+	return Py_BuildValue(
+		"{sisKsdslsl}",
+		"processes", sum->processes,
+		"rss_bytes", sum->rss_bytes,
+		"cpu_seconds", (double)sum->cpu_ticks / sysconf(_SC_CLK_TCK),
+		"threads", sum->threads,
+		"fds", sum->fds
+	);
+}
+
+static PyObject *py_tree_roots(PyObject *obj, void *closure)
+{
+	py_proc_tree_t *self = (py_proc_tree_t *)obj;
+	PyObject *out = NULL;
+	int i, cnt = 0;
+
+	for (i = 0; i < self->snap->cnt; i++) {
+		if (self->parent[i] == -1) {
+			cnt++;
+		}
+	}
+
+	out = PyTuple_New(cnt);
+	if (out == NULL) {
+		return NULL;
+	}
+
+	for (i = 0, cnt = 0; i < self->snap->cnt; i++) {
+		PyObject *pid = NULL;
+
+		if (self->parent[i] != -1) {
+			continue;
+		}
+
+		pid = PyLong_FromLong(self->snap->samples[i].pid);
+		if (pid == NULL) {
+			Py_DECREF(out);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(out, cnt++, pid);
+	}
+
+	return out;
+}
+
+static PyObject *py_tree_snapshot(PyObject *obj, void *closure)
+{
+	py_proc_tree_t *self = (py_proc_tree_t *)obj;
+	Py_INCREF(self->snap);
+	return (PyObject *)self->snap;
+}
+
+static PyMethodDef py_tree_obj_methods[] = {
+	{
+		.ml_name = "get",
+		.ml_meth = (PyCFunction)py_tree_get,
+		.ml_flags = METH_O,
+		.ml_doc = py_tree_get__doc__
+	},
+	{
+		.ml_name = "parent",
+		.ml_meth = (PyCFunction)py_tree_parent,
+		.ml_flags = METH_O,
+		.ml_doc = py_tree_parent__doc__
+	},
+	{
+		.ml_name = "children",
+		.ml_meth = (PyCFunction)py_tree_children,
+		.ml_flags = METH_O,
+		.ml_doc = py_tree_children__doc__
+	},
+	{
+		.ml_name = "descendants",
+		.ml_meth = (PyCFunction)py_tree_descendants,
+		.ml_flags = METH_O,
+		.ml_doc = py_tree_descendants__doc__
+	},
+	{
+		.ml_name = "subtree",
+		.ml_meth = (PyCFunction)py_tree_subtree,
+		.ml_flags = METH_O,
+		.ml_doc = py_tree_subtree__doc__
+	},
+	{ NULL, NULL, 0, NULL }
+};
+
+static PyGetSetDef py_tree_obj_getsetters[] = {
+	{
+		.name	= discard_const_p(char, "roots"),
+		.get	= (getter)py_tree_roots,
+		.doc	= "tuple of the pids of processes without a parent in the tree",
+	},
+	{
+		.name	= discard_const_p(char, "snapshot"),
+		.get	= (getter)py_tree_snapshot,
+		.doc	= "ProcPidSnapshot the tree was built from",
+	},
+	{ .name = NULL }
+};
+
+void py_tree_obj_dealloc(py_proc_tree_t *self)
+{
+	proc_tree_free(self);
+	Py_CLEAR(self->snap);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+PyDoc_STRVAR(py_proc_tree__doc__,
+"Process tree\n"
+"Parent and children of every process of one ProcPidSnapshot, with\n"
+"per-subtree totals. Created by ProcPid.tree(). Supports len().\n"
+);
+
+PyTypeObject PyProcTree = {
+	.tp_name = "ixprocfs.ProcTree",
+	.tp_basicsize = sizeof(py_proc_tree_t),
+	.tp_methods = py_tree_obj_methods,
+	.tp_getset = py_tree_obj_getsetters,
+	.tp_as_sequence = &py_tree_as_sequence,
+	.tp_doc = py_proc_tree__doc__,
+	.tp_dealloc = (destructor)py_tree_obj_dealloc,
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+};
@@ -0,0 +1,81 @@
+/*
+ * Python language bindings for procfs-diskstats
+ *
+ * Copyright (C) Andrew Walker, 2022
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Python.h>
+#include <unistd.h>
+#include "../common/includes.h"
+#include "fdbuf.h"
+
+/*
+ * Read the whole of the file referred to by `fd` from offset zero into
+ * `buf` and NUL-terminate it. Pseudo-files generate their contents on
+ * read, and a short read means the kernel had nothing more to give, so
+ * in the common case this is a single pread(2). If the buffer was
+ * filled, it is doubled and the file is re-read from the start so that
+ * the result comes from a single pass through the kernel.
+ *
+ * Does not take or release the GIL. Returns false with errno set on
+ * failure.
+ */
+bool fd_buf_pread(int fd, fd_buf_t *buf)
+{
+	ssize_t rv;
+	char *new = NULL;
+
+	if (buf->alloc == 0) {
+		buf->data = malloc(FD_BUF_INITIAL_SIZE);
+		if (buf->data == NULL) {
+			return false;
+		}
+		buf->alloc = FD_BUF_INITIAL_SIZE;
+	}
+
+	for (;;) {
+		rv = pread(fd, buf->data, buf->alloc - 1, 0);
+		if (rv == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+
+		if ((size_t)rv < buf->alloc - 1) {
+			break;
+		}
+
+		new = realloc(buf->data, buf->alloc * 2);
+		if (new == NULL) {
+			return false;
+		}
+		buf->data = new;
+		buf->alloc *= 2;
+	}
+
+	buf->len = rv;
+	buf->data[buf->len] = '\0';
+	return true;
+}
+
+void fd_buf_free(fd_buf_t *buf)
+{
+	free(buf->data);
+	buf->data = NULL;
+	buf->alloc = 0;
+	buf->len = 0;
+}
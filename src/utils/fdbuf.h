@@ -0,0 +1,40 @@
+/*
+ * Python language bindings for procfs-diskstats
+ *
+ * Copyright (C) Andrew Walker, 2022
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FDBUF_H_
+#define _FDBUF_H_
+#include "../common/includes.h"
+
+/*
+ * Reusable buffer for reading small pseudo-files (procfs, sysfs) with
+ * pread(2). The buffer grows as needed and is kept between reads so
+ * that steady-state sampling performs no allocations.
+ */
+typedef struct fd_buf {
+	char *data;
+	size_t alloc;
+	size_t len;
+} fd_buf_t;
+
+#define FD_BUF_INITIAL_SIZE 4096
+
+extern bool fd_buf_pread(int fd, fd_buf_t *buf);
+extern void fd_buf_free(fd_buf_t *buf);
+
+#endif /* _FDBUF_H_ */
@@ -0,0 +1,155 @@
+/*
+ * Python language bindings for procfs-diskstats
+ *
+ * Copyright (C) Andrew Walker, 2022
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <Python.h>
+#include "../common/includes.h"
+#include "hashtab.h"
+
+static bool hashtab_alloc(hashtab_t *ht, size_t slots)
+{
+	ht->hashes = calloc(slots, sizeof(uint64_t));
+	if (ht->hashes == NULL) {
+		return false;
+	}
+
+	ht->vals = calloc(slots, sizeof(int));
+	if (ht->vals == NULL) {
+		free(ht->hashes);
+		ht->hashes = NULL;
+		return false;
+	}
+
+	ht->mask = slots - 1;
+	ht->cnt = 0;
+	return true;
+}
+
+/*
+ * Size the table so that `nentries` entries can be inserted without
+ * it having to grow.
+ */
+bool hashtab_init(hashtab_t *ht, size_t nentries)
+{
+	size_t slots = 16;
+
+	while (slots < nentries * 2) {
+		slots <<= 1;
+	}
+
+	return hashtab_alloc(ht, slots);
+}
+
+void hashtab_free(hashtab_t *ht)
+{
+	free(ht->hashes);
+	free(ht->vals);
+	*ht = (hashtab_t) { .hashes = NULL };
+}
+
+void hashtab_clear(hashtab_t *ht)
+{
+	if (ht->hashes != NULL) {
+		memset(ht->hashes, 0, (ht->mask + 1) * sizeof(uint64_t));
+	}
+	ht->cnt = 0;
+}
+
+static void hashtab_insert_impl(hashtab_t *ht, uint64_t hash, int val)
+{
+	size_t pos;
+
+	for (pos = hash & ht->mask; ht->hashes[pos] != 0;
+	     pos = (pos + 1) & ht->mask)
+		;
+
+	ht->hashes[pos] = hash;
+	ht->vals[pos] = val;
+	ht->cnt++;
+}
+
+static bool hashtab_grow(hashtab_t *ht)
+{
+	hashtab_t new;
+	size_t i;
+
+	if (!hashtab_alloc(&new, (ht->mask + 1) * 2)) {
+		return false;
+	}
+
+	for (i = 0; i <= ht->mask; i++) {
+		if (ht->hashes[i] != 0) {
+			hashtab_insert_impl(&new, ht->hashes[i], ht->vals[i]);
+		}
+	}
+
+	hashtab_free(ht);
+	*ht = new;
+	return true;
+}
+
+/*
+ * Insert does not check for duplicates; lookups return the entry that
+ * was inserted first. A zero-initialized table is allocated on first
+ * insert. Returns false with errno set if the table needed
+ * to grow and allocation failed.
+ */
+bool hashtab_insert(hashtab_t *ht, uint64_t hash, int val)
+{
+	if ((ht->hashes == NULL) && !hashtab_init(ht, 0)) {
+		return false;
+	}
+
+	if ((ht->cnt + 1) * 2 > ht->mask + 1) {
+		if (!hashtab_grow(ht)) {
+			return false;
+		}
+	}
+
+	hashtab_insert_impl(ht, hash, val);
+	return true;
+}
+
+/*
+ * Return the value of the first entry with `hash` for which `match`
+ * returns true, or -1 if there is none. If `match` is NULL the hash
+ * alone identifies the key.
+ */
+int hashtab_lookup(const hashtab_t *ht, uint64_t hash,
+		   hashtab_match_fn match, const void *key,
+		   const void *priv)
+{
+	size_t pos;
+
+	if (ht->hashes == NULL) {
+		return -1;
+	}
+
+	for (pos = hash & ht->mask; ht->hashes[pos] != 0;
+	     pos = (pos + 1) & ht->mask) {
+		if (ht->hashes[pos] != hash) {
+			continue;
+		}
+
+		if ((match == NULL) || match(ht->vals[pos], key, priv)) {
+			return ht->vals[pos];
+		}
+	}
+
+	return -1;
+}
@@ -0,0 +1,74 @@
+/*
+ * Python language bindings for procfs-diskstats
+ *
+ * Copyright (C) Andrew Walker, 2022
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HASHTAB_H_
+#define _HASHTAB_H_
+#include <stdint.h>
+#include "../common/includes.h"
+
+/*
+ * Open-addressing hash table mapping precomputed 64-bit hashes to
+ * integer values, typically indexes into a caller-owned array. Keys are
+ * not stored: when a lookup finds a slot with a matching hash it asks
+ * the caller to confirm the match, so any key type can be indexed
+ * without extra allocations. Linear probing, power-of-two sizes and a
+ * maximum load factor of one half.
+ */
+typedef struct hashtab {
+	uint64_t *hashes; /* 0 marks an empty slot */
+	int *vals;
+	size_t mask;
+	size_t cnt;
+} hashtab_t;
+
+typedef bool (*hashtab_match_fn)(int val, const void *key, const void *priv);
+
+extern bool hashtab_init(hashtab_t *ht, size_t nentries);
+extern void hashtab_free(hashtab_t *ht);
+extern void hashtab_clear(hashtab_t *ht);
+extern bool hashtab_insert(hashtab_t *ht, uint64_t hash, int val);
+extern int hashtab_lookup(const hashtab_t *ht, uint64_t hash,
+			  hashtab_match_fn match, const void *key,
+			  const void *priv);
+
+/* splitmix64 finalizer */
+static inline uint64_t hash_u64(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x ? x : 1;
+}
+
+/* FNV-1a */
+static inline uint64_t hash_str(const char *str, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)str[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h ? h : 1;
+}
+
+#endif /* _HASHTAB_H_ */
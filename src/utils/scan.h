@@ -0,0 +1,120 @@
+/*
+ * Python language bindings for procfs-diskstats
+ *
+ * Copyright (C) Andrew Walker, 2022
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SCAN_H_
+#define _SCAN_H_
+#include <limits.h>
+#include "../common/includes.h"
+
+/*
+ * Cursor-based helpers for decoding numbers directly out of a buffer
+ * holding the contents of a pseudo-file. Unlike the token parsers in
+ * parser.h these do not require the input to be split and
+ * NUL-terminated first, which lets callers decode a whole line in one
+ * forward pass. Each scanner advances `*pp` past the digits it
+ * consumed and fails if the number is not followed by whitespace or
+ * the end of the buffer.
+ */
+
+static inline bool scan_is_space(char c)
+{
+	return (c == ' ') || (c == '\t') || (c == '\n');
+}
+
+static inline const char *scan_skip_ws(const char *p, const char *end)
+{
+	while ((p < end) && ((*p == ' ') || (*p == '\t'))) {
+		p++;
+	}
+	return p;
+}
+
+static inline const char *scan_skip_token(const char *p, const char *end)
+{
+	while ((p < end) && !scan_is_space(*p)) {
+		p++;
+	}
+	return p;
+}
+
+static inline bool scan_ulonglong(const char **pp, const char *end,
+				  unsigned long long *out)
+{
+	const char *p = *pp;
+	unsigned long long val = 0;
+
+	if ((p == end) || (*p < '0') || (*p > '9')) {
+		return false;
+	}
+
+	for (; (p < end) && (*p >= '0') && (*p <= '9'); p++) {
+		unsigned digit = *p - '0';
+
+		if (val > (ULLONG_MAX - digit) / 10) {
+			errno = ERANGE;
+			return false;
+		}
+		val = (val * 10) + digit;
+	}
+
+	if ((p < end) && !scan_is_space(*p)) {
+		return false;
+	}
+
+	*pp = p;
+	*out = val;
+	return true;
+}
+
+static inline bool scan_ulong(const char **pp, const char *end,
+			      unsigned long *out)
+{
+	unsigned long long val;
+
+	if (!scan_ulonglong(pp, end, &val)) {
+		return false;
+	}
+
+	if (val > ULONG_MAX) {
+		errno = ERANGE;
+		return false;
+	}
+
+	*out = (unsigned long)val;
+	return true;
+}
+
+static inline bool scan_uint(const char **pp, const char *end, uint *out)
+{
+	unsigned long long val;
+
+	if (!scan_ulonglong(pp, end, &val)) {
+		return false;
+	}
+
+	if (val > UINT_MAX) {
+		errno = ERANGE;
+		return false;
+	}
+
+	*out = (uint)val;
+	return true;
+}
+
+#endif /* _SCAN_H_ */
@@ -0,0 +1,179 @@
+/*
+ * Python language bindings for procfs-diskstats
+ *
+ * Copyright (C) Andrew Walker, 2022
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "workpool.h"
+
+/* items claimed at a time from a range */
+#define WORKPOOL_CHUNK 8
+
+struct workpool_range {
+	atomic_size_t next;
+	size_t end;
+} __attribute__((aligned(64))); /* keep counters on separate cache lines */
+
+struct workpool {
+	struct workpool_range *ranges;
+	int nworkers;
+	workpool_fn_t fn;
+	void *priv;
+};
+
+struct workpool_worker {
+	struct workpool *pool;
+	int id;
+};
+
+/*
+ * Claim up to WORKPOOL_CHUNK items from a range. The owner and thieves
+ * claim from the same end with one atomic add, which is all the
+ * synchronization needed since items are only ever handed out once.
+ */
+static bool claim(struct workpool_range *range, size_t *start, size_t *end)
+{
+	size_t first;
+
+	if (atomic_load_explicit(&range->next, memory_order_relaxed) >= range->end) {
+		return false;
+	}
+
+	first = atomic_fetch_add_explicit(&range->next, WORKPOOL_CHUNK,
+					  memory_order_relaxed);
+	if (first >= range->end) {
+		return false;
+	}
+
+	*start = first;
+	*end = first + WORKPOOL_CHUNK < range->end ?
+	       first + WORKPOOL_CHUNK : range->end;
+	return true;
+}
+
+static int pick_victim(struct workpool *pool)
+{
+	size_t best_left = 0;
+	int i, best = -1;
+
+	for (i = 0; i < pool->nworkers; i++) {
+		struct workpool_range *range = &pool->ranges[i];
+		size_t next = atomic_load_explicit(&range->next,
+						   memory_order_relaxed);
+
+		if ((next < range->end) && (range->end - next > best_left)) {
+			best_left = range->end - next;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+static void *worker_main(void *arg)
+{
+	struct workpool_worker *worker = arg;
+	struct workpool *pool = worker->pool;
+	size_t start, end, i;
+	int victim = worker->id;
+
+	for (;;) {
+		if (!claim(&pool->ranges[victim], &start, &end)) {
+			victim = pick_victim(pool);
+			if (victim == -1) {
+				break;
+			}
+			continue;
+		}
+
+		for (i = start; i < end; i++) {
+			pool->fn(i, worker->id, pool->priv);
+		}
+	}
+
+	return NULL;
+}
+
+bool workpool_run(size_t nitems, int nworkers, workpool_fn_t fn, void *priv)
+{
+	struct workpool pool = {
+		.fn = fn,
+		.priv = priv,
+	};
+	struct workpool_worker workers[WORKPOOL_MAX_WORKERS];
+	pthread_t threads[WORKPOOL_MAX_WORKERS];
+	size_t per_worker, off = 0;
+	int i, started = 0;
+
+	if (nworkers > WORKPOOL_MAX_WORKERS) {
+		nworkers = WORKPOOL_MAX_WORKERS;
+	}
+
+	if ((size_t)nworkers > nitems / WORKPOOL_CHUNK) {
+		nworkers = nitems / WORKPOOL_CHUNK;
+	}
+
+	if (nworkers <= 1) {
+		for (off = 0; off < nitems; off++) {
+			fn(off, 0, priv);
+		}
+		return true;
+	}
+
+	pool.ranges = aligned_alloc(64, nworkers * sizeof(struct workpool_range));
+	if (pool.ranges == NULL) {
+		return false;
+	}
+	pool.nworkers = nworkers;
+
+	per_worker = nitems / nworkers;
+	for (i = 0; i < nworkers; i++) {
+		size_t cnt = per_worker + ((size_t)i < nitems % nworkers ? 1 : 0);
+
+		atomic_init(&pool.ranges[i].next, off);
+		pool.ranges[i].end = off + cnt;
+		off += cnt;
+	}
+
+	for (i = 0; i < nworkers; i++) {
+		workers[i] = (struct workpool_worker) {
+			.pool = &pool,
+			.id = i,
+		};
+	}
+
+	for (i = 1; i < nworkers; i++) {
+		if (pthread_create(&threads[i], NULL, worker_main, &workers[i]) != 0) {
+			break;
+		}
+		started++;
+	}
+
+	/*
+	 * Worker 0 runs on the calling thread. If not all threads could be
+	 * created the ranges of the missing workers are simply stolen.
+	 */
+	worker_main(&workers[0]);
+
+	for (i = 1; i <= started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	free(pool.ranges);
+	return true;
+}
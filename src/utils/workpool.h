@@ -0,0 +1,45 @@
+/*
+ * Python language bindings for procfs-diskstats
+ *
+ * Copyright (C) Andrew Walker, 2022
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _WORKPOOL_H_
+#define _WORKPOOL_H_
+#include "../common/includes.h"
+
+/*
+ * Fork-join helper for processing `nitems` independent items on several
+ * threads. Items are split into one contiguous range per worker, and a
+ * worker that runs out of items takes chunks from the range with the
+ * most items left, so slow items (e.g. a process with many open files)
+ * do not leave the other threads idle. `fn` is called once for each
+ * item with the index of the item and of the worker (0 to nworkers - 1)
+ * so that callers can keep per-worker scratch state, and results can be
+ * stored by item index to keep them in input order.
+ *
+ * The calling thread acts as worker 0 and the call returns once every
+ * item has been processed. Must be called without the GIL, and `fn`
+ * must not take it.
+ */
+typedef void (*workpool_fn_t)(size_t item, int worker, void *priv);
+
+#define WORKPOOL_MAX_WORKERS 64
+
+extern bool workpool_run(size_t nitems, int nworkers, workpool_fn_t fn,
+			 void *priv);
+
+#endif /* _WORKPOOL_H_ */